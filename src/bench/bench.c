@@ -6,8 +6,12 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "c4-api.h"
+#include "chained_rset.h"
+#include "util/hash_func.h"
+#include "util/rset.h"
 #include "util/thread_sync.h"
 
 typedef void (*program_install_f)(C4Client *c);
@@ -15,7 +19,8 @@ typedef void (*program_install_f)(C4Client *c);
 static void
 usage(void)
 {
-    printf("Usage: bench [ -a | -n | -j ]\n");
+    printf("Usage: bench [ -R ] [ -w nthreads ] "
+           "[ -a | -f | -h | -n | -j | -q | -r | -s | -S nshards ]\n");
     exit(1);
 }
 
@@ -92,24 +97,568 @@ join_install_program(C4Client *c)
     c4_install_str(c, "t(A + 1) :- t(A), s(B), A >= B, A < 3000000;");
 }
 
+/*
+ * Like the default benchmark, but with both tables stored in SQLite. The
+ * "s" keys are derived in scrambled order. Each tuple derived in the first
+ * fixpoint is new; the second fixpoint derives the same "s" tuples again,
+ * so each of them is already in SQLite.
+ */
 static void
-do_simple_bench(program_install_f prog, apr_pool_t *pool)
+sqlite_install_program(C4Client *c)
+{
+    c4_install_str(c, "define(t, sqlite, {int});");
+    c4_install_str(c, "define(s, sqlite, {int});");
+    c4_install_str(c, "define(u, {int});");
+    c4_install_str(c, "t(A + 1) :- t(A), A < 100000;");
+    c4_install_str(c, "u(A + 1) :- u(A), A < 100000;");
+    c4_install_str(c, "s(A * 7919 % 100003) :- t(A);");
+    c4_install_str(c, "s(A * 7919 % 100003) :- u(A);");
+    c4_install_str(c, "t(0);");
+    c4_install_str(c, "u(0);");
+}
+
+/*
+ * Each derived tuple contains a short tag and a host name, built by
+ * concatenation so that every tuple allocates new strings.
+ */
+static void
+string_install_program(C4Client *c)
+{
+    c4_install_str(c, "define(t, {int});");
+    c4_install_str(c, "define(s, {int, string, string});");
+    c4_install_str(c, "t(A + 1) :- t(A), A < 1000000;");
+    c4_install_str(c, "s(A, \"web\" + \"01\", "
+                   "\"tcp:localhost:\" + \"27800\") :- t(A);");
+}
+
+/*
+ * Each new "t" tuple triggers several rules, each of which scans all of
+ * "r": the join quals can't use an index. With worker threads, the rules
+ * are evaluated concurrently.
+ */
+static void
+fanout_install_program(C4Client *c)
+{
+    c4_install_str(c, "define(t, {int});");
+    c4_install_str(c, "define(r, {int});");
+    c4_install_str(c, "define(u, {int, int});");
+    c4_install_str(c, "define(v, {int, int});");
+    c4_install_str(c, "define(w, {int, int});");
+    c4_install_str(c, "define(x, {int, int});");
+    c4_install_str(c, "r(A + 1) :- r(A), A < 2000;");
+    c4_install_str(c, "r(0);");
+    c4_install_str(c, "t(A + 1) :- t(A), A < 20000;");
+    c4_install_str(c, "u(A, B) :- t(A), r(B), A + B == 2000;");
+    c4_install_str(c, "v(A, B) :- t(A), r(B), A - B == 1000;");
+    c4_install_str(c, "w(A, B) :- t(A), r(B), A * 2 == B;");
+    c4_install_str(c, "x(A, B) :- t(A), r(B), A == B * 3;");
+}
+
+static void
+do_simple_bench(program_install_f prog, C4FixpointMode mode,
+                int nworkers, apr_pool_t *pool)
 {
     C4Client *c;
 
     c = c4_make(pool, 0);
+    c4_set_fixpoint_mode(c, mode);
+    c4_set_worker_threads(c, nworkers);
     (*prog)(c);
     c4_install_str(c, "t(0);");
 }
 
+/*
+ * Each of SHARD_BENCH_NKEYS keys has a chain of "t" tuples, which are
+ * derived by the shard that owns the key. Each "t" tuple also derives a
+ * "u" tuple that is partitioned by the step number, so most of them are
+ * sent to another shard.
+ */
+#define SHARD_BENCH_NKEYS   64
+
+static void
+shard_install_program(C4Client *c, apr_pool_t *pool)
+{
+    char *facts;
+    int i;
+
+    c4_install_str(c, "define(t, partition(0), {int, int});");
+    c4_install_str(c, "define(s, partition(0), {int, int});");
+    c4_install_str(c, "define(u, partition(0), {int, int});");
+    c4_install_str(c, "t(K, I + 1) :- t(K, I), I < 5000;");
+    c4_install_str(c, "s(K, I * 2) :- t(K, I);");
+    c4_install_str(c, "u(I, K) :- t(K, I);");
+
+    facts = "";
+    for (i = 0; i < SHARD_BENCH_NKEYS; i++)
+        facts = apr_psprintf(pool, "%st(%d, 0);", facts, i);
+    c4_install_str(c, facts);
+}
+
+/*
+ * Run the shard benchmark with 1 .. "max_shards" shards, and report the
+ * speedup over a single shard.
+ */
+static void
+do_shard_bench(int max_shards, C4FixpointMode mode, int nworkers,
+               apr_pool_t *pool)
+{
+    apr_time_t base_time = 0;
+    int nshards;
+
+    for (nshards = 1; nshards <= max_shards; nshards++)
+    {
+        apr_pool_t *subpool;
+        apr_time_t start_time;
+        apr_time_t elapsed;
+        C4Client *c;
+
+        (void) apr_pool_create(&subpool, pool);
+        start_time = apr_time_now();
+
+        c = c4_make_sharded(subpool, 0, nshards);
+        c4_set_fixpoint_mode(c, mode);
+        c4_set_worker_threads(c, nworkers);
+        shard_install_program(c, subpool);
+        apr_pool_destroy(subpool);
+
+        elapsed = apr_time_now() - start_time;
+        if (nshards == 1)
+            base_time = elapsed;
+
+        printf("%2d shard%s: %10" APR_TIME_T_FMT " usec (speedup %.2f)\n",
+               nshards, (nshards == 1) ? " " : "s", elapsed,
+               (double) base_time / elapsed);
+    }
+}
+
+/*
+ * Microbenchmark for the rset implementation, independent of the rest of C4.
+ * Elements are either single ints (as in the perf and join benchmarks) or
+ * ping-style (string, string, int) triples (as in the network benchmark).
+ */
+#define RSET_BENCH_NELEMS   1000000
+
+typedef struct RSetBenchElem
+{
+    char x[24];
+    char y[24];
+    apr_int64_t c;
+} RSetBenchElem;
+
+static unsigned int
+rset_bench_str_hash(const char *str)
+{
+    return hash_bytes((const unsigned char *) str, strlen(str));
+}
+
+static unsigned int
+rset_bench_int_hash(apr_int64_t i)
+{
+    return hash_uint64((apr_uint64_t) i);
+}
+
+static unsigned int
+rset_bench_hash_int(const void *key, void *data)
+{
+    const RSetBenchElem *e = (const RSetBenchElem *) key;
+
+    return rset_bench_int_hash(e->c);
+}
+
+static bool
+rset_bench_cmp_int(const void *k1, const void *k2, void *data)
+{
+    const RSetBenchElem *e1 = (const RSetBenchElem *) k1;
+    const RSetBenchElem *e2 = (const RSetBenchElem *) k2;
+
+    return e1->c == e2->c;
+}
+
+/* Combine column hashes the same way as tuple_hash() */
+static unsigned int
+rset_bench_hash_ping(const void *key, void *data)
+{
+    const RSetBenchElem *e = (const RSetBenchElem *) key;
+    unsigned int result = 37;
+
+    result = hash_combine(result, rset_bench_str_hash(e->x));
+    result = hash_combine(result, rset_bench_str_hash(e->y));
+    result = hash_combine(result, rset_bench_int_hash(e->c));
+    return result;
+}
+
+static bool
+rset_bench_cmp_ping(const void *k1, const void *k2, void *data)
+{
+    const RSetBenchElem *e1 = (const RSetBenchElem *) k1;
+    const RSetBenchElem *e2 = (const RSetBenchElem *) k2;
+
+    return (e1->c == e2->c &&
+            strcmp(e1->x, e2->x) == 0 &&
+            strcmp(e1->y, e2->y) == 0);
+}
+
+static void
+rset_bench_report(const char *phase, apr_time_t *start_time)
+{
+    apr_time_t now = apr_time_now();
+
+    printf("  %-10s %8" APR_TIME_T_FMT " usec\n", phase, now - *start_time);
+    *start_time = now;
+}
+
+/*
+ * An rset implementation to benchmark: either the current one, or the
+ * chained table it replaced. Both have the same API, so we call them through
+ * function pointers cast to take opaque set and iterator pointers.
+ */
+typedef void *(*rset_bench_make_f)(apr_pool_t *pool, void *cb_data,
+                                   rset_hashfunc_t hash_func,
+                                   rset_keycomp_func_t cmp_func);
+typedef bool (*rset_bench_add_f)(void *rs, void *elem);
+typedef unsigned int (*rset_bench_get_f)(void *rs, void *elem);
+typedef void *(*rset_bench_remove_f)(void *rs, void *elem,
+                                     unsigned int *new_refcount);
+typedef unsigned int (*rset_bench_count_f)(void *rs);
+typedef void *(*rset_bench_iter_make_f)(apr_pool_t *p, void *rs);
+typedef bool (*rset_bench_iter_next_f)(void *ri);
+typedef void *(*rset_bench_this_f)(void *ri);
+
+typedef struct RSetBenchImpl
+{
+    const char *name;
+    rset_bench_make_f make;
+    rset_bench_add_f add;
+    rset_bench_get_f get;
+    rset_bench_remove_f remove;
+    rset_bench_count_f count;
+    rset_bench_iter_make_f iter_make;
+    rset_bench_iter_next_f iter_next;
+    rset_bench_this_f this;
+} RSetBenchImpl;
+
+static const RSetBenchImpl rset_bench_impls[] =
+{
+    {
+        "open addressing",
+        (rset_bench_make_f) rset_make,
+        (rset_bench_add_f) rset_add,
+        (rset_bench_get_f) rset_get,
+        (rset_bench_remove_f) rset_remove,
+        (rset_bench_count_f) rset_count,
+        (rset_bench_iter_make_f) rset_iter_make,
+        (rset_bench_iter_next_f) rset_iter_next,
+        (rset_bench_this_f) rset_this
+    },
+    {
+        "chained",
+        (rset_bench_make_f) chained_rset_make,
+        (rset_bench_add_f) chained_rset_add,
+        (rset_bench_get_f) chained_rset_get,
+        (rset_bench_remove_f) chained_rset_remove,
+        (rset_bench_count_f) chained_rset_count,
+        (rset_bench_iter_make_f) chained_rset_iter_make,
+        (rset_bench_iter_next_f) chained_rset_iter_next,
+        (rset_bench_this_f) chained_rset_this
+    }
+};
+
+#define RSET_BENCH_NIMPLS \
+    ((int) (sizeof(rset_bench_impls) / sizeof(rset_bench_impls[0])))
+
+static void
+rset_bench_run(const RSetBenchImpl *impl, const char *name,
+               RSetBenchElem *elems, RSetBenchElem *misses, int *order,
+               rset_hashfunc_t hash_func, rset_keycomp_func_t cmp_func,
+               apr_pool_t *pool)
+{
+    apr_pool_t *subpool;
+    void *rs;
+    void *ri;
+    apr_time_t start_time;
+    unsigned int found;
+    int i;
+
+    (void) apr_pool_create(&subpool, pool);
+    rs = impl->make(subpool, NULL, hash_func, cmp_func);
+    printf("%s rset, workload \"%s\" (%d elements):\n",
+           impl->name, name, RSET_BENCH_NELEMS);
+
+    start_time = apr_time_now();
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+        (void) impl->add(rs, &elems[i]);
+    rset_bench_report("insert", &start_time);
+
+    found = 0;
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+        found += (impl->get(rs, &elems[i]) != 0);
+    rset_bench_report("hit", &start_time);
+
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+        found += (impl->get(rs, &elems[order[i]]) != 0);
+    rset_bench_report("rand hit", &start_time);
+
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+        found += (impl->get(rs, &misses[i]) != 0);
+    rset_bench_report("miss", &start_time);
+
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+        (void) impl->add(rs, &elems[i]);
+    rset_bench_report("dup insert", &start_time);
+
+    ri = impl->iter_make(subpool, rs);
+    while (impl->iter_next(ri))
+        found += (impl->this(ri) != NULL);
+    rset_bench_report("iterate", &start_time);
+
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+    {
+        unsigned int new_count;
+
+        (void) impl->remove(rs, &elems[i], &new_count);
+        (void) impl->remove(rs, &elems[i], &new_count);
+    }
+    rset_bench_report("remove", &start_time);
+
+    if (found != 3 * RSET_BENCH_NELEMS || impl->count(rs) != 0)
+        printf("rset benchmark sanity check failed!\n");
+
+    apr_pool_destroy(subpool);
+}
+
+static void
+do_rset_bench(apr_pool_t *pool)
+{
+    RSetBenchElem *elems;
+    RSetBenchElem *misses;
+    int *order;
+    int i;
+
+    elems = apr_pcalloc(pool, RSET_BENCH_NELEMS * sizeof(*elems));
+    misses = apr_pcalloc(pool, RSET_BENCH_NELEMS * sizeof(*misses));
+
+    /* Random probe order, so that lookups don't follow insertion order */
+    order = apr_palloc(pool, RSET_BENCH_NELEMS * sizeof(*order));
+    srand(1);
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+    {
+        int j = rand() % (i + 1);
+
+        order[i] = order[j];
+        order[j] = i;
+    }
+
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+    {
+        elems[i].c = i;
+        misses[i].c = RSET_BENCH_NELEMS + i;
+    }
+
+    for (i = 0; i < RSET_BENCH_NIMPLS; i++)
+        rset_bench_run(&rset_bench_impls[i], "int", elems, misses, order,
+                       rset_bench_hash_int, rset_bench_cmp_int, pool);
+
+    /* Two nodes bouncing pings back and forth, as in the network benchmark */
+    for (i = 0; i < RSET_BENCH_NELEMS; i++)
+    {
+        RSetBenchElem *e = &elems[i];
+        int src = (i % 2) ? 27800 : 27801;
+
+        snprintf(e->x, sizeof(e->x), "tcp:localhost:%d", src);
+        snprintf(e->y, sizeof(e->y), "tcp:localhost:%d",
+                 (src == 27800) ? 27801 : 27800);
+        e->c = i / 2;
+        misses[i] = *e;
+        misses[i].c += RSET_BENCH_NELEMS;
+    }
+
+    for (i = 0; i < RSET_BENCH_NIMPLS; i++)
+        rset_bench_run(&rset_bench_impls[i], "ping", elems, misses, order,
+                       rset_bench_hash_ping, rset_bench_cmp_ping, pool);
+}
+
+/*
+ * Microbenchmark for the hash functions used by tuple_hash(): throughput of
+ * the per-type hash functions, and the number of collisions produced by
+ * different ways of combining per-column hash codes.
+ */
+#define HASH_BENCH_NITERS   10000000
+#define HASH_BENCH_NADDRS   100
+#define HASH_BENCH_NCOUNTS  100
+
+static void
+hash_bench_report(const char *name, apr_time_t start_time,
+                  apr_uint32_t sink)
+{
+    apr_time_t elapsed = apr_time_now() - start_time;
+
+    /* Print "sink" so the compiler can't discard the hash computation */
+    printf("  %-22s %8" APR_TIME_T_FMT " usec (%.2f ns/hash) [%08x]\n",
+           name, elapsed, (elapsed * 1000.0) / HASH_BENCH_NITERS, sink);
+}
+
+static int
+hash_bench_cmp(const void *a, const void *b)
+{
+    apr_uint32_t h1 = *(const apr_uint32_t *) a;
+    apr_uint32_t h2 = *(const apr_uint32_t *) b;
+
+    return (h1 > h2) - (h1 < h2);
+}
+
+/* Number of hash codes in "hashes" that duplicate an earlier hash code */
+static int
+hash_bench_collisions(apr_uint32_t *hashes, int n)
+{
+    int ncollisions = 0;
+    int i;
+
+    qsort(hashes, n, sizeof(*hashes), hash_bench_cmp);
+    for (i = 1; i < n; i++)
+    {
+        if (hashes[i] == hashes[i - 1])
+            ncollisions++;
+    }
+
+    return ncollisions;
+}
+
+/*
+ * Hash ping(X, Y, C) tuples for every pair of distinct addresses and a range
+ * of counter values, as produced by the network benchmark; XOR-combining
+ * maps ping(X, Y, C) and ping(Y, X, C) to the same hash code. If
+ * "same_addr" is true, we hash ping(X, X, C) instead, for which the address
+ * columns cancel out when XOR-combined.
+ */
+static void
+hash_bench_combine(bool same_addr, apr_uint32_t *addr_hashes,
+                   apr_pool_t *pool)
+{
+    apr_uint32_t *xor_hashes;
+    apr_uint32_t *comb_hashes;
+    int ny = same_addr ? 1 : HASH_BENCH_NADDRS;
+    int n;
+    int i;
+    int j;
+    int k;
+
+    xor_hashes = apr_palloc(pool, HASH_BENCH_NADDRS * HASH_BENCH_NADDRS *
+                            HASH_BENCH_NCOUNTS * sizeof(apr_uint32_t));
+    comb_hashes = apr_palloc(pool, HASH_BENCH_NADDRS * HASH_BENCH_NADDRS *
+                             HASH_BENCH_NCOUNTS * sizeof(apr_uint32_t));
+    n = 0;
+    for (i = 0; i < HASH_BENCH_NADDRS; i++)
+    {
+        for (j = 0; j < ny; j++)
+        {
+            apr_uint32_t hx = addr_hashes[i];
+            apr_uint32_t hy = addr_hashes[same_addr ? i : j];
+
+            if (!same_addr && i == j)
+                continue;
+
+            for (k = 0; k < HASH_BENCH_NCOUNTS; k++)
+            {
+                apr_uint32_t hc = hash_uint64(k);
+                apr_uint32_t h;
+
+                xor_hashes[n] = 37 ^ hx ^ hy ^ hc;
+
+                h = hash_combine(37, hx);
+                h = hash_combine(h, hy);
+                comb_hashes[n] = hash_combine(h, hc);
+                n++;
+            }
+        }
+    }
+
+    printf("  %s: %d keys\n",
+           same_addr ? "ping(X, X, C)" : "ping(X, Y, C)", n);
+    printf("    XOR:          %8d collisions\n",
+           hash_bench_collisions(xor_hashes, n));
+    printf("    hash_combine: %8d collisions\n",
+           hash_bench_collisions(comb_hashes, n));
+}
+
+static void
+do_hash_bench(apr_pool_t *pool)
+{
+    apr_pool_t *subpool;
+    apr_uint32_t *addr_hashes;
+    apr_uint32_t sink;
+    apr_time_t start_time;
+    char str[32];
+    int len;
+    int i;
+
+    printf("hash function throughput (%d hashes):\n", HASH_BENCH_NITERS);
+
+    sink = 0;
+    start_time = apr_time_now();
+    for (i = 0; i < HASH_BENCH_NITERS; i++)
+    {
+        apr_int64_t val = i;
+
+        sink += hash_any((unsigned char *) &val, sizeof(val));
+    }
+    hash_bench_report("hash_any (int8)", start_time, sink);
+
+    sink = 0;
+    start_time = apr_time_now();
+    for (i = 0; i < HASH_BENCH_NITERS; i++)
+        sink += hash_uint64(i);
+    hash_bench_report("hash_uint64 (int8)", start_time, sink);
+
+    len = snprintf(str, sizeof(str), "tcp:localhost:27800");
+    sink = 0;
+    start_time = apr_time_now();
+    for (i = 0; i < HASH_BENCH_NITERS; i++)
+    {
+        str[len - 1] = (char) i;
+        sink += hash_any((unsigned char *) str, len);
+    }
+    hash_bench_report("hash_any (string)", start_time, sink);
+
+    sink = 0;
+    start_time = apr_time_now();
+    for (i = 0; i < HASH_BENCH_NITERS; i++)
+    {
+        str[len - 1] = (char) i;
+        sink += hash_bytes((unsigned char *) str, len);
+    }
+    hash_bench_report("hash_bytes (string)", start_time, sink);
+
+    printf("hash combining collisions (%d addresses):\n", HASH_BENCH_NADDRS);
+    (void) apr_pool_create(&subpool, pool);
+    addr_hashes = apr_palloc(subpool,
+                             HASH_BENCH_NADDRS * sizeof(apr_uint32_t));
+    for (i = 0; i < HASH_BENCH_NADDRS; i++)
+    {
+        len = snprintf(str, sizeof(str), "tcp:localhost:%d", 27800 + i);
+        addr_hashes[i] = hash_bytes((unsigned char *) str, len);
+    }
+
+    hash_bench_combine(false, addr_hashes, subpool);
+    hash_bench_combine(true, addr_hashes, subpool);
+    apr_pool_destroy(subpool);
+}
+
 int
 main(int argc, const char *argv[])
 {
     static const apr_getopt_option_t opt_option[] =
         {
             {"agg", 'a', false, "agg benchmark"},
+            {"fanout", 'f', false, "many rules per delta table"},
+            {"hash", 'h', false, "hash function microbenchmark"},
             {"join", 'j', false, "join benchmark"},
             {"net", 'n', false, "network benchmark"},
+            {"sqlite", 'q', false, "SQLite storage benchmark"},
+            {"rset", 'r', false, "rset microbenchmark"},
+            {"string", 's', false, "string benchmark"},
+            {"shards", 'S', true, "shard scaling, from 1 to N shards"},
+            {"rounds", 'R', false, "set-at-a-time fixpoint evaluation"},
+            {"workers", 'w', true, "evaluate rules using worker threads"},
             { NULL, 0, 0, NULL }
         };
     apr_pool_t *pool;
@@ -118,8 +667,16 @@ main(int argc, const char *argv[])
     const char *optarg;
     apr_status_t s;
     bool agg_bench = false;
+    bool fanout_bench = false;
+    bool hash_bench = false;
     bool join_bench = false;
     bool net_bench = false;
+    bool sqlite_bench = false;
+    bool rset_bench = false;
+    bool string_bench = false;
+    C4FixpointMode mode = C4_FIXPOINT_TUPLE;
+    int nworkers = 0;
+    int max_shards = 0;
     apr_time_t start_time;
 
     c4_initialize();
@@ -136,6 +693,14 @@ main(int argc, const char *argv[])
                 agg_bench = true;
                 break;
 
+            case 'f':
+                fanout_bench = true;
+                break;
+
+            case 'h':
+                hash_bench = true;
+                break;
+
             case 'j':
                 join_bench = true;
                 break;
@@ -144,6 +709,30 @@ main(int argc, const char *argv[])
                 net_bench = true;
                 break;
 
+            case 'q':
+                sqlite_bench = true;
+                break;
+
+            case 'r':
+                rset_bench = true;
+                break;
+
+            case 's':
+                string_bench = true;
+                break;
+
+            case 'S':
+                max_shards = atoi(optarg);
+                break;
+
+            case 'R':
+                mode = C4_FIXPOINT_SET;
+                break;
+
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+
             default:
                 printf("Unrecognized option: %c\n", optch);
                 usage();
@@ -156,13 +745,25 @@ main(int argc, const char *argv[])
     start_time = apr_time_now();
 
     if (agg_bench)
-        do_simple_bench(agg_install_program, pool);
+        do_simple_bench(agg_install_program, mode, nworkers, pool);
+    else if (fanout_bench)
+        do_simple_bench(fanout_install_program, mode, nworkers, pool);
     else if (join_bench)
-        do_simple_bench(join_install_program, pool);
+        do_simple_bench(join_install_program, mode, nworkers, pool);
     else if (net_bench)
         do_net_bench(pool);
+    else if (sqlite_bench)
+        do_simple_bench(sqlite_install_program, mode, nworkers, pool);
+    else if (rset_bench)
+        do_rset_bench(pool);
+    else if (hash_bench)
+        do_hash_bench(pool);
+    else if (string_bench)
+        do_simple_bench(string_install_program, mode, nworkers, pool);
+    else if (max_shards > 0)
+        do_shard_bench(max_shards, mode, nworkers, pool);
     else
-        do_simple_bench(perf_install_program, pool);
+        do_simple_bench(perf_install_program, mode, nworkers, pool);
 
     printf("Benchmark duration: %" APR_TIME_T_FMT " usec\n",
            (apr_time_now() - start_time));
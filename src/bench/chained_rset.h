@@ -0,0 +1,29 @@
+/*
+ * The chained hash table that implemented rset before util/rset.c became an
+ * open-addressing table. It has the same API as rset, with a "chained_"
+ * prefix; it is only used by "bench -r", as a baseline.
+ */
+#ifndef CHAINED_RSET_H
+#define CHAINED_RSET_H
+
+#include "util/rset.h"
+
+typedef struct chained_rset_t chained_rset_t;
+typedef struct chained_rset_index_t chained_rset_index_t;
+
+chained_rset_t *chained_rset_make(apr_pool_t *pool, void *cb_data,
+                                  rset_hashfunc_t hash_func,
+                                  rset_keycomp_func_t cmp_func);
+bool chained_rset_add(chained_rset_t *rs, void *elem);
+unsigned int chained_rset_get(chained_rset_t *rs, void *elem);
+void *chained_rset_remove(chained_rset_t *rs, void *elem,
+                          unsigned int *new_refcount);
+unsigned int chained_rset_count(chained_rset_t *rs);
+
+chained_rset_index_t *chained_rset_iter_make(apr_pool_t *p,
+                                             chained_rset_t *rs);
+void chained_rset_iter_reset(chained_rset_index_t *ri);
+bool chained_rset_iter_next(chained_rset_index_t *ri);
+void *chained_rset_this(chained_rset_index_t *ri);
+
+#endif  /* CHAINED_RSET_H */
@@ -5,6 +5,7 @@
 #include "c4-internal.h"
 #include "router.h"
 #include "runtime.h"
+#include "shard.h"
 #include "util/thread_sync.h"
 
 /*
@@ -18,12 +19,17 @@ struct C4Client
     apr_pool_t *pool;
     /* Reset after each API command */
     apr_pool_t *tmp_pool;
-    /* Runtime state */
-    C4Runtime *runtime;
-    apr_thread_t *runtime_thread;
-    /* State for passing messages => runtime */
+    /* Runtime state: one runtime per shard */
+    int nshards;
+    C4ShardSet *shards;
+    C4Runtime **runtimes;
+    apr_thread_t **runtime_threads;
+    /*
+     * State for passing messages => runtime. API calls fill in "wi", and
+     * each shard is passed a copy of it in "shard_wis".
+     */
     WorkItem *wi;
-    C4ThreadSync *thread_sync;
+    WorkItem *shard_wis;
 };
 
 static apr_status_t c4_client_cleanup(void *data);
@@ -44,42 +50,112 @@ c4_terminate(void)
 
 C4Client *
 c4_make(apr_pool_t *pool, int port)
+{
+    return c4_make_sharded(pool, port, 1);
+}
+
+C4Client *
+c4_make_sharded(apr_pool_t *pool, int port, int nshards)
 {
     apr_pool_t *client_pool;
     C4Client *client;
+    int i;
+
+    if (nshards < 1)
+        return NULL;
 
     client_pool = make_subpool(pool);
     client = apr_pcalloc(client_pool, sizeof(*client));
     client->pool = client_pool;
     client->tmp_pool = make_subpool(client->pool);
-    client->thread_sync = thread_sync_make(client->pool);
-    client->runtime = c4_runtime_start(port, client->thread_sync, client->pool,
-                                       &client->runtime_thread);
-    client->wi = apr_palloc(client->pool, sizeof(WorkItem));
-    client->wi->sync = client->thread_sync;
+    client->nshards = nshards;
+    client->shards = shard_set_make(nshards, client->pool);
+    client->runtimes = apr_palloc(client->pool,
+                                  nshards * sizeof(*client->runtimes));
+    client->runtime_threads = apr_palloc(client->pool, nshards *
+                                         sizeof(*client->runtime_threads));
+    client->wi = apr_pcalloc(client->pool, sizeof(WorkItem));
+    client->shard_wis = apr_pcalloc(client->pool,
+                                    nshards * sizeof(WorkItem));
+
+    /* Only the first shard listens on the client's port */
+    for (i = 0; i < nshards; i++)
+    {
+        client->shard_wis[i].sync = thread_sync_make(client->pool);
+        client->runtimes[i] = c4_runtime_start(i == 0 ? port : 0,
+                                               shard_set_get(client->shards,
+                                                             i),
+                                               client->shard_wis[i].sync,
+                                               client->pool,
+                                               &client->runtime_threads[i]);
+    }
 
     apr_pool_pre_cleanup_register(client->pool, client, c4_client_cleanup);
 
     return client;
 }
 
+/*
+ * Pass a copy of the client's WorkItem to each shard, without waiting for
+ * the shards to process it.
+ */
+static void
+post_work_item(C4Client *client)
+{
+    int i;
+
+    for (i = 0; i < client->nshards; i++)
+    {
+        WorkItem *wi = &client->shard_wis[i];
+        C4ThreadSync *sync = wi->sync;
+
+        *wi = *client->wi;
+        wi->sync = sync;
+        runtime_post_work(client->runtimes[i], wi);
+    }
+}
+
+static void
+wait_work_item(C4Client *client)
+{
+    int i;
+
+    for (i = 0; i < client->nshards; i++)
+        thread_sync_wait(client->shard_wis[i].sync);
+}
+
+/*
+ * Have every shard process the client's WorkItem, and wait until they have
+ * done so and have routed all the tuples they sent one another as a result.
+ */
+static void
+run_work_item(C4Client *client)
+{
+    post_work_item(client);
+    wait_work_item(client);
+    shard_set_wait_idle(client->shards);
+}
+
 static apr_status_t
 c4_client_cleanup(void *data)
 {
     C4Client *client = (C4Client *) data;
-
-    WorkItem *wi = client->wi;
     apr_status_t s;
     apr_status_t thread_status;
+    int i;
 
-    wi->kind = WI_SHUTDOWN;
-    runtime_enqueue_work(client->runtime, wi);
+    client->wi->kind = WI_SHUTDOWN;
+    post_work_item(client);
+    wait_work_item(client);
 
-    s = apr_thread_join(&thread_status, client->runtime_thread);
-    if (s != APR_SUCCESS)
-        FAIL_APR(s);
-    if (thread_status != APR_SUCCESS)
-        FAIL_APR(thread_status);
+    for (i = 0; i < client->nshards; i++)
+    {
+        s = apr_thread_join(&thread_status, client->runtime_threads[i]);
+        if (s != APR_SUCCESS)
+            FAIL_APR(s);
+        if (thread_status != APR_SUCCESS)
+            FAIL_APR(thread_status);
+    }
 
     return APR_SUCCESS;
 }
@@ -94,7 +170,34 @@ c4_destroy(C4Client *client)
 int
 c4_get_port(C4Client *client)
 {
-    return client->runtime->port;
+    return client->runtimes[0]->port;
+}
+
+C4Status
+c4_set_fixpoint_mode(C4Client *client, C4FixpointMode mode)
+{
+    WorkItem *wi = client->wi;
+
+    wi->kind = WI_FIXPOINT_MODE;
+    wi->fixpoint_mode = mode;
+    run_work_item(client);
+
+    return C4_OK;
+}
+
+C4Status
+c4_set_worker_threads(C4Client *client, int nthreads)
+{
+    WorkItem *wi = client->wi;
+
+    if (nthreads < 0)
+        return C4_ERROR;
+
+    wi->kind = WI_WORKER_THREADS;
+    wi->worker_threads = nthreads;
+    run_work_item(client);
+
+    return C4_OK;
 }
 
 /*
@@ -157,22 +260,40 @@ c4_install_str(C4Client *client, const char *str)
 
     wi->kind = WI_PROGRAM;
     wi->program_src = str;
-    runtime_enqueue_work(client->runtime, wi);
+    run_work_item(client);
 
     return C4_OK;
 }
 
+/*
+ * The shards dump their partitions of the table one at a time, appending to
+ * the same buffer. Each shard's output is NUL-terminated, so we remove the
+ * terminator before the next shard appends its output.
+ */
 char *
 c4_dump_table(C4Client *client, const char *tbl_name)
 {
-    WorkItem *wi = client->wi;
+    StrBuf *buf;
+    int i;
+
+    buf = sbuf_make(client->pool);
+    for (i = 0; i < client->nshards; i++)
+    {
+        WorkItem *shard_wi = &client->shard_wis[i];
+
+        if (buf->len > 0 && buf->data[buf->len - 1] == '\0')
+            buf->len--;
+
+        shard_wi->kind = WI_DUMP_TABLE;
+        shard_wi->tbl_name = tbl_name;
+        shard_wi->buf = buf;
+        runtime_enqueue_work(client->runtimes[i], shard_wi);
+    }
 
-    wi->kind = WI_DUMP_TABLE;
-    wi->tbl_name = tbl_name;
-    wi->buf = sbuf_make(client->pool);
-    runtime_enqueue_work(client->runtime, wi);
+    if (buf->len == 0 || buf->data[buf->len - 1] != '\0')
+        sbuf_append_char(buf, '\0');
 
-    return wi->buf->data;
+    return buf->data;
 }
 
 C4Status
@@ -185,7 +306,7 @@ c4_register_callback(C4Client *client, const char *tbl_name,
     wi->cb_tbl_name = tbl_name;
     wi->cb_func = callback;
     wi->cb_data = data;
-    runtime_enqueue_work(client->runtime, wi);
+    run_work_item(client);
 
     return C4_OK;
 }
@@ -37,6 +37,44 @@ C4Client *c4_make(apr_pool_t *pool, int port);
 C4Status c4_destroy(C4Client *c4);
 int c4_get_port(C4Client *c4);
 
+/*
+ * Create an instance of C4 that divides its work among "nshards" runtimes,
+ * each with its own thread. The tuples of a table declared with
+ * partition(N) are divided among the shards by the value of column N;
+ * other tables are replicated on every shard. Dumping a table returns the
+ * tuples of every shard. The first shard listens on "port"; the shards
+ * share its network address. Returns NULL if "nshards" is less than 1.
+ */
+C4Client *c4_make_sharded(apr_pool_t *pool, int port, int nshards);
+
+/*
+ * How the runtime evaluates rules within a fixpoint. C4_FIXPOINT_TUPLE
+ * (the default) routes derived tuples one batch at a time, in the order in
+ * which they were derived. C4_FIXPOINT_SET works in rounds: each round
+ * routes every tuple derived in the previous round, grouped by table. Both
+ * modes evaluate rules with the same operators, which join a batch of
+ * tuples against the other tables one tuple at a time; there are no
+ * set-oriented join operators. The tables' contents are the same in either
+ * mode.
+ */
+typedef enum C4FixpointMode
+{
+    C4_FIXPOINT_TUPLE = 0,
+    C4_FIXPOINT_SET
+} C4FixpointMode;
+
+C4Status c4_set_fixpoint_mode(C4Client *c4, C4FixpointMode mode);
+
+/*
+ * Evaluate rules using "nthreads" worker threads in addition to the runtime
+ * thread, or only in the runtime thread if "nthreads" is zero (the
+ * default). When a batch of tuples triggers several rules, the workers
+ * evaluate them concurrently; rules that use aggregates or scan SQLite
+ * tables are still evaluated by the runtime thread. The results are the
+ * same in either case.
+ */
+C4Status c4_set_worker_threads(C4Client *c4, int nthreads);
+
 C4Status c4_install_file(C4Client *c4, const char *path);
 C4Status c4_install_str(C4Client *c4, const char *str);
 
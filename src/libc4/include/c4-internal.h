@@ -43,6 +43,7 @@ struct C4Runtime
     struct SQLiteState *sql;
     struct C4Timer *timer;
     struct TuplePoolMgr *tpool_mgr;
+    struct C4Shard *shard;
 
     int port;
     Datum local_addr;
@@ -8,7 +8,8 @@
 AstProgram *make_program(List *defines, List *timers, List *facts,
                          List *rules, apr_pool_t *p);
 AstDefine *make_define(const char *name, AstStorageKind storage,
-                       List *schema, apr_pool_t *p);
+                       List *schema, List *keys, List *order_cols,
+                       int partition_col, apr_pool_t *p);
 AstTimer *make_ast_timer(const char *name, apr_int64_t period,
                          apr_pool_t *p);
 AstSchemaElt *make_schema_elt(const char *type_name, bool is_loc_spec,
@@ -34,6 +35,7 @@ InsertPlan *make_insert_plan(AstTableRef *head, List *proj_list, apr_pool_t *p);
 ProjectPlan *make_project_plan(List *proj_list, apr_pool_t *p);
 ScanPlan *make_scan_plan(AstJoinClause *scan_rel, List *quals,
                          List *qual_exprs, List *proj_list,
+                         List *key_cols, List *key_ops, List *key_exprs,
                          apr_pool_t *p);
 
 ExprOp *make_expr_op(DataType type, AstOperKind op_kind,
@@ -41,6 +43,7 @@ ExprOp *make_expr_op(DataType type, AstOperKind op_kind,
 ExprVar *make_expr_var(DataType type, int attno, bool is_outer,
                        const char *name, apr_pool_t *p);
 ExprConst *make_expr_const(DataType type, Datum val, apr_pool_t *p);
-AstAggExpr *make_ast_agg_expr(AstAggKind a_kind, C4Node *expr, apr_pool_t *p);
+AstAggExpr *make_ast_agg_expr(AstAggKind a_kind, C4Node *expr,
+                              C4Node *param, apr_pool_t *p);
 
 #endif  /* MAKEFUNCS_H */
@@ -2,6 +2,7 @@
 #define AGG_H
 
 #include "operator/operator.h"
+#include "router.h"
 #include "types/agg_funcs.h"
 #include "types/catalog.h"
 #include "util/hash.h"
@@ -24,9 +25,20 @@ typedef struct AggGroupState
      */
     Tuple *key;
     Tuple *output_tup;
+    /* # of input tuples; if zero, the group is removed by agg_flush() */
     int count;
     AggStateVal *state_vals;
     struct AggGroupState *next;
+
+    /* Has the group changed since its output was last emitted? */
+    bool dirty;
+    struct AggGroupState *next_dirty;
+
+    /*
+     * Has an agg that can't handle deletions lost an input tuple? If so, the
+     * group's state is recomputed by agg_flush().
+     */
+    bool needs_rebuild;
 } AggGroupState;
 
 typedef struct AggOperator
@@ -36,12 +48,32 @@ typedef struct AggOperator
     AggExprInfo **agg_info;
     int num_group_cols;
     int *group_colnos;
+    /*
+     * Is the input insert-only? See rule_is_append_only() and
+     * agg_op_allow_deletes()
+     */
+    bool append_only;
+    /* Do deletions require rebuilding a group? See rebuild_agg_groups() */
+    bool rebuild_on_delete;
+    /* The distinct input tuples, or NULL if not needed */
     rset_t *tuple_set;
     c4_hash_t *group_tbl;
     AggGroupState *free_groups;
     TableDef *output_tbl;
+    /* The agg values most recently computed by compute_agg_output() */
+    Datum *output_vals;
+
+    /*
+     * The groups that have changed in the current fixpoint. Rather than
+     * emitting a new output tuple for each input tuple, we emit the final
+     * output of each changed group once, from a router pre-commit hook.
+     */
+    AggGroupState *dirty_groups;
+    RouterHook flush_hook;
 } AggOperator;
 
-AggOperator *agg_op_make(AggPlan *plan, OpChain *chain);
+AggOperator *agg_op_make(AggPlan *plan, Schema *input_schema, OpChain *chain,
+                         bool append_only);
+void agg_op_allow_deletes(AggOperator *agg_op);
 
 #endif  /* AGG_H */
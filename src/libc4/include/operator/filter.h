@@ -7,11 +7,11 @@
 typedef struct FilterOperator
 {
     Operator op;
-    int nquals;
-    ExprState **qual_ary;
+    /* All the quals, compiled into a single program; NULL if none */
+    ExprState *qual_state;
 } FilterOperator;
 
-FilterOperator *filter_op_make(FilterPlan *plan, Operator *next_op,
-                               OpChain *chain);
+FilterOperator *filter_op_make(FilterPlan *plan, Schema *input_schema,
+                               Operator *next_op, OpChain *chain);
 
 #endif  /* FILTER_H */
@@ -11,6 +11,7 @@ typedef struct InsertOperator
     TableDef *tbl_def;
 } InsertOperator;
 
-InsertOperator *insert_op_make(InsertPlan *plan, OpChain *chain);
+InsertOperator *insert_op_make(InsertPlan *plan, Schema *input_schema,
+                               OpChain *chain);
 
 #endif  /* INSERT_H */
@@ -6,6 +6,7 @@
 #include "types/catalog.h"
 #include "types/expr.h"
 #include "types/tuple.h"
+#include "util/hash.h"
 
 typedef struct Operator Operator;
 typedef struct OpChain OpChain;
@@ -25,6 +26,43 @@ struct OpChain
     Operator *chain_start;
     int length;
 
+    /*
+     * If the chain's join order was chosen using table statistics, the rule
+     * it was planned from and the index of the delta table in the rule's
+     * join list; see replan_op_chain(). NULL otherwise.
+     */
+    AstRule *rule;
+    int delta_idx;
+
+    /*
+     * If the leading operators of this chain are shared with an op chain
+     * that was installed earlier for the same delta table, that chain. The
+     * router only invokes the earlier chain: the last shared operator passes
+     * its output to the rest of both chains.
+     */
+    OpChain *prefix_chain;
+
+    /*
+     * If the chain's leading Filter requires column "dispatch_colno" of the
+     * delta tuple to equal the constant "dispatch_val", the router can skip
+     * the chain for delta tuples with other values (see OpChainList);
+     * otherwise, -1.
+     */
+    int dispatch_colno;
+    Datum dispatch_val;
+
+    /*
+     * Can the operators invoked via this chain be evaluated by a router
+     * worker thread? See operator_parallel_safe().
+     */
+    bool parallel_safe;
+
+    /*
+     * Does the rule only reference replicated tables? If so, every shard of
+     * a sharded runtime derives the same tuples from it.
+     */
+    bool replicated_body;
+
     /*
      * In the router, a pointer to the next op chain for the same delta
      * table
@@ -32,7 +70,52 @@ struct OpChain
     OpChain *next;
 };
 
-typedef void (*op_invoke_func)(Operator *op, Tuple *t);
+/*
+ * Operators are invoked on a batch of input tuples at a time, which
+ * amortizes the cost of dispatching to the next operator in the chain. The
+ * caller retains ownership of the batch and the tuples in it: an operator
+ * that wants to keep a tuple must pin it.
+ *
+ * Intermediate results within an op chain are not materialized as Tuples.
+ * Instead, an operator that feeds another scan, filter or project emits a
+ * batch of "virtual" tuples: the i'th virtual tuple is the array of
+ * "slot_width" column values that begins at slot_vals[i * slot_width]. The
+ * values are not copied or pinned; they point into the operator's input
+ * tuples or into stored table tuples, which remain valid until the
+ * operator returns. Only the operator that feeds an Agg builds a real
+ * Tuple; an Insert builds one for each virtual tuple it is passed.
+ */
+#define TUPLE_BATCH_SIZE 64
+
+typedef struct TupleBatch
+{
+    int ntuples;
+    Tuple *tuples[TUPLE_BATCH_SIZE];
+    Datum *slot_vals;           /* NULL if the batch holds real Tuples */
+    int slot_width;
+} TupleBatch;
+
+#define tuple_batch_is_full(batch)  ((batch)->ntuples == TUPLE_BATCH_SIZE)
+
+/*
+ * Make the i'th tuple in the batch the inner tuple of "cxt".
+ */
+static inline void
+exec_cxt_bind_inner(ExprEvalContext *cxt, TupleBatch *batch, int i)
+{
+    if (batch->slot_vals != NULL)
+    {
+        cxt->inner = NULL;
+        cxt->inner_vals = batch->slot_vals + i * batch->slot_width;
+    }
+    else
+    {
+        cxt->inner = batch->tuples[i];
+        cxt->inner_vals = NULL;
+    }
+}
+
+typedef void (*op_invoke_func)(Operator *op, TupleBatch *batch);
 
 struct Operator
 {
@@ -40,6 +123,11 @@ struct Operator
     apr_pool_t *pool;
     PlanNode *plan;
     Operator *next;
+    /*
+     * Another operator that consumes the output of the operator preceding
+     * this one, if op chains share a prefix; NULL if none
+     */
+    Operator *sibling;
     ExprEvalContext *exec_cxt;
     OpChain *chain;
 
@@ -47,6 +135,10 @@ struct Operator
     int nproj;
     ExprState **proj_ary;
     Schema *proj_schema;
+    /* Storage for a batch of virtual output tuples; NULL if none */
+    Datum *slot_buf;
+    /* Does the projection list just copy the input tuple? */
+    bool proj_is_identity;
 
     op_invoke_func invoke;
 };
@@ -56,20 +148,83 @@ struct Operator
  * for convenience in the router (specifically, we need something for
  * TableDef to point at, even if the list happens to be empty).
  */
+/*
+ * The chains in an OpChainList's dispatch index that require a given value
+ * of the dispatch column, and a batch of delta tuples with that value.
+ */
+typedef struct DispatchEntry
+{
+    Datum val;
+    int nchains;
+    OpChain **chains;
+    TupleBatch batch;
+} DispatchEntry;
+
 typedef struct OpChainList
 {
+    apr_pool_t *pool;
     OpChain *head;
     int length;
+
+    /*
+     * Does any op chain in the list scan its own delta table? If so, the
+     * router must route the delta table's tuples one at a time, so that a
+     * scan doesn't see tuples that were inserted after the one being
+     * routed.
+     */
+    bool scans_delta_tbl;
+
+    /*
+     * Dispatch index: if enough chains dispatch on the same column of the
+     * delta table (see OpChain), "dispatch_tbl" maps each value of that
+     * column to the DispatchEntry for that value. The router only invokes
+     * those chains for delta tuples with a matching value; the other chains
+     * are invoked for every delta tuple. The index is rebuilt when the list
+     * of chains changes.
+     */
+    bool dispatch_stale;
+    int dispatch_colno;
+    datum_hash_func dispatch_hash;
+    datum_eq_func dispatch_eq;
+    c4_hash_t *dispatch_tbl;
+    apr_pool_t *dispatch_pool;
 } OpChainList;
 
 /* Generic support routines for operators */
 Operator *operator_make(C4NodeKind kind, apr_size_t sz, PlanNode *plan,
-                        Operator *next_op, OpChain *chain,
-                        op_invoke_func invoke_f);
+                        Schema *input_schema, Operator *next_op,
+                        OpChain *chain, op_invoke_func invoke_f);
+
+/*
+ * Pass a batch of output tuples from "op" to each of its successors.
+ */
+static inline void
+operator_invoke_next(Operator *op, TupleBatch *batch)
+{
+    Operator *next;
+
+    for (next = op->next; next != NULL; next = next->sibling)
+        next->invoke(next, batch);
+}
+
+/*
+ * If the projection list of "op" just copies its input tuple and "batch"
+ * holds real Tuples, the operator can pass its input tuples on instead of
+ * projecting new ones; see operator_forward_batch().
+ */
+#define operator_can_forward(op, batch) \
+    ((op)->proj_is_identity && (batch)->slot_vals == NULL)
+
+bool operator_parallel_safe(Operator *op);
 
 Tuple *operator_do_project(Operator *op);
+void operator_batch_init(Operator *op, TupleBatch *batch);
+void operator_batch_project(Operator *op, TupleBatch *batch);
+void operator_emit_batch(Operator *op, TupleBatch *batch);
+void operator_forward_batch(Operator *op, TupleBatch *batch);
 
 OpChainList *opchain_list_make(apr_pool_t *pool);
 void opchain_list_add(OpChainList *list, OpChain *op_chain);
+void opchain_list_build_dispatch(OpChainList *list, Schema *schema);
 
 #endif  /* OPERATOR_H */
@@ -9,7 +9,7 @@ typedef struct ProjectOperator
     Operator op;
 } ProjectOperator;
 
-ProjectOperator *project_op_make(ProjectPlan *plan, Operator *next_op,
-                                 OpChain *chain);
+ProjectOperator *project_op_make(ProjectPlan *plan, Schema *input_schema,
+                                 Operator *next_op, OpChain *chain);
 
 #endif  /* PROJECT_H */
@@ -9,13 +9,17 @@
 typedef struct ScanOperator
 {
     Operator op;
-    int nquals;
-    ExprState **qual_ary;
+    /* All the quals, compiled into a single program; NULL if none */
+    ExprState *qual_state;
     AbstractTable *table;
     ScanCursor *cursor;
     bool anti_scan;
+    /* If nkeys > 0, the cursor is an index scan over these key exprs */
+    int nkeys;
+    ExprState **key_ary;
 } ScanOperator;
 
-ScanOperator *scan_op_make(ScanPlan *plan, Operator *next_op, OpChain *chain);
+ScanOperator *scan_op_make(ScanPlan *plan, Schema *input_schema,
+                           Operator *next_op, OpChain *chain);
 
 #endif  /* SCAN_H */
@@ -8,10 +8,22 @@
 typedef struct ScanCursor
 {
     apr_pool_t *pool;
+    /* Probe key for an index scan; filled-in by caller before scan_reset */
+    Datum *key;
+    int nkeys;
+    int *key_cols;
     /* Cursor over MemTable */
     rset_index_t *rset_iter;
-    /* Cursor over SQLiteTable */
+    /* Cursor over a MemTable index */
+    struct MemIndex *mem_index;
+    struct MemIndexEntry *index_entry;
+    apr_uint32_t index_hash;
+    /* Cursor over OrderedTable; "ordered_range" is NULL for a full scan */
+    struct ordered_node *ordered_node;
+    struct OrderedRange *ordered_range;
+    /* Cursor over SQLiteTable; also uses rset_iter for pending inserts */
     sqlite3_stmt *sqlite_stmt;
+    bool sqlite_done;
 } ScanCursor;
 
 #endif  /* SCAN_CURSOR_H */
@@ -19,6 +19,7 @@ typedef struct AstProgram
 typedef enum AstStorageKind
 {
     AST_STORAGE_MEMORY,
+    AST_STORAGE_ORDERED,
     AST_STORAGE_SQLITE
 } AstStorageKind;
 
@@ -28,6 +29,9 @@ typedef struct AstDefine
     char *name;
     AstStorageKind storage;
     List *schema;
+    List *keys;                 /* Key column numbers; empty => all columns */
+    List *order_cols;           /* Leading sort columns of an ordered table */
+    int partition_col;          /* Partition column, or -1 if replicated */
 } AstDefine;
 
 typedef struct AstTimer
@@ -137,9 +141,12 @@ typedef enum AstAggKind
 {
     AST_AGG_AVG,
     AST_AGG_COUNT,
+    AST_AGG_COUNT_DISTINCT,
     AST_AGG_MAX,
     AST_AGG_MIN,
-    AST_AGG_SUM
+    AST_AGG_QUANTILE,
+    AST_AGG_SUM,
+    AST_AGG_TOPK
 } AstAggKind;
 
 typedef struct AstAggExpr
@@ -147,6 +154,8 @@ typedef struct AstAggExpr
     C4Node node;
     AstAggKind agg_kind;
     C4Node *expr;
+    /* Constant parameter (an AstConstExpr), or NULL if none */
+    C4Node *param;
 } AstAggExpr;
 
 #endif  /* AST_H */
@@ -3,6 +3,9 @@
 
 #include "planner/planner.h"
 
+#include "operator/operator.h"
+
 void install_plan(ProgramPlan *plan, apr_pool_t *pool, C4Runtime *c4);
+OpChain *replan_op_chain(OpChain *op_chain, apr_pool_t *pool);
 
 #endif  /* INSTALLER_H */
@@ -15,6 +15,11 @@ typedef struct PlannerState
     List *join_set;
     List *qual_set;
     List *join_set_refs;
+    /*
+     * Did we choose between several candidate joins while planning the
+     * current OpChain? If so, the choice depended on table statistics.
+     */
+    bool join_order_chosen;
 
     /* The set of variable names projected by the current operator */
     List *current_plist;
@@ -34,5 +39,6 @@ typedef struct PlannerState
 
 /* plan_expr.c */
 void fix_chain_exprs(OpChainPlan *chain_plan, PlannerState *state);
+void simplify_chain_exprs(OpChainPlan *chain_plan, PlannerState *state);
 
 #endif  /* PLANNER_INTERNAL_H */
@@ -43,6 +43,18 @@ typedef struct ScanPlan
 {
     PlanNode plan;
     AstJoinClause *scan_rel;
+    /*
+     * Quals of the form "outer_var OP expr", where OP is an equality or
+     * range operator and "expr" only references the operator's input tuple,
+     * can be implemented by probing an index on the scan relation.
+     * "key_cols" is a list of the scan relation's column numbers, "key_ops"
+     * holds the AstOperKind of each key, and "key_exprs" holds the
+     * corresponding expressions over the input tuple. Equality keys precede
+     * range keys. The quals themselves remain in "qual_exprs".
+     */
+    List *key_cols;
+    List *key_ops;
+    List *key_exprs;
 } ScanPlan;
 
 typedef struct ProgramPlan
@@ -60,6 +72,13 @@ typedef struct OpChainPlan
     AstTableRef *head;
     /* A PlanNode for each op in the chain */
     List *chain;
+    /*
+     * If the join order was chosen using table statistics, the rule and the
+     * index of the delta table in its join list, so that the chain can be
+     * re-planned when the statistics change. NULL otherwise.
+     */
+    AstRule *rule;
+    int delta_idx;
 } OpChainPlan;
 
 typedef struct RulePlan
@@ -71,6 +90,9 @@ typedef struct RulePlan
      * do grouping/aggregation over the entire rule output.
      */
     AggPlan *agg_plan;
+
+    /* Is this a "delete" rule? */
+    bool is_delete;
     /*
      * When a rule is installed, we need to trigger deltas for facts that
      * existed prior to the rule's definition. We do this by picking an
@@ -81,6 +103,9 @@ typedef struct RulePlan
 } RulePlan;
 
 ProgramPlan *plan_program(AstProgram *ast, apr_pool_t *pool, C4Runtime *c4);
+OpChainPlan *plan_rule_chain(AstRule *rule, int delta_idx,
+                             apr_pool_t *pool, C4Runtime *c4);
 void print_plan_info(PlanNode *plan, apr_pool_t *p);
+bool plan_node_equal(PlanNode *p1, PlanNode *p2);
 
 #endif  /* PLANNER_H */
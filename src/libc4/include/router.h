@@ -8,6 +8,22 @@
 
 typedef struct C4Router C4Router;
 
+/*
+ * A function that the router invokes once the tuples derived in the current
+ * fixpoint have been routed, before the fixpoint completes. Operators that
+ * accumulate changes over the fixpoint (e.g. aggs) use hooks to emit their
+ * results: tuples routed by a hook are routed in the same fixpoint, after
+ * which the router invokes any hooks that have been added since.
+ */
+typedef void (*router_hook_f)(void *data);
+
+typedef struct RouterHook
+{
+    router_hook_f hook_f;
+    void *data;
+    struct RouterHook *next;
+} RouterHook;
+
 C4Router *router_make(C4Runtime *c4);
 void router_main_loop(C4Router *router);
 
@@ -17,12 +33,20 @@ char *runtime_enqueue_dump_table(C4Runtime *c4, const char *tbl_name,
 
 /* Internal APIs: XXX: clearer naming */
 void router_insert_tuple(C4Router *router, Tuple *tuple,
-                         TableDef *tbl_def, bool check_remote);
-void router_delete_tuple(C4Router *router, Tuple *tuple, TableDef *tbl_def);
+                         TableDef *tbl_def, bool check_remote,
+                         bool every_shard);
+void router_delete_tuple(C4Router *router, Tuple *tuple, TableDef *tbl_def,
+                         bool every_shard);
+void router_update_tuple(C4Router *router, Tuple *old_tuple,
+                         Tuple *new_tuple, TableDef *tbl_def,
+                         bool check_remote, bool every_shard);
+void router_route_batch(C4Router *router, TupleBatch *batch,
+                        TableDef *tbl_def, bool every_shard);
 void router_enqueue_internal(C4Router *router, Tuple *tuple, TableDef *tbl_def);
 
 OpChainList *router_get_opchain_list(C4Router *router, const char *tbl_name);
 void router_add_op_chain(C4Router *router, OpChain *op_chain);
 bool router_is_deleting(C4Router *router);
+void router_add_precommit_hook(C4Router *router, RouterHook *hook);
 
 #endif  /* ROUTER_H */
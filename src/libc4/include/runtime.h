@@ -3,20 +3,26 @@
 
 #include <apr_thread_proc.h>
 
+#include "c4-api.h"
 #include "c4-api-callback.h"
 #include "types/catalog.h"
 #include "types/tuple.h"
 #include "util/strbuf.h"
 #include "util/thread_sync.h"
 
-C4Runtime *c4_runtime_start(int port, C4ThreadSync *thread_sync,
-                            apr_pool_t *pool, apr_thread_t **thread);
+struct C4Shard;
+
+C4Runtime *c4_runtime_start(int port, struct C4Shard *shard,
+                            C4ThreadSync *thread_sync, apr_pool_t *pool,
+                            apr_thread_t **thread);
 
 typedef enum WorkItemKind
 {
     WI_PROGRAM,
     WI_DUMP_TABLE,
     WI_CALLBACK,
+    WI_FIXPOINT_MODE,
+    WI_WORKER_THREADS,
     WI_SHUTDOWN
 } WorkItemKind;
 
@@ -36,8 +42,15 @@ typedef struct WorkItem
     const char *cb_tbl_name;
     C4TupleCallback cb_func;
     void *cb_data;
+
+    /* WI_FIXPOINT_MODE: */
+    C4FixpointMode fixpoint_mode;
+
+    /* WI_WORKER_THREADS: */
+    int worker_threads;
 } WorkItem;
 
 void runtime_enqueue_work(C4Runtime *c4, WorkItem *wi);
+void runtime_post_work(C4Runtime *c4, WorkItem *wi);
 
 #endif  /* C4_RUNTIME_H */
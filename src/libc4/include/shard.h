@@ -0,0 +1,59 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "types/catalog.h"
+#include "types/tuple.h"
+#include "util/strbuf.h"
+
+/*
+ * A C4 client can divide its work among several runtimes ("shards") in the
+ * same process. Each shard is a complete runtime with its own router
+ * thread, and every program is installed on every shard. The tuples of a
+ * table declared with partition(N) are divided among the shards by the hash
+ * of column N; other tables are replicated on every shard. The analyzer
+ * requires that the partitioned tables in a rule body are joined on their
+ * partition columns, so each shard can evaluate a rule over its own
+ * partitions. Derived tuples that belong to other shards are sent to them
+ * at the end of the fixpoint; see shard_route_tuple().
+ *
+ * A C4ShardSet holds the state shared by the shards of a client; it must
+ * outlive the shards' runtimes. A runtime that isn't sharded is the only
+ * member of its set.
+ */
+typedef struct C4ShardSet C4ShardSet;
+
+typedef struct C4Shard
+{
+    int id;
+    int nshards;
+    C4ShardSet *set;
+    /* The shard's runtime; NULL until the runtime has started */
+    C4Runtime *c4;
+
+    /*
+     * The serialized tuples to send to each shard at the end of the
+     * current fixpoint. Only accessed by the shard's router thread.
+     */
+    StrBuf **out_bufs;
+
+    /*
+     * The messages that other shards have sent to this shard, most recent
+     * first. Senders push messages with a compare-and-swap; the router
+     * thread takes the whole list at once, so no locking is needed.
+     */
+    void * volatile inbox;
+} C4Shard;
+
+C4ShardSet *shard_set_make(int nshards, apr_pool_t *pool);
+C4Shard *shard_set_get(C4ShardSet *set, int shard_id);
+void shard_set_wait_idle(C4ShardSet *set);
+
+bool shard_route_tuple(C4Shard *shard, Tuple *tuple, TableDef *tbl_def,
+                       bool every_shard, bool is_delete);
+bool shard_reports_table(C4Shard *shard, TableDef *tbl_def);
+void shard_flush(C4Shard *shard);
+int shard_recv(C4Shard *shard);
+void shard_recv_done(C4Shard *shard, int nmsgs);
+void shard_barrier(C4Shard *shard);
+
+#endif  /* SHARD_H */
@@ -4,10 +4,38 @@
 #include "storage/table.h"
 #include "util/rset.h"
 
+typedef struct MemIndexEntry MemIndexEntry;
+
+/*
+ * A secondary hash index over a subset of the columns of a MemTable. Every
+ * tuple in the table has exactly one entry in each of the table's indexes;
+ * tuples with equal key values hash to the same bucket. An index is dropped
+ * when the last cursor that uses it is destroyed.
+ */
+typedef struct MemIndex
+{
+    struct MemTable *table;
+    /* Holds the index's key columns and entries */
+    apr_pool_t *pool;
+    /* Number of live cursors over the index */
+    int nusers;
+    int nkeys;
+    int *key_cols;
+    /* Bucket array; allocated with ol_alloc() so that it can be resized */
+    MemIndexEntry **buckets;
+    unsigned int max;
+    unsigned int count;
+    /* List of recycled entries */
+    MemIndexEntry *free;
+    struct MemIndex *next;
+} MemIndex;
+
 typedef struct MemTable
 {
     AbstractTable table;
     rset_t *tuples;
+    /* List of secondary indexes */
+    MemIndex *indexes;
 } MemTable;
 
 MemTable *mem_table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool);
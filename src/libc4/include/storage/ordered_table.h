@@ -0,0 +1,35 @@
+#ifndef ORDERED_TABLE_H
+#define ORDERED_TABLE_H
+
+#include "storage/table.h"
+#include "util/rbtree.h"
+
+typedef struct OrderedTable OrderedTable;
+
+struct ordered_node;
+
+RB_HEAD(ordered_tree, ordered_node, OrderedTable *);
+
+/*
+ * An OrderedTable keeps its tuples in a red-black tree, sorted by the
+ * columns in the TableDef's "order_cols". Since every column is part of the
+ * sort order, identical tuples share a single tree node, which holds a
+ * refcount as with MemTable. An index scan whose keys fix a prefix of the
+ * sort columns (via equality) and optionally bound the next sort column
+ * (via <, <=, > or >=) is evaluated by seeking to the first matching tuple
+ * and walking forward until the range is exhausted.
+ */
+struct OrderedTable
+{
+    AbstractTable table;
+    struct ordered_tree tree;
+    /* Comparison function for each column, in sort order */
+    datum_cmp_func *cmp_funcs;
+    /* List of recycled tree nodes */
+    struct ordered_node *free_head;
+};
+
+OrderedTable *ordered_table_make(TableDef *def, C4Runtime *c4,
+                                 apr_pool_t *pool);
+
+#endif  /* ORDERED_TABLE_H */
@@ -3,11 +3,15 @@
 
 #include <sqlite3.h>
 
+struct SQLiteTable;
+
 typedef struct SQLiteState
 {
     C4Runtime *c4;
     sqlite3 *db;
     bool xact_in_progress;
+    /* Tables with changes that have not yet been applied to SQLite */
+    struct SQLiteTable *dirty_tables;
 } SQLiteState;
 
 SQLiteState *sqlite_init(C4Runtime *c4);
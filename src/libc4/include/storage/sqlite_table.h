@@ -3,15 +3,43 @@
 
 #include <sqlite3.h>
 
+#include "storage/sqlite.h"
 #include "storage/table.h"
+#include "util/rset.h"
 
 typedef struct SQLiteTable
 {
     AbstractTable table;
+    /* Inserts "insert_batch" rows at once */
     sqlite3_stmt *insert_stmt;
+    int insert_batch;
+    /* Inserts a single row */
+    sqlite3_stmt *insert_one_stmt;
+    sqlite3_stmt *delete_stmt;
+    /* Comparison function for each column; see pending_row_cmp() */
+    datum_cmp_func *cmp_funcs;
+
+    /*
+     * The rows stored in SQLite, so that an insert or delete can tell
+     * whether the tuple is already present without asking SQLite. The
+     * SQLite table is created empty and only changed by us, so this is
+     * exact.
+     */
+    rset_t *rows;
+
+    /*
+     * Inserts and deletes made in the current fixpoint. These are applied to
+     * SQLite at the end of the fixpoint by sqlite_table_apply_changes(); in
+     * the mean time, scans consult them as well as SQLite.
+     */
+    rset_t *pending_inserts;
+    rset_t *pending_deletes;
+    bool dirty;
+    struct SQLiteTable *next_dirty;
 } SQLiteTable;
 
 SQLiteTable *sqlite_table_make(TableDef *def, C4Runtime *c4,
                                apr_pool_t *pool);
+void sqlite_table_apply_changes(SQLiteState *sql);
 
 #endif  /* SQLITE_TABLE_H */
@@ -13,9 +13,12 @@ struct ScanCursor;
 /*
  * Insert the tuple into this table. Returns "true" if the tuple was added;
  * returns false if the insert was a no-op because the tuple is already
- * contained by this table.
+ * contained by this table. If the table has a primary key and the new tuple
+ * replaced a different tuple with the same key, the replaced tuple is
+ * returned in "old_t" and the caller is responsible for unpinning it;
+ * otherwise, "old_t" is set to NULL.
  */
-typedef bool (*table_insert_f)(AbstractTable *tbl, Tuple *t);
+typedef bool (*table_insert_f)(AbstractTable *tbl, Tuple *t, Tuple **old_t);
 
 /*
  * Delete the tuple from this table. Returns "true" if the tuple was deleted;
@@ -28,6 +31,23 @@ typedef struct ScanCursor *(*table_scan_make_f)(AbstractTable *tbl, apr_pool_t *
 typedef void (*table_scan_reset_f)(AbstractTable *tbl, struct ScanCursor *scan);
 typedef Tuple *(*table_scan_next_f)(AbstractTable *tbl, struct ScanCursor *scan);
 
+/*
+ * Create a cursor that only returns the tuples whose values for the "nkeys"
+ * columns in "key_cols" satisfy the comparison in "key_ops" against the
+ * cursor's probe key; equality keys precede range keys. The table may choose
+ * to use only a prefix of the keys (e.g. just the equality keys); it sets the
+ * cursor's "nkeys" to the number of keys it uses. Before each call to
+ * scan_reset, the caller stores the probe key in the cursor's "key" array.
+ * The cursor may return false positives, so the caller must recheck the key
+ * quals. Returns NULL if the table can't support an index
+ * scan on these keys, in which case the caller should fall back to scanning
+ * the entire table.
+ */
+typedef struct ScanCursor *(*table_index_scan_make_f)(AbstractTable *tbl,
+                                                      int nkeys, int *key_cols,
+                                                      AstOperKind *key_ops,
+                                                      apr_pool_t *pool);
+
 struct AbstractTable
 {
     apr_pool_t *pool;
@@ -41,6 +61,7 @@ struct AbstractTable
     table_scan_make_f scan_make;
     table_scan_reset_f scan_reset;
     table_scan_next_f scan_next;
+    table_index_scan_make_f index_scan_make;
 };
 
 AbstractTable *table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool);
@@ -51,6 +72,7 @@ AbstractTable *table_make_super(apr_size_t sz, TableDef *def, C4Runtime *c4,
                                 table_scan_make_f scan_make_f,
                                 table_scan_reset_f scan_reset_f,
                                 table_scan_next_f scan_next_f,
+                                table_index_scan_make_f index_scan_make_f,
                                 apr_pool_t *pool);
 
 #endif  /* TABLE_H */
@@ -3,6 +3,9 @@
 
 #include "parser/ast.h"
 
+/* The largest "k" allowed for topk<X, k> */
+#define AGG_TOPK_MAX 1000
+
 typedef union AggStateVal
 {
     Datum d;            /* "Simple" state value */
@@ -30,11 +33,18 @@ typedef struct AggFuncDesc
 {
     agg_init_f init_f;
     agg_trans_f fw_trans_f;
+    /*
+     * NULL if the agg can't remove an input value from its state. If such an
+     * agg's input is deleted, the agg operator rebuilds the state from the
+     * group's remaining input; see rebuild_agg_groups().
+     */
     agg_trans_f bw_trans_f;
     agg_output_f output_f;
     agg_shutdown_f shutdown_f;
+    /* Is the output unaffected by adding a value that was already seen? */
+    bool dup_insensitive;
 } AggFuncDesc;
 
-AggFuncDesc *lookup_agg_desc(AstAggKind agg_kind);
+AggFuncDesc *lookup_agg_desc(AstAggKind agg_kind, bool append_only);
 
 #endif  /* AGG_FUNCS_H */
@@ -15,6 +15,29 @@ struct Tuple;
 
 typedef struct CallbackRecord CallbackRecord;
 
+/*
+ * Statistics about the contents of a table, which the planner uses to
+ * choose join orders. "ntuples" is maintained by the router as tuples are
+ * inserted and deleted. The estimated number of distinct values in each
+ * column is computed by scanning the table, and is only recomputed when
+ * "ntuples" has drifted by more than a factor of two since the last scan.
+ * Once "ntuples" moves outside ["replan_below", "replan_above"], the
+ * router re-plans the op chains whose join order depends on statistics,
+ * and resets the range to half and twice the new size (but at least
+ * TABLE_STATS_MIN_REPLAN). Only accessed by the router thread.
+ */
+#define TABLE_STATS_MIN_REPLAN      1024
+
+typedef struct TableStats
+{
+    unsigned int ntuples;
+    unsigned int replan_below;
+    unsigned int replan_above;
+    bool analyzed;
+    unsigned int analyzed_ntuples;
+    double *ndistinct;
+} TableStats;
+
 /*
  * A TableDef is a container for metadata about a C4 table. Because this
  * struct is shared among threads, fields of the structure should not be
@@ -30,9 +53,45 @@ typedef struct TableDef
     /* Column number of location spec, or -1 if none */
     int ls_colno;
 
+    /*
+     * Primary key columns. If the table has no declared key, nkeys is 0 and
+     * the entire tuple serves as the key.
+     */
+    int nkeys;
+    int *key_cols;
+
+    /*
+     * For an ordered table, the columns in the order used to sort the
+     * table's tuples; this includes every column of the table. NULL for
+     * other kinds of tables.
+     */
+    int *order_cols;
+
+    /*
+     * The column whose value determines which shard of a sharded runtime
+     * holds a tuple, or -1 if the table is replicated on every shard.
+     */
+    int partition_col;
+
+    /*
+     * Can tuples be deleted from the table? This is true if the table has a
+     * primary key (a new tuple can replace an old one with the same key),
+     * or if an installed rule that derives the table can delete tuples from
+     * it; see plan_install_rule_deps(). "derived_tbls" holds the names of
+     * the tables derived from this table by installed rules.
+     * "append_only_aggs" holds the installed AggOperators that rely on the
+     * table being insert-only; see table_set_may_delete().
+     */
+    bool may_delete;
+    List *derived_tbls;
+    List *append_only_aggs;
+
     /* List of callbacks registered for this table */
     CallbackRecord *cb;
 
+    /* Table statistics; unlike the rest of the TableDef, these change */
+    TableStats stats;
+
     /* Table implementation */
     struct AbstractTable *table;
 
@@ -55,11 +114,14 @@ struct CallbackRecord
 C4Catalog *cat_make(C4Runtime *c4);
 
 void cat_define_table(C4Catalog *cat, const char *name,
-                      AstStorageKind storage, List *schema);
+                      AstStorageKind storage, List *schema, List *keys,
+                      List *order_cols, int partition_col);
 void cat_delete_table(C4Catalog *cat, const char *name);
 bool cat_table_exists(C4Catalog *cat, const char *name);
 TableDef *cat_get_table(C4Catalog *cat, const char *name);
 struct AbstractTable *cat_get_table_impl(C4Catalog *cat, const char *name);
+TableStats *cat_get_table_stats(C4Catalog *cat, const char *name,
+                                apr_pool_t *pool);
 
 void cat_register_callback(C4Catalog *cat, const char *tbl_name,
                            C4TupleCallback callback, void *data);
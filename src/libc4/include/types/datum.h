@@ -1,6 +1,8 @@
 #ifndef DATUM_H
 #define DATUM_H
 
+#include <stdint.h>
+
 #include "util/strbuf.h"
 
 /*
@@ -16,14 +18,41 @@ typedef unsigned char DataType;
 #define TYPE_INT     4
 #define TYPE_STRING  5
 
+/*
+ * Strings longer than STRING_INLINE_MAX bytes are stored out-of-line in a
+ * refcounted C4String. Shorter strings are stored inline in the Datum
+ * itself: the low-order byte of "i8" holds (len << 1) | 1, and the string's
+ * bytes occupy the remaining bytes of the Datum (unused bytes are zero).
+ * Since C4Strings are at least 2-byte aligned, the low bit of the pointer
+ * distinguishes the two representations. A string is always stored inline
+ * if it is short enough, so two inline strings are equal iff their Datums
+ * are bitwise equal.
+ *
+ * Inline strings require that a pointer fill the entire Datum; on other
+ * platforms, all strings are stored out-of-line.
+ */
 typedef struct C4String
 {
     /* The number of bytes in "data"; we do NOT store a NUL terminator */
     apr_uint32_t len;
-    apr_uint16_t refcount;
+    /* A constant string can be shared by a great many tuples */
+    apr_uint32_t refcount;
     char data[1];       /* Variable-sized */
 } C4String;
 
+#if UINTPTR_MAX == 0xFFFFFFFFFFFFFFFFULL
+#define STRING_INLINE_MAX 7
+#else
+#define STRING_INLINE_MAX 0
+#endif
+
+/* Offset of the first byte of an inline string within its Datum */
+#if APR_IS_BIGENDIAN
+#define STRING_INLINE_OFFSET 0
+#else
+#define STRING_INLINE_OFFSET 1
+#endif
+
 typedef union Datum
 {
     /* Pass-by-value types (unboxed) */
@@ -100,6 +129,40 @@ void pool_track_datum(apr_pool_t *pool, Datum datum, DataType type);
 void datum_to_str(Datum d, DataType type, StrBuf *buf);
 Datum datum_from_str(DataType type, const char *str);
 
-C4String *make_string(apr_size_t slen);
+char *make_string(apr_size_t slen, Datum *result);
+Datum string_from_data(const char *data, apr_size_t slen);
+void string_slab_thread_exit(void);
+
+static inline bool
+string_is_inline(Datum d)
+{
+#if STRING_INLINE_MAX > 0
+    return (d.i8 & 1) != 0;
+#else
+    return false;
+#endif
+}
+
+static inline apr_size_t
+string_len(Datum d)
+{
+    if (string_is_inline(d))
+        return (apr_size_t) ((d.i8 & 0xFF) >> 1);
+
+    return d.s->len;
+}
+
+/*
+ * Note that the bytes of an inline string are stored in the Datum itself,
+ * so the result is only valid as long as "*d" is.
+ */
+static inline const char *
+string_data(const Datum *d)
+{
+    if (string_is_inline(*d))
+        return (const char *) d + STRING_INLINE_OFFSET;
+
+    return d->s->data;
+}
 
 #endif  /* DATUM_H */
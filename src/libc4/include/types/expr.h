@@ -8,10 +8,16 @@ typedef struct ExprEvalContext
 {
     Tuple *inner;
     Tuple *outer;
+    /* If non-NULL, the inner tuple is virtual: these are its column values */
+    Datum *inner_vals;
+    /* Needed to access the columns of the inner and outer tuples */
+    Schema *inner_schema;
+    Schema *outer_schema;
 } ExprEvalContext;
 
 typedef struct ExprNode ExprNode;
 typedef struct ExprState ExprState;
+typedef struct ExprProgram ExprProgram;
 
 typedef Datum (*eval_expr_func)(ExprState *state);
 
@@ -20,8 +26,8 @@ struct ExprState
     ExprEvalContext *cxt;
     ExprNode *expr;
     eval_expr_func expr_func;
-    ExprState *lhs;
-    ExprState *rhs;
+    /* Compiled form of the expression; NULL for a bare Var or Const */
+    ExprProgram *prog;
 };
 
 struct ExprNode
@@ -57,6 +63,11 @@ typedef struct ExprConst
 ExprState *make_expr_state(ExprNode *expr, ExprEvalContext *cxt,
                            apr_pool_t *pool);
 
-bool eval_qual_set(int nquals, ExprState **qual_ary);
+ExprState *make_qual_set_state(List *qual_exprs, int nproj,
+                               ExprState **proj_ary, ExprEvalContext *cxt,
+                               apr_pool_t *pool);
+
+/* A NULL qual set (no quals) is always satisfied */
+#define eval_qual_set(state)    ((state) == NULL || eval_expr(state).b)
 
 #endif  /* EXPR_H */
@@ -16,6 +16,15 @@ typedef struct Schema
     datum_text_in_func *text_in_funcs;
     datum_bin_out_func *bin_out_funcs;
     datum_text_out_func *text_out_funcs;
+    /*
+     * Packed tuple layout: the byte offset of each column within the tuple's
+     * data area, and the number of bytes it occupies. If no column is
+     * narrower than a Datum, "packed" is false and column i is simply stored
+     * at offset i * sizeof(Datum). See tuple.h
+     */
+    bool packed;
+    apr_uint16_t *col_offsets;
+    unsigned char *col_widths;
     /* Used to manage tuple allocations */
     TuplePool *tuple_pool;
 } Schema;
@@ -1,6 +1,8 @@
 #ifndef TUPLE_H
 #define TUPLE_H
 
+#include <string.h>
+
 #include "types/catalog.h"
 #include "types/datum.h"
 #include "types/schema.h"
@@ -10,21 +12,64 @@
  * Note that tuple refcounts are not currently tracked by the APR pool cleanup
  * mechanism. Therefore, modules keeping a tuple pinned should be sure to
  * release their pin in a cleanup function.
+ *
+ * Column values are stored in a packed format that depends on the tuple's
+ * Schema: each column occupies only as many bytes as its type requires (e.g.
+ * one byte for a bool), at an offset precomputed by the Schema. Hence column
+ * values must be accessed via tuple_get_val() and tuple_set_val().
  */
 typedef struct Tuple
 {
+    apr_uint16_t refcount;
     /*
-     * TODO: On LP64 machines, we have 6 bytes of padding we can use. One
-     * possible use for them is to cache the per-Tuple hash code.
+     * Cached value of tuple_hash(), computed on first use. Since tuples are
+     * immutable once constructed, the cached value never needs to be
+     * invalidated. This fits into padding on LP64 machines.
      */
-    apr_uint16_t refcount;
-    Datum vals[1];      /* Variable-length array */
+    bool hash_valid;
+    apr_uint32_t hash;
+    char data[1];       /* Variable-length; 8-byte aligned */
 } Tuple;
 
-#define tuple_get_val(t, i)     ((t)->vals[(i)])
+static inline Datum
+tuple_get_val(Tuple *t, int i, Schema *s)
+{
+    const char *ptr;
+    Datum d;
+
+    if (!s->packed)
+    {
+        memcpy(&d, t->data + i * sizeof(Datum), sizeof(Datum));
+        return d;
+    }
+
+    ptr = t->data + s->col_offsets[i];
+    if (s->col_widths[i] == sizeof(Datum))
+    {
+        memcpy(&d, ptr, sizeof(Datum));
+    }
+    else
+    {
+        /* Narrow types occupy the first byte of the Datum */
+        d.i8 = 0;
+        memcpy(&d, ptr, s->col_widths[i]);
+    }
+
+    return d;
+}
+
+static inline void
+tuple_set_val(Tuple *t, int i, Datum d, Schema *s)
+{
+    if (!s->packed)
+        memcpy(t->data + i * sizeof(Datum), &d, sizeof(Datum));
+    else
+        memcpy(t->data + s->col_offsets[i], &d, s->col_widths[i]);
+}
 
 Tuple *tuple_make_empty(Schema *s);
 Tuple *tuple_make(Schema *s, Datum *values);
+Tuple *tuple_make_copy(Schema *s, Datum *values);
 Tuple *tuple_make_from_strings(Schema *s, char **values);
 
 void tuple_pin(Tuple *tuple);
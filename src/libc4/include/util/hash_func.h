@@ -2,5 +2,19 @@
 #define HASH_FUNC_H
 
 apr_uint32_t hash_any(register const unsigned char *k, register int keylen);
+apr_uint32_t hash_uint64(apr_uint64_t k);
+/* Like hash_any(), but uses CRC32C instructions when available */
+apr_uint32_t hash_bytes(const unsigned char *k, int keylen);
+
+/*
+ * Combine the hash code "h" of the next column into the hash code of a
+ * multi-column key. Unlike XOR, this is sensitive to column order, and
+ * equal column values don't cancel each other out.
+ */
+static inline apr_uint32_t
+hash_combine(apr_uint32_t seed, apr_uint32_t h)
+{
+    return seed ^ (h + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
 
 #endif  /* HASH_FUNC_H */
@@ -3,7 +3,8 @@
  * number of times it has been inserted. The count is decremented on removal;
  * when the count reaches zero, the element is deleted from the set.
  *
- * RSet is based on C4Hash, as of rev fad4ec5d1b9e (r635).
+ * RSet was originally based on C4Hash, as of rev fad4ec5d1b9e (r635); it is
+ * now an open-addressing table in the style of Google's "Swiss tables".
  */
 
 /* Licensed to the Apache Software Foundation (ASF) under one or more
@@ -81,6 +82,25 @@ bool rset_add(rset_t *rs, void *elem);
  */
 unsigned int rset_get(rset_t *rs, void *elem);
 
+/**
+ * Look up an element in the rset.
+ * @param rs The rset
+ * @param elem Element to search for
+ * @return The element stored in the rset that compares equal to "elem", or
+ *         NULL if there is no such element.
+ */
+void *rset_lookup(rset_t *rs, void *elem);
+
+/**
+ * Replace an element in the rset. The element that compares equal to "elem"
+ * is replaced by "elem", and its refcount is reset to 1.
+ * @param rs The rset
+ * @param elem New element
+ * @return The element that was replaced, or NULL if there was no element
+ *         equal to "elem" (in which case the rset is not modified).
+ */
+void *rset_replace(rset_t *rs, void *elem);
+
 /**
  * Decrement the refcount of an element in the rset. If the refcount reaches
  * zero, the element is removed.
@@ -0,0 +1,21 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/*
+ * A WorkerPool is a fixed set of threads that run a "job" together: the
+ * job function is invoked once on each worker thread and once on the thread
+ * that started the job, which lets the caller split the job's work among
+ * them (e.g. by having each invocation claim items from a shared counter).
+ * Worker ids are 0 .. nthreads - 1; the caller's invocation has id
+ * "nthreads". The threads are shut down when the pool's APR pool is
+ * destroyed.
+ */
+typedef struct WorkerPool WorkerPool;
+
+typedef void (*worker_job_func)(void *arg, int worker_id);
+
+WorkerPool *worker_pool_make(int nthreads, apr_pool_t *pool);
+int worker_pool_size(WorkerPool *wp);
+void worker_pool_run(WorkerPool *wp, worker_job_func func, void *arg);
+
+#endif  /* WORKER_POOL_H */
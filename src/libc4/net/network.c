@@ -464,7 +464,7 @@ deserialize_tuple(ClientState *client)
     ASSERT(client->recv_state == RECV_TUPLE);
     tbl_def = cat_get_table(client->c4->cat, tbl_name);
     tuple = tuple_from_buf(client->recv_tuple_buf, tbl_def->schema);
-    router_insert_tuple(client->c4->router, tuple, tbl_def, false);
+    router_insert_tuple(client->c4->router, tuple, tbl_def, false, false);
     tuple_unpin(tuple, tbl_def->schema);
 }
 
@@ -566,7 +566,7 @@ get_client_for_loc_spec(C4Network *net, Tuple *tuple, TableDef *tbl_def)
     ClientState *client;
     Datum loc_spec;
 
-    loc_spec = tuple_get_val(tuple, tbl_def->ls_colno);
+    loc_spec = tuple_get_val(tuple, tbl_def->ls_colno, tbl_def->schema);
     client = c4_hash_get(net->client_tbl, loc_spec.s);
     if (client == NULL)
     {
@@ -11,7 +11,8 @@ copy_program(AstProgram *in, apr_pool_t *p)
 static AstDefine *
 copy_define(AstDefine *in, apr_pool_t *p)
 {
-    return make_define(in->name, in->storage, in->schema, p);
+    return make_define(in->name, in->storage, in->schema, in->keys,
+                       in->order_cols, in->partition_col, p);
 }
 
 static AstTimer *
@@ -78,7 +79,7 @@ copy_ast_const_expr(AstConstExpr *in, apr_pool_t *p)
 static AstAggExpr *
 copy_ast_agg_expr(AstAggExpr *in, apr_pool_t *p)
 {
-    return make_ast_agg_expr(in->agg_kind, in->expr, p);
+    return make_ast_agg_expr(in->agg_kind, in->expr, in->param, p);
 }
 
 static AggPlan *
@@ -111,7 +112,8 @@ static ScanPlan *
 copy_scan_plan(ScanPlan *in, apr_pool_t *p)
 {
     return make_scan_plan(in->scan_rel, in->plan.quals, in->plan.qual_exprs,
-                          in->plan.proj_list, p);
+                          in->plan.proj_list, in->key_cols, in->key_ops,
+                          in->key_exprs, p);
 }
 
 static ExprOp *
@@ -17,13 +17,17 @@ make_program(List *defines, List *timers, List *facts, List *rules, apr_pool_t *
 
 AstDefine *
 make_define(const char *name, AstStorageKind storage,
-            List *schema, apr_pool_t *p)
+            List *schema, List *keys, List *order_cols, int partition_col,
+            apr_pool_t *p)
 {
     AstDefine *result = apr_pcalloc(p, sizeof(*result));
     result->node.kind = AST_DEFINE;
     result->storage = storage;
     result->name = apr_pstrdup(p, name);
     result->schema = list_copy_deep(schema, p);
+    result->keys = list_copy(keys, p);
+    result->order_cols = list_copy(order_cols, p);
+    result->partition_col = partition_col;
     return result;
 }
 
@@ -138,12 +142,14 @@ make_ast_const_expr(AstConstKind c_kind, const char *value, apr_pool_t *p)
 }
 
 AstAggExpr *
-make_ast_agg_expr(AstAggKind a_kind, C4Node *expr, apr_pool_t *p)
+make_ast_agg_expr(AstAggKind a_kind, C4Node *expr, C4Node *param,
+                  apr_pool_t *p)
 {
     AstAggExpr *result = apr_pcalloc(p, sizeof(*result));
     result->node.kind = AST_AGG_EXPR;
     result->agg_kind = a_kind;
     result->expr = copy_node(expr, p);
+    result->param = copy_node(param, p);
     return result;
 }
 
@@ -202,7 +208,8 @@ make_project_plan(List *proj_list, apr_pool_t *p)
 
 ScanPlan *
 make_scan_plan(AstJoinClause *scan_rel, List *quals, List *qual_exprs,
-               List *proj_list, apr_pool_t *p)
+               List *proj_list, List *key_cols, List *key_ops,
+               List *key_exprs, apr_pool_t *p)
 {
     ScanPlan *result = apr_pcalloc(p, sizeof(*result));
     result->plan.node.kind = PLAN_SCAN;
@@ -212,6 +219,12 @@ make_scan_plan(AstJoinClause *scan_rel, List *quals, List *qual_exprs,
     if (proj_list)
         result->plan.proj_list = list_copy_deep(proj_list, p);
     result->scan_rel = copy_node(scan_rel, p);
+    if (key_cols)
+        result->key_cols = list_copy(key_cols, p);
+    if (key_ops)
+        result->key_ops = list_copy(key_ops, p);
+    if (key_exprs)
+        result->key_exprs = list_copy_deep(key_exprs, p);
     return result;
 }
 
@@ -1,29 +1,40 @@
 #include "c4-internal.h"
 #include "operator/agg.h"
+#include "operator/scancursor.h"
 #include "router.h"
 #include "parser/analyze.h"
 #include "nodes/copyfuncs.h"
+#include "storage/table.h"
+#include "util/hash_func.h"
 
-static bool add_new_tuple(Tuple *t, AggOperator *agg_op);
+static bool add_new_tuple(Tuple *t, bool is_delete, AggOperator *agg_op);
 static void agg_do_delete(Tuple *t, AggOperator *agg_op);
 static void agg_do_insert(Tuple *t, AggOperator *agg_op);
 
 static void
-agg_invoke(Operator *op, Tuple *t)
+agg_invoke(Operator *op, TupleBatch *batch)
 {
     AggOperator *agg_op = (AggOperator *) op;
     C4Runtime *c4 = op->chain->c4;
-    bool need_work;
+    bool is_delete;
+    int i;
+
+    ASSERT(batch->slot_vals == NULL);
+    is_delete = router_is_deleting(c4->router);
+    ASSERT(!is_delete || !agg_op->append_only);
+    for (i = 0; i < batch->ntuples; i++)
+    {
+        Tuple *t = batch->tuples[i];
 
 #if 0
-    c4_log(c4, "%s: %s",
-           __func__, log_tuple(c4, t, op->proj_schema));
+        c4_log(c4, "%s: %s",
+               __func__, log_tuple(c4, t, op->exec_cxt->inner_schema));
 #endif
 
-    need_work = add_new_tuple(t, agg_op);
-    if (need_work)
-    {
-        if (router_is_deleting(c4->router))
+        if (agg_op->tuple_set != NULL && !add_new_tuple(t, is_delete, agg_op))
+            continue;
+
+        if (is_delete)
             agg_do_delete(t, agg_op);
         else
             agg_do_insert(t, agg_op);
@@ -31,11 +42,9 @@ agg_invoke(Operator *op, Tuple *t)
 }
 
 static bool
-add_new_tuple(Tuple *t, AggOperator *agg_op)
+add_new_tuple(Tuple *t, bool is_delete, AggOperator *agg_op)
 {
-    C4Runtime *c4 = agg_op->op.chain->c4;
-
-    if (router_is_deleting(c4->router))
+    if (is_delete)
     {
         Tuple *old_t;
         unsigned int new_count;
@@ -43,7 +52,7 @@ add_new_tuple(Tuple *t, AggOperator *agg_op)
         old_t = rset_remove(agg_op->tuple_set, t, &new_count);
         if (old_t != NULL && new_count == 0)
         {
-            tuple_unpin(old_t, agg_op->op.proj_schema);
+            tuple_unpin(old_t, agg_op->op.exec_cxt->inner_schema);
             return true;
         }
 
@@ -61,42 +70,83 @@ add_new_tuple(Tuple *t, AggOperator *agg_op)
     }
 }
 
+/*
+ * Compute the group's agg values into the operator's "output_vals". Returns
+ * false if they are the same as the values in the group's current output
+ * tuple, in which case there is nothing to emit.
+ */
+static bool
+compute_agg_output(AggGroupState *group, AggOperator *agg_op)
+{
+    Schema *output_schema = agg_op->output_tbl->schema;
+    bool changed;
+    int i;
+
+    changed = (group->output_tup == NULL);
+    for (i = 0; i < agg_op->num_aggs; i++)
+    {
+        AggExprInfo *agg_info;
+        Datum d;
+
+        agg_info = agg_op->agg_info[i];
+        if (agg_info->desc->output_f)
+            d = agg_info->desc->output_f(group->state_vals[i]);
+        else
+            d = group->state_vals[i].d;
+
+        agg_op->output_vals[i] = d;
+
+        if (!changed)
+        {
+            int colno = agg_info->colno;
+            Datum old_d;
+
+            old_d = tuple_get_val(group->output_tup, colno, output_schema);
+            if (!(output_schema->eq_funcs[colno])(d, old_d))
+                changed = true;
+        }
+    }
+
+    return changed;
+}
+
 static void
 emit_agg_output(AggGroupState *group, AggOperator *agg_op)
 {
     C4Runtime *c4 = agg_op->op.chain->c4;
+    Schema *input_schema = agg_op->op.exec_cxt->inner_schema;
+    Schema *output_schema = agg_op->output_tbl->schema;
+    Tuple *old_tup;
     int i;
 
-    if (group->output_tup)
-    {
-        router_delete_tuple(c4->router, group->output_tup,
-                            agg_op->output_tbl);
-        tuple_unpin(group->output_tup, agg_op->op.proj_schema);
-    }
+    /*
+     * If the agg values haven't changed (e.g. sum<> of a zero, or min<> of a
+     * value that isn't the minimum), neither has the output tuple.
+     */
+    if (!compute_agg_output(group, agg_op))
+        return;
 
     /*
      * Note that because tuples are immutable, we can't overwrite the previous
-     * output tuple in-place
+     * output tuple in-place. Also note that the agg's projection list just
+     * mirrors its input, so we use the output table's schema instead.
      */
-    group->output_tup = tuple_make_empty(agg_op->op.proj_schema);
+    old_tup = group->output_tup;
+    group->output_tup = tuple_make_empty(output_schema);
 
     /* Compute agg columns */
     for (i = 0; i < agg_op->num_aggs; i++)
     {
         AggExprInfo *agg_info;
-        Datum d;
         int colno;
         DataType type;
 
         agg_info = agg_op->agg_info[i];
-        if (agg_info->desc->output_f)
-            d = agg_info->desc->output_f(group->state_vals[i]);
-        else
-            d = group->state_vals[i].d;
-
         colno = agg_info->colno;
         type = expr_get_type((C4Node *) agg_info->ast_expr);
-        group->output_tup->vals[colno] = datum_copy(d, type);
+        tuple_set_val(group->output_tup, colno,
+                      datum_copy(agg_op->output_vals[i], type),
+                      output_schema);
     }
 
     /* Copy over group columns: no need to recompute */
@@ -107,57 +157,53 @@ emit_agg_output(AggGroupState *group, AggOperator *agg_op)
         Datum d;
 
         colno = agg_op->group_colnos[i];
-        type = schema_get_type(agg_op->op.proj_schema, colno);
-        d = tuple_get_val(group->key, colno);
-        group->output_tup->vals[colno] = datum_copy(d, type);
+        type = schema_get_type(output_schema, colno);
+        d = tuple_get_val(group->key, colno, input_schema);
+        tuple_set_val(group->output_tup, colno, datum_copy(d, type),
+                      output_schema);
     }
 
-    router_insert_tuple(c4->router, group->output_tup,
-                        agg_op->output_tbl, true);
+    /* Replace the group's previous output tuple, if any */
+    if (old_tup != NULL)
+    {
+        router_update_tuple(c4->router, old_tup, group->output_tup,
+                            agg_op->output_tbl, true,
+                            agg_op->op.chain->replicated_body);
+        tuple_unpin(old_tup, output_schema);
+    }
+    else
+        router_insert_tuple(c4->router, group->output_tup,
+                            agg_op->output_tbl, true,
+                            agg_op->op.chain->replicated_body);
 }
 
+/*
+ * Compute the initial state of a group from its first input tuple.
+ */
 static void
-create_agg_group(Tuple *t, AggOperator *agg_op)
+init_agg_group(AggGroupState *group, Tuple *t, AggOperator *agg_op)
 {
-    AggGroupState *new_group;
     int i;
 
-    if (agg_op->free_groups != NULL)
-    {
-        new_group = agg_op->free_groups;
-        agg_op->free_groups = new_group->next;
-    }
-    else
-    {
-        new_group = apr_palloc(agg_op->op.pool, sizeof(*new_group));
-        new_group->state_vals = apr_palloc(agg_op->op.pool,
-                                           sizeof(AggStateVal) * agg_op->num_aggs);
-    }
-
-    new_group->output_tup = NULL;
-    new_group->count = 1;
-    new_group->key = t;
-    tuple_pin(new_group->key);
+    group->count = 1;
     for (i = 0; i < agg_op->num_aggs; i++)
     {
         AggExprInfo *agg_info;
         Datum input_val;
 
         agg_info = agg_op->agg_info[i];
-        input_val = tuple_get_val(t, agg_info->colno);
+        input_val = tuple_get_val(t, agg_info->colno,
+                                  agg_op->op.exec_cxt->inner_schema);
         if (agg_info->desc->init_f)
-            new_group->state_vals[i] = agg_info->desc->init_f(input_val,
-                                                              agg_op, i);
+            group->state_vals[i] = agg_info->desc->init_f(input_val,
+                                                          agg_op, i);
         else
-            new_group->state_vals[i].d = input_val;
+            group->state_vals[i].d = input_val;
     }
-
-    c4_hash_set(agg_op->group_tbl, t, new_group);
-    emit_agg_output(new_group, agg_op);
 }
 
 static void
-free_agg_group(AggGroupState *group, AggOperator *agg_op)
+shutdown_agg_group(AggGroupState *group, AggOperator *agg_op)
 {
     int i;
 
@@ -169,9 +215,63 @@ free_agg_group(AggGroupState *group, AggOperator *agg_op)
         if (agg_info->desc->shutdown_f)
             agg_info->desc->shutdown_f(group->state_vals[i]);
     }
+}
+
+/*
+ * Note that the group has changed, so that its output is emitted before the
+ * current fixpoint completes.
+ */
+static void
+mark_group_dirty(AggGroupState *group, AggOperator *agg_op)
+{
+    if (group->dirty)
+        return;
+
+    if (agg_op->dirty_groups == NULL)
+        router_add_precommit_hook(agg_op->op.chain->c4->router,
+                                  &agg_op->flush_hook);
+
+    group->dirty = true;
+    group->next_dirty = agg_op->dirty_groups;
+    agg_op->dirty_groups = group;
+}
+
+static void
+create_agg_group(Tuple *t, AggOperator *agg_op)
+{
+    AggGroupState *new_group;
+
+    if (agg_op->free_groups != NULL)
+    {
+        new_group = agg_op->free_groups;
+        agg_op->free_groups = new_group->next;
+    }
+    else
+    {
+        new_group = apr_palloc(agg_op->op.pool, sizeof(*new_group));
+        new_group->state_vals = apr_palloc(agg_op->op.pool,
+                                           sizeof(AggStateVal) * agg_op->num_aggs);
+    }
+
+    new_group->output_tup = NULL;
+    new_group->dirty = false;
+    new_group->needs_rebuild = false;
+    new_group->key = t;
+    tuple_pin(new_group->key);
+    init_agg_group(new_group, t, agg_op);
+
+    c4_hash_set(agg_op->group_tbl, t, new_group);
+    mark_group_dirty(new_group, agg_op);
+}
+
+static void
+free_agg_group(AggGroupState *group, AggOperator *agg_op)
+{
+    shutdown_agg_group(group, agg_op);
 
-    tuple_unpin(group->output_tup, agg_op->op.proj_schema);
-    tuple_unpin(group->key, agg_op->op.proj_schema);
+    if (group->output_tup)
+        tuple_unpin(group->output_tup, agg_op->output_tbl->schema);
+    tuple_unpin(group->key, agg_op->op.exec_cxt->inner_schema);
     group->next = agg_op->free_groups;
     agg_op->free_groups = group;
 }
@@ -186,12 +286,14 @@ remove_agg_group(AggGroupState *group, AggOperator *agg_op)
     if (!found)
         ERROR("Failed to re-find group for key");
 
-    router_delete_tuple(c4->router, group->output_tup, agg_op->output_tbl);
+    if (group->output_tup)
+        router_delete_tuple(c4->router, group->output_tup, agg_op->output_tbl,
+                            agg_op->op.chain->replicated_body);
     free_agg_group(group, agg_op);
 }
 
 static void
-advance_agg_group(Tuple *t, bool forward,
+advance_agg_state(Tuple *t, bool forward,
                   AggGroupState *group, AggOperator *agg_op)
 {
     int i;
@@ -203,7 +305,8 @@ advance_agg_group(Tuple *t, bool forward,
         agg_trans_f trans_f;
 
         agg_info = agg_op->agg_info[i];
-        input_val = tuple_get_val(t, agg_info->colno);
+        input_val = tuple_get_val(t, agg_info->colno,
+                                  agg_op->op.exec_cxt->inner_schema);
 
         if (forward)
             trans_f = agg_info->desc->fw_trans_f;
@@ -212,23 +315,43 @@ advance_agg_group(Tuple *t, bool forward,
 
         group->state_vals[i] = trans_f(group->state_vals[i], input_val);
     }
+}
+
+static void
+advance_agg_group(Tuple *t, bool forward,
+                  AggGroupState *group, AggOperator *agg_op)
+{
+    /*
+     * If some agg can't remove an input value from its state, defer the
+     * deletion (and any later input) until the group is rebuilt.
+     */
+    if (!forward && agg_op->rebuild_on_delete)
+        group->needs_rebuild = true;
+
+    if (!group->needs_rebuild)
+        advance_agg_state(t, forward, group, agg_op);
 
-    emit_agg_output(group, agg_op);
+    mark_group_dirty(group, agg_op);
 }
 
+/*
+ * A group whose input becomes empty stays in the hash table until the end
+ * of the fixpoint, so that if the group gets new input in the meantime, its
+ * previous output tuple can be replaced with an update.
+ */
 static void
 agg_do_delete(Tuple *t, AggOperator *agg_op)
 {
     AggGroupState *agg_group;
 
     agg_group = c4_hash_get(agg_op->group_tbl, t);
-    if (agg_group == NULL)
+    if (agg_group == NULL || agg_group->count == 0)
         return;
 
     agg_group->count--;
     if (agg_group->count == 0)
     {
-        remove_agg_group(agg_group, agg_op);
+        mark_group_dirty(agg_group, agg_op);
         return;
     }
 
@@ -247,15 +370,118 @@ agg_do_insert(Tuple *t, AggOperator *agg_op)
         return;
     }
 
+    if (agg_group->count == 0)
+    {
+        shutdown_agg_group(agg_group, agg_op);
+        init_agg_group(agg_group, t, agg_op);
+        agg_group->needs_rebuild = false;
+        mark_group_dirty(agg_group, agg_op);
+        return;
+    }
+
     agg_group->count++;
     advance_agg_group(t, true, agg_group, agg_op);
 }
 
+/*
+ * Recompute the state of each changed group that needs it from scratch,
+ * using the agg's input tuples. This requires a scan of the entire input,
+ * but the cost is shared by every such group in the fixpoint.
+ */
+static void
+rebuild_agg_groups(AggOperator *agg_op)
+{
+    C4Runtime *c4 = agg_op->op.chain->c4;
+    AggGroupState *group;
+    rset_index_t *ri;
+    bool found;
+
+    found = false;
+    for (group = agg_op->dirty_groups; group != NULL;
+         group = group->next_dirty)
+    {
+        if (!group->needs_rebuild)
+            continue;
+
+        /* Empty groups are about to be removed anyway */
+        if (group->count == 0)
+        {
+            group->needs_rebuild = false;
+            continue;
+        }
+
+        shutdown_agg_group(group, agg_op);
+        group->count = 0;
+        found = true;
+    }
+
+    if (!found)
+        return;
+
+    ri = rset_iter_make(c4->tmp_pool, agg_op->tuple_set);
+    while (rset_iter_next(ri))
+    {
+        Tuple *t = rset_this(ri);
+
+        group = c4_hash_get(agg_op->group_tbl, t);
+        ASSERT(group != NULL);
+        if (!group->needs_rebuild)
+            continue;
+
+        if (group->count == 0)
+        {
+            init_agg_group(group, t, agg_op);
+        }
+        else
+        {
+            group->count++;
+            advance_agg_state(t, true, group, agg_op);
+        }
+    }
+
+    for (group = agg_op->dirty_groups; group != NULL;
+         group = group->next_dirty)
+    {
+        ASSERT(group->count > 0 || !group->needs_rebuild);
+        group->needs_rebuild = false;
+    }
+}
+
+/*
+ * Router pre-commit hook: emit the output of each group that has changed in
+ * this fixpoint, and remove the groups that no longer have any input.
+ */
+static void
+agg_flush(void *data)
+{
+    AggOperator *agg_op = (AggOperator *) data;
+    AggGroupState *group;
+
+    if (agg_op->rebuild_on_delete)
+        rebuild_agg_groups(agg_op);
+
+    group = agg_op->dirty_groups;
+    agg_op->dirty_groups = NULL;
+    while (group != NULL)
+    {
+        AggGroupState *next = group->next_dirty;
+
+        group->dirty = false;
+        if (group->count == 0)
+            remove_agg_group(group, agg_op);
+        else
+            emit_agg_output(group, agg_op);
+
+        group = next;
+    }
+}
+
 static unsigned int
 group_tbl_hash(const char *key, int klen, void *data)
 {
     Tuple *t = (Tuple *) key;
     AggOperator *agg_op = (AggOperator *) data;
+    Schema *schema = agg_op->op.exec_cxt->inner_schema;
     int i;
     unsigned int result;
 
@@ -268,9 +494,9 @@ group_tbl_hash(const char *key, int klen, void *data)
         apr_uint32_t h;
 
         colno = agg_op->group_colnos[i];
-        val = tuple_get_val(t, colno);
-        h = (agg_op->op.proj_schema->hash_funcs[colno])(val);
-        result ^= h;
+        val = tuple_get_val(t, colno, schema);
+        h = (schema->hash_funcs[colno])(val);
+        result = hash_combine(result, h);
     }
 
     return result;
@@ -282,6 +508,7 @@ group_tbl_cmp(const void *k1, const void *k2, int klen, void *data)
     Tuple *t1 = (Tuple *) k1;
     Tuple *t2 = (Tuple *) k2;
     AggOperator *agg_op = (AggOperator *) data;
+    Schema *schema = agg_op->op.exec_cxt->inner_schema;
     int i;
 
     ASSERT(klen == sizeof(Tuple *));
@@ -293,9 +520,9 @@ group_tbl_cmp(const void *k1, const void *k2, int klen, void *data)
         bool result;
 
         colno = agg_op->group_colnos[i];
-        val1 = tuple_get_val(t1, colno);
-        val2 = tuple_get_val(t2, colno);
-        result = (agg_op->op.proj_schema->eq_funcs[colno])(val1, val2);
+        val1 = tuple_get_val(t1, colno, schema);
+        val2 = tuple_get_val(t2, colno, schema);
+        result = (schema->eq_funcs[colno])(val1, val2);
         if (!result)
             return false;
     }
@@ -329,7 +556,7 @@ count_agg_exprs(AstTableRef *head)
 }
 
 static AggExprInfo **
-make_agg_info(int num_aggs, List *cols, apr_pool_t *pool)
+make_agg_info(int num_aggs, List *cols, bool append_only, apr_pool_t *pool)
 {
     AggExprInfo **result;
     ListCell *lc;
@@ -355,7 +582,7 @@ make_agg_info(int num_aggs, List *cols, apr_pool_t *pool)
         agg_info = apr_palloc(pool, sizeof(*agg_info));
         agg_info->colno = colno;
         agg_info->ast_expr = copy_node(agg_expr, pool);
-        agg_info->desc = lookup_agg_desc(agg_expr->agg_kind);
+        agg_info->desc = lookup_agg_desc(agg_expr->agg_kind, append_only);
         result[aggno] = agg_info;
         aggno++;
         colno++;
@@ -398,13 +625,16 @@ agg_cleanup(void *data)
     rset_index_t *ri;
     c4_hash_index_t *hi;
 
-    ri = rset_iter_make(agg->op.pool, agg->tuple_set);
-    while (rset_iter_next(ri))
+    if (agg->tuple_set != NULL)
     {
-        Tuple *t;
+        ri = rset_iter_make(agg->op.pool, agg->tuple_set);
+        while (rset_iter_next(ri))
+        {
+            Tuple *t;
 
-        t = rset_this(ri);
-        tuple_unpin(t, agg->op.proj_schema);
+            t = rset_this(ri);
+            tuple_unpin(t, agg->op.exec_cxt->inner_schema);
+        }
     }
 
     hi = c4_hash_iter_make(agg->op.pool, agg->group_tbl);
@@ -419,8 +649,194 @@ agg_cleanup(void *data)
     return APR_SUCCESS;
 }
 
+/*
+ * Does the agg need to keep its input tuples? Each distinct input tuple is
+ * only counted once, so we need to remember which tuples we have seen,
+ * unless none of the aggs are affected by duplicate input values. We also
+ * need the input tuples to handle deletions, but not if the input is
+ * insert-only.
+ */
+static bool
+agg_needs_tuple_set(AggOperator *agg_op)
+{
+    int i;
+
+    if (!agg_op->append_only)
+        return true;
+
+    for (i = 0; i < agg_op->num_aggs; i++)
+    {
+        if (!agg_op->agg_info[i]->desc->dup_insensitive)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Does some agg lack a backward transition function? If so, deleting an
+ * input tuple requires recomputing the group's state from its remaining
+ * input. Insert-only input is never deleted.
+ */
+static bool
+agg_needs_rebuild(AggOperator *agg_op)
+{
+    int i;
+
+    if (agg_op->append_only)
+        return false;
+
+    for (i = 0; i < agg_op->num_aggs; i++)
+    {
+        if (agg_op->agg_info[i]->desc->bw_trans_f == NULL)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Add the agg's input tuples to its tuple_set, without changing the groups;
+ * used by rescan_agg_input().
+ */
+static void
+agg_collect_input(Operator *op, TupleBatch *batch)
+{
+    AggOperator *agg_op = (AggOperator *) op;
+    int i;
+
+    ASSERT(batch->slot_vals == NULL);
+    for (i = 0; i < batch->ntuples; i++)
+        add_new_tuple(batch->tuples[i], false, agg_op);
+}
+
+/*
+ * Recompute the agg's entire input into its tuple_set: the output of its op
+ * chain for every tuple in the chain's delta table is the output of the
+ * agg's rule over the current contents of the tables in its body. An agg's
+ * chain has operators of its own (see find_shared_prefix()), but chains
+ * installed later can consume the output of its leading operators; we
+ * detach them while we rescan, so that they don't see the tuples again.
+ */
+static void
+rescan_agg_input(AggOperator *agg_op)
+{
+    OpChain *chain = agg_op->op.chain;
+    AbstractTable *tbl = chain->delta_tbl->table;
+    apr_pool_t *tmp_pool = chain->c4->tmp_pool;
+    Operator **siblings;
+    ScanCursor *cursor;
+    TupleBatch batch;
+    Operator *op;
+    Tuple *t;
+    int i;
+
+    siblings = apr_palloc(tmp_pool, chain->length * sizeof(*siblings));
+    for (op = chain->chain_start, i = 0; op != NULL; op = op->next, i++)
+    {
+        ASSERT(i < chain->length);
+        siblings[i] = op->sibling;
+        op->sibling = NULL;
+    }
+
+    agg_op->op.invoke = agg_collect_input;
+    batch.ntuples = 0;
+    batch.slot_vals = NULL;
+    cursor = tbl->scan_make(tbl, tmp_pool);
+    tbl->scan_reset(tbl, cursor);
+    while ((t = tbl->scan_next(tbl, cursor)) != NULL)
+    {
+        batch.tuples[batch.ntuples++] = t;
+        if (tuple_batch_is_full(&batch))
+        {
+            chain->chain_start->invoke(chain->chain_start, &batch);
+            batch.ntuples = 0;
+        }
+    }
+
+    if (batch.ntuples > 0)
+        chain->chain_start->invoke(chain->chain_start, &batch);
+    agg_op->op.invoke = agg_invoke;
+
+    for (op = chain->chain_start, i = 0; op != NULL; op = op->next, i++)
+        op->sibling = siblings[i];
+}
+
+/*
+ * A rule installed after the agg can delete from one of the tables in the
+ * agg's body, so the agg's input is no longer insert-only. Switch to agg
+ * functions that handle deletions, and recompute each group's state with
+ * them from the group's input. If we didn't keep the input tuples, we
+ * rescan the body tables to find them. The agg values don't change, so
+ * there is no new output to emit.
+ */
+void
+agg_op_allow_deletes(AggOperator *agg_op)
+{
+    apr_pool_t *tmp_pool = agg_op->op.chain->c4->tmp_pool;
+    c4_hash_index_t *hi;
+    rset_index_t *ri;
+    int i;
+
+    if (!agg_op->append_only)
+        return;
+
+    /* Rules are installed between fixpoints */
+    ASSERT(agg_op->dirty_groups == NULL);
+
+    hi = c4_hash_iter_make(tmp_pool, agg_op->group_tbl);
+    while (c4_hash_iter_next(hi))
+    {
+        AggGroupState *group = c4_hash_this_val(hi);
+
+        shutdown_agg_group(group, agg_op);
+        group->count = 0;
+    }
+
+    agg_op->append_only = false;
+    for (i = 0; i < agg_op->num_aggs; i++)
+    {
+        AggExprInfo *agg_info = agg_op->agg_info[i];
+
+        agg_info->desc = lookup_agg_desc(agg_info->ast_expr->agg_kind, false);
+    }
+    agg_op->rebuild_on_delete = agg_needs_rebuild(agg_op);
+
+    if (agg_op->tuple_set == NULL)
+    {
+        agg_op->tuple_set = rset_make(agg_op->op.pool,
+                                      agg_op->op.exec_cxt->inner_schema,
+                                      tuple_hash_tbl, tuple_cmp_tbl);
+        rescan_agg_input(agg_op);
+    }
+
+    ri = rset_iter_make(tmp_pool, agg_op->tuple_set);
+    while (rset_iter_next(ri))
+    {
+        Tuple *t = rset_this(ri);
+        AggGroupState *group;
+
+        group = c4_hash_get(agg_op->group_tbl, t);
+        ASSERT(group != NULL);
+        if (group->count == 0)
+        {
+            init_agg_group(group, t, agg_op);
+        }
+        else
+        {
+            group->count++;
+            advance_agg_state(t, true, group, agg_op);
+        }
+    }
+}
+
+/*
+ * If "append_only" is true, the planner has proven that the agg's input is
+ * insert-only.
+ */
 AggOperator *
-agg_op_make(AggPlan *plan, OpChain *chain)
+agg_op_make(AggPlan *plan, Schema *input_schema, OpChain *chain,
+            bool append_only)
 {
     AggOperator *agg_op;
     int num_cols;
@@ -430,13 +846,16 @@ agg_op_make(AggPlan *plan, OpChain *chain)
     agg_op = (AggOperator *) operator_make(OPER_AGG,
                                            sizeof(*agg_op),
                                            (PlanNode *) plan,
+                                           input_schema,
                                            NULL,
                                            chain,
                                            agg_invoke);
 
+    agg_op->append_only = append_only;
     agg_op->num_aggs = count_agg_exprs(plan->head);
     agg_op->agg_info = make_agg_info(agg_op->num_aggs, plan->head->cols,
-                                     agg_op->op.pool);
+                                     append_only, agg_op->op.pool);
+    agg_op->rebuild_on_delete = agg_needs_rebuild(agg_op);
 
     num_cols = list_length(plan->head->cols);
     ASSERT(num_cols >= agg_op->num_aggs);
@@ -446,9 +865,18 @@ agg_op_make(AggPlan *plan, OpChain *chain)
 
     agg_op->group_tbl = c4_hash_make(agg_op->op.pool, sizeof(Tuple *),
                                      agg_op, group_tbl_hash, group_tbl_cmp);
-    agg_op->tuple_set = rset_make(agg_op->op.pool, agg_op->op.proj_schema,
-                                  tuple_hash_tbl, tuple_cmp_tbl);
+    if (agg_needs_tuple_set(agg_op))
+        agg_op->tuple_set = rset_make(agg_op->op.pool, input_schema,
+                                      tuple_hash_tbl, tuple_cmp_tbl);
+    else
+        agg_op->tuple_set = NULL;
     agg_op->free_groups = NULL;
+    agg_op->output_vals = apr_palloc(agg_op->op.pool,
+                                     agg_op->num_aggs * sizeof(Datum));
+    agg_op->dirty_groups = NULL;
+    agg_op->flush_hook.hook_f = agg_flush;
+    agg_op->flush_hook.data = agg_op;
+    agg_op->flush_hook.next = NULL;
     agg_op->output_tbl = cat_get_table(chain->c4->cat, plan->head->name);
 
     /*
@@ -2,50 +2,71 @@
 #include "operator/filter.h"
 
 static void
-filter_invoke(Operator *op, Tuple *t)
+filter_invoke(Operator *op, TupleBatch *batch)
 {
     FilterOperator *filter_op = (FilterOperator *) op;
     ExprEvalContext *exec_cxt;
+    TupleBatch out;
+    int i;
 
     exec_cxt = filter_op->op.exec_cxt;
-    exec_cxt->inner = t;
 
     /*
-     * Only route the tuple onward if it passes all the quals. Note that
-     * although OPER_FILTER has a projection list, we don't actually do any
-     * projection: the planner ensures that the associated projection list
-     * just preserves the input to the filter.
+     * Only route the tuples onward that pass all the quals. Usually the
+     * filter's projection list just preserves its input, so we can pass on
+     * the input tuples; the caller owns them, so we don't need to pin them.
+     */
+    if (operator_can_forward(op, batch))
+    {
+        out.ntuples = 0;
+        out.slot_vals = NULL;
+        for (i = 0; i < batch->ntuples; i++)
+        {
+            exec_cxt_bind_inner(exec_cxt, batch, i);
+            if (eval_qual_set(filter_op->qual_state))
+                out.tuples[out.ntuples++] = batch->tuples[i];
+        }
+
+        operator_forward_batch(op, &out);
+        return;
+    }
+
+    /*
+     * Otherwise, either the filter is the last operator before an Insert or
+     * Agg, and it projects the rule head, or the input tuples are virtual.
+     * Virtual input tuples are only valid within this call, so we copy the
+     * ones that pass the quals to our own output batch.
      */
-    if (eval_qual_set(filter_op->nquals, filter_op->qual_ary))
-        op->next->invoke(op->next, t);
+    operator_batch_init(op, &out);
+    for (i = 0; i < batch->ntuples; i++)
+    {
+        exec_cxt_bind_inner(exec_cxt, batch, i);
+        if (eval_qual_set(filter_op->qual_state))
+            operator_batch_project(op, &out);
+    }
+
+    operator_emit_batch(op, &out);
 }
 
 FilterOperator *
-filter_op_make(FilterPlan *plan, Operator *next_op, OpChain *chain)
+filter_op_make(FilterPlan *plan, Schema *input_schema,
+               Operator *next_op, OpChain *chain)
 {
     FilterOperator *filter_op;
-    ListCell *lc;
-    int i;
 
     filter_op = (FilterOperator *) operator_make(OPER_FILTER,
                                                  sizeof(*filter_op),
                                                  (PlanNode *) plan,
+                                                 input_schema,
                                                  next_op,
                                                  chain,
                                                  filter_invoke);
 
-    filter_op->nquals = list_length(filter_op->op.plan->quals);
-    filter_op->qual_ary = apr_palloc(filter_op->op.pool,
-                                     sizeof(*filter_op->qual_ary) * filter_op->nquals);
-    i = 0;
-    foreach (lc, filter_op->op.plan->qual_exprs)
-    {
-        ExprNode *expr = (ExprNode *) lc_ptr(lc);
-
-        filter_op->qual_ary[i++] = make_expr_state(expr,
-                                                   filter_op->op.exec_cxt,
-                                                   filter_op->op.pool);
-    }
+    filter_op->qual_state = make_qual_set_state(filter_op->op.plan->qual_exprs,
+                                                filter_op->op.nproj,
+                                                filter_op->op.proj_ary,
+                                                filter_op->op.exec_cxt,
+                                                filter_op->op.pool);
 
     return filter_op;
 }
@@ -3,19 +3,17 @@
 #include "router.h"
 
 static void
-insert_invoke(Operator *op, Tuple *t)
+insert_invoke(Operator *op, TupleBatch *batch)
 {
     C4Runtime *c4 = op->chain->c4;
     InsertOperator *insert_op = (InsertOperator *) op;
 
-    if (router_is_deleting(c4->router))
-        router_delete_tuple(c4->router, t, insert_op->tbl_def);
-    else
-        router_insert_tuple(c4->router, t, insert_op->tbl_def, true);
+    router_route_batch(c4->router, batch, insert_op->tbl_def,
+                       op->chain->replicated_body);
 }
 
 InsertOperator *
-insert_op_make(InsertPlan *plan, OpChain *chain)
+insert_op_make(InsertPlan *plan, Schema *input_schema, OpChain *chain)
 {
     InsertOperator *insert_op;
 
@@ -24,6 +22,7 @@ insert_op_make(InsertPlan *plan, OpChain *chain)
     insert_op = (InsertOperator *) operator_make(OPER_INSERT,
                                                  sizeof(*insert_op),
                                                  (PlanNode *) plan,
+                                                 input_schema,
                                                  NULL,
                                                  chain,
                                                  insert_invoke);
@@ -1,11 +1,39 @@
 #include "c4-internal.h"
 #include "nodes/copyfuncs.h"
 #include "operator/operator.h"
+#include "operator/scan.h"
+
+/*
+ * Does the projection list of "op" produce a copy of its input tuple?
+ */
+static bool
+proj_is_identity(Operator *op, Schema *input_schema)
+{
+    int i;
+
+    if (op->nproj != input_schema->len)
+        return false;
+
+    for (i = 0; i < op->nproj; i++)
+    {
+        ExprNode *expr = op->proj_ary[i]->expr;
+        ExprVar *var;
+
+        if (expr->node.kind != EXPR_VAR)
+            return false;
+
+        var = (ExprVar *) expr;
+        if (var->is_outer || var->attno != i)
+            return false;
+    }
+
+    return true;
+}
 
 Operator *
 operator_make(C4NodeKind kind, apr_size_t sz, PlanNode *plan,
-              Operator *next_op, OpChain *chain,
-              op_invoke_func invoke_f)
+              Schema *input_schema, Operator *next_op,
+              OpChain *chain, op_invoke_func invoke_f)
 {
     apr_pool_t *pool = chain->pool;
     Operator *op;
@@ -17,8 +45,10 @@ operator_make(C4NodeKind kind, apr_size_t sz, PlanNode *plan,
     op->pool = pool;
     op->plan = copy_node(plan, pool);
     op->next = next_op;
+    op->sibling = NULL;
     op->chain = chain;
     op->exec_cxt = apr_pcalloc(pool, sizeof(*op->exec_cxt));
+    op->exec_cxt->inner_schema = input_schema;
     op->invoke = invoke_f;
 
     op->nproj = list_length(op->plan->proj_list);
@@ -34,6 +64,17 @@ operator_make(C4NodeKind kind, apr_size_t sz, PlanNode *plan,
 
     op->proj_schema = schema_make_from_exprs(op->nproj, op->proj_ary,
                                              chain->c4, pool);
+    op->proj_is_identity = proj_is_identity(op, input_schema);
+
+    /*
+     * Aggs need real tuples as input; other operators (including inserts)
+     * can consume virtual tuples.
+     */
+    if (next_op != NULL && next_op->node.kind != OPER_AGG)
+        op->slot_buf = apr_palloc(pool, sizeof(Datum) * op->nproj *
+                                  TUPLE_BATCH_SIZE);
+    else
+        op->slot_buf = NULL;
 
     return op;
 }
@@ -51,24 +92,165 @@ operator_do_project(Operator *op)
         Datum result;
 
         result = eval_expr(proj_state);
-        proj_tuple->vals[i] = datum_copy(result, proj_state->expr->type);
+        tuple_set_val(proj_tuple, i,
+                      datum_copy(result, proj_state->expr->type),
+                      op->proj_schema);
     }
 
     return proj_tuple;
 }
 
+/*
+ * Prepare an empty batch for the output of "op". The batch holds virtual
+ * tuples if the next operator can consume them.
+ */
+void
+operator_batch_init(Operator *op, TupleBatch *batch)
+{
+    batch->ntuples = 0;
+    batch->slot_vals = op->slot_buf;
+    batch->slot_width = op->nproj;
+}
+
+/*
+ * Evaluate the projection list of "op" and append the result to "batch",
+ * which must have been prepared by operator_batch_init().
+ */
+void
+operator_batch_project(Operator *op, TupleBatch *batch)
+{
+    Datum *slot;
+    int i;
+
+    if (batch->slot_vals == NULL)
+    {
+        batch->tuples[batch->ntuples++] = operator_do_project(op);
+        return;
+    }
+
+    slot = batch->slot_vals + batch->ntuples * batch->slot_width;
+    for (i = 0; i < op->nproj; i++)
+        slot[i] = eval_expr(op->proj_ary[i]);
+
+    batch->ntuples++;
+}
+
+/*
+ * Pass a batch of tuples produced by "op" to the next operator in the chain,
+ * and then release our pins on them (if they are real tuples).
+ */
+void
+operator_emit_batch(Operator *op, TupleBatch *batch)
+{
+    int i;
+
+    if (batch->ntuples == 0)
+        return;
+
+    operator_invoke_next(op, batch);
+
+    if (batch->slot_vals == NULL)
+    {
+        for (i = 0; i < batch->ntuples; i++)
+            tuple_unpin(batch->tuples[i], op->proj_schema);
+    }
+
+    batch->ntuples = 0;
+}
+
+/*
+ * Pass a batch of the input tuples of "op" to the next operator in the
+ * chain. We don't hold pins on them: the input tuples are owned by our
+ * caller.
+ */
+void
+operator_forward_batch(Operator *op, TupleBatch *batch)
+{
+    if (batch->ntuples == 0)
+        return;
+
+    operator_invoke_next(op, batch);
+    batch->ntuples = 0;
+}
+
 OpChainList *
 opchain_list_make(apr_pool_t *pool)
 {
     OpChainList *result;
 
     result = apr_palloc(pool, sizeof(*result));
+    result->pool = pool;
     result->length = 0;
     result->head = NULL;
+    result->scans_delta_tbl = false;
+    result->dispatch_stale = false;
+    result->dispatch_colno = -1;
+    result->dispatch_tbl = NULL;
+    result->dispatch_pool = NULL;
 
     return result;
 }
 
+/*
+ * Does "op", or any operator that consumes its output (directly or
+ * indirectly), scan "tbl_def"?
+ */
+static bool
+operator_scans_tbl(Operator *op, TableDef *tbl_def)
+{
+    for (; op != NULL; op = op->next)
+    {
+        if (op->node.kind == OPER_SCAN &&
+            ((ScanOperator *) op)->table->def == tbl_def)
+            return true;
+
+        if (op->sibling != NULL && operator_scans_tbl(op->sibling, tbl_def))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Can "op", and every operator that consumes its output, be evaluated by a
+ * router worker thread? Such operators may only read tables and derive
+ * tuples for Inserts, which the router routes once the workers are done.
+ * Aggs update their own state, and SQLite tables can't be scanned
+ * concurrently, so chains that use them are evaluated by the router thread.
+ */
+bool
+operator_parallel_safe(Operator *op)
+{
+    for (; op != NULL; op = op->next)
+    {
+        switch (op->node.kind)
+        {
+            case OPER_AGG:
+                return false;
+
+            case OPER_SCAN:
+                if (((ScanOperator *) op)->table->def->storage ==
+                    AST_STORAGE_SQLITE)
+                    return false;
+                break;
+
+            default:
+                break;
+        }
+
+        if (op->sibling != NULL && !operator_parallel_safe(op->sibling))
+            return false;
+    }
+
+    return true;
+}
+
+static bool
+opchain_scans_delta_tbl(OpChain *op_chain)
+{
+    return operator_scans_tbl(op_chain->chain_start, op_chain->delta_tbl);
+}
+
 void
 opchain_list_add(OpChainList *list, OpChain *op_chain)
 {
@@ -77,4 +259,120 @@ opchain_list_add(OpChainList *list, OpChain *op_chain)
     op_chain->next = list->head;
     list->head = op_chain;
     list->length++;
+
+    if (opchain_scans_delta_tbl(op_chain))
+        list->scans_delta_tbl = true;
+
+    if (op_chain->dispatch_colno != -1)
+        list->dispatch_stale = true;
+}
+
+/*
+ * We only build a dispatch index if at least this many chains would use it:
+ * otherwise, evaluating their filters is cheaper than probing the index.
+ */
+#define DISPATCH_MIN_CHAINS     2
+
+static unsigned int
+dispatch_tbl_hash(const char *key, __unused int klen, void *user_data)
+{
+    OpChainList *list = (OpChainList *) user_data;
+
+    return list->dispatch_hash(*((Datum *) key));
+}
+
+static bool
+dispatch_tbl_cmp(const void *k1, const void *k2, __unused int klen,
+                 void *user_data)
+{
+    OpChainList *list = (OpChainList *) user_data;
+
+    return list->dispatch_eq(*((Datum *) k1), *((Datum *) k2));
+}
+
+/*
+ * Rebuild the dispatch index of "list", whose delta table has the given
+ * schema. We index the column that the most chains dispatch on. Chains that
+ * share the operators of another chain are invoked via that chain, so they
+ * aren't indexed separately.
+ */
+void
+opchain_list_build_dispatch(OpChainList *list, Schema *schema)
+{
+    OpChain *op_chain;
+    int *counts;
+    int best;
+    int i;
+
+    list->dispatch_stale = false;
+    list->dispatch_colno = -1;
+    list->dispatch_tbl = NULL;
+    if (list->dispatch_pool == NULL)
+        list->dispatch_pool = make_subpool(list->pool);
+    else
+        apr_pool_clear(list->dispatch_pool);
+
+    counts = apr_pcalloc(list->dispatch_pool, schema->len * sizeof(*counts));
+    for (op_chain = list->head; op_chain != NULL; op_chain = op_chain->next)
+    {
+        if (op_chain->prefix_chain == NULL && op_chain->dispatch_colno != -1)
+            counts[op_chain->dispatch_colno]++;
+    }
+
+    best = 0;
+    for (i = 1; i < schema->len; i++)
+    {
+        if (counts[i] > counts[best])
+            best = i;
+    }
+
+    if (schema->len == 0 || counts[best] < DISPATCH_MIN_CHAINS)
+        return;
+
+    list->dispatch_colno = best;
+    list->dispatch_hash = schema->hash_funcs[best];
+    list->dispatch_eq = schema->eq_funcs[best];
+    list->dispatch_tbl = c4_hash_make(list->dispatch_pool, sizeof(Datum),
+                                      list, dispatch_tbl_hash,
+                                      dispatch_tbl_cmp);
+
+    /*
+     * Make an entry for each distinct value and count its chains, and then
+     * fill in the chains of each entry (in list order).
+     */
+    for (op_chain = list->head; op_chain != NULL; op_chain = op_chain->next)
+    {
+        DispatchEntry *entry;
+        bool is_new;
+
+        if (op_chain->prefix_chain != NULL ||
+            op_chain->dispatch_colno != best)
+            continue;
+
+        entry = apr_pcalloc(list->dispatch_pool, sizeof(*entry));
+        entry->val = op_chain->dispatch_val;
+        entry = c4_hash_set_if_new(list->dispatch_tbl, &entry->val,
+                                   entry, &is_new);
+        entry->nchains++;
+    }
+
+    for (op_chain = list->head; op_chain != NULL; op_chain = op_chain->next)
+    {
+        DispatchEntry *entry;
+
+        if (op_chain->prefix_chain != NULL ||
+            op_chain->dispatch_colno != best)
+            continue;
+
+        entry = c4_hash_get(list->dispatch_tbl, &op_chain->dispatch_val);
+        if (entry->chains == NULL)
+        {
+            entry->chains = apr_palloc(list->dispatch_pool,
+                                       entry->nchains *
+                                       sizeof(*entry->chains));
+            entry->nchains = 0;
+        }
+
+        entry->chains[entry->nchains++] = op_chain;
+    }
 }
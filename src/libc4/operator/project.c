@@ -2,21 +2,33 @@
 #include "operator/project.h"
 
 static void
-project_invoke(Operator *op, Tuple *t)
+project_invoke(Operator *op, TupleBatch *batch)
 {
     ExprEvalContext *exec_cxt;
-    Tuple *proj_tuple;
+    TupleBatch out;
+    int i;
+
+    /* If we'd just copy the input tuples, pass them on as they are */
+    if (operator_can_forward(op, batch))
+    {
+        operator_invoke_next(op, batch);
+        return;
+    }
 
     exec_cxt = op->exec_cxt;
-    exec_cxt->inner = t;
+    operator_batch_init(op, &out);
+    for (i = 0; i < batch->ntuples; i++)
+    {
+        exec_cxt_bind_inner(exec_cxt, batch, i);
+        operator_batch_project(op, &out);
+    }
 
-    proj_tuple = operator_do_project(op);
-    op->next->invoke(op->next, proj_tuple);
-    tuple_unpin(proj_tuple, op->proj_schema);
+    operator_emit_batch(op, &out);
 }
 
 ProjectOperator *
-project_op_make(ProjectPlan *plan, Operator *next_op, OpChain *chain)
+project_op_make(ProjectPlan *plan, Schema *input_schema,
+                Operator *next_op, OpChain *chain)
 {
     ProjectOperator *proj_op;
 
@@ -25,6 +37,7 @@ project_op_make(ProjectPlan *plan, Operator *next_op, OpChain *chain)
     proj_op = (ProjectOperator *) operator_make(OPER_PROJECT,
                                                 sizeof(*proj_op),
                                                 (PlanNode *) plan,
+                                                input_schema,
                                                 next_op,
                                                 chain,
                                                 project_invoke);
@@ -2,78 +2,186 @@
 #include "operator/scan.h"
 #include "operator/scancursor.h"
 
+/*
+ * Emit a join tuple formed from the current inner and outer tuples, flushing
+ * the output batch if it is full. If "input" is non-NULL, the projection
+ * list just copies the inner tuple, so we pass on "input" instead.
+ */
 static void
-scan_invoke(Operator *op, Tuple *t)
+scan_emit(Operator *op, TupleBatch *out, Tuple *input)
+{
+    if (input != NULL)
+    {
+        out->tuples[out->ntuples++] = input;
+        if (tuple_batch_is_full(out))
+            operator_forward_batch(op, out);
+        return;
+    }
+
+    operator_batch_project(op, out);
+    if (tuple_batch_is_full(out))
+        operator_emit_batch(op, out);
+}
+
+static void
+scan_invoke(Operator *op, TupleBatch *batch)
 {
     ScanOperator *scan_op = (ScanOperator *) op;
     AbstractTable *tbl = scan_op->table;
     ExprEvalContext *exec_cxt;
-    Tuple *scan_tuple;
+    TupleBatch out;
+    bool forward;
+    int i;
 
     exec_cxt = scan_op->op.exec_cxt;
-    exec_cxt->inner = t;
+    forward = operator_can_forward(op, batch);
+    if (forward)
+    {
+        /* E.g. an anti-scan, or a scan that only checks for a match */
+        out.ntuples = 0;
+        out.slot_vals = NULL;
+    }
+    else
+        operator_batch_init(op, &out);
 
-    tbl->scan_reset(tbl, scan_op->cursor);
-    while ((scan_tuple = tbl->scan_next(tbl, scan_op->cursor)) != NULL)
+    for (i = 0; i < batch->ntuples; i++)
     {
-        exec_cxt->outer = scan_tuple;
+        Tuple *input = forward ? batch->tuples[i] : NULL;
+        Tuple *scan_tuple;
+        bool found = false;
+        int j;
+
+        exec_cxt_bind_inner(exec_cxt, batch, i);
 
-        if (eval_qual_set(scan_op->nquals, scan_op->qual_ary))
+        /* If this is an index scan, compute the probe key */
+        for (j = 0; j < scan_op->nkeys; j++)
+            scan_op->cursor->key[j] = eval_expr(scan_op->key_ary[j]);
+
+        tbl->scan_reset(tbl, scan_op->cursor);
+        while ((scan_tuple = tbl->scan_next(tbl, scan_op->cursor)) != NULL)
         {
-            Tuple *join_tuple;
+            exec_cxt->outer = scan_tuple;
 
-            /* If this is NOT and we see a matching tuple, we're done */
-            if (scan_op->anti_scan)
-                return;
+            if (eval_qual_set(scan_op->qual_state))
+            {
+                /* If this is NOT and we see a matching tuple, we're done */
+                if (scan_op->anti_scan)
+                {
+                    found = true;
+                    break;
+                }
 
-            join_tuple = operator_do_project(op);
-            op->next->invoke(op->next, join_tuple);
+                scan_emit(op, &out, input);
+            }
         }
+
+        /* If this is NOT and no matches, emit an output tuple */
+        if (scan_op->anti_scan && !found)
+        {
+            exec_cxt->outer = NULL;
+            scan_emit(op, &out, input);
+        }
+    }
+
+    if (forward)
+        operator_forward_batch(op, &out);
+    else
+        operator_emit_batch(op, &out);
+}
+
+/*
+ * If the planner found any quals that can be used as index keys, try to
+ * create an index scan over the table. Note that the key quals are still
+ * evaluated normally, which filters out any false positives returned by the
+ * index scan.
+ */
+static void
+make_scan_cursor(ScanOperator *scan_op)
+{
+    ScanPlan *plan = (ScanPlan *) scan_op->op.plan;
+    AbstractTable *tbl = scan_op->table;
+    apr_pool_t *pool = scan_op->op.pool;
+    int *key_cols;
+    AstOperKind *key_ops;
+    ListCell *lc;
+    int i;
+
+    scan_op->nkeys = 0;
+    scan_op->key_ary = NULL;
+    scan_op->cursor = NULL;
+
+    if (!list_is_empty(plan->key_cols) && tbl->index_scan_make != NULL)
+    {
+        int nkeys = list_length(plan->key_cols);
+
+        key_cols = apr_palloc(pool, sizeof(*key_cols) * nkeys);
+        key_ops = apr_palloc(pool, sizeof(*key_ops) * nkeys);
+        i = 0;
+        foreach (lc, plan->key_cols)
+            key_cols[i++] = lc_int(lc);
+        i = 0;
+        foreach (lc, plan->key_ops)
+            key_ops[i++] = (AstOperKind) lc_int(lc);
+
+        scan_op->cursor = tbl->index_scan_make(tbl, nkeys, key_cols,
+                                               key_ops, pool);
     }
 
-    /* If this is NOT and no matches, emit an output tuple */
-    if (scan_op->anti_scan)
+    if (scan_op->cursor == NULL)
     {
-        Tuple *join_tuple;
+        scan_op->cursor = tbl->scan_make(tbl, pool);
+        return;
+    }
 
-        exec_cxt->outer = NULL;
-        join_tuple = operator_do_project(op);
-        op->next->invoke(op->next, join_tuple);
+    /* The table might only use a prefix of the keys */
+    scan_op->nkeys = scan_op->cursor->nkeys;
+    scan_op->key_ary = apr_palloc(pool,
+                                  sizeof(*scan_op->key_ary) * scan_op->nkeys);
+    i = 0;
+    foreach (lc, plan->key_exprs)
+    {
+        ExprNode *expr = (ExprNode *) lc_ptr(lc);
+
+        if (i == scan_op->nkeys)
+            break;
+
+        scan_op->key_ary[i++] = make_expr_state(expr,
+                                                scan_op->op.exec_cxt,
+                                                pool);
     }
 }
 
 ScanOperator *
-scan_op_make(ScanPlan *plan, Operator *next_op, OpChain *chain)
+scan_op_make(ScanPlan *plan, Schema *input_schema,
+             Operator *next_op, OpChain *chain)
 {
     ScanOperator *scan_op;
     char *tbl_name;
-    ListCell *lc;
-    int i;
 
     scan_op = (ScanOperator *) operator_make(OPER_SCAN,
                                              sizeof(*scan_op),
                                              (PlanNode *) plan,
+                                             input_schema,
                                              next_op,
                                              chain,
                                              scan_invoke);
 
     tbl_name = plan->scan_rel->ref->name;
     scan_op->table = cat_get_table_impl(chain->c4->cat, tbl_name);
-    scan_op->cursor = scan_op->table->scan_make(scan_op->table, scan_op->op.pool);
+    scan_op->op.exec_cxt->outer_schema = scan_op->table->def->schema;
     scan_op->anti_scan = plan->scan_rel->not;
+    make_scan_cursor(scan_op);
 
-    scan_op->nquals = list_length(scan_op->op.plan->quals);
-    scan_op->qual_ary = apr_palloc(scan_op->op.pool,
-                                   sizeof(*scan_op->qual_ary) * scan_op->nquals);
-    i = 0;
-    foreach (lc, scan_op->op.plan->qual_exprs)
-    {
-        ExprNode *expr = (ExprNode *) lc_ptr(lc);
-
-        scan_op->qual_ary[i++] = make_expr_state(expr,
-                                                 scan_op->op.exec_cxt,
-                                                 scan_op->op.pool);
-    }
+    /*
+     * The projection list of an anti-scan is evaluated when no scan tuple
+     * satisfies the quals, so it can't reuse the values they computed.
+     */
+    scan_op->qual_state = make_qual_set_state(scan_op->op.plan->qual_exprs,
+                                              scan_op->anti_scan ? 0 :
+                                              scan_op->op.nproj,
+                                              scan_op->op.proj_ary,
+                                              scan_op->op.exec_cxt,
+                                              scan_op->op.pool);
 
     return scan_op;
 }
@@ -4,6 +4,7 @@
 #include "nodes/makefuncs.h"
 #include "parser/analyze.h"
 #include "parser/walker.h"
+#include "types/agg_funcs.h"
 #include "types/catalog.h"
 
 typedef struct AnalyzeState
@@ -54,6 +55,7 @@ static void analyze_const_expr(AstConstExpr *c_expr, AnalyzeState *state);
 static void analyze_agg_expr(AstAggExpr *a_expr, ExprLocation loc, AnalyzeState *state);
 static void analyze_rule_head(AstRule *rule, AnalyzeState *state);
 static void analyze_rule_location(AstRule *rule, AnalyzeState *state);
+static void analyze_rule_partitioning(AstRule *rule, AnalyzeState *state);
 
 static void find_unused_vars(AstRule *rule, AnalyzeState *state);
 static void check_rule_safety(AstRule *rule, AnalyzeState *state);
@@ -75,6 +77,7 @@ static void make_implied_quals(AstRule *rule, AnalyzeState *state);
 static bool table_is_defined(const char *tbl_name, AnalyzeState *state);
 static DataType table_get_col_type(const char *tbl_name, int colno, AnalyzeState *state);
 static int table_get_num_cols(const char *tbl_name, AnalyzeState *state);
+static int table_get_partition_col(const char *tbl_name, AnalyzeState *state);
 
 static DataType op_expr_get_type(AstOpExpr *op_expr);
 static DataType const_expr_get_type(AstConstExpr *c_expr);
@@ -82,6 +85,33 @@ static DataType var_expr_get_type(AstVarExpr *var);
 static DataType agg_expr_get_type(AstAggExpr *agg);
 
 
+/*
+ * Check that a list of column numbers in a table definition is valid: each
+ * column must exist, and may appear at most once.
+ */
+static void
+check_column_list(List *cols, const char *desc, AstDefine *def)
+{
+    ListCell *lc;
+
+    foreach (lc, cols)
+    {
+        int colno = lc_int(lc);
+        ListCell *lc2;
+
+        if (colno < 0 || colno >= list_length(def->schema))
+            ERROR("The %s column %d is out of range for table %s",
+                  desc, colno, def->name);
+
+        for (lc2 = lc->next; lc2 != NULL; lc2 = lc2->next)
+        {
+            if (lc_int(lc2) == colno)
+                ERROR("Duplicate %s column %d in table %s",
+                      desc, colno, def->name);
+        }
+    }
+}
+
 static void
 analyze_define(AstDefine *def, AnalyzeState *state)
 {
@@ -118,6 +148,20 @@ analyze_define(AstDefine *def, AnalyzeState *state)
                 ERROR("Location specifiers must be of type string");
         }
     }
+
+    /* Validate the table's primary key */
+    if (!list_is_empty(def->keys) && def->storage != AST_STORAGE_MEMORY)
+        ERROR("Primary keys are only supported for memory tables (table %s)",
+              def->name);
+
+    check_column_list(def->keys, "key", def);
+
+    /* Validate the sort columns of an ordered table */
+    check_column_list(def->order_cols, "sort", def);
+
+    if (def->partition_col >= list_length(def->schema))
+        ERROR("The partition column %d is out of range for table %s",
+              def->partition_col, def->name);
 }
 
 static void
@@ -137,7 +181,9 @@ analyze_timer(AstTimer *timer, AnalyzeState *state)
     schema = list_make(state->pool);
     list_append(schema, make_schema_elt("int", false, state->pool));
 
-    def = make_define(timer->name, AST_STORAGE_MEMORY, schema, state->pool);
+    def = make_define(timer->name, AST_STORAGE_MEMORY, schema,
+                      list_make(state->pool), list_make(state->pool),
+                      -1, state->pool);
     list_append(state->program->defines, def);
     analyze_define(def, state);
 }
@@ -182,6 +228,7 @@ analyze_rule(AstRule *rule, AnalyzeState *state)
     make_var_eq_table(rule, state);
     make_implied_quals(rule, state);
     analyze_rule_location(rule, state);
+    analyze_rule_partitioning(rule, state);
     find_unused_vars(rule, state);
     check_rule_safety(rule, state);
 }
@@ -264,6 +311,68 @@ analyze_rule_location(AstRule *rule, AnalyzeState *state)
         rule->is_network = true;
 }
 
+static bool
+is_partition_var_equal(C4Node *n1, C4Node *n2, AnalyzeState *state)
+{
+    AstVarExpr *v1;
+    AstVarExpr *v2;
+
+    if (n1->kind != AST_VAR_EXPR || n2->kind != AST_VAR_EXPR ||
+        is_dont_care_var(n1) || is_dont_care_var(n2))
+        return false;
+
+    v1 = (AstVarExpr *) n1;
+    v2 = (AstVarExpr *) n2;
+    return (strcmp(v1->name, v2->name) == 0 || is_var_equal(v1, v2, state));
+}
+
+/*
+ * Check that each shard of a sharded runtime can evaluate the rule over its
+ * own partitions of the partitioned tables in the rule body: those tables
+ * must all be joined on their partition columns, and an aggregate rule must
+ * group by the partition column. Rules whose body only references
+ * replicated tables are evaluated in full by every shard.
+ */
+static void
+analyze_rule_partitioning(AstRule *rule, AnalyzeState *state)
+{
+    C4Node *part_var;
+    ListCell *lc;
+
+    part_var = NULL;
+    foreach (lc, rule->joins)
+    {
+        AstJoinClause *join = (AstJoinClause *) lc_ptr(lc);
+        C4Node *var;
+        int colno;
+
+        colno = table_get_partition_col(join->ref->name, state);
+        if (colno == -1)
+            continue;
+
+        var = (C4Node *) list_get(join->ref->cols, colno);
+        if (part_var != NULL && !is_partition_var_equal(var, part_var, state))
+            ERROR("Partitioned tables in the body of rule %s must be "
+                  "joined on their partition columns", rule->name);
+
+        part_var = var;
+    }
+
+    if (part_var == NULL || !rule->has_agg)
+        return;
+
+    foreach (lc, rule->head->cols)
+    {
+        C4Node *expr = (C4Node *) lc_ptr(lc);
+
+        if (is_partition_var_equal(expr, part_var, state))
+            return;
+    }
+
+    ERROR("Aggregate rule %s must group by the partition column "
+          "of the tables in its body", rule->name);
+}
+
 static bool
 unused_var_walker(AstVarExpr *var, void *data)
 {
@@ -732,6 +841,16 @@ analyze_agg_expr(AstAggExpr *a_expr, ExprLocation loc, AnalyzeState *state)
 
     analyze_expr(a_expr->expr, loc, state);
 
+    /* Only quantile<> and topk<> take a parameter */
+    if (a_expr->agg_kind == AST_AGG_QUANTILE ||
+        a_expr->agg_kind == AST_AGG_TOPK)
+    {
+        if (a_expr->param == NULL)
+            ERROR("Quantile and topk aggregates require a parameter");
+    }
+    else if (a_expr->param != NULL)
+        ERROR("Only quantile and topk aggregates take a parameter");
+
     /* Check consistency of input to aggregate function */
     switch (a_expr->agg_kind)
     {
@@ -745,6 +864,36 @@ analyze_agg_expr(AstAggExpr *a_expr, ExprLocation loc, AnalyzeState *state)
                 ERROR("Sum aggregate must be used with int value");
             break;
 
+        case AST_AGG_QUANTILE:
+        {
+            AstConstExpr *param = (AstConstExpr *) a_expr->param;
+            DataType input_type = expr_get_type(a_expr->expr);
+            double p;
+
+            if (input_type != TYPE_INT && input_type != TYPE_DOUBLE)
+                ERROR("Quantile aggregate must be used with numeric value");
+
+            p = (param->const_kind == AST_CONST_DOUBLE) ?
+                strtod(param->value, NULL) : -1.0;
+            if (p <= 0.0 || p > 1.0)
+                ERROR("Quantile must be a double in (0, 1]: %s",
+                      param->value);
+            break;
+        }
+
+        case AST_AGG_TOPK:
+        {
+            AstConstExpr *param = (AstConstExpr *) a_expr->param;
+            apr_int64_t k;
+
+            k = (param->const_kind == AST_CONST_INT) ?
+                apr_atoi64(param->value) : -1;
+            if (k <= 0 || k > AGG_TOPK_MAX)
+                ERROR("Topk parameter must be an int in [1, %d]: %s",
+                      AGG_TOPK_MAX, param->value);
+            break;
+        }
+
         default:
             break;
     }
@@ -1010,6 +1159,24 @@ table_get_num_cols(const char *tbl_name, AnalyzeState *state)
     return tbl_def->schema->len;
 }
 
+/*
+ * Returns the partition column of the table with the given name, or -1 if
+ * the table is replicated.
+ */
+static int
+table_get_partition_col(const char *tbl_name, AnalyzeState *state)
+{
+    AstDefine *define;
+    TableDef *tbl_def;
+
+    define = apr_hash_get(state->define_tbl, tbl_name, APR_HASH_KEY_STRING);
+    if (define != NULL)
+        return define->partition_col;
+
+    tbl_def = cat_get_table(state->c4->cat, tbl_name);
+    return tbl_def->partition_col;
+}
+
 /*
  * Compute qualifiers that are implied by the set of quals explicitly stated
  * in the query. We only try to do this for the trivial case of computing
@@ -1153,13 +1320,18 @@ agg_expr_get_type(AstAggExpr *agg)
             return TYPE_DOUBLE;
 
         case AST_AGG_COUNT:
+        case AST_AGG_COUNT_DISTINCT:
         case AST_AGG_SUM:
             return TYPE_INT;
 
         case AST_AGG_MAX:
         case AST_AGG_MIN:
+        case AST_AGG_QUANTILE:
             return expr_get_type(agg->expr);
 
+        case AST_AGG_TOPK:
+            return TYPE_STRING;
+
         default:
             ERROR("Unexpected agg kind: %d", (int) agg->agg_kind);
     }
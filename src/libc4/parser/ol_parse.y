@@ -32,8 +32,9 @@ static void split_rule_body(List *body, List **joins,
 %parse-param { void *scanner }
 %lex-param { yyscan_t scanner }
 
-%token DEFINE MEMORY SQLITE DELETE NOTIN TIMER
+%token DEFINE KEYS MEMORY ORDERED PARTITION SQLITE DELETE NOTIN TIMER
        OL_FALSE OL_TRUE OL_AVG OL_COUNT OL_MAX OL_MIN OL_SUM
+       OL_COUNT_DISTINCT OL_QUANTILE OL_TOPK
 %token <str> VAR_IDENT TBL_IDENT FCONST SCONST CCONST ICONST
 
 %left OL_EQ OL_NEQ
@@ -43,13 +44,14 @@ static void split_rule_body(List *body, List **joins,
 %left UMINUS
 
 %type <ptr>        clause define rule timer table_ref join_clause
-%type <list>       program_body schema_list define_schema
+%type <list>       program_body schema_list define_schema opt_keys key_list
+%type <list>       opt_order_cols
 %type <list>       expr_list opt_rule_body rule_body
 %type <ptr>        rule_body_elem qualifier qual_expr expr const_expr op_expr
 %type <ptr>        var_expr agg_expr rule_prefix schema_elt
 %type <agg_kind>   agg_kind
 %type <str>        bool_const
-%type <ival>       iconst_ival
+%type <ival>       iconst_ival opt_partition
 %type <boolean>    opt_not opt_delete
 
 %%
@@ -79,15 +81,60 @@ clause:
  * confused by adjacent optional productions. Is there a better fix?
  */
 define:
-  DEFINE '(' TBL_IDENT ',' MEMORY ',' define_schema ')' {
-    $$ = make_define($3, AST_STORAGE_MEMORY, $7, context->pool);
+  DEFINE '(' TBL_IDENT ',' MEMORY ',' opt_partition opt_keys
+  define_schema ')' {
+    $$ = make_define($3, AST_STORAGE_MEMORY, $9, $8,
+                     list_make(context->pool), $7, context->pool);
 }
-| DEFINE '(' TBL_IDENT ',' SQLITE ',' define_schema ')' {
-    $$ = make_define($3, AST_STORAGE_SQLITE, $7, context->pool);
+| DEFINE '(' TBL_IDENT ',' ORDERED opt_order_cols ','
+  opt_partition opt_keys define_schema ')' {
+    $$ = make_define($3, AST_STORAGE_ORDERED, $10, $9, $6, $8,
+                     context->pool);
 }
-| DEFINE '(' TBL_IDENT ',' define_schema ')' {
-    $$ = make_define($3, AST_STORAGE_MEMORY, $5, context->pool);
+| DEFINE '(' TBL_IDENT ',' SQLITE ',' opt_partition opt_keys
+  define_schema ')' {
+    $$ = make_define($3, AST_STORAGE_SQLITE, $9, $8,
+                     list_make(context->pool), $7, context->pool);
 }
+| DEFINE '(' TBL_IDENT ',' opt_partition opt_keys define_schema ')' {
+    $$ = make_define($3, AST_STORAGE_MEMORY, $7, $6,
+                     list_make(context->pool), $5, context->pool);
+}
+;
+
+/*
+ * The tuples of an ordered table are sorted by the listed (zero-based)
+ * columns, followed by the rest of the table's columns in order. If no
+ * columns are listed, the table is sorted by all of its columns in order.
+ */
+opt_order_cols:
+  '(' key_list ')'              { $$ = $2; }
+| /* EMPTY */                   { $$ = list_make(context->pool); }
+;
+
+/*
+ * An optional list of the (zero-based) column numbers that form the table's
+ * primary key. If no key is specified, all the columns of the table form the
+ * key.
+ */
+opt_keys:
+  KEYS '(' key_list ')' ','     { $$ = $3; }
+| /* EMPTY */                   { $$ = list_make(context->pool); }
+;
+
+/*
+ * The (zero-based) column by whose value the table's tuples are divided
+ * among the shards of a sharded runtime. Tables without a partition column
+ * are replicated on every shard.
+ */
+opt_partition:
+  PARTITION '(' iconst_ival ')' ','     { $$ = $3; }
+| /* EMPTY */                           { $$ = -1; }
+;
+
+key_list:
+  iconst_ival                   { $$ = list_make1_int($1, context->pool); }
+| key_list ',' iconst_ival      { $$ = list_append_int($1, $3); }
 ;
 
 timer: TIMER '(' TBL_IDENT ',' iconst_ival ')' {
@@ -230,14 +277,24 @@ bool_const:
 
 var_expr: VAR_IDENT { $$ = make_ast_var_expr($1, TYPE_INVALID, context->pool); };
 
-agg_expr: agg_kind '<' expr '>' { $$ = make_ast_agg_expr($1, $3, context->pool); }
+/*
+ * Some aggs take a constant parameter, e.g. the "k" of topk<X, k>. Whether
+ * one is required is checked by analyze_agg_expr().
+ */
+agg_expr:
+  agg_kind '<' expr '>' { $$ = make_ast_agg_expr($1, $3, NULL, context->pool); }
+| agg_kind '<' expr ',' const_expr '>' { $$ = make_ast_agg_expr($1, $3, $5, context->pool); }
+;
 
 agg_kind:
   OL_AVG        { $$ = AST_AGG_AVG; }
 | OL_COUNT      { $$ = AST_AGG_COUNT; }
+| OL_COUNT_DISTINCT { $$ = AST_AGG_COUNT_DISTINCT; }
 | OL_MAX        { $$ = AST_AGG_MAX; }
 | OL_MIN        { $$ = AST_AGG_MIN; }
+| OL_QUANTILE   { $$ = AST_AGG_QUANTILE; }
 | OL_SUM        { $$ = AST_AGG_SUM; }
+| OL_TOPK       { $$ = AST_AGG_TOPK; }
 ;
 
 expr_list:
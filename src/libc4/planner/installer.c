@@ -15,6 +15,8 @@ typedef struct InstallState
     C4Runtime *c4;
     apr_pool_t *tmp_pool;
     AggOperator *current_agg;
+    /* Are the inputs of the current rule's agg insert-only? */
+    bool agg_append_only;
 } InstallState;
 
 static void
@@ -27,7 +29,127 @@ plan_install_defines(ProgramPlan *plan, InstallState *istate)
         AstDefine *def = (AstDefine *) lc_ptr(lc);
 
         cat_define_table(istate->c4->cat, def->name, def->storage,
-                         def->schema);
+                         def->schema, def->keys, def->order_cols,
+                         def->partition_col);
+    }
+}
+
+/*
+ * Note that tuples can be deleted from "tbl_def", and hence from the tables
+ * derived from it. An agg that has already been installed with the
+ * assumption that its input is insert-only can't handle deletions, so it
+ * is converted into one that can.
+ */
+static void
+table_set_may_delete(TableDef *tbl_def, InstallState *istate)
+{
+    ListCell *lc;
+
+    if (tbl_def->may_delete)
+        return;
+
+    tbl_def->may_delete = true;
+    foreach (lc, tbl_def->append_only_aggs)
+        agg_op_allow_deletes((AggOperator *) lc_ptr(lc));
+
+    foreach (lc, tbl_def->derived_tbls)
+    {
+        char *derived_name = (char *) lc_ptr(lc);
+
+        table_set_may_delete(cat_get_table(istate->c4->cat, derived_name),
+                             istate);
+    }
+}
+
+/*
+ * Record which tables each rule derives from which others, and which tables
+ * the rules can delete tuples from. A rule can delete from its head table if
+ * it is a delete rule, if it has an agg (the agg's output changes), if it
+ * negates a table (inserting into the negated table deletes derivations), or
+ * if tuples can be deleted from one of the other tables in its body.
+ */
+static void
+plan_install_rule_deps(ProgramPlan *plan, InstallState *istate)
+{
+    C4Catalog *cat = istate->c4->cat;
+    ListCell *lc;
+
+    foreach (lc, plan->rules)
+    {
+        RulePlan *rplan = (RulePlan *) lc_ptr(lc);
+        OpChainPlan *first_chain;
+        TableDef *head_def;
+        bool may_delete;
+        ListCell *lc2;
+
+        first_chain = (OpChainPlan *) lc_ptr(list_head(rplan->chains));
+        head_def = cat_get_table(cat, first_chain->head->name);
+        may_delete = (rplan->is_delete || rplan->agg_plan != NULL);
+
+        foreach (lc2, rplan->chains)
+        {
+            OpChainPlan *chain_plan = (OpChainPlan *) lc_ptr(lc2);
+            TableDef *body_def;
+
+            if (chain_plan->delta_tbl->not)
+            {
+                may_delete = true;
+                continue;
+            }
+
+            body_def = cat_get_table(cat, chain_plan->delta_tbl->ref->name);
+            list_append(body_def->derived_tbls,
+                        apr_pstrdup(body_def->pool, head_def->name));
+            if (body_def->may_delete)
+                may_delete = true;
+        }
+
+        if (may_delete)
+            table_set_may_delete(head_def, istate);
+    }
+}
+
+/*
+ * Are the tables in the rule's body insert-only? If so, and the rule has an
+ * agg, the agg doesn't need to handle deletions.
+ */
+static bool
+rule_is_append_only(RulePlan *rplan, InstallState *istate)
+{
+    ListCell *lc;
+
+    foreach (lc, rplan->chains)
+    {
+        OpChainPlan *chain_plan = (OpChainPlan *) lc_ptr(lc);
+
+        if (chain_plan->delta_tbl->not ||
+            cat_get_table(istate->c4->cat,
+                          chain_plan->delta_tbl->ref->name)->may_delete)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Note that the rule's agg relies on the tables in the rule's body being
+ * insert-only, so that if a rule installed later can delete from one of
+ * them, the agg can be told.
+ */
+static void
+note_append_only_agg(RulePlan *rplan, AggOperator *agg_op,
+                     InstallState *istate)
+{
+    ListCell *lc;
+
+    foreach (lc, rplan->chains)
+    {
+        OpChainPlan *chain_plan = (OpChainPlan *) lc_ptr(lc);
+        TableDef *body_def;
+
+        body_def = cat_get_table(istate->c4->cat,
+                                 chain_plan->delta_tbl->ref->name);
+        list_append(body_def->append_only_aggs, agg_op);
     }
 }
 
@@ -66,14 +188,231 @@ print_op_chain(OpChainPlan *chain_plan)
     printf("]\n");
 }
 
+/*
+ * Return the schema of the tuples produced by the given plan node's
+ * projection list.
+ */
+static Schema *
+plan_get_proj_schema(PlanNode *plan, C4Runtime *c4, apr_pool_t *pool)
+{
+    DataType *types;
+    ListCell *lc;
+    int len;
+    int i;
+
+    len = list_length(plan->proj_list);
+    types = apr_palloc(pool, len * sizeof(*types));
+    i = 0;
+    foreach (lc, plan->proj_list)
+    {
+        ExprNode *expr = (ExprNode *) lc_ptr(lc);
+
+        types[i++] = expr->type;
+    }
+
+    return schema_make(len, types, c4, pool);
+}
+
+/*
+ * Does "op" or one of its siblings agg its input? An Agg is shared by the op
+ * chains for each of its rule's delta tables, so it can't be made to consume
+ * the output of another operator: the sibling link would be followed by
+ * each of those chains.
+ */
+static bool
+sibling_list_has_agg(Operator *op)
+{
+    for (; op != NULL; op = op->sibling)
+    {
+        if (op->node.kind == OPER_AGG)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Find the longest prefix of "chain_plan" that is computed by the operators
+ * of an op chain that has already been installed for the same delta table.
+ * Returns the number of operators in the prefix, and sets "*last_op" to the
+ * last of them and "*owner" to the chain via which the router invokes them.
+ * Chains that end in an Agg don't share their operators; see
+ * sibling_list_has_agg().
+ */
+static int
+find_shared_prefix(OpChain *op_chain, OpChainPlan *chain_plan,
+                   Operator **last_op, OpChain **owner)
+{
+    OpChainList *opc_list;
+    OpChain *other;
+    int nshared;
+
+    nshared = 0;
+    if (((PlanNode *) lc_ptr(list_tail(chain_plan->chain)))->node.kind ==
+        PLAN_AGG)
+        return nshared;
+
+    opc_list = router_get_opchain_list(op_chain->c4->router,
+                                       op_chain->delta_tbl->name);
+    for (other = opc_list->head; other != NULL; other = other->next)
+    {
+        Operator *op;
+        ListCell *lc;
+        int n;
+
+        if (other->prefix_chain != NULL ||
+            other->anti_chain != op_chain->anti_chain)
+            continue;
+
+        /* Walk down the tree of operators invoked via "other" */
+        op = other->chain_start;
+        n = 0;
+        foreach (lc, chain_plan->chain)
+        {
+            PlanNode *plan = (PlanNode *) lc_ptr(lc);
+            Operator *match;
+
+            /* The last operator is an Insert or Agg, which isn't shared */
+            if (lc->next == NULL)
+                break;
+
+            for (match = op; match != NULL; match = match->sibling)
+            {
+                if (match->next != NULL && plan_node_equal(match->plan, plan))
+                    break;
+            }
+
+            if (match == NULL)
+                break;
+
+            n++;
+            if (n > nshared && !sibling_list_has_agg(match->next))
+            {
+                nshared = n;
+                *last_op = match;
+                *owner = other;
+            }
+
+            op = match->next;
+        }
+    }
+
+    return nshared;
+}
+
+/*
+ * Make "op" consume the output of "prev_op", in addition to the operators
+ * that already do.
+ */
 static void
-install_op_chain(OpChainPlan *chain_plan, InstallState *istate)
+add_sibling_op(Operator *prev_op, Operator *op)
+{
+    Operator *last;
+
+    for (last = prev_op->next; last->sibling != NULL; last = last->sibling)
+        ;
+    last->sibling = op;
+
+    /* Aggs need real tuples as input */
+    if (op->node.kind == OPER_AGG)
+        prev_op->slot_buf = NULL;
+}
+
+/*
+ * If the op chain begins with a filter that requires a column of the delta
+ * tuple to equal a constant, record the column and the constant, so that the
+ * router can skip the chain for delta tuples with other values.
+ */
+static void
+find_dispatch_qual(OpChain *op_chain)
+{
+    Operator *start = op_chain->chain_start;
+    ListCell *lc;
+
+    op_chain->dispatch_colno = -1;
+    if (start->node.kind != OPER_FILTER)
+        return;
+
+    foreach (lc, start->plan->qual_exprs)
+    {
+        ExprNode *qual = (ExprNode *) lc_ptr(lc);
+        ExprNode *lhs;
+        ExprNode *rhs;
+        ExprVar *var;
+
+        if (qual->node.kind != EXPR_OP ||
+            ((ExprOp *) qual)->op_kind != AST_OP_EQ)
+            continue;
+
+        lhs = ((ExprOp *) qual)->lhs;
+        rhs = ((ExprOp *) qual)->rhs;
+        if (lhs->node.kind == EXPR_CONST)
+        {
+            ExprNode *tmp = lhs;
+
+            lhs = rhs;
+            rhs = tmp;
+        }
+
+        if (lhs->node.kind != EXPR_VAR || rhs->node.kind != EXPR_CONST ||
+            lhs->type != rhs->type)
+            continue;
+
+        var = (ExprVar *) lhs;
+        ASSERT(!var->is_outer);
+        op_chain->dispatch_colno = var->attno;
+        op_chain->dispatch_val = ((ExprConst *) rhs)->value;
+        return;
+    }
+}
+
+static bool
+table_is_replicated(const char *tbl_name, InstallState *istate)
+{
+    return (cat_get_table(istate->c4->cat, tbl_name)->partition_col == -1);
+}
+
+/*
+ * Does the op chain's rule only reference replicated tables? Each chain of
+ * a rule scans every table in the rule body other than its delta table.
+ */
+static bool
+chain_plan_is_replicated(OpChainPlan *chain_plan, InstallState *istate)
+{
+    ListCell *lc;
+
+    if (!table_is_replicated(chain_plan->delta_tbl->ref->name, istate))
+        return false;
+
+    foreach (lc, chain_plan->chain)
+    {
+        PlanNode *plan = (PlanNode *) lc_ptr(lc);
+        ScanPlan *scan_plan;
+
+        if (plan->node.kind != PLAN_SCAN)
+            continue;
+
+        scan_plan = (ScanPlan *) plan;
+        if (!table_is_replicated(scan_plan->scan_rel->ref->name, istate))
+            return false;
+    }
+
+    return true;
+}
+
+static OpChain *
+make_op_chain(OpChainPlan *chain_plan, bool share_prefix,
+              InstallState *istate)
 {
     List *chain_rev;
     Operator *prev_op;
     ListCell *lc;
     apr_pool_t *chain_pool;
     OpChain *op_chain;
+    Schema **input_schemas;
+    Operator *shared_op;
+    int nshared;
+    int i;
 
 #if 0
     print_op_chain(chain_plan);
@@ -89,7 +428,49 @@ install_op_chain(OpChainPlan *chain_plan, InstallState *istate)
     op_chain->head = copy_node(chain_plan->head, chain_pool);
     op_chain->anti_chain = chain_plan->delta_tbl->not;
     op_chain->length = list_length(chain_plan->chain);
+    if (chain_plan->rule != NULL)
+        op_chain->rule = copy_node(chain_plan->rule, chain_pool);
+    op_chain->delta_idx = chain_plan->delta_idx;
+    op_chain->prefix_chain = NULL;
     op_chain->next = NULL;
+    op_chain->replicated_body = chain_plan_is_replicated(chain_plan, istate);
+
+    /*
+     * If the leading operators of the chain are the same as those of an
+     * existing chain, we reuse them rather than evaluating them twice for
+     * each delta tuple. Since replan_op_chain() replaces a chain with one
+     * that has its own operators, we no longer re-plan either chain.
+     */
+    shared_op = NULL;
+    nshared = 0;
+    if (share_prefix)
+        nshared = find_shared_prefix(op_chain, chain_plan, &shared_op,
+                                     &op_chain->prefix_chain);
+    if (nshared > 0)
+    {
+        op_chain->rule = NULL;
+        op_chain->prefix_chain->rule = NULL;
+    }
+
+    /*
+     * Each operator needs the schema of its input tuples, in order to access
+     * their columns. The first operator's input is the delta table; every
+     * other operator's input is the output of the operator preceding it.
+     */
+    input_schemas = apr_palloc(istate->tmp_pool,
+                               op_chain->length * sizeof(*input_schemas));
+    i = 0;
+    foreach (lc, chain_plan->chain)
+    {
+        PlanNode *plan = (PlanNode *) lc_ptr(lc);
+
+        if (i == 0)
+            input_schemas[i] = op_chain->delta_tbl->schema;
+        if (i + 1 < op_chain->length)
+            input_schemas[i + 1] = plan_get_proj_schema(plan, istate->c4,
+                                                        chain_pool);
+        i++;
+    }
 
     /*
      * We build the operator chain in reverse, so that each operator knows
@@ -101,8 +482,12 @@ install_op_chain(OpChainPlan *chain_plan, InstallState *istate)
     foreach (lc, chain_rev)
     {
         PlanNode *plan = (PlanNode *) lc_ptr(lc);
+        Schema *input_schema = input_schemas[--i];
         Operator *op;
 
+        if (i < nshared)
+            break;
+
         ASSERT(list_length(plan->quals) == list_length(plan->qual_exprs));
 #if 0
         print_plan_info(plan, istate->tmp_pool);
@@ -115,12 +500,15 @@ install_op_chain(OpChainPlan *chain_plan, InstallState *istate)
                 ASSERT(prev_op == NULL);
                 if (istate->current_agg == NULL)
                     istate->current_agg = agg_op_make((AggPlan *) plan,
-                                                      op_chain);
+                                                      input_schema,
+                                                      op_chain,
+                                                      istate->agg_append_only);
                 op = (Operator *) istate->current_agg;
                 break;
 
             case PLAN_FILTER:
                 op = (Operator *) filter_op_make((FilterPlan *) plan,
+                                                 input_schema,
                                                  prev_op, op_chain);
                 break;
 
@@ -128,16 +516,19 @@ install_op_chain(OpChainPlan *chain_plan, InstallState *istate)
                 /* Should be the last op in the chain */
                 ASSERT(prev_op == NULL);
                 op = (Operator *) insert_op_make((InsertPlan *) plan,
+                                                 input_schema,
                                                  op_chain);
                 break;
 
             case PLAN_PROJECT:
                 op = (Operator *) project_op_make((ProjectPlan *) plan,
+                                                  input_schema,
                                                   prev_op, op_chain);
                 break;
 
             case PLAN_SCAN:
                 op = (Operator *) scan_op_make((ScanPlan *) plan,
+                                               input_schema,
                                                prev_op, op_chain);
                 break;
 
@@ -148,12 +539,25 @@ install_op_chain(OpChainPlan *chain_plan, InstallState *istate)
 
         prev_op = op;
     }
-    op_chain->chain_start = prev_op;
 
-    router_add_op_chain(istate->c4->router, op_chain);
+    if (nshared > 0)
+    {
+        add_sibling_op(shared_op, prev_op);
+        op_chain->chain_start = op_chain->prefix_chain->chain_start;
+    }
+    else
+        op_chain->chain_start = prev_op;
+
+    find_dispatch_qual(op_chain);
+
+    op_chain->parallel_safe = operator_parallel_safe(op_chain->chain_start);
+    if (nshared > 0)
+        op_chain->prefix_chain->parallel_safe = op_chain->parallel_safe;
 #if 0
     printf("================\n");
 #endif
+
+    return op_chain;
 }
 
 static void
@@ -166,13 +570,21 @@ plan_install_rules(ProgramPlan *plan, InstallState *istate)
         RulePlan *rplan = (RulePlan *) lc_ptr(lc);
         ListCell *lc2;
 
+        if (rplan->agg_plan != NULL)
+            istate->agg_append_only = rule_is_append_only(rplan, istate);
+
         foreach (lc2, rplan->chains)
         {
             OpChainPlan *chain_plan = (OpChainPlan *) lc_ptr(lc2);
+            OpChain *op_chain;
 
-            install_op_chain(chain_plan, istate);
+            op_chain = make_op_chain(chain_plan, true, istate);
+            router_add_op_chain(istate->c4->router, op_chain);
         }
 
+        if (rplan->agg_plan != NULL && istate->agg_append_only)
+            note_append_only_agg(rplan, istate->current_agg, istate);
+
         istate->current_agg = NULL;
     }
 }
@@ -212,7 +624,7 @@ plan_install_facts(ProgramPlan *plan, InstallState *istate)
 
         tbl_def = cat_get_table(istate->c4->cat, fact->head->name);
         t = fact_make_tuple(fact, tbl_def, istate);
-        router_insert_tuple(istate->c4->router, t, tbl_def, true);
+        router_insert_tuple(istate->c4->router, t, tbl_def, true, true);
         tuple_unpin(t, tbl_def->schema);
     }
 }
@@ -252,10 +664,75 @@ istate_make(apr_pool_t *pool, C4Runtime *c4)
     istate->tmp_pool = pool;
     istate->c4 = c4;
     istate->current_agg = NULL;
+    istate->agg_append_only = false;
 
     return istate;
 }
 
+static bool
+join_clause_equal(AstJoinClause *j1, AstJoinClause *j2)
+{
+    return (j1->not == j2->not &&
+            strcmp(j1->ref->name, j2->ref->name) == 0);
+}
+
+/*
+ * Do the scans of "op_chain" visit the same tables in the same order as
+ * the scans in "chain_plan"?
+ */
+static bool
+op_chain_matches_plan(OpChain *op_chain, OpChainPlan *chain_plan)
+{
+    Operator *op;
+    ListCell *lc;
+
+    op = op_chain->chain_start;
+    foreach (lc, chain_plan->chain)
+    {
+        PlanNode *plan = (PlanNode *) lc_ptr(lc);
+
+        if (plan->node.kind != PLAN_SCAN)
+            continue;
+
+        while (op != NULL && op->plan->node.kind != PLAN_SCAN)
+            op = op->next;
+        if (op == NULL)
+            return false;
+
+        if (!join_clause_equal(((ScanPlan *) plan)->scan_rel,
+                               ((ScanPlan *) op->plan)->scan_rel))
+            return false;
+
+        op = op->next;
+    }
+
+    while (op != NULL && op->plan->node.kind != PLAN_SCAN)
+        op = op->next;
+
+    return (op == NULL);
+}
+
+/*
+ * Re-plan "op_chain" using the current table statistics. If that yields a
+ * different join order, return a new OpChain; the caller is responsible for
+ * replacing the old chain with it. Otherwise, return NULL.
+ */
+OpChain *
+replan_op_chain(OpChain *op_chain, apr_pool_t *pool)
+{
+    OpChainPlan *chain_plan;
+    InstallState *istate;
+
+    ASSERT(op_chain->rule != NULL);
+    chain_plan = plan_rule_chain(op_chain->rule, op_chain->delta_idx,
+                                 pool, op_chain->c4);
+    if (op_chain_matches_plan(op_chain, chain_plan))
+        return NULL;
+
+    istate = istate_make(pool, op_chain->c4);
+    return make_op_chain(chain_plan, false, istate);
+}
+
 void
 install_plan(ProgramPlan *plan, apr_pool_t *pool, C4Runtime *c4)
 {
@@ -264,6 +741,7 @@ install_plan(ProgramPlan *plan, apr_pool_t *pool, C4Runtime *c4)
     istate = istate_make(pool, c4);
     plan_install_defines(plan, istate);
     plan_install_timers(plan, istate);
+    plan_install_rule_deps(plan, istate);
     plan_install_rules(plan, istate);
     plan_install_facts(plan, istate);
 
@@ -316,25 +316,13 @@ make_proj_list(PlanNode *plan, ListCell *chain_rest, AstJoinClause *outer_rel,
                                       chain_plan, state);
 
     /*
-     * We also handle PLAN_FILTER specially: the filter operator never does
-     * projection because it does not modify its input, so there is little to be
-     * gained by only projecting out the attributes we need for the rest of the
-     * operator chain. Hence, we just cookup a projection list that is
-     * equivalent to the filter's input schema.
+     * Check if this is a PLAN_SCAN or PLAN_FILTER followed immediately by a
+     * PLAN_AGG or PLAN_INSERT. When this is the case, we can skip projection
+     * in the agg/insert op, and instead do any necessary projection when
+     * producing the output of the scan or filter. We can't always apply this
+     * optimization, since an agg/insert might be the first op in a chain.
      */
-    if (plan->node.kind == PLAN_FILTER)
-        return make_tbl_ref_proj_list(chain_plan->delta_tbl->ref,
-                                      outer_rel, chain_plan, state);
-
-    /*
-     * Check if this is a PLAN_SCAN followed immediately by a PLAN_AGG or
-     * PLAN_INSERT. When this is the case, we can skip projection in the
-     * agg/insert op, and instead do any necessary projection when producing the
-     * output of the scan. We can't always apply this optimization, since an
-     * agg/insert might be preceded by a filter or might be the first op in a
-     * chain.
-     */
-    if (plan->node.kind == PLAN_SCAN)
+    if (plan->node.kind == PLAN_SCAN || plan->node.kind == PLAN_FILTER)
     {
         PlanNode *next;
 
@@ -345,6 +333,18 @@ make_proj_list(PlanNode *plan, ListCell *chain_rest, AstJoinClause *outer_rel,
                                           chain_plan, state);
     }
 
+    /*
+     * Otherwise, a PLAN_FILTER preserves its input: the filter operator does
+     * not modify its input, so there is little to be gained by only
+     * projecting out the attributes we need for the rest of the operator
+     * chain. Hence, we just cookup a projection list that is equivalent to
+     * the filter's input schema, which lets the filter pass on its input
+     * tuples without projecting them.
+     */
+    if (plan->node.kind == PLAN_FILTER)
+        return make_tbl_ref_proj_list(chain_plan->delta_tbl->ref,
+                                      outer_rel, chain_plan, state);
+
     cxt.wip_plist = list_make(state->plan_pool);
     cxt.outer_rel = outer_rel;
     cxt.delta_tbl = chain_plan->delta_tbl;
@@ -409,6 +409,183 @@ add_qual_expr(AstQualifier *qual, PlanNode *plan, AstJoinClause *outer_rel,
     }
 }
 
+static bool
+expr_has_outer_var(ExprNode *expr)
+{
+    switch (expr->node.kind)
+    {
+        case EXPR_OP:
+            {
+                ExprOp *op = (ExprOp *) expr;
+
+                if (expr_has_outer_var(op->lhs))
+                    return true;
+                if (op->rhs && expr_has_outer_var(op->rhs))
+                    return true;
+
+                return false;
+            }
+
+        case EXPR_VAR:
+            return ((ExprVar *) expr)->is_outer;
+
+        case EXPR_CONST:
+            return false;
+
+        default:
+            ERROR("Unexpected expr node kind: %d", (int) expr->node.kind);
+    }
+}
+
+/*
+ * Return the operator that yields the same result as "op" when its operands
+ * are swapped.
+ */
+static AstOperKind
+commute_op_kind(AstOperKind op_kind)
+{
+    switch (op_kind)
+    {
+        case AST_OP_LT:
+            return AST_OP_GT;
+        case AST_OP_LTE:
+            return AST_OP_GTE;
+        case AST_OP_GT:
+            return AST_OP_LT;
+        case AST_OP_GTE:
+            return AST_OP_LTE;
+        case AST_OP_EQ:
+        case AST_OP_NEQ:
+        case AST_OP_PLUS:
+        case AST_OP_TIMES:
+            return op_kind;
+
+        default:
+            ERROR("Unexpected op kind: %d", (int) op_kind);
+    }
+}
+
+/*
+ * If "expr" is an equality or range comparison between a column of the scan
+ * relation and an expression that can be evaluated using only the scan's
+ * input tuple, return true and fill-in "outer_var", "key_op" and
+ * "key_expr". "key_op" is oriented so that the scan column is its lhs.
+ */
+static bool
+is_index_qual(ExprNode *expr, ExprVar **outer_var, AstOperKind *key_op,
+              ExprNode **key_expr)
+{
+    ExprOp *op;
+
+    if (expr->node.kind != EXPR_OP)
+        return false;
+
+    op = (ExprOp *) expr;
+    switch (op->op_kind)
+    {
+        case AST_OP_EQ:
+        case AST_OP_LT:
+        case AST_OP_LTE:
+        case AST_OP_GT:
+        case AST_OP_GTE:
+            break;
+
+        default:
+            return false;
+    }
+
+    if (op->lhs->node.kind == EXPR_VAR && ((ExprVar *) op->lhs)->is_outer &&
+        !expr_has_outer_var(op->rhs))
+    {
+        *outer_var = (ExprVar *) op->lhs;
+        *key_op = op->op_kind;
+        *key_expr = op->rhs;
+        return true;
+    }
+
+    if (op->rhs->node.kind == EXPR_VAR && ((ExprVar *) op->rhs)->is_outer &&
+        !expr_has_outer_var(op->lhs))
+    {
+        *outer_var = (ExprVar *) op->rhs;
+        *key_op = commute_op_kind(op->op_kind);
+        *key_expr = op->lhs;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Find the quals of a scan that can be used to probe an index on the scan
+ * relation, rather than scanning the entire relation. Equality keys are
+ * placed before range keys. If the same column appears in several equality
+ * quals, we only use the first; range quals on a column that already has an
+ * equality key are not used. All such quals are still checked along with the
+ * rest of the scan's quals.
+ */
+static void
+find_scan_keys(ScanPlan *plan, PlannerState *state)
+{
+    List *eq_cols;
+    List *range_cols;
+    List *range_ops;
+    List *range_exprs;
+    ListCell *lc;
+    ListCell *lc2;
+    ListCell *lc3;
+
+    plan->key_cols = list_make(state->plan_pool);
+    plan->key_ops = list_make(state->plan_pool);
+    plan->key_exprs = list_make(state->plan_pool);
+    range_cols = list_make(state->tmp_pool);
+    range_ops = list_make(state->tmp_pool);
+    range_exprs = list_make(state->tmp_pool);
+
+    foreach (lc, plan->plan.qual_exprs)
+    {
+        ExprNode *expr = (ExprNode *) lc_ptr(lc);
+        ExprVar *outer_var;
+        AstOperKind key_op;
+        ExprNode *key_expr;
+
+        if (!is_index_qual(expr, &outer_var, &key_op, &key_expr))
+            continue;
+
+        if (key_op != AST_OP_EQ)
+        {
+            list_append_int(range_cols, outer_var->attno);
+            list_append_int(range_ops, key_op);
+            list_append(range_exprs, key_expr);
+            continue;
+        }
+
+        if (list_member_int(plan->key_cols, outer_var->attno))
+            continue;
+
+        list_append_int(plan->key_cols, outer_var->attno);
+        list_append_int(plan->key_ops, key_op);
+        list_append(plan->key_exprs, key_expr);
+    }
+
+    eq_cols = list_copy(plan->key_cols, state->tmp_pool);
+    lc2 = list_head(range_ops);
+    lc3 = list_head(range_exprs);
+    foreach (lc, range_cols)
+    {
+        int attno = lc_int(lc);
+
+        if (!list_member_int(eq_cols, attno))
+        {
+            list_append_int(plan->key_cols, attno);
+            list_append_int(plan->key_ops, lc_int(lc2));
+            list_append(plan->key_exprs, lc_ptr(lc3));
+        }
+
+        lc2 = lc2->next;
+        lc3 = lc3->next;
+    }
+}
+
 static void
 fix_op_exprs(PlanNode *plan, ListCell *chain_rest,
              OpChainPlan *chain_plan, PlannerState *state)
@@ -443,6 +620,9 @@ fix_op_exprs(PlanNode *plan, ListCell *chain_rest,
         add_qual_expr(qual, plan, outer_rel, chain_plan, state);
     }
 
+    if (plan->node.kind == PLAN_SCAN)
+        find_scan_keys((ScanPlan *) plan, state);
+
     new_plist = make_proj_list(plan, chain_rest, outer_rel, chain_plan, state);
     ASSERT(plan->proj_list == NULL);
     plan->proj_list = new_plist;
@@ -471,3 +651,449 @@ fix_chain_exprs(OpChainPlan *chain_plan, PlannerState *state)
         fix_op_exprs(node, lc->next, chain_plan, state);
     }
 }
+
+/*
+ * Can the operands of "op" be swapped (with commute_op_kind() applied to
+ * the operator)? Note that string concatenation is not commutative.
+ */
+static bool
+op_is_commutable(ExprOp *op)
+{
+    switch (op->op_kind)
+    {
+        case AST_OP_LT:
+        case AST_OP_LTE:
+        case AST_OP_GT:
+        case AST_OP_GTE:
+        case AST_OP_EQ:
+        case AST_OP_NEQ:
+            return true;
+
+        case AST_OP_PLUS:
+        case AST_OP_TIMES:
+            return (op->expr.type != TYPE_STRING);
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Return the name of the representative of the class of variables that are
+ * known to be equal to "name".
+ */
+static char *
+get_var_class(char *name, apr_hash_t *var_classes)
+{
+    char *parent;
+
+    while ((parent = apr_hash_get(var_classes, name,
+                                  APR_HASH_KEY_STRING)) != NULL)
+        name = parent;
+
+    return name;
+}
+
+/*
+ * A total order over expression trees. If "var_classes" is NULL, two
+ * variables are equal if they refer to the same column; otherwise, they are
+ * equal if they belong to the same class of equal variables.
+ */
+static int
+expr_cmp(ExprNode *e1, ExprNode *e2, apr_hash_t *var_classes)
+{
+    if (e1->node.kind != e2->node.kind)
+        return (int) e1->node.kind - (int) e2->node.kind;
+    if (e1->type != e2->type)
+        return (int) e1->type - (int) e2->type;
+
+    switch (e1->node.kind)
+    {
+        case EXPR_OP:
+            {
+                ExprOp *op1 = (ExprOp *) e1;
+                ExprOp *op2 = (ExprOp *) e2;
+                int result;
+
+                if (op1->op_kind != op2->op_kind)
+                    return (int) op1->op_kind - (int) op2->op_kind;
+
+                result = expr_cmp(op1->lhs, op2->lhs, var_classes);
+                if (result != 0 || op1->rhs == NULL)
+                    return result;
+
+                return expr_cmp(op1->rhs, op2->rhs, var_classes);
+            }
+
+        case EXPR_VAR:
+            {
+                ExprVar *var1 = (ExprVar *) e1;
+                ExprVar *var2 = (ExprVar *) e2;
+
+                if (var_classes != NULL)
+                    return strcmp(get_var_class(var1->name, var_classes),
+                                  get_var_class(var2->name, var_classes));
+
+                if (var1->is_outer != var2->is_outer)
+                    return (int) var1->is_outer - (int) var2->is_outer;
+
+                return var1->attno - var2->attno;
+            }
+
+        case EXPR_CONST:
+            return datum_cmp(((ExprConst *) e1)->value,
+                             ((ExprConst *) e2)->value, e1->type);
+
+        default:
+            ERROR("Unexpected expr node kind: %d", (int) e1->node.kind);
+    }
+}
+
+/*
+ * Replace subexpressions whose operands are all constants with their
+ * values. We don't fold division or modulus by zero: that error should be
+ * raised if and when the expression is evaluated.
+ */
+static ExprNode *
+fold_constants(ExprNode *expr, PlannerState *state)
+{
+    ExprOp *op;
+    ExprEvalContext cxt;
+    ExprState *expr_state;
+    Datum result;
+
+    if (expr->node.kind != EXPR_OP)
+        return expr;
+
+    op = (ExprOp *) expr;
+    op->lhs = fold_constants(op->lhs, state);
+    if (op->rhs)
+        op->rhs = fold_constants(op->rhs, state);
+
+    if (op->lhs->node.kind != EXPR_CONST ||
+        (op->rhs && op->rhs->node.kind != EXPR_CONST))
+        return expr;
+
+    if ((op->op_kind == AST_OP_DIVIDE || op->op_kind == AST_OP_MODULUS) &&
+        ((ExprConst *) op->rhs)->value.i8 == 0)
+        return expr;
+
+    memset(&cxt, 0, sizeof(cxt));
+    expr_state = make_expr_state(expr, &cxt, state->tmp_pool);
+    result = eval_expr(expr_state);
+    pool_track_datum(state->plan_pool, result, expr->type);
+
+    return (ExprNode *) make_expr_const(expr->type, result, state->plan_pool);
+}
+
+/*
+ * Put the operands of commutable operators into a canonical order, so that
+ * equivalent expressions (e.g. "A + B" and "B + A") have the same form.
+ */
+static void
+canonicalize_expr(ExprNode *expr)
+{
+    ExprOp *op;
+
+    if (expr->node.kind != EXPR_OP)
+        return;
+
+    op = (ExprOp *) expr;
+    canonicalize_expr(op->lhs);
+    if (op->rhs == NULL)
+        return;
+
+    canonicalize_expr(op->rhs);
+    if (op_is_commutable(op) && expr_cmp(op->lhs, op->rhs, NULL) > 0)
+    {
+        ExprNode *tmp = op->lhs;
+
+        op->lhs = op->rhs;
+        op->rhs = tmp;
+        op->op_kind = commute_op_kind(op->op_kind);
+    }
+}
+
+static ExprNode *
+simplify_expr(ExprNode *expr, PlannerState *state)
+{
+    expr = fold_constants(expr, state);
+    canonicalize_expr(expr);
+    return expr;
+}
+
+/*
+ * Is "qual" always satisfied? We don't consider "A = A" to be a tautology
+ * for doubles, because NaN is not equal to itself.
+ */
+static bool
+qual_is_tautology(ExprNode *qual, apr_hash_t *var_classes)
+{
+    ExprOp *op;
+
+    if (qual->node.kind == EXPR_CONST)
+        return ((ExprConst *) qual)->value.b;
+
+    if (qual->node.kind != EXPR_OP)
+        return false;
+
+    op = (ExprOp *) qual;
+    switch (op->op_kind)
+    {
+        case AST_OP_EQ:
+        case AST_OP_LTE:
+        case AST_OP_GTE:
+            if (op->lhs->type == TYPE_DOUBLE)
+                return false;
+            return (expr_cmp(op->lhs, op->rhs, var_classes) == 0);
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Is "qual" implied by one of the quals in "applied"? Since the quals have
+ * been canonicalized by column number rather than by variable class, we
+ * also check for a match with the operands swapped.
+ */
+static bool
+qual_is_duplicate(ExprNode *qual, List *applied, apr_hash_t *var_classes)
+{
+    ListCell *lc;
+
+    foreach (lc, applied)
+    {
+        ExprNode *prev = (ExprNode *) lc_ptr(lc);
+        ExprOp *op;
+        ExprOp *prev_op;
+
+        if (expr_cmp(qual, prev, var_classes) == 0)
+            return true;
+
+        if (qual->node.kind != EXPR_OP || prev->node.kind != EXPR_OP)
+            continue;
+
+        op = (ExprOp *) qual;
+        prev_op = (ExprOp *) prev;
+        if (op_is_commutable(op) && op->rhs != NULL &&
+            op->op_kind == commute_op_kind(prev_op->op_kind) &&
+            expr_cmp(op->lhs, prev_op->rhs, var_classes) == 0 &&
+            expr_cmp(op->rhs, prev_op->lhs, var_classes) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * If "qual" is an equality between two variables, merge their classes.
+ */
+static void
+add_var_class_eq(ExprNode *qual, apr_hash_t *var_classes)
+{
+    ExprOp *op;
+    char *lhs_class;
+    char *rhs_class;
+
+    if (qual->node.kind != EXPR_OP)
+        return;
+
+    op = (ExprOp *) qual;
+    if (op->op_kind != AST_OP_EQ ||
+        op->lhs->node.kind != EXPR_VAR || op->rhs->node.kind != EXPR_VAR)
+        return;
+
+    lhs_class = get_var_class(((ExprVar *) op->lhs)->name, var_classes);
+    rhs_class = get_var_class(((ExprVar *) op->rhs)->name, var_classes);
+    if (strcmp(lhs_class, rhs_class) != 0)
+        apr_hash_set(var_classes, lhs_class, APR_HASH_KEY_STRING, rhs_class);
+}
+
+static void
+simplify_expr_list(List *exprs, PlannerState *state)
+{
+    ListCell *lc;
+
+    foreach (lc, exprs)
+        lc_ptr(lc) = simplify_expr((ExprNode *) lc_ptr(lc), state);
+}
+
+/*
+ * Simplify the quals of "plan", and drop those that are tautologies or that
+ * are implied by quals that have already been applied, either earlier in
+ * the op chain or by this operator. The AST quals are kept in sync with the
+ * qual exprs. The quals of an anti-scan are not satisfied by the tuples it
+ * emits, so they are not added to "applied".
+ */
+static void
+simplify_op_quals(PlanNode *plan, List *applied, apr_hash_t *var_classes,
+                  PlannerState *state)
+{
+    bool is_anti_scan;
+    List *op_applied;
+    List *quals;
+    List *qual_exprs;
+    ListCell *lc;
+    ListCell *lc2;
+
+    is_anti_scan = (plan->node.kind == PLAN_SCAN &&
+                    ((ScanPlan *) plan)->scan_rel->not);
+    if (is_anti_scan)
+        op_applied = list_copy(applied, state->tmp_pool);
+    else
+        op_applied = applied;
+
+    quals = list_make(state->plan_pool);
+    qual_exprs = list_make(state->plan_pool);
+    lc2 = list_head(plan->qual_exprs);
+    foreach (lc, plan->quals)
+    {
+        ExprNode *expr = simplify_expr((ExprNode *) lc_ptr(lc2), state);
+
+        lc2 = lc2->next;
+        if (qual_is_tautology(expr, var_classes) ||
+            qual_is_duplicate(expr, op_applied, var_classes))
+            continue;
+
+        list_append(quals, lc_ptr(lc));
+        list_append(qual_exprs, expr);
+        list_append(op_applied, expr);
+        if (!is_anti_scan)
+            add_var_class_eq(expr, var_classes);
+    }
+
+    plan->quals = quals;
+    plan->qual_exprs = qual_exprs;
+}
+
+/*
+ * Rewrite the expressions in the op chain to reduce the work done per
+ * tuple: fold constant subexpressions, canonicalize commutable operators
+ * (which lets the expression compiler share the evaluation of common
+ * subexpressions between an operator's quals and its projection list), and
+ * drop redundant quals. Quals are compared using the classes of variables
+ * known to be equal at each point in the chain, so that an implied equality
+ * qual (see make_implied_quals()) is dropped if it has already been
+ * enforced.
+ */
+void
+simplify_chain_exprs(OpChainPlan *chain_plan, PlannerState *state)
+{
+    List *applied;
+    apr_hash_t *var_classes;
+    ListCell *lc;
+
+    applied = list_make(state->tmp_pool);
+    var_classes = apr_hash_make(state->tmp_pool);
+
+    foreach (lc, chain_plan->chain)
+    {
+        PlanNode *plan = (PlanNode *) lc_ptr(lc);
+
+        /* An AggPlan is shared by the chains of a rule, and has no quals */
+        if (plan->node.kind == PLAN_AGG)
+            continue;
+
+        simplify_op_quals(plan, applied, var_classes, state);
+        simplify_expr_list(plan->proj_list, state);
+        if (plan->node.kind == PLAN_SCAN)
+            simplify_expr_list(((ScanPlan *) plan)->key_exprs, state);
+    }
+}
+
+/*
+ * Plan nodes that have been copied by copy_node() might have NULL in place
+ * of an empty list.
+ */
+#define list_length_or_0(list)  ((list) == NULL ? 0 : list_length(list))
+
+static bool
+expr_list_equal(List *l1, List *l2)
+{
+    ListCell *lc1;
+    ListCell *lc2;
+
+    if (list_length_or_0(l1) != list_length_or_0(l2))
+        return false;
+    if (l1 == NULL)
+        return true;
+
+    lc2 = list_head(l2);
+    foreach (lc1, l1)
+    {
+        if (expr_cmp(lc_ptr(lc1), lc_ptr(lc2), NULL) != 0)
+            return false;
+
+        lc2 = lc2->next;
+    }
+
+    return true;
+}
+
+static bool
+int_list_equal(List *l1, List *l2)
+{
+    ListCell *lc1;
+    ListCell *lc2;
+
+    if (list_length_or_0(l1) != list_length_or_0(l2))
+        return false;
+    if (l1 == NULL)
+        return true;
+
+    lc2 = list_head(l2);
+    foreach (lc1, l1)
+    {
+        if (lc_int(lc1) != lc_int(lc2))
+            return false;
+
+        lc2 = lc2->next;
+    }
+
+    return true;
+}
+
+/*
+ * Do two planned operators compute the same output from the same input?
+ * We compare the runtime representation of their expressions, which refer
+ * to columns by position rather than by variable name, so the operators of
+ * different rules can be equal. Inserts and aggs are never considered equal,
+ * since they have side effects.
+ */
+bool
+plan_node_equal(PlanNode *p1, PlanNode *p2)
+{
+    if (p1->node.kind != p2->node.kind)
+        return false;
+
+    if (!expr_list_equal(p1->qual_exprs, p2->qual_exprs) ||
+        !expr_list_equal(p1->proj_list, p2->proj_list))
+        return false;
+
+    switch (p1->node.kind)
+    {
+        case PLAN_FILTER:
+            return (strcmp(((FilterPlan *) p1)->tbl_name,
+                           ((FilterPlan *) p2)->tbl_name) == 0);
+
+        case PLAN_PROJECT:
+            return true;
+
+        case PLAN_SCAN:
+            {
+                ScanPlan *s1 = (ScanPlan *) p1;
+                ScanPlan *s2 = (ScanPlan *) p2;
+
+                return (s1->scan_rel->not == s2->scan_rel->not &&
+                        strcmp(s1->scan_rel->ref->name,
+                               s2->scan_rel->ref->name) == 0 &&
+                        int_list_equal(s1->key_cols, s2->key_cols) &&
+                        int_list_equal(s1->key_ops, s2->key_ops) &&
+                        expr_list_equal(s1->key_exprs, s2->key_exprs));
+            }
+
+        default:
+            return false;
+    }
+}
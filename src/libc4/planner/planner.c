@@ -1,8 +1,8 @@
 /*
  * Basic planner algorithm is described below. Doesn't handle negation,
- * aggregation, or stratification. No significant optimization is performed
- * (e.g. no intelligent selection of join order). We always perform
- * predicate pushdown.
+ * aggregation, or stratification. The join order is chosen greedily, using
+ * the table statistics kept in the catalog. We always perform predicate
+ * pushdown.
  *
  * Foreach rule r:
  *  Foreach join clause j in r->body:
@@ -13,7 +13,8 @@
  *  Done = {delta}
  *  Chain = []
  *  while J != {}:
- *    Select an element j from J which joins against a relation in Done with qualifier q
+ *    Select the cheapest element j from J, preferring those which join
+ *    against a relation in Done with qualifier q
  *    Remove j from J, remove q from Q
  *    Done = Done U j
  *    Chain << Make_Op(j, q)
@@ -31,6 +32,14 @@
 #include "parser/walker.h"
 #include "planner/planner.h"
 #include "planner/planner-internal.h"
+#include "types/catalog.h"
+
+/*
+ * Selectivity estimates for quals that can't use the distinct-value
+ * estimates in the catalog.
+ */
+#define RANGE_QUAL_SELECTIVITY  (1.0 / 3.0)
+#define OTHER_QUAL_SELECTIVITY  0.5
 
 static ProgramPlan *
 program_plan_make(apr_pool_t *pool)
@@ -193,7 +202,8 @@ add_scan_op(AstJoinClause *ast_join, List *quals,
 {
     ScanPlan *splan;
 
-    splan = make_scan_plan(ast_join, quals, NULL, NULL, state->plan_pool);
+    splan = make_scan_plan(ast_join, quals, NULL, NULL,
+                           NULL, NULL, NULL, state->plan_pool);
     list_append(chain_plan->chain, splan);
 }
 
@@ -252,17 +262,294 @@ add_delta_filter(OpChainPlan *chain_plan, PlannerState *state)
         add_filter_op(quals, chain_plan, state);
 }
 
+/*
+ * If "var" names a column of "join", return the column number; otherwise,
+ * return -1.
+ */
+static int
+join_get_var_colno(AstJoinClause *join, AstVarExpr *var)
+{
+    ListCell *lc;
+    int i;
+
+    i = 0;
+    foreach (lc, join->ref->cols)
+    {
+        AstVarExpr *column_var = (AstVarExpr *) lc_ptr(lc);
+
+        if (strcmp(var->name, column_var->name) == 0)
+            return i;
+        i++;
+    }
+
+    return -1;
+}
+
+/*
+ * Does "expr" reference a column of "join", and does it reference any other
+ * variable?
+ */
+static void
+expr_get_join_refs(C4Node *expr, AstJoinClause *join, bool *refs_join,
+                   bool *refs_other, PlannerState *state)
+{
+    List *var_list;
+    ListCell *lc;
+
+    *refs_join = false;
+    *refs_other = false;
+    var_list = expr_get_vars(expr, state->tmp_pool);
+    foreach (lc, var_list)
+    {
+        AstVarExpr *var = (AstVarExpr *) lc_ptr(lc);
+
+        if (join_get_var_colno(join, var) != -1)
+            *refs_join = true;
+        else
+            *refs_other = true;
+    }
+}
+
+/*
+ * If "qual" is of the form "column OP expr", where "column" is a column of
+ * "join" and "expr" doesn't reference "join", return the column number;
+ * otherwise, return -1.
+ */
+static int
+qual_get_key_colno(AstQualifier *qual, AstJoinClause *join,
+                   PlannerState *state)
+{
+    AstOpExpr *op_expr;
+    int i;
+
+    if (qual->expr->kind != AST_OP_EXPR)
+        return -1;
+
+    op_expr = (AstOpExpr *) qual->expr;
+    for (i = 0; i < 2; i++)
+    {
+        C4Node *key = (i == 0) ? op_expr->lhs : op_expr->rhs;
+        C4Node *other = (i == 0) ? op_expr->rhs : op_expr->lhs;
+        bool refs_join;
+        bool refs_other;
+        int colno;
+
+        if (key->kind != AST_VAR_EXPR)
+            continue;
+
+        colno = join_get_var_colno(join, (AstVarExpr *) key);
+        if (colno == -1)
+            continue;
+
+        expr_get_join_refs(other, join, &refs_join, &refs_other, state);
+        if (!refs_join)
+            return colno;
+    }
+
+    return -1;
+}
+
+/*
+ * Return the quals in "qual_set_todo" that would become applicable if
+ * "candidate" was added to the join set.
+ */
+static List *
+candidate_get_quals(AstJoinClause *candidate, PlannerState *state)
+{
+    List *old_join_set = state->join_set;
+    List *result;
+    ListCell *lc;
+
+    state->join_set = list_copy(old_join_set, state->tmp_pool);
+    list_append(state->join_set, candidate);
+
+    result = list_make(state->tmp_pool);
+    foreach (lc, state->qual_set_todo)
+    {
+        AstQualifier *qual = (AstQualifier *) lc_ptr(lc);
+
+        if (join_set_satisfies_qual(qual, state))
+            list_append(result, qual);
+    }
+
+    state->join_set = old_join_set;
+    return result;
+}
+
+/*
+ * Estimate the cost of scanning "candidate" once per tuple produced by the
+ * current join set: the number of tuples we need to examine, plus the
+ * number of tuples that pass the candidate's quals. Quals of the form
+ * "column OP expr" can be evaluated with an index probe (see ScanPlan);
+ * other quals are evaluated against every tuple in the table. Also sets
+ * "*connected" to whether any of the quals joins the candidate with a
+ * table in the current join set.
+ */
+static double
+estimate_join_cost(AstJoinClause *candidate, bool *connected,
+                   PlannerState *state)
+{
+    TableStats *stats;
+    bool range_indexable;
+    double ntuples;
+    double selectivity;
+    bool indexable;
+    List *quals;
+    ListCell *lc;
+
+    stats = cat_get_table_stats(state->c4->cat, candidate->ref->name,
+                                state->tmp_pool);
+    if (stats != NULL)
+    {
+        TableDef *tbl_def = cat_get_table(state->c4->cat,
+                                          candidate->ref->name);
+
+        ntuples = stats->ntuples;
+        range_indexable = (tbl_def->storage != AST_STORAGE_MEMORY);
+    }
+    else
+    {
+        /* The table is defined by the program we're planning */
+        ntuples = 0;
+        range_indexable = false;
+    }
+
+    selectivity = 1.0;
+    indexable = false;
+    *connected = false;
+
+    quals = candidate_get_quals(candidate, state);
+    foreach (lc, quals)
+    {
+        AstQualifier *qual = (AstQualifier *) lc_ptr(lc);
+        bool refs_join;
+        bool refs_other;
+        int colno;
+
+        expr_get_join_refs(qual->expr, candidate,
+                           &refs_join, &refs_other, state);
+        if (refs_join && refs_other)
+            *connected = true;
+
+        colno = qual_get_key_colno(qual, candidate, state);
+        if (colno == -1)
+        {
+            selectivity *= OTHER_QUAL_SELECTIVITY;
+            continue;
+        }
+
+        switch (((AstOpExpr *) qual->expr)->op_kind)
+        {
+            case AST_OP_EQ:
+                if (stats != NULL)
+                    selectivity /= Max(stats->ndistinct[colno], 1.0);
+                indexable = true;
+                break;
+
+            case AST_OP_LT:
+            case AST_OP_LTE:
+            case AST_OP_GT:
+            case AST_OP_GTE:
+                selectivity *= RANGE_QUAL_SELECTIVITY;
+                if (range_indexable)
+                    indexable = true;
+                break;
+
+            default:
+                selectivity *= OTHER_QUAL_SELECTIVITY;
+                break;
+        }
+    }
+
+    if (indexable)
+        return 2 * ntuples * selectivity;
+
+    return ntuples + ntuples * selectivity;
+}
+
+/*
+ * Remove and return the next relation to add to the join set. Among the
+ * relations that are joined with the current join set by some qual, we
+ * pick the one with the lowest estimated cost; we only consider the others
+ * (which would produce a Cartesian product) if there are no such relations.
+ * Ties are broken in favor of the order in which the rule lists its joins.
+ * Anti-scans are only chosen once every other relation has been joined:
+ * before then, the variables they are compared with might not be bound.
+ */
+static AstJoinClause *
+choose_next_join(PlannerState *state)
+{
+    AstJoinClause *best;
+    ListCell *best_prev;
+    bool best_connected;
+    double best_cost;
+    int ncandidates;
+    ListCell *prev;
+    ListCell *lc;
+
+    ncandidates = 0;
+    foreach (lc, state->join_set_todo)
+    {
+        AstJoinClause *join = (AstJoinClause *) lc_ptr(lc);
+
+        if (!join->not)
+            ncandidates++;
+    }
+
+    if (ncandidates == 0)
+        return list_remove_head(state->join_set_todo);
+    if (ncandidates > 1)
+        state->join_order_chosen = true;
+
+    best = NULL;
+    best_prev = NULL;
+    best_connected = false;
+    best_cost = 0;
+    prev = NULL;
+    foreach (lc, state->join_set_todo)
+    {
+        AstJoinClause *join = (AstJoinClause *) lc_ptr(lc);
+        bool connected;
+        double cost;
+
+        if (!join->not && ncandidates == 1)
+        {
+            best = join;
+            best_prev = prev;
+            break;
+        }
+
+        if (!join->not)
+        {
+            cost = estimate_join_cost(join, &connected, state);
+            if (best == NULL ||
+                (connected && !best_connected) ||
+                (connected == best_connected && cost < best_cost))
+            {
+                best = join;
+                best_prev = prev;
+                best_connected = connected;
+                best_cost = cost;
+            }
+        }
+
+        prev = lc;
+    }
+
+    if (best_prev == NULL)
+        return list_remove_head(state->join_set_todo);
+
+    list_remove_cell(state->join_set_todo, best_prev->next, best_prev);
+    return best;
+}
+
 static void
 extend_op_chain(OpChainPlan *chain_plan, PlannerState *state)
 {
     AstJoinClause *candidate;
     List *quals;
 
-    /*
-     * Choose a new relation from the TODO list to add to the join set. XXX:
-     * for now we just take the first element of the list.
-     */
-    candidate = list_remove_head(state->join_set_todo);
+    candidate = choose_next_join(state);
     list_append(state->join_set, candidate);
     list_append(state->join_set_refs, candidate->ref);
 
@@ -277,9 +564,10 @@ extend_op_chain(OpChainPlan *chain_plan, PlannerState *state)
  * output contains all the variables in the qualifier).
  */
 static OpChainPlan *
-plan_op_chain(AstJoinClause *delta_tbl, AstRule *rule,
+plan_op_chain(int delta_idx, AstRule *rule,
               RulePlan *rplan, PlannerState *state)
 {
+    AstJoinClause *delta_tbl = list_get(rule->joins, delta_idx);
     OpChainPlan *chain_plan;
     ListCell *chain_tail;
     PlanNode *tail_plan;
@@ -290,6 +578,7 @@ plan_op_chain(AstJoinClause *delta_tbl, AstRule *rule,
     state->join_set = list_make1(delta_tbl, state->tmp_pool);
     state->join_set_refs = list_make1(delta_tbl->ref, state->tmp_pool);
     state->qual_set = list_make(state->tmp_pool);
+    state->join_order_chosen = false;
 
     chain_plan = apr_pcalloc(state->plan_pool, sizeof(*chain_plan));
     chain_plan->delta_tbl = copy_node(delta_tbl, state->plan_pool);
@@ -311,15 +600,18 @@ plan_op_chain(AstJoinClause *delta_tbl, AstRule *rule,
 
     /*
      * The last operator in a chain is either PLAN_INSERT or PLAN_AGG. In either
-     * case, we check if the preceding operator is projection-capable; if so, we
-     * have the preceding operator do projection for us. If not, we insert an
-     * explicit PLAN_PROJECT to do any needed projection.
+     * case, we check if the preceding operator is projection-capable (a scan
+     * or filter); if so, we have the preceding operator do projection for
+     * us. If not, we insert an explicit PLAN_PROJECT to do any needed
+     * projection.
      */
     chain_tail = list_tail(chain_plan->chain);
     if (chain_tail != NULL)
         tail_plan = (PlanNode *) lc_ptr(chain_tail);
 
-    if (chain_tail == NULL || tail_plan->node.kind != PLAN_SCAN)
+    if (chain_tail == NULL ||
+        (tail_plan->node.kind != PLAN_SCAN &&
+         tail_plan->node.kind != PLAN_FILTER))
         add_project_op(chain_plan, state);
 
     if (rule->has_agg)
@@ -334,6 +626,23 @@ plan_op_chain(AstJoinClause *delta_tbl, AstRule *rule,
      */
     fix_chain_exprs(chain_plan, state);
 
+    /*
+     * Fold constants and eliminate redundant quals, now that we know which
+     * operator evaluates each expression.
+     */
+    simplify_chain_exprs(chain_plan, state);
+
+    /*
+     * If the join order depended on table statistics, remember how to
+     * re-plan the chain. We don't re-plan aggregate rules, because the
+     * AggOperator is shared by all the rule's op chains and holds state.
+     */
+    if (state->join_order_chosen && !rule->has_agg)
+    {
+        chain_plan->rule = copy_node(rule, state->plan_pool);
+        chain_plan->delta_idx = delta_idx;
+    }
+
     return chain_plan;
 }
 
@@ -342,10 +651,12 @@ plan_rule(AstRule *rule, PlannerState *state)
 {
     RulePlan *rplan;
     ListCell *lc;
+    int i;
 
     rplan = apr_palloc(state->plan_pool, sizeof(*rplan));
     rplan->chains = list_make(state->plan_pool);
     rplan->agg_plan = NULL;
+    rplan->is_delete = rule->is_delete;
     rplan->bootstrap_tbl = NULL;
 
     /*
@@ -354,12 +665,13 @@ plan_rule(AstRule *rule, PlannerState *state)
      * of operators that are evaluated when we see a new tuple in that
      * table.
      */
+    i = 0;
     foreach (lc, rule->joins)
     {
         AstJoinClause *delta_tbl = (AstJoinClause *) lc_ptr(lc);
         OpChainPlan *chain_plan;
 
-        chain_plan = plan_op_chain(delta_tbl, rule, rplan, state);
+        chain_plan = plan_op_chain(i++, rule, rplan, state);
         list_append(rplan->chains, chain_plan);
 
         /* We currently use the first join for the bootstrap table */
@@ -400,6 +712,32 @@ plan_program(AstProgram *ast, apr_pool_t *pool, C4Runtime *c4)
     return pplan;
 }
 
+/*
+ * Plan the op chain of "rule" whose delta table is the rule's "delta_idx"'th
+ * join, using the current table statistics. This is used to re-plan an
+ * installed op chain; the rule must not contain aggregates.
+ */
+OpChainPlan *
+plan_rule_chain(AstRule *rule, int delta_idx, apr_pool_t *pool,
+                C4Runtime *c4)
+{
+    PlannerState *state;
+    RulePlan rplan;
+    OpChainPlan *chain_plan;
+
+    ASSERT(!rule->has_agg);
+    state = planner_state_make(pool, c4);
+    rplan.chains = NULL;
+    rplan.agg_plan = NULL;
+    rplan.is_delete = rule->is_delete;
+    rplan.bootstrap_tbl = NULL;
+
+    chain_plan = plan_op_chain(delta_idx, rule, &rplan, state);
+
+    apr_pool_destroy(state->tmp_pool);
+    return chain_plan;
+}
+
 void
 print_plan_info(PlanNode *plan, apr_pool_t *p)
 {
@@ -440,6 +778,13 @@ print_plan_info(PlanNode *plan, apr_pool_t *p)
                              splan->scan_rel->not ? "true" : "false");
                 list_to_str(splan->scan_rel->ref->cols, sbuf);
                 sbuf_append(sbuf, "\n");
+
+                if (!list_is_empty(splan->key_exprs))
+                {
+                    sbuf_append(sbuf, "  INDEX KEY: [");
+                    list_to_str(splan->key_exprs, sbuf);
+                    sbuf_append(sbuf, "]\n");
+                }
             }
             break;
 
@@ -1,3 +1,4 @@
+#include <apr_atomic.h>
 #include <apr_hash.h>
 #include <apr_queue.h>
 #include <apr_thread_cond.h>
@@ -10,14 +11,58 @@
 #include "planner/planner.h"
 #include "router.h"
 #include "runtime.h"
+#include "shard.h"
 #include "storage/sqlite.h"
+#include "storage/sqlite_table.h"
 #include "storage/table.h"
 #include "timer.h"
 #include "types/catalog.h"
 #include "util/dump_table.h"
 #include "util/list.h"
+#include "util/rset.h"
 #include "util/strbuf.h"
 #include "util/tuple_buf.h"
+#include "util/worker_pool.h"
+
+/*
+ * The tuples derived by the op chains that a thread evaluates on behalf of
+ * run_chain_tasks(), which are routed once every chain has been evaluated.
+ * A derived tuple is either a Tuple that was passed on unchanged from the
+ * delta tuples being routed (which remain pinned until then, so we don't
+ * pin it), or a virtual tuple, whose column values are copied to "vals".
+ */
+typedef struct DeferredTuple
+{
+    TableDef *tbl_def;
+    bool every_shard;
+    Tuple *tuple;           /* NULL if the tuple's values are in "vals" */
+    int vals_off;
+} DeferredTuple;
+
+typedef struct DeferBuf
+{
+    DeferredTuple *tuples;
+    int ntuples;
+    int size;
+    Datum *vals;
+    int nvals;
+    int vals_size;
+} DeferBuf;
+
+/*
+ * An invocation of an op chain on a batch of delta tuples, when the router
+ * has worker threads. If the chain was evaluated by run_chain_tasks(), the
+ * tuples it derived are entries [out_start, out_end) of "out".
+ */
+typedef struct ChainTask
+{
+    OpChain *op_chain;
+    TupleBatch *batch;
+    bool routing_deletes;
+    DeferBuf *out;
+    int out_start;
+    int out_end;
+} ChainTask;
 
 struct C4Router
 {
@@ -34,11 +79,51 @@ struct C4Router
     TupleBuf *insert_buf;
     TupleBuf *delete_buf;
     bool routing_deletes;       /* Are we currently routing from delete_buf? */
+    /* Updates computed within current fixpoint; see route_update_buf() */
+    TupleBuf *update_buf;
+    /* Holds the sets of inserted tuples used by route_update_buf() */
+    apr_pool_t *update_pool;
+
+    /* Hooks to invoke before the current fixpoint completes */
+    RouterHook *precommit_hooks;
 
     /* Pending network output tuples computed within current fixpoint */
     TupleBuf *net_buf;
+
+    /* How to route insert_buf and delete_buf; see router_do_fixpoint() */
+    C4FixpointMode fixpoint_mode;
+    /* The tuples being routed in the current round (set-at-a-time mode) */
+    TupleBuf *round_buf;
+
+    /* Has a table's size drifted enough to re-plan the op chains? */
+    bool replan_pending;
+
+    /*
+     * Worker threads that help evaluate parallel-safe op chains, or NULL if
+     * the router thread evaluates every op chain itself. "workers_pool" holds
+     * the workers and the state below; see run_chain_tasks().
+     */
+    WorkerPool *workers;
+    apr_pool_t *workers_pool;
+    /* One DeferBuf per worker thread, plus one for the router thread */
+    DeferBuf *defer_bufs;
+    /* Op chain invocations for the batch being routed */
+    ChainTask *tasks;
+    int ntasks;
+    int max_tasks;
+    /* Indexes of the tasks that the workers evaluate */
+    int *parallel_tasks;
+    int nparallel;
+    volatile apr_uint32_t next_task;
 };
 
+/*
+ * The task that this thread is evaluating on behalf of run_chain_tasks(),
+ * if any; the tuples derived by Insert operators are saved rather than
+ * routed. Per-thread, since the tasks run on several threads at once.
+ */
+static __thread ChainTask *current_task = NULL;
+
 static void router_enqueue(C4Router *router, WorkItem *wi);
 static bool drain_queue(C4Router *router);
 
@@ -55,7 +140,15 @@ router_make(C4Runtime *c4)
     router->insert_buf = tuple_buf_make(4096, router->pool);
     router->delete_buf = tuple_buf_make(512, router->pool);
     router->routing_deletes = false;
+    router->update_buf = tuple_buf_make(512, router->pool);
+    router->update_pool = make_subpool(router->pool);
+    router->precommit_hooks = NULL;
     router->net_buf = tuple_buf_make(512, router->pool);
+    router->fixpoint_mode = C4_FIXPOINT_TUPLE;
+    router->round_buf = tuple_buf_make(4096, router->pool);
+    router->replan_pending = false;
+    router->workers = NULL;
+    router->workers_pool = NULL;
     s = apr_queue_create(&router->queue, 512, router->pool);
     if (s != APR_SUCCESS)
         FAIL_APR(s);
@@ -63,52 +156,766 @@ router_make(C4Runtime *c4)
     return router;
 }
 
+static apr_status_t
+router_workers_cleanup(void *data)
+{
+    C4Router *router = (C4Router *) data;
+    int i;
+
+    for (i = 0; i <= worker_pool_size(router->workers); i++)
+    {
+        ol_free(router->defer_bufs[i].tuples);
+        ol_free(router->defer_bufs[i].vals);
+    }
+
+    ol_free(router->tasks);
+    ol_free(router->parallel_tasks);
+    router->workers = NULL;
+    router->workers_pool = NULL;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Evaluate parallel-safe op chains using "nthreads" worker threads, in
+ * addition to the router thread. If "nthreads" is zero, the router thread
+ * evaluates every op chain itself.
+ */
+static void
+set_worker_threads(C4Router *router, int nthreads)
+{
+    int i;
+
+    if (router->workers_pool != NULL)
+        apr_pool_destroy(router->workers_pool);
+
+    if (nthreads == 0)
+        return;
+
+    router->workers_pool = make_subpool(router->pool);
+    router->workers = worker_pool_make(nthreads, router->workers_pool);
+    router->defer_bufs = apr_pcalloc(router->workers_pool,
+                                     (nthreads + 1) *
+                                     sizeof(*router->defer_bufs));
+    for (i = 0; i <= nthreads; i++)
+    {
+        DeferBuf *buf = &router->defer_bufs[i];
+
+        buf->size = TUPLE_BATCH_SIZE;
+        buf->tuples = ol_alloc(buf->size * sizeof(*buf->tuples));
+        buf->vals_size = TUPLE_BATCH_SIZE * 4;
+        buf->vals = ol_alloc(buf->vals_size * sizeof(*buf->vals));
+    }
+
+    router->ntasks = 0;
+    router->max_tasks = 16;
+    router->tasks = ol_alloc(router->max_tasks * sizeof(*router->tasks));
+    router->parallel_tasks = ol_alloc(router->max_tasks *
+                                      sizeof(*router->parallel_tasks));
+
+    apr_pool_cleanup_register(router->workers_pool, router,
+                              router_workers_cleanup, apr_pool_cleanup_null);
+}
+
+/*
+ * Save a batch of tuples derived by an Insert operator for "tbl_def" in the
+ * current task's DeferBuf.
+ */
+static void
+defer_batch(ChainTask *task, TupleBatch *batch, TableDef *tbl_def,
+            bool every_shard)
+{
+    DeferBuf *buf = task->out;
+    int i;
+
+    for (i = 0; i < batch->ntuples; i++)
+    {
+        DeferredTuple *dt;
+
+        if (buf->ntuples == buf->size)
+        {
+            buf->size *= 2;
+            buf->tuples = ol_realloc(buf->tuples,
+                                     buf->size * sizeof(*buf->tuples));
+        }
+
+        dt = &buf->tuples[buf->ntuples++];
+        dt->tbl_def = tbl_def;
+        dt->every_shard = every_shard;
+        dt->vals_off = buf->nvals;
+        if (batch->slot_vals == NULL)
+        {
+            dt->tuple = batch->tuples[i];
+            continue;
+        }
+
+        dt->tuple = NULL;
+        while (buf->nvals + batch->slot_width > buf->vals_size)
+        {
+            buf->vals_size *= 2;
+            buf->vals = ol_realloc(buf->vals,
+                                   buf->vals_size * sizeof(*buf->vals));
+        }
+
+        memcpy(buf->vals + buf->nvals,
+               batch->slot_vals + i * batch->slot_width,
+               batch->slot_width * sizeof(Datum));
+        buf->nvals += batch->slot_width;
+    }
+}
+
+/*
+ * Route a tuple derived by an Insert operator. If "tuple" is NULL, we make
+ * one from the column values in "vals". See router_insert_tuple() for
+ * "every_shard".
+ */
+static void
+route_derived_tuple(C4Router *router, TableDef *tbl_def, bool every_shard,
+                    Tuple *tuple, Datum *vals)
+{
+    bool made_tuple = false;
+
+    if (tuple == NULL)
+    {
+        tuple = tuple_make_copy(tbl_def->schema, vals);
+        made_tuple = true;
+    }
+
+    if (router->routing_deletes)
+        router_delete_tuple(router, tuple, tbl_def, every_shard);
+    else
+        router_insert_tuple(router, tuple, tbl_def, true, every_shard);
+
+    if (made_tuple)
+        tuple_unpin(tuple, tbl_def->schema);
+}
+
+/*
+ * Route a batch of tuples derived by an Insert operator for "tbl_def". The
+ * batch may hold virtual tuples. If this thread is evaluating a task for
+ * run_chain_tasks(), the tuples are saved and routed later.
+ */
+void
+router_route_batch(C4Router *router, TupleBatch *batch, TableDef *tbl_def,
+                   bool every_shard)
+{
+    int i;
+
+    if (current_task != NULL)
+    {
+        defer_batch(current_task, batch, tbl_def, every_shard);
+        return;
+    }
+
+    for (i = 0; i < batch->ntuples; i++)
+    {
+        if (batch->slot_vals == NULL)
+            route_derived_tuple(router, tbl_def, every_shard,
+                                batch->tuples[i], NULL);
+        else
+            route_derived_tuple(router, tbl_def, every_shard, NULL,
+                                batch->slot_vals + i * batch->slot_width);
+    }
+}
+
+/*
+ * Job function for the worker pool: evaluate parallel-safe tasks until
+ * none are left.
+ */
+static void
+chain_task_worker(void *arg, int worker_id)
+{
+    C4Router *router = (C4Router *) arg;
+    DeferBuf *buf = &router->defer_bufs[worker_id];
+
+    while (true)
+    {
+        int idx = (int) apr_atomic_inc32(&router->next_task);
+        ChainTask *task;
+        Operator *start;
+
+        if (idx >= router->nparallel)
+            break;
+
+        task = &router->tasks[router->parallel_tasks[idx]];
+        task->out = buf;
+        task->out_start = buf->ntuples;
+
+        current_task = task;
+        start = task->op_chain->chain_start;
+        start->invoke(start, task->batch);
+        current_task = NULL;
+
+        task->out_end = buf->ntuples;
+    }
+}
+
+/*
+ * Evaluate the op chain invocations collected for the batch being routed.
+ * The worker threads and the router thread divide the parallel-safe
+ * invocations among themselves, saving the tuples they derive. Then, in
+ * the order in which the chains were invoked, the router thread routes the
+ * saved tuples of each parallel-safe invocation and evaluates each of the
+ * other invocations. Hence the router sees the same derivations in the same
+ * order as if it had evaluated every chain itself. Tables are only modified
+ * between batches, so the scans in the workers see the same table contents
+ * that the router would.
+ */
+static void
+run_chain_tasks(C4Router *router)
+{
+    int i;
+
+    if (router->ntasks == 0)
+        return;
+
+    router->nparallel = 0;
+    for (i = 0; i < router->ntasks; i++)
+    {
+        router->tasks[i].out = NULL;
+        if (router->tasks[i].op_chain->parallel_safe)
+            router->parallel_tasks[router->nparallel++] = i;
+    }
+
+    /* Waking up the workers isn't worth it for a single chain */
+    if (router->nparallel > 1)
+    {
+        for (i = 0; i <= worker_pool_size(router->workers); i++)
+        {
+            router->defer_bufs[i].ntuples = 0;
+            router->defer_bufs[i].nvals = 0;
+        }
+
+        apr_atomic_set32(&router->next_task, 0);
+        worker_pool_run(router->workers, chain_task_worker, router);
+    }
+
+    for (i = 0; i < router->ntasks; i++)
+    {
+        ChainTask *task = &router->tasks[i];
+        Operator *start = task->op_chain->chain_start;
+        int j;
+
+        router->routing_deletes = task->routing_deletes;
+        if (task->out == NULL)
+        {
+            start->invoke(start, task->batch);
+            continue;
+        }
+
+        for (j = task->out_start; j < task->out_end; j++)
+        {
+            DeferredTuple *dt = &task->out->tuples[j];
+
+            route_derived_tuple(router, dt->tbl_def, dt->every_shard,
+                                dt->tuple, task->out->vals + dt->vals_off);
+        }
+    }
+
+    router->ntasks = 0;
+}
+
+static void
+invoke_op_chain(C4Router *router, OpChain *op_chain, TupleBatch *batch,
+                bool is_delete)
+{
+    Operator *start = op_chain->chain_start;
+    bool routing_deletes;
+
+    if (op_chain->anti_chain)
+        routing_deletes = !is_delete;
+    else
+        routing_deletes = is_delete;
+
+    /* With worker threads, the chain is evaluated by run_chain_tasks() */
+    if (router->workers != NULL)
+    {
+        ChainTask *task;
+
+        if (router->ntasks == router->max_tasks)
+        {
+            router->max_tasks *= 2;
+            router->tasks = ol_realloc(router->tasks,
+                                       router->max_tasks * sizeof(ChainTask));
+            router->parallel_tasks = ol_realloc(router->parallel_tasks,
+                                                router->max_tasks *
+                                                sizeof(int));
+        }
+
+        task = &router->tasks[router->ntasks++];
+        task->op_chain = op_chain;
+        task->batch = batch;
+        task->routing_deletes = routing_deletes;
+        return;
+    }
+
+    router->routing_deletes = routing_deletes;
+    start->invoke(start, batch);
+}
+
+/*
+ * Pass each tuple in the batch to the chains in the dispatch index entry for
+ * the tuple's value of the dispatch column, if any.
+ */
+static void
+dispatch_batch(C4Router *router, OpChainList *opc_list, TupleBatch *batch,
+               TableDef *tbl_def, bool is_delete)
+{
+    DispatchEntry *entries[TUPLE_BATCH_SIZE];
+    int nentries;
+    int i;
+    int j;
+
+    nentries = 0;
+    for (i = 0; i < batch->ntuples; i++)
+    {
+        Tuple *tuple = batch->tuples[i];
+        DispatchEntry *entry;
+        Datum val;
+
+        val = tuple_get_val(tuple, opc_list->dispatch_colno, tbl_def->schema);
+        entry = c4_hash_get(opc_list->dispatch_tbl, &val);
+        if (entry == NULL)
+            continue;
+
+        if (entry->batch.ntuples == 0)
+            entries[nentries++] = entry;
+        entry->batch.tuples[entry->batch.ntuples++] = tuple;
+    }
+
+    for (i = 0; i < nentries; i++)
+    {
+        DispatchEntry *entry = entries[i];
+
+        for (j = 0; j < entry->nchains; j++)
+            invoke_op_chain(router, entry->chains[j], &entry->batch,
+                            is_delete);
+    }
+
+    /* The chains must be evaluated before we reuse the entries' batches */
+    run_chain_tasks(router);
+    for (i = 0; i < nentries; i++)
+        entries[i]->batch.ntuples = 0;
+}
+
+/*
+ * Pass a batch of tuples that have been inserted into (or deleted from) their
+ * table to each of the op chains that have the table as their delta table.
+ */
+static void
+invoke_op_chains(C4Router *router, TupleBatch *batch, TableDef *tbl_def,
+                 bool is_delete)
+{
+    OpChainList *opc_list = tbl_def->op_chain_list;
+    OpChain *op_chain;
+
+    if (opc_list->dispatch_stale)
+        opchain_list_build_dispatch(opc_list, tbl_def->schema);
+
+    for (op_chain = opc_list->head; op_chain != NULL;
+         op_chain = op_chain->next)
+    {
+        /* Invoked via the chain whose operators it shares */
+        if (op_chain->prefix_chain != NULL)
+            continue;
+
+        /* Invoked via the dispatch index */
+        if (opc_list->dispatch_tbl != NULL &&
+            op_chain->dispatch_colno == opc_list->dispatch_colno)
+            continue;
+
+        invoke_op_chain(router, op_chain, batch, is_delete);
+    }
+
+    if (opc_list->dispatch_tbl != NULL)
+        dispatch_batch(router, opc_list, batch, tbl_def, is_delete);
+
+    run_chain_tasks(router);
+}
+
+/*
+ * Route a batch of tuples that belong to "tbl_def", and then release the
+ * tuple buffer's pins on them.
+ */
+static void
+flush_batch(C4Router *router, TupleBatch *batch, TableDef *tbl_def,
+            bool is_delete)
+{
+    int i;
+
+    if (batch->ntuples == 0)
+        return;
+
+    invoke_op_chains(router, batch, tbl_def, is_delete);
+
+    for (i = 0; i < batch->ntuples; i++)
+        tuple_unpin(batch->tuples[i], tbl_def->schema);
+
+    batch->ntuples = 0;
+}
+
+/*
+ * Account for a tuple that has been inserted into (or deleted from) the
+ * table. Once the table has doubled or halved in size since we last checked,
+ * the op chains are re-planned at the end of the fixpoint.
+ */
+static void
+update_table_stats(C4Router *router, TableDef *tbl_def, bool is_delete)
+{
+    TableStats *stats = &tbl_def->stats;
+
+    if (is_delete)
+    {
+        /* Tuples loaded from persistent storage aren't counted yet */
+        if (stats->ntuples > 0)
+            stats->ntuples--;
+    }
+    else
+        stats->ntuples++;
+
+    if (stats->ntuples < stats->replan_below ||
+        stats->ntuples > stats->replan_above)
+    {
+        stats->replan_below = stats->ntuples / 2;
+        stats->replan_above = Max(stats->ntuples * 2, TABLE_STATS_MIN_REPLAN);
+        router->replan_pending = true;
+    }
+}
+
+/*
+ * Apply a tuple shifted from a TupleBuf to its table. If that changes the
+ * table, add the tuple to "batch" so that it is routed when the batch is
+ * flushed; otherwise, just release the buffer's pin on it.
+ */
+static void
+apply_tuple(C4Router *router, TupleBatch *batch, Tuple *tuple,
+            TableDef *tbl_def, bool is_delete)
+{
+    Tuple *old_tuple;
+    bool route_tuple;
+
+#if 0
+    c4_log(router->c4, "%s: %s %s (=> %s)",
+           __func__, is_delete ? "delete" : "insert",
+           log_tuple(router->c4, tuple, tbl_def->schema),
+           tbl_def->name);
+#endif
+
+    old_tuple = NULL;
+    if (is_delete)
+        route_tuple = tbl_def->table->delete(tbl_def->table, tuple);
+    else
+        route_tuple = tbl_def->table->insert(tbl_def->table, tuple,
+                                             &old_tuple);
+
+    if (!route_tuple)
+    {
+        tuple_unpin(tuple, tbl_def->schema);
+        return;
+    }
+
+    /* Replacing a tuple with the same primary key doesn't change the size */
+    if (old_tuple == NULL)
+        update_table_stats(router, tbl_def, is_delete);
+
+    /*
+     * If the new tuple replaced an old tuple with the same primary key,
+     * route a delete for the old tuple before routing the insert.
+     */
+    if (old_tuple != NULL)
+    {
+        TupleBatch old_batch;
+
+        flush_batch(router, batch, tbl_def, is_delete);
+        table_invoke_callbacks(old_tuple, tbl_def, true);
+        old_batch.ntuples = 1;
+        old_batch.slot_vals = NULL;
+        old_batch.tuples[0] = old_tuple;
+        flush_batch(router, &old_batch, tbl_def, true);
+    }
+
+    batch->tuples[batch->ntuples++] = tuple;
+}
+
+/*
+ * Add a tuple that has been deleted from its table to "del_batch", unless it
+ * was inserted by an earlier update in the same batch (e.g. an agg value
+ * that has changed twice): then the op chains need not see it at all, so we
+ * remove it from "ins_set", and flush_update_batch() drops it from the
+ * insert batch. Either way, the caller's pin on the tuple is consumed.
+ */
+static void
+add_deleted_tuple(TupleBatch *del_batch, rset_t *ins_set,
+                  Tuple *tuple, TableDef *tbl_def)
+{
+    unsigned int new_count;
+
+    if (rset_remove(ins_set, tuple, &new_count) != NULL)
+    {
+        tuple_unpin(tuple, tbl_def->schema);
+        return;
+    }
+
+    del_batch->tuples[del_batch->ntuples++] = tuple;
+}
+
+/*
+ * Apply an update that replaces "old_tuple" with "new_tuple" to their table,
+ * adding the tuples that the table no longer contains to "del_batch" and the
+ * new tuple (if the table didn't already contain it) to "ins_batch" and
+ * "ins_set". The old tuple is normally in the table, in which case its size
+ * is unchanged.
+ */
+static void
+apply_update(C4Router *router, TupleBatch *del_batch, TupleBatch *ins_batch,
+             rset_t *ins_set, Tuple *old_tuple, Tuple *new_tuple,
+             TableDef *tbl_def)
+{
+    AbstractTable *table = tbl_def->table;
+    Tuple *replaced;
+    bool deleted;
+    bool inserted;
+
+    deleted = table->delete(table, old_tuple);
+    inserted = table->insert(table, new_tuple, &replaced);
+
+    if (deleted)
+        add_deleted_tuple(del_batch, ins_set, old_tuple, tbl_def);
+    else
+        tuple_unpin(old_tuple, tbl_def->schema);
+
+    if (replaced != NULL)
+    {
+        table_invoke_callbacks(replaced, tbl_def, true);
+        add_deleted_tuple(del_batch, ins_set, replaced, tbl_def);
+    }
+
+    if (inserted)
+    {
+        ins_batch->tuples[ins_batch->ntuples++] = new_tuple;
+        (void) rset_add(ins_set, new_tuple);
+    }
+    else
+        tuple_unpin(new_tuple, tbl_def->schema);
+
+    if (inserted && replaced == NULL && !deleted)
+        update_table_stats(router, tbl_def, false);
+    else if (deleted && !(inserted && replaced == NULL))
+        update_table_stats(router, tbl_def, true);
+}
+
+/*
+ * Should the batch be routed now? If one of the table's op chains scans the
+ * table itself, each tuple must be routed before the next one is inserted,
+ * so that the scan doesn't see tuples inserted "after" it.
+ */
+#define batch_needs_flush(batch, tbl_def)                   \
+    (tuple_batch_is_full(batch) ||                          \
+     (tbl_def)->op_chain_list->scans_delta_tbl)
+
 /*
  * We route tuples from the buffer in a FIFO manner, but that is not necessarily
- * the only choice.
+ * the only choice. Consecutive tuples that belong to the same table are
+ * routed together as a batch.
  */
 static void
 route_tuple_buf(C4Router *router, TupleBuf *buf, bool is_delete)
 {
+    TupleBatch batch;
+    TableDef *batch_def;
+
+    batch.ntuples = 0;
+    batch.slot_vals = NULL;
+    batch_def = NULL;
+
     while (!tuple_buf_is_empty(buf))
     {
         Tuple *tuple;
         TableDef *tbl_def;
-        OpChain *op_chain;
-        bool route_tuple;
 
         tuple_buf_shift(buf, &tuple, &tbl_def);
 
-#if 0
-        c4_log(router->c4, "%s: %s %s (=> %s)",
-               __func__, is_delete ? "delete" : "insert",
-               log_tuple(router->c4, tuple, tbl_def->schema),
-               tbl_def->name);
-#endif
+        if (tbl_def != batch_def)
+        {
+            flush_batch(router, &batch, batch_def, is_delete);
+            batch_def = tbl_def;
+        }
+
+        apply_tuple(router, &batch, tuple, tbl_def, is_delete);
+
+        /*
+         * Routing the batch might add more tuples to the buffer, so we must
+         * flush before checking whether the buffer is empty.
+         */
+        if (batch_needs_flush(&batch, tbl_def) || tuple_buf_is_empty(buf))
+            flush_batch(router, &batch, tbl_def, is_delete);
+    }
+}
 
-        if (is_delete)
-            route_tuple = tbl_def->table->delete(tbl_def->table, tuple);
+/*
+ * Route a batch of updates to "tbl_def": first the deleted tuples, then the
+ * inserted ones. "ins_set" holds the inserted tuples that haven't been
+ * deleted again by a later update in the batch; the other tuples in
+ * "ins_batch" are dropped here. Afterwards, "ins_set" is empty again.
+ */
+static void
+flush_update_batch(C4Router *router, TupleBatch *del_batch,
+                   TupleBatch *ins_batch, rset_t *ins_set, TableDef *tbl_def)
+{
+    int nkept;
+    int i;
+
+    nkept = 0;
+    for (i = 0; i < ins_batch->ntuples; i++)
+    {
+        Tuple *tuple = ins_batch->tuples[i];
+        unsigned int new_count;
+
+        if (rset_lookup(ins_set, tuple) == tuple)
+        {
+            (void) rset_remove(ins_set, tuple, &new_count);
+            ins_batch->tuples[nkept++] = tuple;
+        }
         else
-            route_tuple = tbl_def->table->insert(tbl_def->table, tuple);
+            tuple_unpin(tuple, tbl_def->schema);
+    }
+    ins_batch->ntuples = nkept;
 
-        if (!route_tuple)
-            continue;
+    flush_batch(router, del_batch, tbl_def, true);
+    flush_batch(router, ins_batch, tbl_def, false);
+}
 
-        op_chain = tbl_def->op_chain_list->head;
-        while (op_chain != NULL)
+/*
+ * Route the updates in the update buffer, each of which is a pair of
+ * entries: the old tuple, followed by the new tuple that replaces it. The
+ * table applies each update in place; the op chains then see the old tuples
+ * of a batch of updates as deletions, followed by the new tuples as
+ * insertions.
+ *
+ * Only the table that the update was routed to sees it as an update. The op
+ * chains are invoked separately for the deletions and the insertions, and
+ * an Insert operator can't tell which of the tuples it derives from the
+ * deletions correspond to those it derives from the insertions, so it routes
+ * them as ordinary deletes and inserts.
+ */
+static void
+route_update_buf(C4Router *router)
+{
+    TupleBuf *buf = router->update_buf;
+    TupleBatch del_batch;
+    TupleBatch ins_batch;
+    rset_t *ins_set;
+    TableDef *batch_def;
+
+    del_batch.ntuples = 0;
+    del_batch.slot_vals = NULL;
+    ins_batch.ntuples = 0;
+    ins_batch.slot_vals = NULL;
+    ins_set = NULL;
+    batch_def = NULL;
+
+    while (!tuple_buf_is_empty(buf))
+    {
+        Tuple *old_tuple;
+        Tuple *new_tuple;
+        TableDef *tbl_def;
+
+        tuple_buf_shift(buf, &old_tuple, &tbl_def);
+        tuple_buf_shift(buf, &new_tuple, &tbl_def);
+
+        if (tbl_def != batch_def)
         {
-            Operator *start = op_chain->chain_start;
+            if (batch_def != NULL)
+                flush_update_batch(router, &del_batch, &ins_batch,
+                                   ins_set, batch_def);
+            ins_set = rset_make(router->update_pool, tbl_def->schema,
+                                tuple_hash_tbl, tuple_cmp_tbl);
+            batch_def = tbl_def;
+        }
 
-            if (op_chain->anti_chain)
-                router->routing_deletes = !is_delete;
-            else
-                router->routing_deletes = is_delete;
+        apply_update(router, &del_batch, &ins_batch, ins_set,
+                     old_tuple, new_tuple, tbl_def);
+
+        /* An update can add two tuples to the delete batch */
+        if (del_batch.ntuples >= TUPLE_BATCH_SIZE - 1 ||
+            batch_needs_flush(&ins_batch, tbl_def) ||
+            tuple_buf_is_empty(buf))
+            flush_update_batch(router, &del_batch, &ins_batch,
+                               ins_set, tbl_def);
+    }
+
+    if (ins_set != NULL)
+        apr_pool_clear(router->update_pool);
+}
+
+/*
+ * Set-at-a-time (semi-naive) routing: each round takes the tuples that are
+ * in the buffer when the round starts, and routes them one table at a time;
+ * tuples derived during the round are routed in the next round. Since all
+ * the tuples of a table are routed together, they form larger batches than
+ * with FIFO routing, where derivations for different tables are
+ * interleaved. Tables are still routed one after another, so that a join
+ * between two tables with deltas in the same round derives each result
+ * exactly once.
+ *
+ * Each table's delta still goes through the table's ordinary op chains, so
+ * a join probes the other tables once per delta tuple, as in FIFO routing;
+ * we don't evaluate joins set-at-a-time (e.g. by hashing a whole delta).
+ * Nor do rounds form larger batches than FIFO routing when a recursive rule
+ * derives fewer than TUPLE_BATCH_SIZE tuples per round: the FIFO buffer then
+ * holds the tuples of several rounds, which fill a whole batch.
+ *
+ * "live_buf" points at the router's insert or delete buffer; we swap it with
+ * the (empty) round buffer at the start of each round. Finding each table's
+ * tuples takes a pass over the round's tuples, which is cheap as long as
+ * few tables have deltas in a single round.
+ */
+static void
+route_tuple_rounds(C4Router *router, TupleBuf **live_buf, bool is_delete)
+{
+    while (!tuple_buf_is_empty(*live_buf))
+    {
+        TupleBuf *round_buf = *live_buf;
+        TupleBufEntry *entries;
+        int start;
+        int end;
+        int i;
+
+        *live_buf = router->round_buf;
+        router->round_buf = round_buf;
+
+        entries = round_buf->entries;
+        start = round_buf->start;
+        end = round_buf->end;
+        for (i = start; i < end; i++)
+        {
+            TableDef *tbl_def = entries[i].tbl_def;
+            TupleBatch batch;
+            int j;
+
+            /* Skip tuples whose table we've already routed */
+            if (tbl_def == NULL)
+                continue;
+
+            batch.ntuples = 0;
+            batch.slot_vals = NULL;
+            for (j = i; j < end; j++)
+            {
+                if (entries[j].tbl_def != tbl_def)
+                    continue;
 
-            start->invoke(start, tuple);
-            op_chain = op_chain->next;
+                apply_tuple(router, &batch, entries[j].tuple,
+                            tbl_def, is_delete);
+                entries[j].tbl_def = NULL;
+
+                if (batch_needs_flush(&batch, tbl_def))
+                    flush_batch(router, &batch, tbl_def, is_delete);
+            }
+
+            flush_batch(router, &batch, tbl_def, is_delete);
         }
 
-        tuple_unpin(tuple, tbl_def->schema);
+        tuple_buf_reset(round_buf);
     }
 }
 
@@ -116,27 +923,121 @@ route_tuple_buf(C4Router *router, TupleBuf *buf, bool is_delete)
 static bool
 has_pending_tuples(C4Router *router)
 {
-    return (!tuple_buf_is_empty(router->insert_buf) ||
+    return (router->precommit_hooks != NULL ||
+            !tuple_buf_is_empty(router->insert_buf) ||
+            !tuple_buf_is_empty(router->update_buf) ||
             !tuple_buf_is_empty(router->delete_buf) ||
             !tuple_buf_is_empty(router->net_buf));
 }
 #endif
 
+/*
+ * Re-plan every op chain whose join order was chosen using table
+ * statistics, replacing the chains whose join order changes.
+ */
+static void
+replan_op_chains(C4Router *router)
+{
+    apr_hash_index_t *hi;
+
+    for (hi = apr_hash_first(router->c4->tmp_pool, router->op_chain_tbl);
+         hi != NULL; hi = apr_hash_next(hi))
+    {
+        OpChainList *opc_list;
+        OpChain **link;
+
+        apr_hash_this(hi, NULL, NULL, (void **) &opc_list);
+        link = &opc_list->head;
+        while (*link != NULL)
+        {
+            OpChain *op_chain = *link;
+            OpChain *new_chain;
+
+            if (op_chain->rule == NULL ||
+                (new_chain = replan_op_chain(op_chain,
+                                             router->c4->tmp_pool)) == NULL)
+            {
+                link = &op_chain->next;
+                continue;
+            }
+
+            new_chain->next = op_chain->next;
+            *link = new_chain;
+            opc_list->dispatch_stale = true;
+            apr_pool_destroy(op_chain->pool);
+            link = &new_chain->next;
+        }
+    }
+
+    router->replan_pending = false;
+}
+
+/*
+ * Invoke the pre-commit hooks that have been added since we last did so.
+ * Returns false if there weren't any.
+ */
+static bool
+run_precommit_hooks(C4Router *router)
+{
+    RouterHook *hook;
+
+    hook = router->precommit_hooks;
+    if (hook == NULL)
+        return false;
+
+    /* Hooks may add themselves again, so detach the list first */
+    router->precommit_hooks = NULL;
+    while (hook != NULL)
+    {
+        RouterHook *next = hook->next;
+
+        hook->next = NULL;
+        hook->hook_f(hook->data);
+        hook = next;
+    }
+
+    return true;
+}
+
+/*
+ * Route tuples until no more derivations are possible. The router's
+ * fixpoint mode determines whether tuples are routed in FIFO order or in
+ * set-at-a-time rounds; the resulting table contents are the same. Once the
+ * buffers are empty, we invoke the pre-commit hooks, which may route more
+ * tuples.
+ */
 static void
 router_do_fixpoint(C4Router *router)
 {
     TupleBuf *net_buf = router->net_buf;
 
-    while (!tuple_buf_is_empty(router->insert_buf) ||
-           !tuple_buf_is_empty(router->delete_buf))
+    do
     {
-        route_tuple_buf(router, router->insert_buf, false);
-        route_tuple_buf(router, router->delete_buf, true);
-    }
+        while (!tuple_buf_is_empty(router->insert_buf) ||
+               !tuple_buf_is_empty(router->update_buf) ||
+               !tuple_buf_is_empty(router->delete_buf))
+        {
+            if (router->fixpoint_mode == C4_FIXPOINT_SET)
+            {
+                route_tuple_rounds(router, &router->insert_buf, false);
+                route_update_buf(router);
+                route_tuple_rounds(router, &router->delete_buf, true);
+            }
+            else
+            {
+                route_tuple_buf(router, router->insert_buf, false);
+                route_update_buf(router);
+                route_tuple_buf(router, router->delete_buf, true);
+            }
+        }
+    } while (run_precommit_hooks(router));
 
-    /* If we modified persistent storage, commit to disk */
+    /* If we modified persistent storage, write our changes and commit */
     if (router->c4->sql->xact_in_progress)
+    {
+        sqlite_table_apply_changes(router->c4->sql);
         sqlite_commit_xact(router->c4->sql);
+    }
 
     /* Fixpoint is now considered to be "complete" */
 
@@ -151,6 +1052,13 @@ router_do_fixpoint(C4Router *router)
         tuple_unpin(tuple, tbl_def->schema);
     }
 
+    /* Send the tuples that belong to other shards */
+    if (router->c4->shard->nshards > 1)
+        shard_flush(router->c4->shard);
+
+    if (router->replan_pending)
+        replan_op_chains(router);
+
     apr_pool_clear(router->c4->tmp_pool);
     /* Sending network messages should not cause more routing work */
     ASSERT(!has_pending_tuples(router));
@@ -167,11 +1075,18 @@ router_do_fixpoint(C4Router *router)
  * different addresses (due to multi-homing, IPv4 vs. IPv6, DNS aliases,
  * etc.). If we receive a network tuple that doesn't exactly match our local
  * node address, we can easily get into an infinite loop.
+ *
+ * If the runtime is sharded, "every_shard" says whether every shard
+ * computes the same tuple, in which case only the shard that owns it keeps
+ * it; otherwise, the tuple is sent to the shards that need it (see
+ * shard_route_tuple()).
  */
 void
 router_insert_tuple(C4Router *router, Tuple *tuple, TableDef *tbl_def,
-                    bool check_remote)
+                    bool check_remote, bool every_shard)
 {
+    C4Shard *shard = router->c4->shard;
+
 #if 0
     c4_log(router->c4, "%s: %s (=> %s)",
            __func__, log_tuple(router->c4, tuple, tbl_def->schema),
@@ -180,27 +1095,92 @@ router_insert_tuple(C4Router *router, Tuple *tuple, TableDef *tbl_def,
 
     if (check_remote && tuple_is_remote(tuple, tbl_def, router->c4))
     {
-        tuple_buf_push(router->net_buf, tuple, tbl_def);
+        /* Only one shard sends a tuple that they all computed */
+        if (!every_shard || shard->id == 0)
+            tuple_buf_push(router->net_buf, tuple, tbl_def);
         return;
     }
 
+    if (shard->nshards > 1 &&
+        !shard_route_tuple(shard, tuple, tbl_def, every_shard, false))
+        return;
+
     table_invoke_callbacks(tuple, tbl_def, false);
     router_enqueue_internal(router, tuple, tbl_def);
 }
 
 void
-router_delete_tuple(C4Router *router, Tuple *tuple, TableDef *tbl_def)
+router_delete_tuple(C4Router *router, Tuple *tuple, TableDef *tbl_def,
+                    bool every_shard)
 {
+    C4Shard *shard = router->c4->shard;
+
 #if 0
     c4_log(router->c4, "%s: %s (=> %s)",
            __func__, log_tuple(router->c4, tuple, tbl_def->schema),
            tbl_def->name);
 #endif
 
+    if (shard->nshards > 1 &&
+        !shard_route_tuple(shard, tuple, tbl_def, every_shard, true))
+        return;
+
     table_invoke_callbacks(tuple, tbl_def, true);
     tuple_buf_push(router->delete_buf, tuple, tbl_def);
 }
 
+/*
+ * Route an update that replaces "old_tuple" with "new_tuple" in the given
+ * table, such as a change to the value of an aggregate. This is equivalent
+ * to deleting the old tuple and inserting the new one, but the table applies
+ * both at once; see route_update_buf(). The arguments are as for
+ * router_insert_tuple(). A remote tuple, or an update whose tuples don't
+ * both belong to this shard, is routed as a separate delete and insert.
+ */
+void
+router_update_tuple(C4Router *router, Tuple *old_tuple, Tuple *new_tuple,
+                    TableDef *tbl_def, bool check_remote, bool every_shard)
+{
+    C4Shard *shard = router->c4->shard;
+
+    if (check_remote && tuple_is_remote(new_tuple, tbl_def, router->c4))
+    {
+        router_delete_tuple(router, old_tuple, tbl_def, every_shard);
+        router_insert_tuple(router, new_tuple, tbl_def, true, every_shard);
+        return;
+    }
+
+    if (shard->nshards > 1)
+    {
+        bool keep_old;
+        bool keep_new;
+
+        keep_old = shard_route_tuple(shard, old_tuple, tbl_def,
+                                     every_shard, true);
+        keep_new = shard_route_tuple(shard, new_tuple, tbl_def,
+                                     every_shard, false);
+        if (!keep_old || !keep_new)
+        {
+            if (keep_old)
+            {
+                table_invoke_callbacks(old_tuple, tbl_def, true);
+                tuple_buf_push(router->delete_buf, old_tuple, tbl_def);
+            }
+            if (keep_new)
+            {
+                table_invoke_callbacks(new_tuple, tbl_def, false);
+                router_enqueue_internal(router, new_tuple, tbl_def);
+            }
+            return;
+        }
+    }
+
+    table_invoke_callbacks(old_tuple, tbl_def, true);
+    table_invoke_callbacks(new_tuple, tbl_def, false);
+    tuple_buf_push(router->update_buf, old_tuple, tbl_def);
+    tuple_buf_push(router->update_buf, new_tuple, tbl_def);
+}
+
 static void
 route_program(C4Router *router, const char *src)
 {
@@ -213,6 +1193,23 @@ route_program(C4Router *router, const char *src)
     install_plan(plan, c4->tmp_pool, c4);
 }
 
+/*
+ * Route the tuples that other shards have sent us. The messages are done
+ * once we have reached a fixpoint.
+ */
+static void
+route_shard_msgs(C4Router *router)
+{
+    int nmsgs;
+
+    nmsgs = shard_recv(router->c4->shard);
+    if (nmsgs > 0)
+    {
+        router_do_fixpoint(router);
+        shard_recv_done(router->c4->shard, nmsgs);
+    }
+}
+
 void
 router_main_loop(C4Router *router)
 {
@@ -224,6 +1221,8 @@ router_main_loop(C4Router *router)
         if (timer_poll(router->c4->timer))
             router_do_fixpoint(router);
 
+        route_shard_msgs(router);
+
         timeout = timer_get_sleep_time(router->c4->timer);
         if (network_poll(router->c4->net, timeout))
             router_do_fixpoint(router);
@@ -259,15 +1258,31 @@ drain_queue(C4Router *router)
         {
             case WI_PROGRAM:
                 route_program(router, wi->program_src);
+                /* Don't evaluate the program until every shard has it */
+                shard_barrier(router->c4->shard);
                 break;
 
             case WI_DUMP_TABLE:
-                dump_table(router->c4, wi->tbl_name, wi->buf);
+                if (shard_reports_table(router->c4->shard,
+                                        cat_get_table(router->c4->cat,
+                                                      wi->tbl_name)))
+                    dump_table(router->c4, wi->tbl_name, wi->buf);
                 break;
 
             case WI_CALLBACK:
-                cat_register_callback(router->c4->cat, wi->cb_tbl_name,
-                                      wi->cb_func, wi->cb_data);
+                if (shard_reports_table(router->c4->shard,
+                                        cat_get_table(router->c4->cat,
+                                                      wi->cb_tbl_name)))
+                    cat_register_callback(router->c4->cat, wi->cb_tbl_name,
+                                          wi->cb_func, wi->cb_data);
+                break;
+
+            case WI_FIXPOINT_MODE:
+                router->fixpoint_mode = wi->fixpoint_mode;
+                break;
+
+            case WI_WORKER_THREADS:
+                set_worker_threads(router, wi->worker_threads);
                 break;
 
             case WI_SHUTDOWN:
@@ -292,6 +1307,16 @@ runtime_enqueue_work(C4Runtime *c4, WorkItem *wi)
     thread_sync_wait(wi->sync);
 }
 
+/*
+ * Like runtime_enqueue_work(), but don't wait for the runtime to process
+ * the WorkItem: the caller must call thread_sync_wait() on "wi->sync".
+ */
+void
+runtime_post_work(C4Runtime *c4, WorkItem *wi)
+{
+    router_enqueue(c4->router, wi);
+}
+
 /*
  * Enqueue a new WorkItem to be routed. The WorkItem will be routed in some
  * subsequent fixpoint. WorkItems are routed in the order in which they are
@@ -362,3 +1387,14 @@ router_is_deleting(C4Router *router)
 {
     return router->routing_deletes;
 }
+
+/*
+ * Invoke "hook" before the current fixpoint completes. A hook is invoked
+ * once per call; it must not be added again until it has been invoked.
+ */
+void
+router_add_precommit_hook(C4Router *router, RouterHook *hook)
+{
+    hook->next = router->precommit_hooks;
+    router->precommit_hooks = hook;
+}
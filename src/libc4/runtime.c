@@ -2,6 +2,7 @@
 #include "net/network.h"
 #include "router.h"
 #include "runtime.h"
+#include "shard.h"
 #include "storage/sqlite.h"
 #include "timer.h"
 #include "types/catalog.h"
@@ -68,11 +69,12 @@ get_c4_base_dir(int port, apr_pool_t *pool, apr_pool_t *tmp_pool)
 }
 
 static C4Runtime *
-c4_runtime_make(int port)
+c4_runtime_make(int port, C4Shard *shard)
 {
     apr_status_t s;
     apr_pool_t *pool;
     C4Runtime *c4;
+    int addr_port;
 
     s = apr_pool_create(&pool, NULL);
     if (s != APR_SUCCESS)
@@ -88,8 +90,18 @@ c4_runtime_make(int port)
     c4->sql = sqlite_init(c4);
     c4->timer = timer_make(c4);
     c4->tpool_mgr = tpool_mgr_make(c4->pool);
+    c4->shard = shard;
     c4->port = network_get_port(c4->net);
-    c4->local_addr = get_local_addr(c4->port, c4->tmp_pool);
+
+    /*
+     * Tuples addressed to this node are local to each of its shards, so
+     * every shard uses the address of shard 0 (which is started first).
+     */
+    if (shard->id == 0)
+        addr_port = c4->port;
+    else
+        addr_port = shard_set_get(shard->set, 0)->c4->port;
+    c4->local_addr = get_local_addr(addr_port, c4->tmp_pool);
     c4->base_dir = get_c4_base_dir(c4->port, c4->pool, c4->tmp_pool);
 
     return c4;
@@ -104,6 +116,7 @@ typedef struct RuntimeInitData
 {
     /* Input data */
     int port;
+    C4Shard *shard;
     C4ThreadSync *thread_sync;
 
     /* Output data */
@@ -116,7 +129,7 @@ typedef struct RuntimeInitData
  * client-provided pool; the runtime itself uses a distinct top-level APR pool.
  */
 C4Runtime *
-c4_runtime_start(int port, C4ThreadSync *thread_sync,
+c4_runtime_start(int port, C4Shard *shard, C4ThreadSync *thread_sync,
                  apr_pool_t *pool, apr_thread_t **thread)
 {
     RuntimeInitData *init_data;
@@ -126,6 +139,7 @@ c4_runtime_start(int port, C4ThreadSync *thread_sync,
 
     init_data = ol_alloc0(sizeof(*init_data));
     init_data->port = port;
+    init_data->shard = shard;
     init_data->thread_sync = thread_sync;
 
     s = apr_threadattr_create(&thread_attr, pool);
@@ -150,7 +164,8 @@ runtime_thread_main(apr_thread_t *thread, void *data)
     RuntimeInitData *init_data = (RuntimeInitData *) data;
     C4Runtime *c4;
 
-    c4 = c4_runtime_make(init_data->port);
+    c4 = c4_runtime_make(init_data->port, init_data->shard);
+    init_data->shard->c4 = c4;
 
     /* Signal client that startup has completed */
     init_data->runtime = c4;
@@ -158,8 +173,13 @@ runtime_thread_main(apr_thread_t *thread, void *data)
 
     router_main_loop(c4->router);
 
-    /* Client initiated an orderly shutdown */
+    /*
+     * Client initiated an orderly shutdown. Other shards can send us
+     * messages until they have stopped routing tuples too.
+     */
+    shard_barrier(c4->shard);
     apr_pool_destroy(c4->pool);
+    string_slab_thread_exit();
     apr_thread_exit(thread, APR_SUCCESS);
 
     return NULL;        /* Return value ignored */
@@ -0,0 +1,431 @@
+#include <apr_atomic.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+
+#include "c4-internal.h"
+#include "net/network.h"
+#include "router.h"
+#include "shard.h"
+
+/*
+ * A batch of serialized tuples sent from one shard to another. Each tuple
+ * is preceded by the length and name of its table, and a flag that says
+ * whether it is to be deleted.
+ */
+typedef struct ShardMsg
+{
+    struct ShardMsg *next;
+    apr_size_t len;
+    char data[];
+} ShardMsg;
+
+struct C4ShardSet
+{
+    apr_pool_t *pool;
+    int nshards;
+    C4Shard *shards;
+
+    /*
+     * The number of messages that have been sent but not yet fully
+     * processed: a message is done once the receiving shard has reached a
+     * fixpoint after routing its tuples, by which time any messages sent as
+     * a result have been counted. Hence the shards are idle when the count
+     * is zero; shard_set_wait_idle() waits on "idle_cond" for that.
+     */
+    volatile apr_uint32_t nin_flight;
+
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *idle_cond;
+
+    /* shard_barrier() state; protected by "lock" */
+    apr_thread_cond_t *barrier_cond;
+    int barrier_count;
+    apr_uint32_t barrier_generation;
+};
+
+static void
+set_lock(C4ShardSet *set)
+{
+    apr_status_t s;
+
+    s = apr_thread_mutex_lock(set->lock);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+}
+
+static void
+set_unlock(C4ShardSet *set)
+{
+    apr_status_t s;
+
+    s = apr_thread_mutex_unlock(set->lock);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+}
+
+static void
+set_wait(C4ShardSet *set, apr_thread_cond_t *cond)
+{
+    apr_status_t s;
+
+    s = apr_thread_cond_wait(cond, set->lock);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+}
+
+/*
+ * Free the messages that were never received, because their shard had
+ * already shut down.
+ */
+static apr_status_t
+shard_set_cleanup(void *data)
+{
+    C4ShardSet *set = (C4ShardSet *) data;
+    int i;
+
+    for (i = 0; i < set->nshards; i++)
+    {
+        ShardMsg *msg = set->shards[i].inbox;
+
+        while (msg != NULL)
+        {
+            ShardMsg *next = msg->next;
+
+            ol_free(msg);
+            msg = next;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+C4ShardSet *
+shard_set_make(int nshards, apr_pool_t *pool)
+{
+    C4ShardSet *set;
+    apr_status_t s;
+    int i;
+
+    ASSERT(nshards > 0);
+
+    set = apr_pcalloc(pool, sizeof(*set));
+    set->pool = pool;
+    set->nshards = nshards;
+    set->shards = apr_pcalloc(pool, nshards * sizeof(*set->shards));
+    set->nin_flight = 0;
+    set->barrier_count = 0;
+    set->barrier_generation = 0;
+
+    s = apr_thread_mutex_create(&set->lock, APR_THREAD_MUTEX_DEFAULT, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    s = apr_thread_cond_create(&set->idle_cond, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    s = apr_thread_cond_create(&set->barrier_cond, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    for (i = 0; i < nshards; i++)
+    {
+        C4Shard *shard = &set->shards[i];
+        int j;
+
+        shard->id = i;
+        shard->nshards = nshards;
+        shard->set = set;
+        shard->c4 = NULL;
+        shard->inbox = NULL;
+        shard->out_bufs = apr_palloc(pool, nshards * sizeof(StrBuf *));
+        for (j = 0; j < nshards; j++)
+            shard->out_bufs[j] = (j == i) ? NULL : sbuf_make(pool);
+    }
+
+    apr_pool_cleanup_register(pool, set, shard_set_cleanup,
+                              apr_pool_cleanup_null);
+
+    return set;
+}
+
+C4Shard *
+shard_set_get(C4ShardSet *set, int shard_id)
+{
+    ASSERT(shard_id >= 0 && shard_id < set->nshards);
+    return &set->shards[shard_id];
+}
+
+/*
+ * Wait until every message sent between the shards has been processed.
+ * Called by the client after each of the shards has finished a request.
+ */
+void
+shard_set_wait_idle(C4ShardSet *set)
+{
+    set_lock(set);
+    while (apr_atomic_read32(&set->nin_flight) != 0)
+        set_wait(set, set->idle_cond);
+    set_unlock(set);
+}
+
+static int
+shard_get_owner(C4Shard *shard, Tuple *tuple, TableDef *tbl_def)
+{
+    Schema *schema = tbl_def->schema;
+    int colno = tbl_def->partition_col;
+    Datum val;
+
+    val = tuple_get_val(tuple, colno, schema);
+    return (int) (schema->hash_funcs[colno](val) % shard->nshards);
+}
+
+static void
+shard_send(C4Shard *shard, int dest, Tuple *tuple, TableDef *tbl_def,
+           bool is_delete)
+{
+    StrBuf *buf = shard->out_bufs[dest];
+    apr_size_t name_len = strlen(tbl_def->name);
+
+    sbuf_append_int16(buf, (apr_uint16_t) name_len);
+    sbuf_append_data(buf, tbl_def->name, name_len);
+    sbuf_append_char(buf, is_delete ? 1 : 0);
+    tuple_to_buf(tuple, tbl_def->schema, buf);
+}
+
+/*
+ * Decide which shards a tuple that this shard inserts into (or deletes
+ * from) "tbl_def" belongs to, and send it to the other shards that need
+ * it. If "every_shard" is true, every shard derives the same tuple (e.g.
+ * it is a fact, or it was derived from replicated tables only), so we just
+ * drop it if it belongs to another shard. Otherwise, it was derived from
+ * this shard's partitions: we send it to the shard that owns it, or to
+ * every other shard if the table is replicated. Returns true if the tuple
+ * should be applied to this shard.
+ */
+bool
+shard_route_tuple(C4Shard *shard, Tuple *tuple, TableDef *tbl_def,
+                  bool every_shard, bool is_delete)
+{
+    int owner;
+    int i;
+
+    if (tbl_def->partition_col == -1)
+    {
+        if (!every_shard)
+        {
+            for (i = 0; i < shard->nshards; i++)
+            {
+                if (i != shard->id)
+                    shard_send(shard, i, tuple, tbl_def, is_delete);
+            }
+        }
+
+        return true;
+    }
+
+    owner = shard_get_owner(shard, tuple, tbl_def);
+    if (owner == shard->id)
+        return true;
+
+    if (!every_shard)
+        shard_send(shard, owner, tuple, tbl_def, is_delete);
+
+    return false;
+}
+
+/*
+ * Should this shard include the contents of "tbl_def" when the client
+ * dumps the table, and invoke its callbacks? Each shard holds its own
+ * partition of a partitioned table, but only shard 0 reports the contents
+ * of replicated tables.
+ */
+bool
+shard_reports_table(C4Shard *shard, TableDef *tbl_def)
+{
+    return (shard->id == 0 || tbl_def->partition_col != -1);
+}
+
+/*
+ * Push "msg" onto the inbox of "dest". If the compare-and-swap fails, it
+ * returns the current head of the inbox, which we try again with.
+ */
+static void
+inbox_push(C4Shard *dest, ShardMsg *msg)
+{
+    void *head = NULL;
+
+    while (true)
+    {
+        void *old_head;
+
+        msg->next = head;
+        old_head = apr_atomic_casptr((volatile void **) &dest->inbox,
+                                     msg, head);
+        if (old_head == head)
+            break;
+
+        head = old_head;
+    }
+}
+
+/*
+ * Send the tuples for other shards that were derived in the fixpoint that
+ * just completed. Called by the router at the end of each fixpoint.
+ */
+void
+shard_flush(C4Shard *shard)
+{
+    int i;
+
+    for (i = 0; i < shard->nshards; i++)
+    {
+        StrBuf *buf = shard->out_bufs[i];
+        C4Shard *dest;
+        ShardMsg *msg;
+
+        if (buf == NULL || buf->len == 0)
+            continue;
+
+        msg = ol_alloc(sizeof(*msg) + buf->len);
+        msg->len = buf->len;
+        memcpy(msg->data, buf->data, buf->len);
+        sbuf_reset(buf);
+
+        dest = shard_set_get(shard->set, i);
+        apr_atomic_inc32(&shard->set->nin_flight);
+        inbox_push(dest, msg);
+        network_wakeup(dest->c4->net);
+    }
+}
+
+static void
+route_msg(C4Shard *shard, ShardMsg *msg)
+{
+    C4Runtime *c4 = shard->c4;
+    StrBuf buf;
+
+    /* Read the message in place */
+    buf.data = msg->data;
+    buf.len = msg->len;
+    buf.max_len = msg->len;
+    buf.pos = 0;
+
+    while (sbuf_data_avail(&buf) > 0)
+    {
+        apr_size_t name_len;
+        char *tbl_name;
+        bool is_delete;
+        TableDef *tbl_def;
+        Tuple *tuple;
+
+        name_len = sbuf_read_int16(&buf);
+        tbl_name = apr_pstrndup(c4->tmp_pool, buf.data + buf.pos, name_len);
+        buf.pos += name_len;
+        is_delete = (sbuf_read_char(&buf) != 0);
+
+        tbl_def = cat_get_table(c4->cat, tbl_name);
+        tuple = tuple_from_buf(&buf, tbl_def->schema);
+        if (is_delete)
+            router_delete_tuple(c4->router, tuple, tbl_def, true);
+        else
+            router_insert_tuple(c4->router, tuple, tbl_def, false, true);
+        tuple_unpin(tuple, tbl_def->schema);
+    }
+}
+
+/*
+ * Route the tuples that other shards have sent us, in the order in which
+ * they were sent. Returns the number of messages received; the caller
+ * should compute a fixpoint and then call shard_recv_done().
+ */
+int
+shard_recv(C4Shard *shard)
+{
+    ShardMsg *msg;
+    ShardMsg *rev;
+    int nmsgs;
+
+    msg = apr_atomic_xchgptr((volatile void **) &shard->inbox, NULL);
+
+    /* The inbox is most recent first */
+    rev = NULL;
+    while (msg != NULL)
+    {
+        ShardMsg *next = msg->next;
+
+        msg->next = rev;
+        rev = msg;
+        msg = next;
+    }
+
+    nmsgs = 0;
+    while (rev != NULL)
+    {
+        ShardMsg *next = rev->next;
+
+        route_msg(shard, rev);
+        ol_free(rev);
+        rev = next;
+        nmsgs++;
+    }
+
+    return nmsgs;
+}
+
+/*
+ * Mark "nmsgs" received messages as processed, once the fixpoint that
+ * routed them has completed.
+ */
+void
+shard_recv_done(C4Shard *shard, int nmsgs)
+{
+    C4ShardSet *set = shard->set;
+    bool is_idle = false;
+    int i;
+
+    for (i = 0; i < nmsgs; i++)
+    {
+        if (apr_atomic_dec32(&set->nin_flight) == 0)
+            is_idle = true;
+    }
+
+    if (is_idle)
+    {
+        set_lock(set);
+        (void) apr_thread_cond_broadcast(set->idle_cond);
+        set_unlock(set);
+    }
+}
+
+/*
+ * Wait until every shard of the set has called shard_barrier(). The router
+ * calls this after installing a program, so that no shard evaluates the
+ * program (and sends tuples to other shards) before every shard has
+ * installed it.
+ */
+void
+shard_barrier(C4Shard *shard)
+{
+    C4ShardSet *set = shard->set;
+    apr_uint32_t generation;
+
+    if (shard->nshards == 1)
+        return;
+
+    set_lock(set);
+    generation = set->barrier_generation;
+    set->barrier_count++;
+    if (set->barrier_count == set->nshards)
+    {
+        set->barrier_count = 0;
+        set->barrier_generation++;
+        (void) apr_thread_cond_broadcast(set->barrier_cond);
+    }
+    else
+    {
+        while (set->barrier_generation == generation)
+            set_wait(set, set->barrier_cond);
+    }
+    set_unlock(set);
+}
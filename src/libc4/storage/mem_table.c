@@ -1,6 +1,201 @@
+#include <string.h>
+
 #include "c4-internal.h"
 #include "operator/scancursor.h"
 #include "storage/mem_table.h"
+#include "util/hash_func.h"
+
+struct MemIndexEntry
+{
+    MemIndexEntry *next;
+    apr_uint32_t hash;
+    Tuple *tuple;
+};
+
+#define INDEX_INITIAL_MAX 15   /* Must be 2^n - 1 */
+
+static apr_uint32_t
+index_hash_key(MemIndex *idx, Datum *key, Schema *schema)
+{
+    apr_uint32_t result;
+    int i;
+
+    /* Should agree with the mixing function used by tuple_hash() */
+    result = 37;
+    for (i = 0; i < idx->nkeys; i++)
+    {
+        int colno = idx->key_cols[i];
+        apr_uint32_t h = (schema->hash_funcs[colno])(key[i]);
+
+        result = hash_combine(result, h);
+    }
+
+    return result;
+}
+
+static apr_uint32_t
+index_hash_tuple(MemIndex *idx, Tuple *t, Schema *schema)
+{
+    apr_uint32_t result;
+    int i;
+
+    result = 37;
+    for (i = 0; i < idx->nkeys; i++)
+    {
+        int colno = idx->key_cols[i];
+        Datum val = tuple_get_val(t, colno, schema);
+        apr_uint32_t h = (schema->hash_funcs[colno])(val);
+
+        result = hash_combine(result, h);
+    }
+
+    return result;
+}
+
+static void
+index_expand(MemIndex *idx)
+{
+    MemIndexEntry **new_buckets;
+    unsigned int new_max;
+    unsigned int i;
+
+    new_max = idx->max * 2 + 1;
+    new_buckets = ol_alloc0(sizeof(*new_buckets) * (new_max + 1));
+
+    for (i = 0; i <= idx->max; i++)
+    {
+        MemIndexEntry *entry = idx->buckets[i];
+
+        while (entry != NULL)
+        {
+            MemIndexEntry *next = entry->next;
+            unsigned int j = entry->hash & new_max;
+
+            entry->next = new_buckets[j];
+            new_buckets[j] = entry;
+            entry = next;
+        }
+    }
+
+    ol_free(idx->buckets);
+    idx->buckets = new_buckets;
+    idx->max = new_max;
+}
+
+static void
+index_insert(MemTable *tbl, MemIndex *idx, Tuple *t)
+{
+    MemIndexEntry *entry;
+    unsigned int i;
+
+    if (idx->free != NULL)
+    {
+        entry = idx->free;
+        idx->free = entry->next;
+    }
+    else
+        entry = apr_palloc(idx->pool, sizeof(*entry));
+
+    entry->hash = index_hash_tuple(idx, t, tbl->table.def->schema);
+    entry->tuple = t;
+
+    i = entry->hash & idx->max;
+    entry->next = idx->buckets[i];
+    idx->buckets[i] = entry;
+
+    idx->count++;
+    if (idx->count > idx->max)
+        index_expand(idx);
+}
+
+/*
+ * Remove the entry for "t" from the index. Note that "t" must be the
+ * instance of the tuple that is stored in the table, since we compare
+ * entries by pointer equality.
+ */
+static void
+index_remove(MemTable *tbl, MemIndex *idx, Tuple *t)
+{
+    MemIndexEntry **prev;
+    apr_uint32_t hash;
+
+    hash = index_hash_tuple(idx, t, tbl->table.def->schema);
+    prev = &idx->buckets[hash & idx->max];
+    while (*prev != NULL)
+    {
+        MemIndexEntry *entry = *prev;
+
+        if (entry->tuple == t)
+        {
+            *prev = entry->next;
+            entry->next = idx->free;
+            idx->free = entry;
+            idx->count--;
+            return;
+        }
+
+        prev = &entry->next;
+    }
+
+    ERROR("Failed to find tuple in index");
+}
+
+static MemIndex *
+index_make(MemTable *tbl, int nkeys, int *key_cols)
+{
+    apr_pool_t *pool;
+    MemIndex *idx;
+    rset_index_t *ri;
+
+    pool = make_subpool(tbl->table.pool);
+    idx = apr_pcalloc(pool, sizeof(*idx));
+    idx->table = tbl;
+    idx->pool = pool;
+    idx->nusers = 0;
+    idx->nkeys = nkeys;
+    idx->key_cols = apr_pmemdup(pool, key_cols, nkeys * sizeof(*key_cols));
+    idx->max = INDEX_INITIAL_MAX;
+    idx->buckets = ol_alloc0(sizeof(*idx->buckets) * (idx->max + 1));
+    idx->count = 0;
+    idx->free = NULL;
+
+    /* Add an entry for each tuple already in the table */
+    ri = rset_iter_make(pool, tbl->tuples);
+    while (rset_iter_next(ri))
+        index_insert(tbl, idx, rset_this(ri));
+
+    idx->next = tbl->indexes;
+    tbl->indexes = idx;
+
+    return idx;
+}
+
+/*
+ * Pool cleanup function for an index cursor. When the last cursor over an
+ * index goes away (e.g. because the op chain that owned it was replanned),
+ * drop the index, so that the table doesn't keep maintaining it.
+ */
+static apr_status_t
+index_cursor_cleanup(void *data)
+{
+    ScanCursor *scan = (ScanCursor *) data;
+    MemIndex *idx = scan->mem_index;
+    MemIndex **prev;
+
+    idx->nusers--;
+    if (idx->nusers > 0)
+        return APR_SUCCESS;
+
+    prev = &idx->table->indexes;
+    while (*prev != idx)
+        prev = &(*prev)->next;
+    *prev = idx->next;
+
+    ol_free(idx->buckets);
+    apr_pool_destroy(idx->pool);
+
+    return APR_SUCCESS;
+}
 
 /*
  * Unpin the tuples contained in this table.
@@ -10,6 +205,7 @@ mem_table_cleanup(AbstractTable *a_tbl)
 {
     MemTable *tbl = (MemTable *) a_tbl;
     rset_index_t *ri;
+    MemIndex *idx;
 
     ri = rset_iter_make(a_tbl->pool, tbl->tuples);
     while (rset_iter_next(ri))
@@ -19,18 +215,115 @@ mem_table_cleanup(AbstractTable *a_tbl)
         t = rset_this(ri);
         tuple_unpin(t, a_tbl->def->schema);
     }
+
+    for (idx = tbl->indexes; idx != NULL; idx = idx->next)
+        ol_free(idx->buckets);
+}
+
+/*
+ * Hash and equality functions for tables with a declared primary key: only
+ * the key columns are considered.
+ */
+static unsigned int
+tuple_key_hash(const void *key, void *data)
+{
+    Tuple *t = (Tuple *) key;
+    TableDef *def = (TableDef *) data;
+    apr_uint32_t result;
+    int i;
+
+    result = 37;
+    for (i = 0; i < def->nkeys; i++)
+    {
+        int colno = def->key_cols[i];
+        Datum val = tuple_get_val(t, colno, def->schema);
+
+        result = hash_combine(result, (def->schema->hash_funcs[colno])(val));
+    }
+
+    return result;
+}
+
+static bool
+tuple_key_cmp(const void *k1, const void *k2, void *data)
+{
+    Tuple *t1 = (Tuple *) k1;
+    Tuple *t2 = (Tuple *) k2;
+    TableDef *def = (TableDef *) data;
+    int i;
+
+    for (i = 0; i < def->nkeys; i++)
+    {
+        int colno = def->key_cols[i];
+        Datum val1 = tuple_get_val(t1, colno, def->schema);
+        Datum val2 = tuple_get_val(t2, colno, def->schema);
+
+        if ((def->schema->eq_funcs[colno])(val1, val2) == false)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Insert into a table with a declared primary key. If the table already
+ * contains an identical tuple, we just bump its refcount. If it contains a
+ * different tuple with the same key, the new tuple replaces it.
+ */
+static bool
+mem_table_upsert(MemTable *tbl, Tuple *t, Tuple **old_t)
+{
+    Schema *schema = tbl->table.def->schema;
+    Tuple *prev;
+    MemIndex *idx;
+
+    prev = rset_lookup(tbl->tuples, t);
+    if (prev != NULL)
+    {
+        if (tuple_equal(prev, t, schema))
+        {
+            (void) rset_add(tbl->tuples, t);
+            return false;
+        }
+
+        (void) rset_replace(tbl->tuples, t);
+        for (idx = tbl->indexes; idx != NULL; idx = idx->next)
+            index_remove(tbl, idx, prev);
+
+        /* Caller unpins the old tuple */
+        *old_t = prev;
+    }
+    else
+        (void) rset_add(tbl->tuples, t);
+
+    tuple_pin(t);
+    for (idx = tbl->indexes; idx != NULL; idx = idx->next)
+        index_insert(tbl, idx, t);
+
+    return true;
 }
 
 static bool
-mem_table_insert(AbstractTable *a_tbl, Tuple *t)
+mem_table_insert(AbstractTable *a_tbl, Tuple *t, Tuple **old_t)
 {
     MemTable *tbl = (MemTable *) a_tbl;
     bool is_new;
 
+    *old_t = NULL;
+    if (a_tbl->def->nkeys > 0)
+        return mem_table_upsert(tbl, t, old_t);
+
     is_new = rset_add(tbl->tuples, t);
     if (is_new)
+    {
+        MemIndex *idx;
+
         tuple_pin(t);
 
+        for (idx = tbl->indexes; idx != NULL; idx = idx->next)
+            index_insert(tbl, idx, t);
+    }
+
     return is_new;
 }
 
@@ -41,9 +334,25 @@ mem_table_delete(AbstractTable *a_tbl, Tuple *t)
     Tuple *old_t;
     unsigned int new_count;
 
+    /*
+     * If the table has a primary key, the tuple we find might only match the
+     * key of "t"; in that case, "t" is not in the table.
+     */
+    if (a_tbl->def->nkeys > 0)
+    {
+        old_t = rset_lookup(tbl->tuples, t);
+        if (old_t == NULL || !tuple_equal(old_t, t, a_tbl->def->schema))
+            return false;
+    }
+
     old_t = rset_remove(tbl->tuples, t, &new_count);
     if (old_t != NULL && new_count == 0)
     {
+        MemIndex *idx;
+
+        for (idx = tbl->indexes; idx != NULL; idx = idx->next)
+            index_remove(tbl, idx, old_t);
+
         tuple_unpin(old_t, a_tbl->def->schema);
         return true;
     }
@@ -68,16 +377,92 @@ mem_table_scan_make(AbstractTable *a_tbl, apr_pool_t *pool)
 static void
 mem_table_scan_reset(AbstractTable *a_tbl, ScanCursor *scan)
 {
-    rset_iter_reset(scan->rset_iter);
+    MemIndex *idx = scan->mem_index;
+
+    if (idx == NULL)
+    {
+        rset_iter_reset(scan->rset_iter);
+        return;
+    }
+
+    scan->index_hash = index_hash_key(idx, scan->key, a_tbl->def->schema);
+    scan->index_entry = idx->buckets[scan->index_hash & idx->max];
 }
 
 static Tuple *
 mem_table_scan_next(AbstractTable *a_tbl, ScanCursor *cur)
 {
-    if (!rset_iter_next(cur->rset_iter))
+    if (cur->mem_index == NULL)
+    {
+        if (!rset_iter_next(cur->rset_iter))
+            return NULL;
+
+        return rset_this(cur->rset_iter);
+    }
+
+    /*
+     * Return the next tuple in the bucket that has the same key hash. We
+     * don't compare the key values themselves: the caller is responsible for
+     * filtering out hash collisions.
+     */
+    while (cur->index_entry != NULL)
+    {
+        MemIndexEntry *entry = cur->index_entry;
+
+        cur->index_entry = entry->next;
+        if (entry->hash == cur->index_hash)
+            return entry->tuple;
+    }
+
+    return NULL;
+}
+
+/*
+ * Return a cursor over an index on the equality key columns, building the
+ * index if necessary. Indexes are shared by all the cursors that use the
+ * same key columns, and are dropped when the last such cursor's pool is
+ * destroyed. Range keys are ignored, since a hash index can't be
+ * used to evaluate them.
+ */
+static ScanCursor *
+mem_table_index_scan_make(AbstractTable *a_tbl, int nkeys, int *key_cols,
+                          AstOperKind *key_ops, apr_pool_t *pool)
+{
+    MemTable *tbl = (MemTable *) a_tbl;
+    MemIndex *idx;
+    ScanCursor *scan;
+    int neq;
+
+    /* Equality keys precede range keys */
+    neq = 0;
+    while (neq < nkeys && key_ops[neq] == AST_OP_EQ)
+        neq++;
+
+    if (neq == 0)
         return NULL;
 
-    return rset_this(cur->rset_iter);
+    for (idx = tbl->indexes; idx != NULL; idx = idx->next)
+    {
+        if (idx->nkeys == neq &&
+            memcmp(idx->key_cols, key_cols, neq * sizeof(*key_cols)) == 0)
+            break;
+    }
+
+    if (idx == NULL)
+        idx = index_make(tbl, neq, key_cols);
+
+    scan = apr_pcalloc(pool, sizeof(*scan));
+    scan->pool = pool;
+    scan->key = apr_pcalloc(pool, neq * sizeof(*scan->key));
+    scan->nkeys = neq;
+    scan->key_cols = idx->key_cols;
+    scan->mem_index = idx;
+
+    idx->nusers++;
+    apr_pool_cleanup_register(pool, scan, index_cursor_cleanup,
+                              apr_pool_cleanup_null);
+
+    return scan;
 }
 
 MemTable *
@@ -92,9 +477,14 @@ mem_table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool)
                                         mem_table_scan_make,
                                         mem_table_scan_reset,
                                         mem_table_scan_next,
+                                        mem_table_index_scan_make,
                                         pool);
-    tbl->tuples = rset_make(pool, def->schema,
-                            tuple_hash_tbl, tuple_cmp_tbl);
+    if (def->nkeys > 0)
+        tbl->tuples = rset_make(pool, def, tuple_key_hash, tuple_key_cmp);
+    else
+        tbl->tuples = rset_make(pool, def->schema,
+                                tuple_hash_tbl, tuple_cmp_tbl);
+    tbl->indexes = NULL;
 
     return tbl;
 }
@@ -0,0 +1,428 @@
+#include "c4-internal.h"
+#include "operator/scancursor.h"
+#include "storage/ordered_table.h"
+
+struct ordered_node
+{
+    RB_ENTRY(ordered_node) entry;
+    Tuple *tuple;               /* NULL if this is a search probe */
+    union
+    {
+        unsigned int refcount;
+        struct ordered_node *next_free;   /* Next free node, if on free list */
+    } v;
+};
+
+/*
+ * A search probe: a key for the first "nvals" sort columns. A probe never
+ * compares equal to a tuple: if the tuple's prefix is equal to "vals", the
+ * probe sorts before the tuple if "bias" is negative, and after it
+ * otherwise. Hence, RB_NFIND() returns the first tuple whose prefix is >=
+ * (negative bias) or > (positive bias) the probe.
+ */
+typedef struct OrderedProbe
+{
+    struct ordered_node node;   /* Must be first */
+    Datum *vals;
+    int nvals;
+    int bias;
+} OrderedProbe;
+
+/*
+ * The part of an index scan's keys that the table can use: equality keys
+ * for the first "neq" sort columns, and range keys on the next sort column.
+ * Key numbers are indexes into the cursor's "key" array. Each scan_reset
+ * fills in "vals" with the equality key values, followed by the lower bound
+ * (if any); "upper" holds the upper bound (if any).
+ */
+typedef struct OrderedRange
+{
+    int neq;
+    int *eq_keys;
+    int nrange;
+    int *range_keys;
+    AstOperKind *range_ops;
+    Datum *vals;
+    bool has_upper;
+    bool upper_inclusive;
+    Datum upper;
+} OrderedRange;
+
+static int
+ordered_tuple_cmp(OrderedTable *tbl, Tuple *t1, Tuple *t2)
+{
+    TableDef *def = tbl->table.def;
+    Schema *schema = def->schema;
+    int i;
+
+    for (i = 0; i < schema->len; i++)
+    {
+        int colno = def->order_cols[i];
+        int result;
+
+        result = (tbl->cmp_funcs[i])(tuple_get_val(t1, colno, schema),
+                                     tuple_get_val(t2, colno, schema));
+        if (result != 0)
+            return result;
+    }
+
+    return 0;
+}
+
+static int
+ordered_probe_cmp(OrderedTable *tbl, OrderedProbe *probe, Tuple *t)
+{
+    TableDef *def = tbl->table.def;
+    int i;
+
+    for (i = 0; i < probe->nvals; i++)
+    {
+        int colno = def->order_cols[i];
+        int result;
+
+        result = (tbl->cmp_funcs[i])(probe->vals[i],
+                                     tuple_get_val(t, colno, def->schema));
+        if (result != 0)
+            return result;
+    }
+
+    return probe->bias;
+}
+
+static int
+ordered_node_cmp(struct ordered_tree *tree, struct ordered_node *n1,
+                 struct ordered_node *n2)
+{
+    OrderedTable *tbl = tree->opaque;
+
+    /* Only the search key (the first argument) can be a probe */
+    if (n1->tuple == NULL)
+        return ordered_probe_cmp(tbl, (OrderedProbe *) n1, n2->tuple);
+
+    return ordered_tuple_cmp(tbl, n1->tuple, n2->tuple);
+}
+
+RB_GENERATE_STATIC(ordered_tree, ordered_node, entry, ordered_node_cmp)
+
+static struct ordered_node *
+ordered_node_alloc(OrderedTable *tbl)
+{
+    struct ordered_node *n;
+
+    if (tbl->free_head != NULL)
+    {
+        n = tbl->free_head;
+        tbl->free_head = n->v.next_free;
+    }
+    else
+        n = apr_palloc(tbl->table.pool, sizeof(*n));
+
+    return n;
+}
+
+static void
+ordered_node_free(OrderedTable *tbl, struct ordered_node *n)
+{
+    n->v.next_free = tbl->free_head;
+    tbl->free_head = n;
+}
+
+/*
+ * Unpin the tuples contained in this table.
+ */
+static void
+ordered_table_cleanup(AbstractTable *a_tbl)
+{
+    OrderedTable *tbl = (OrderedTable *) a_tbl;
+    struct ordered_node *n;
+
+    RB_FOREACH(n, ordered_tree, &tbl->tree)
+        tuple_unpin(n->tuple, a_tbl->def->schema);
+}
+
+static bool
+ordered_table_insert(AbstractTable *a_tbl, Tuple *t, Tuple **old_t)
+{
+    OrderedTable *tbl = (OrderedTable *) a_tbl;
+    struct ordered_node *n;
+    struct ordered_node *prev;
+
+    *old_t = NULL;
+    n = ordered_node_alloc(tbl);
+    n->tuple = t;
+
+    prev = RB_INSERT(ordered_tree, &tbl->tree, n);
+    if (prev != NULL)
+    {
+        /* The table already contains an identical tuple */
+        prev->v.refcount++;
+        ordered_node_free(tbl, n);
+        return false;
+    }
+
+    n->v.refcount = 1;
+    tuple_pin(t);
+    return true;
+}
+
+static bool
+ordered_table_delete(AbstractTable *a_tbl, Tuple *t)
+{
+    OrderedTable *tbl = (OrderedTable *) a_tbl;
+    struct ordered_node find;
+    struct ordered_node *n;
+
+    find.tuple = t;
+    n = RB_FIND(ordered_tree, &tbl->tree, &find);
+    if (n == NULL)
+        return false;
+
+    n->v.refcount--;
+    if (n->v.refcount > 0)
+        return false;
+
+    RB_REMOVE(ordered_tree, &tbl->tree, n);
+    tuple_unpin(n->tuple, a_tbl->def->schema);
+    ordered_node_free(tbl, n);
+    return true;
+}
+
+static ScanCursor *
+ordered_table_scan_make(__unused AbstractTable *a_tbl, apr_pool_t *pool)
+{
+    ScanCursor *scan;
+
+    scan = apr_pcalloc(pool, sizeof(*scan));
+    scan->pool = pool;
+    scan->ordered_range = NULL;
+
+    return scan;
+}
+
+/*
+ * Compute the bounds of the range scan from the cursor's probe key. If
+ * there are several lower or upper bounds, we use the tightest ones.
+ */
+static void
+ordered_table_scan_reset(AbstractTable *a_tbl, ScanCursor *scan)
+{
+    OrderedTable *tbl = (OrderedTable *) a_tbl;
+    OrderedRange *range = scan->ordered_range;
+    OrderedProbe probe;
+    datum_cmp_func cmp_func;
+    int i;
+
+    if (range == NULL)
+    {
+        scan->ordered_node = RB_MIN(ordered_tree, &tbl->tree);
+        return;
+    }
+
+    for (i = 0; i < range->neq; i++)
+        range->vals[i] = scan->key[range->eq_keys[i]];
+
+    probe.node.tuple = NULL;
+    probe.vals = range->vals;
+    probe.nvals = range->neq;
+    probe.bias = -1;
+    range->has_upper = false;
+
+    for (i = 0; i < range->nrange; i++)
+    {
+        AstOperKind op_kind = range->range_ops[i];
+        Datum val = scan->key[range->range_keys[i]];
+        bool inclusive;
+        int c;
+
+        cmp_func = tbl->cmp_funcs[range->neq];
+        switch (op_kind)
+        {
+            case AST_OP_GT:
+            case AST_OP_GTE:
+                inclusive = (op_kind == AST_OP_GTE);
+                if (probe.nvals > range->neq)
+                {
+                    c = cmp_func(val, range->vals[range->neq]);
+                    if (c < 0 || (c == 0 && inclusive))
+                        break;
+                }
+
+                range->vals[range->neq] = val;
+                probe.nvals = range->neq + 1;
+                probe.bias = inclusive ? -1 : 1;
+                break;
+
+            case AST_OP_LT:
+            case AST_OP_LTE:
+                inclusive = (op_kind == AST_OP_LTE);
+                if (range->has_upper)
+                {
+                    c = cmp_func(val, range->upper);
+                    if (c > 0 || (c == 0 && inclusive))
+                        break;
+                }
+
+                range->upper = val;
+                range->upper_inclusive = inclusive;
+                range->has_upper = true;
+                break;
+
+            default:
+                ERROR("Unexpected range key op: %d", (int) op_kind);
+        }
+    }
+
+    scan->ordered_node = RB_NFIND(ordered_tree, &tbl->tree, &probe.node);
+}
+
+/*
+ * Does the tuple at the current position of the range scan fall within the
+ * range? Since we start at the range's lower bound and walk forward, we
+ * only need to check the equality keys and the upper bound.
+ */
+static bool
+ordered_range_contains(OrderedTable *tbl, OrderedRange *range, Tuple *t)
+{
+    TableDef *def = tbl->table.def;
+    int i;
+
+    for (i = 0; i < range->neq; i++)
+    {
+        Datum val = tuple_get_val(t, def->order_cols[i], def->schema);
+
+        if ((tbl->cmp_funcs[i])(range->vals[i], val) != 0)
+            return false;
+    }
+
+    if (range->has_upper)
+    {
+        Datum val = tuple_get_val(t, def->order_cols[range->neq], def->schema);
+        int c = (tbl->cmp_funcs[range->neq])(val, range->upper);
+
+        if (c > 0 || (c == 0 && !range->upper_inclusive))
+            return false;
+    }
+
+    return true;
+}
+
+static Tuple *
+ordered_table_scan_next(AbstractTable *a_tbl, ScanCursor *cur)
+{
+    OrderedTable *tbl = (OrderedTable *) a_tbl;
+    struct ordered_node *n = cur->ordered_node;
+
+    if (n == NULL)
+        return NULL;
+
+    if (cur->ordered_range != NULL &&
+        !ordered_range_contains(tbl, cur->ordered_range, n->tuple))
+    {
+        cur->ordered_node = NULL;
+        return NULL;
+    }
+
+    cur->ordered_node = RB_NEXT(ordered_tree, &tbl->tree, n);
+    return n->tuple;
+}
+
+/*
+ * Return a cursor that scans the range of the table selected by the keys:
+ * we use equality keys on the longest possible prefix of the sort columns,
+ * and range keys on the sort column that follows that prefix. The cursor
+ * uses the shortest prefix of the keys that includes all such keys. If no
+ * keys are usable, we return NULL.
+ */
+static ScanCursor *
+ordered_table_index_scan_make(AbstractTable *a_tbl, int nkeys, int *key_cols,
+                              AstOperKind *key_ops, apr_pool_t *pool)
+{
+    TableDef *def = a_tbl->def;
+    int ncols = def->schema->len;
+    OrderedRange *range;
+    ScanCursor *scan;
+    int nused;
+    int i;
+
+    range = apr_pcalloc(pool, sizeof(*range));
+    range->eq_keys = apr_palloc(pool, ncols * sizeof(*range->eq_keys));
+    range->range_keys = apr_palloc(pool, nkeys * sizeof(*range->range_keys));
+    range->range_ops = apr_palloc(pool, nkeys * sizeof(*range->range_ops));
+    range->vals = apr_palloc(pool, ncols * sizeof(*range->vals));
+
+    nused = 0;
+    while (range->neq < ncols)
+    {
+        int colno = def->order_cols[range->neq];
+
+        for (i = 0; i < nkeys; i++)
+        {
+            if (key_ops[i] == AST_OP_EQ && key_cols[i] == colno)
+                break;
+        }
+
+        if (i == nkeys)
+            break;
+
+        range->eq_keys[range->neq++] = i;
+        nused = Max(nused, i + 1);
+    }
+
+    if (range->neq < ncols)
+    {
+        int colno = def->order_cols[range->neq];
+
+        for (i = 0; i < nkeys; i++)
+        {
+            if (key_ops[i] == AST_OP_EQ || key_cols[i] != colno)
+                continue;
+
+            range->range_keys[range->nrange] = i;
+            range->range_ops[range->nrange] = key_ops[i];
+            range->nrange++;
+            nused = Max(nused, i + 1);
+        }
+    }
+
+    if (nused == 0)
+        return NULL;
+
+    scan = apr_pcalloc(pool, sizeof(*scan));
+    scan->pool = pool;
+    scan->key = apr_pcalloc(pool, nused * sizeof(*scan->key));
+    scan->nkeys = nused;
+    scan->key_cols = apr_pmemdup(pool, key_cols, nused * sizeof(*key_cols));
+    scan->ordered_range = range;
+
+    return scan;
+}
+
+OrderedTable *
+ordered_table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool)
+{
+    OrderedTable *tbl;
+    int i;
+
+    tbl = (OrderedTable *) table_make_super(sizeof(*tbl), def, c4,
+                                            ordered_table_insert,
+                                            ordered_table_delete,
+                                            ordered_table_cleanup,
+                                            ordered_table_scan_make,
+                                            ordered_table_scan_reset,
+                                            ordered_table_scan_next,
+                                            ordered_table_index_scan_make,
+                                            pool);
+    tbl->cmp_funcs = apr_palloc(pool, def->schema->len *
+                                sizeof(*tbl->cmp_funcs));
+    for (i = 0; i < def->schema->len; i++)
+    {
+        DataType type = schema_get_type(def->schema, def->order_cols[i]);
+
+        tbl->cmp_funcs[i] = type_get_cmp_func(type);
+    }
+
+    tbl->free_head = NULL;
+    RB_INIT(&tbl->tree, tbl);
+
+    return tbl;
+}
@@ -14,6 +14,7 @@ sqlite_init(C4Runtime *c4)
     sql = apr_palloc(c4->pool, sizeof(*sql));
     sql->c4 = c4;
     sql->xact_in_progress = false;
+    sql->dirty_tables = NULL;
 
     db_fname = apr_pstrcat(c4->tmp_pool, c4->base_dir, "/", "sqlite.db", NULL);
     if ((res = sqlite3_open(db_fname, &sql->db)) != 0)
@@ -4,6 +4,9 @@
 #include "storage/sqlite.h"
 #include "storage/sqlite_table.h"
 
+/* Max number of rows inserted by a single INSERT statement */
+#define SQLITE_INSERT_BATCH     64
+
 static void
 sqlite_table_create_sql(SQLiteTable *tbl)
 {
@@ -59,113 +62,427 @@ sqlite_table_create_sql(SQLiteTable *tbl)
 }
 
 /*
- * Close the DB connection. MemTable unpins tuples here. What do we do?
+ * Drop the SQLite table. Note that any pending changes have already been
+ * applied at the end of the previous fixpoint.
  */
 static void
 sqlite_table_cleanup(AbstractTable *a_tbl)
 {
+    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
+    rset_index_t *ri;
     char stmt[1024];
 
+    if (tbl->dirty)
+    {
+        SQLiteTable **prev = &a_tbl->c4->sql->dirty_tables;
+
+        while (*prev != tbl)
+            prev = &(*prev)->next_dirty;
+        *prev = tbl->next_dirty;
+    }
+
     snprintf(stmt, sizeof(stmt), "DROP TABLE %s;", a_tbl->def->name);
     sqlite_exec_sql(a_tbl->c4->sql, stmt);
+
+    ri = rset_iter_make(a_tbl->pool, tbl->rows);
+    while (rset_iter_next(ri))
+        tuple_unpin(rset_this(ri), a_tbl->def->schema);
+}
+
+static void
+sqlite_bind_datum(sqlite3_stmt *stmt, int idx, Datum val, DataType type)
+{
+    switch (type)
+    {
+        case TYPE_BOOL:
+            sqlite3_bind_int(stmt, idx, val.b);
+            break;
+        case TYPE_CHAR:
+            sqlite3_bind_int(stmt, idx, val.c);
+            break;
+        case TYPE_INT:
+            sqlite3_bind_int64(stmt, idx, val.i8);
+            break;
+        case TYPE_DOUBLE:
+            sqlite3_bind_double(stmt, idx, val.d8);
+            break;
+        case TYPE_STRING:
+            /* An inline string is stored in "val", so SQLite must copy it */
+            sqlite3_bind_text(stmt, idx, string_data(&val), string_len(val),
+                              string_is_inline(val) ?
+                              SQLITE_TRANSIENT : SQLITE_STATIC);
+            break;
+
+        case TYPE_INVALID:
+            ERROR("Invalid data type: TYPE_INVALID");
+        default:
+            ERROR("Unexpected data type: %uc", type);
+    }
 }
 
 /*
- * Insert the tuple into this table. Returns "true" if the tuple was added;
- * returns false if the insert was a no-op because the tuple is already
- * contained by this table.
+ * Bind the columns of "t" to the parameters of "stmt", starting at parameter
+ * number "first_param".
  */
-static bool
-sqlite_table_insert(AbstractTable *a_tbl, Tuple *t)
+static void
+sqlite_bind_tuple(sqlite3_stmt *stmt, int first_param, Tuple *t,
+                  Schema *schema)
+{
+    int i;
+
+    for (i = 0; i < schema->len; i++)
+        sqlite_bind_datum(stmt, first_param + i, tuple_get_val(t, i, schema),
+                          schema_get_type(schema, i));
+}
+
+/*
+ * Append a WHERE clause that matches every column of the table (i.e. the
+ * table's primary key) to "stmt".
+ */
+static void
+sqlite_append_pkey_qual(StrBuf *stmt, Schema *schema)
 {
-    /* take prepared SQL statement, use Schema to walk the tuple for insert constants. */
-    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
-    TableDef *tbl_def = a_tbl->def;
-    DataType *types = tbl_def->schema->types;
-    SQLiteState *sql = a_tbl->c4->sql;
     int i;
-    int res;
 
-    if (tbl->insert_stmt == NULL)
+    sbuf_append(stmt, " WHERE ");
+    for (i = 0; i < schema->len; i++)
     {
-        /* Prepare an insert statement */
-        char *param_str;
-        char stmt[1024];
-        int stmt_len;
-
-        param_str = schema_to_sql_param_str(a_tbl->def->schema,
-                                            a_tbl->c4->tmp_pool);
-
-        /* XXX: need to escape SQL string */
-        stmt_len = snprintf(stmt, sizeof(stmt), "INSERT INTO %s VALUES (%s);",
-                            tbl_def->name, param_str);
-        tbl->insert_stmt = sqlite_pstmt_make(sql, stmt, stmt_len, a_tbl->pool);
+        if (i != 0)
+            sbuf_append(stmt, " AND ");
+
+        sbuf_appendf(stmt, "c%d = ?", i);
     }
-    else
-        (void) sqlite3_reset(tbl->insert_stmt);
+}
 
-    for (i = 0; i < tbl_def->schema->len; i++)
+static sqlite3_stmt *
+sqlite_table_insert_stmt_make(SQLiteTable *tbl, int nrows)
+{
+    AbstractTable *a_tbl = &tbl->table;
+    char *param_str;
+    StrBuf *stmt;
+    int i;
+
+    param_str = schema_to_sql_param_str(a_tbl->def->schema,
+                                        a_tbl->c4->tmp_pool);
+
+    /* XXX: need to escape SQL string */
+    stmt = sbuf_make(a_tbl->c4->tmp_pool);
+    sbuf_appendf(stmt, "INSERT INTO %s VALUES ", a_tbl->def->name);
+    for (i = 0; i < nrows; i++)
     {
-        Datum val = tuple_get_val(t, i);
+        if (i != 0)
+            sbuf_append_char(stmt, ',');
 
-        switch (types[i])
-        {
-            case TYPE_BOOL:
-                sqlite3_bind_int(tbl->insert_stmt, i + 1, val.b);
-                break;
-            case TYPE_CHAR:
-                sqlite3_bind_int(tbl->insert_stmt, i + 1, val.c);
-                break;
-            case TYPE_INT:
-                sqlite3_bind_int64(tbl->insert_stmt, i + 1, val.i8);
-                break;
-            case TYPE_DOUBLE:
-                sqlite3_bind_double(tbl->insert_stmt, i + 1, val.d8);
-                break;
-            case TYPE_STRING:
-                sqlite3_bind_text(tbl->insert_stmt, i + 1, val.s->data,
-                                  val.s->len, SQLITE_STATIC);
-                break;
+        sbuf_appendf(stmt, "(%s)", param_str);
+    }
+    sbuf_append(stmt, ";");
+    sbuf_append_char(stmt, '\0');
 
-            case TYPE_INVALID:
-                ERROR("Invalid data type: TYPE_INVALID");
-            default:
-                ERROR("Unexpected data type: %uc", types[i]);
-        }
+    return sqlite_pstmt_make(a_tbl->c4->sql, stmt->data, -1, a_tbl->pool);
+}
+
+/*
+ * Note that this table has pending changes that must be applied before the
+ * end of the current fixpoint.
+ */
+static void
+sqlite_table_mark_dirty(SQLiteTable *tbl)
+{
+    SQLiteState *sql = tbl->table.c4->sql;
+
+    if (!tbl->dirty)
+    {
+        tbl->dirty = true;
+        tbl->next_dirty = sql->dirty_tables;
+        sql->dirty_tables = tbl;
     }
 
     /* If we're not inside an xact block, start one */
     if (!sql->xact_in_progress)
         sqlite_begin_xact(sql);
+}
+
+/*
+ * Insert the tuple into this table. Returns "true" if the tuple was added;
+ * returns false if the insert was a no-op because the tuple is already
+ * contained by this table. The insert is not applied to SQLite until the end
+ * of the fixpoint.
+ */
+static bool
+sqlite_table_insert(AbstractTable *a_tbl, Tuple *t, Tuple **old_t)
+{
+    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
+    Schema *schema = a_tbl->def->schema;
+    Tuple *pending_t;
+    unsigned int new_count;
+
+    /* SQLite tables don't support declared primary keys */
+    *old_t = NULL;
 
-    do {
-        res = sqlite3_step(tbl->insert_stmt);
-    } while (res == SQLITE_OK);
+    /* Re-inserting a tuple deleted in this fixpoint cancels the delete */
+    pending_t = rset_remove(tbl->pending_deletes, t, &new_count);
+    if (pending_t != NULL)
+    {
+        tuple_unpin(pending_t, schema);
+        return true;
+    }
 
-    /* We assume that a constraint failure is a PK violation due to a dup */
-    if (res == SQLITE_CONSTRAINT)
+    if (rset_get(tbl->pending_inserts, t) > 0 || rset_get(tbl->rows, t) > 0)
         return false;
-    if (res != SQLITE_DONE)
-        FAIL_SQLITE(tbl->table.c4);
 
-    return true;        /* Not a duplicate */
+    (void) rset_add(tbl->pending_inserts, t);
+    tuple_pin(t);
+    sqlite_table_mark_dirty(tbl);
+
+    return true;
 }
 
 static bool
 sqlite_table_delete(AbstractTable *a_tbl, Tuple *t)
 {
-    return false;
+    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
+    Schema *schema = a_tbl->def->schema;
+    Tuple *pending_t;
+    unsigned int new_count;
+
+    /* Deleting a tuple inserted in this fixpoint cancels the insert */
+    pending_t = rset_remove(tbl->pending_inserts, t, &new_count);
+    if (pending_t != NULL)
+    {
+        tuple_unpin(pending_t, schema);
+        return true;
+    }
+
+    if (rset_get(tbl->pending_deletes, t) > 0 || rset_get(tbl->rows, t) == 0)
+        return false;
+
+    (void) rset_add(tbl->pending_deletes, t);
+    tuple_pin(t);
+    sqlite_table_mark_dirty(tbl);
+
+    return true;
+}
+
+/*
+ * A pending change, as sorted by pending_row_cmp(). Each row points at its
+ * table, because qsort() doesn't pass the comparator a context argument. We
+ * also copy out the first column, which usually decides the comparison.
+ */
+typedef struct PendingRow
+{
+    Datum first_val;
+    Tuple *tuple;
+    SQLiteTable *tbl;
+} PendingRow;
+
+/*
+ * Compare two rows in the order of the table's primary key. Each column's
+ * comparison function matches SQLite's: strings are compared bytewise, as
+ * by SQLite's default BINARY collation.
+ */
+static int
+pending_row_cmp(const void *a, const void *b)
+{
+    const PendingRow *r1 = (const PendingRow *) a;
+    const PendingRow *r2 = (const PendingRow *) b;
+    SQLiteTable *tbl = r1->tbl;
+    Schema *schema = tbl->table.def->schema;
+    int result;
+    int i;
+
+    result = (tbl->cmp_funcs[0])(r1->first_val, r2->first_val);
+    for (i = 1; result == 0 && i < schema->len; i++)
+        result = (tbl->cmp_funcs[i])(tuple_get_val(r1->tuple, i, schema),
+                                     tuple_get_val(r2->tuple, i, schema));
+
+    return result;
+}
+
+/*
+ * Return the tuples in a set of pending changes, sorted into primary key
+ * order. In that order, SQLite's updates to the primary key index are
+ * mostly sequential; in hash order, each one lands on a random page of the
+ * index B-tree.
+ */
+static PendingRow *
+sort_pending_set(SQLiteTable *tbl, rset_t *rs, int *nrows)
+{
+    apr_pool_t *pool = tbl->table.c4->tmp_pool;
+    PendingRow *rows;
+    rset_index_t *ri;
+    int n;
+
+    rows = apr_palloc(pool, rset_count(rs) * sizeof(*rows));
+    n = 0;
+    ri = rset_iter_make(pool, rs);
+    while (rset_iter_next(ri))
+    {
+        rows[n].tuple = rset_this(ri);
+        rows[n].first_val = tuple_get_val(rows[n].tuple, 0,
+                                          tbl->table.def->schema);
+        rows[n].tbl = tbl;
+        n++;
+    }
+
+    qsort(rows, n, sizeof(*rows), pending_row_cmp);
+    *nrows = n;
+    return rows;
+}
+
+/*
+ * Remove every tuple from a set of pending changes.
+ */
+static void
+clear_pending_set(rset_t *rs, Schema *schema, apr_pool_t *pool)
+{
+    rset_index_t *ri;
+
+    ri = rset_iter_make(pool, rs);
+    while (rset_iter_next(ri))
+    {
+        Tuple *t = rset_this(ri);
+        unsigned int new_count;
+
+        (void) rset_remove(rs, t, &new_count);
+        tuple_unpin(t, schema);
+    }
+}
+
+static void
+sqlite_table_apply_deletes(SQLiteTable *tbl)
+{
+    AbstractTable *a_tbl = &tbl->table;
+    Schema *schema = a_tbl->def->schema;
+    PendingRow *rows;
+    int nrows;
+    int i;
+
+    if (rset_count(tbl->pending_deletes) == 0)
+        return;
+
+    if (tbl->delete_stmt == NULL)
+    {
+        StrBuf *stmt;
+
+        stmt = sbuf_make(a_tbl->c4->tmp_pool);
+        sbuf_appendf(stmt, "DELETE FROM %s", a_tbl->def->name);
+        sqlite_append_pkey_qual(stmt, schema);
+        sbuf_append(stmt, ";");
+        sbuf_append_char(stmt, '\0');
+        tbl->delete_stmt = sqlite_pstmt_make(a_tbl->c4->sql, stmt->data,
+                                             -1, a_tbl->pool);
+    }
+
+    rows = sort_pending_set(tbl, tbl->pending_deletes, &nrows);
+    for (i = 0; i < nrows; i++)
+    {
+        Tuple *old_t;
+        unsigned int new_count;
+        int res;
+
+        sqlite_bind_tuple(tbl->delete_stmt, 1, rows[i].tuple, schema);
+        res = sqlite3_step(tbl->delete_stmt);
+        (void) sqlite3_reset(tbl->delete_stmt);
+        if (res != SQLITE_DONE)
+            FAIL_SQLITE(a_tbl->c4);
+
+        old_t = rset_remove(tbl->rows, rows[i].tuple, &new_count);
+        ASSERT(old_t != NULL && new_count == 0);
+        tuple_unpin(old_t, schema);
+    }
+
+    clear_pending_set(tbl->pending_deletes, schema, a_tbl->c4->tmp_pool);
+}
+
+static void
+sqlite_table_insert_rows(SQLiteTable *tbl, sqlite3_stmt *stmt,
+                         PendingRow *rows, int nrows)
+{
+    Schema *schema = tbl->table.def->schema;
+    int res;
+    int i;
+
+    for (i = 0; i < nrows; i++)
+    {
+        sqlite_bind_tuple(stmt, (i * schema->len) + 1, rows[i].tuple, schema);
+        (void) rset_add(tbl->rows, rows[i].tuple);
+        tuple_pin(rows[i].tuple);
+    }
+
+    res = sqlite3_step(stmt);
+    (void) sqlite3_reset(stmt);
+    if (res != SQLITE_DONE)
+        FAIL_SQLITE(tbl->table.c4);
+}
+
+/*
+ * Apply the pending inserts, using multi-row INSERT statements where
+ * possible.
+ */
+static void
+sqlite_table_apply_inserts(SQLiteTable *tbl)
+{
+    AbstractTable *a_tbl = &tbl->table;
+    Schema *schema = a_tbl->def->schema;
+    PendingRow *rows;
+    int nrows;
+    int i;
+
+    if (rset_count(tbl->pending_inserts) == 0)
+        return;
+
+    rows = sort_pending_set(tbl, tbl->pending_inserts, &nrows);
+    for (i = 0; i + tbl->insert_batch <= nrows; i += tbl->insert_batch)
+    {
+        if (tbl->insert_stmt == NULL)
+            tbl->insert_stmt = sqlite_table_insert_stmt_make(tbl,
+                                                             tbl->insert_batch);
+
+        sqlite_table_insert_rows(tbl, tbl->insert_stmt, &rows[i],
+                                 tbl->insert_batch);
+    }
+
+    /* Insert any leftover rows one-at-a-time */
+    if (i < nrows && tbl->insert_one_stmt == NULL)
+        tbl->insert_one_stmt = sqlite_table_insert_stmt_make(tbl, 1);
+
+    for (; i < nrows; i++)
+        sqlite_table_insert_rows(tbl, tbl->insert_one_stmt, &rows[i], 1);
+
+    clear_pending_set(tbl->pending_inserts, schema, a_tbl->c4->tmp_pool);
+}
+
+/*
+ * Apply the changes made to SQLite tables in the current fixpoint. This must
+ * be done before the fixpoint's transaction is committed.
+ */
+void
+sqlite_table_apply_changes(SQLiteState *sql)
+{
+    while (sql->dirty_tables != NULL)
+    {
+        SQLiteTable *tbl = sql->dirty_tables;
+
+        sql->dirty_tables = tbl->next_dirty;
+        tbl->next_dirty = NULL;
+        tbl->dirty = false;
+
+        sqlite_table_apply_deletes(tbl);
+        sqlite_table_apply_inserts(tbl);
+    }
 }
 
 static ScanCursor *
 sqlite_table_scan_make(AbstractTable *a_tbl, apr_pool_t *pool)
 {
+    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
     ScanCursor *scan;
     char stmt[1024];
     int stmt_len;
 
     scan = apr_pcalloc(pool, sizeof(*scan));
     scan->pool = pool;
+    scan->rset_iter = rset_iter_make(pool, tbl->pending_inserts);
 
     /* XXX: escape table name? */
     stmt_len = snprintf(stmt, sizeof(stmt), "SELECT * FROM %s;",
@@ -175,55 +492,175 @@ sqlite_table_scan_make(AbstractTable *a_tbl, apr_pool_t *pool)
     return scan;
 }
 
+static const char *
+sql_op_str(AstOperKind op_kind)
+{
+    switch (op_kind)
+    {
+        case AST_OP_LT:
+            return "<";
+        case AST_OP_LTE:
+            return "<=";
+        case AST_OP_GT:
+            return ">";
+        case AST_OP_GTE:
+            return ">=";
+        case AST_OP_EQ:
+            return "=";
+
+        default:
+            ERROR("Unexpected op kind: %d", (int) op_kind);
+    }
+}
+
+/*
+ * Create a SQLite index on the given columns, unless one already exists. We
+ * don't bother if the columns are a prefix of the primary key, since SQLite
+ * has already built an index on the primary key.
+ */
+static void
+sqlite_table_create_index(AbstractTable *a_tbl, int ncols, int *cols)
+{
+    StrBuf *name;
+    StrBuf *col_list;
+    StrBuf *stmt;
+    bool pkey_prefix;
+    int i;
+
+    name = sbuf_make(a_tbl->c4->tmp_pool);
+    col_list = sbuf_make(a_tbl->c4->tmp_pool);
+    stmt = sbuf_make(a_tbl->c4->tmp_pool);
+
+    pkey_prefix = true;
+    sbuf_append(name, a_tbl->def->name);
+    sbuf_append(name, "_idx");
+    for (i = 0; i < ncols; i++)
+    {
+        if (cols[i] != i)
+            pkey_prefix = false;
+
+        if (i != 0)
+            sbuf_append_char(col_list, ',');
+
+        sbuf_appendf(col_list, "c%d", cols[i]);
+        sbuf_appendf(name, "_c%d", cols[i]);
+    }
+
+    if (pkey_prefix)
+        return;
+
+    sbuf_append_char(name, '\0');
+    sbuf_append_char(col_list, '\0');
+    sbuf_appendf(stmt, "CREATE INDEX IF NOT EXISTS %s ON %s (%s);",
+                 name->data, a_tbl->def->name, col_list->data);
+    sbuf_append_char(stmt, '\0');
+
+    sqlite_exec_sql(a_tbl->c4->sql, stmt->data);
+}
+
+/*
+ * Push the key quals down into SQLite as a parameterized WHERE clause. The
+ * parameters are bound to the cursor's probe key in scan_reset. We also
+ * create an index on the equality columns and the first range column, if
+ * any; SQLite can't use an index on any later columns.
+ */
+static ScanCursor *
+sqlite_table_index_scan_make(AbstractTable *a_tbl, int nkeys, int *key_cols,
+                             AstOperKind *key_ops, apr_pool_t *pool)
+{
+    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
+    ScanCursor *scan;
+    StrBuf *stmt;
+    int nidx_cols;
+    int i;
+
+    stmt = sbuf_make(a_tbl->c4->tmp_pool);
+    sbuf_appendf(stmt, "SELECT * FROM %s WHERE ", a_tbl->def->name);
+    for (i = 0; i < nkeys; i++)
+    {
+        if (i != 0)
+            sbuf_append(stmt, " AND ");
+
+        sbuf_appendf(stmt, "c%d %s ?", key_cols[i], sql_op_str(key_ops[i]));
+    }
+    sbuf_append(stmt, ";");
+    sbuf_append_char(stmt, '\0');
+
+    /* Equality keys precede range keys */
+    nidx_cols = 0;
+    while (nidx_cols < nkeys && key_ops[nidx_cols] == AST_OP_EQ)
+        nidx_cols++;
+    if (nidx_cols < nkeys)
+        nidx_cols++;
+
+    sqlite_table_create_index(a_tbl, nidx_cols, key_cols);
+
+    scan = apr_pcalloc(pool, sizeof(*scan));
+    scan->pool = pool;
+    scan->key = apr_pcalloc(pool, nkeys * sizeof(*scan->key));
+    scan->nkeys = nkeys;
+    scan->key_cols = apr_pmemdup(pool, key_cols, nkeys * sizeof(*key_cols));
+    scan->rset_iter = rset_iter_make(pool, tbl->pending_inserts);
+    scan->sqlite_stmt = sqlite_pstmt_make(a_tbl->c4->sql, stmt->data,
+                                          -1, pool);
+
+    return scan;
+}
+
 static void
 sqlite_table_scan_reset(AbstractTable *a_tbl, ScanCursor *scan)
 {
+    Schema *schema = a_tbl->def->schema;
+    int i;
+
     (void) sqlite3_reset(scan->sqlite_stmt);
+    scan->sqlite_done = false;
+    rset_iter_reset(scan->rset_iter);
+
+    /* Bind the probe key, if this is an index scan */
+    for (i = 0; i < scan->nkeys; i++)
+        sqlite_bind_datum(scan->sqlite_stmt, i + 1, scan->key[i],
+                          schema_get_type(schema, scan->key_cols[i]));
 }
 
 /*
- * Construct a C4 tuple from the next row of the SQLite result set.
+ * Construct a C4 tuple from the current row of the SQLite result set.
  *
  * XXX: when we advance to a subsequent SQLite row, the storage for the previous
  * row is released; we currently get this wrong, because we don't copy when
  * building C4 datums.
  */
 static Tuple *
-sqlite_table_scan_next(AbstractTable *a_tbl, ScanCursor *scan)
+sqlite_row_to_tuple(sqlite3_stmt *stmt, Schema *schema)
 {
-    Schema *schema = a_tbl->def->schema;
     Tuple *tuple;
-    int res;
     int i;
 
-    res = sqlite3_step(scan->sqlite_stmt);
-    if (res == SQLITE_DONE)
-        return NULL;
-    if (res != SQLITE_ROW)
-        FAIL_SQLITE(a_tbl->c4);
-
     tuple = tuple_make_empty(schema);
 
     for (i = 0; i < schema->len; i++)
     {
         Datum d;
+        const char *str;
 
         switch (schema->types[i])
         {
             case TYPE_BOOL:
-                d.b = (bool) sqlite3_column_int(scan->sqlite_stmt, i);
+                d.b = (bool) sqlite3_column_int(stmt, i);
                 break;
             case TYPE_CHAR:
-                d.c = (unsigned char) sqlite3_column_int(scan->sqlite_stmt, i);
+                d.c = (unsigned char) sqlite3_column_int(stmt, i);
                 break;
             case TYPE_INT:
-                d.i8 = (apr_int64_t) sqlite3_column_int64(scan->sqlite_stmt, i);
+                d.i8 = (apr_int64_t) sqlite3_column_int64(stmt, i);
                 break;
             case TYPE_DOUBLE:
-                d.d8 = (double) sqlite3_column_double(scan->sqlite_stmt, i);
+                d.d8 = (double) sqlite3_column_double(stmt, i);
                 break;
             case TYPE_STRING:
-                d = string_from_str((const char *) sqlite3_column_text(scan->sqlite_stmt, i));
+                /* Fetch the text before its length, per the SQLite docs */
+                str = (const char *) sqlite3_column_text(stmt, i);
+                d = string_from_data(str, sqlite3_column_bytes(stmt, i));
                 break;
 
             case TYPE_INVALID:
@@ -232,16 +669,55 @@ sqlite_table_scan_next(AbstractTable *a_tbl, ScanCursor *scan)
                 ERROR("Unexpected data type: %uc", schema->types[i]);
         }
 
-        tuple->vals[i] = d;
+        tuple_set_val(tuple, i, d, schema);
     }
 
     return tuple;
 }
 
+/*
+ * Return the next tuple in the table. We first return the rows of the SQLite
+ * result set, skipping any rows that have been deleted in the current
+ * fixpoint, and then return the tuples inserted in the current fixpoint.
+ */
+static Tuple *
+sqlite_table_scan_next(AbstractTable *a_tbl, ScanCursor *scan)
+{
+    SQLiteTable *tbl = (SQLiteTable *) a_tbl;
+    Schema *schema = a_tbl->def->schema;
+
+    while (!scan->sqlite_done)
+    {
+        Tuple *tuple;
+        int res;
+
+        res = sqlite3_step(scan->sqlite_stmt);
+        if (res == SQLITE_DONE)
+        {
+            scan->sqlite_done = true;
+            break;
+        }
+        if (res != SQLITE_ROW)
+            FAIL_SQLITE(a_tbl->c4);
+
+        tuple = sqlite_row_to_tuple(scan->sqlite_stmt, schema);
+        if (rset_get(tbl->pending_deletes, tuple) == 0)
+            return tuple;
+
+        tuple_unpin(tuple, schema);
+    }
+
+    if (!rset_iter_next(scan->rset_iter))
+        return NULL;
+
+    return rset_this(scan->rset_iter);
+}
+
 SQLiteTable *
 sqlite_table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool)
 {
     SQLiteTable *tbl;
+    int i;
 
     tbl = (SQLiteTable *) table_make_super(sizeof(*tbl), def, c4,
                                            sqlite_table_insert,
@@ -250,7 +726,25 @@ sqlite_table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool)
                                            sqlite_table_scan_make,
                                            sqlite_table_scan_reset,
                                            sqlite_table_scan_next,
+                                           sqlite_table_index_scan_make,
                                            pool);
+    tbl->insert_stmt = NULL;
+    tbl->insert_one_stmt = NULL;
+    tbl->delete_stmt = NULL;
+    tbl->cmp_funcs = apr_palloc(pool,
+                                def->schema->len * sizeof(*tbl->cmp_funcs));
+    for (i = 0; i < def->schema->len; i++)
+        tbl->cmp_funcs[i] = type_get_cmp_func(schema_get_type(def->schema, i));
+    tbl->rows = rset_make(pool, def->schema, tuple_hash_tbl, tuple_cmp_tbl);
+    /* Each batch can bind at most 999 parameters */
+    tbl->insert_batch = Max(1, Min(SQLITE_INSERT_BATCH,
+                                   999 / def->schema->len));
+    tbl->pending_inserts = rset_make(pool, def->schema,
+                                     tuple_hash_tbl, tuple_cmp_tbl);
+    tbl->pending_deletes = rset_make(pool, def->schema,
+                                     tuple_hash_tbl, tuple_cmp_tbl);
+    tbl->dirty = false;
+    tbl->next_dirty = NULL;
 
     sqlite_table_create_sql(tbl);
 
@@ -1,5 +1,6 @@
 #include "c4-internal.h"
 #include "storage/mem_table.h"
+#include "storage/ordered_table.h"
 #include "storage/sqlite_table.h"
 #include "storage/table.h"
 #include "types/tuple.h"
@@ -17,6 +18,10 @@ table_make(TableDef *def, C4Runtime *c4, apr_pool_t *pool)
             tbl = (AbstractTable *) mem_table_make(def, c4, pool);
             break;
 
+        case AST_STORAGE_ORDERED:
+            tbl = (AbstractTable *) ordered_table_make(def, c4, pool);
+            break;
+
         case AST_STORAGE_SQLITE:
             tbl = (AbstractTable *) sqlite_table_make(def, c4, pool);
             break;
@@ -36,6 +41,7 @@ table_make_super(apr_size_t sz, TableDef *def, C4Runtime *c4,
                  table_scan_make_f scan_make_f,
                  table_scan_reset_f scan_reset_f,
                  table_scan_next_f scan_next_f,
+                 table_index_scan_make_f index_scan_make_f,
                  apr_pool_t *pool)
 {
     AbstractTable *tbl;
@@ -50,6 +56,7 @@ table_make_super(apr_size_t sz, TableDef *def, C4Runtime *c4,
     tbl->scan_make = scan_make_f;
     tbl->scan_reset = scan_reset_f;
     tbl->scan_next = scan_next_f;
+    tbl->index_scan_make = index_scan_make_f;
 
     apr_pool_cleanup_register(pool, tbl, abstract_table_cleanup,
                               apr_pool_cleanup_null);
@@ -95,7 +95,7 @@ fire_alarm(AlarmState *alarm, C4Timer *timer)
     time_val.i8 = alarm->deadline;
     alarm_tuple = tuple_make(alarm->tbl_def->schema, &time_val);
     router_insert_tuple(timer->c4->router, alarm_tuple,
-                        alarm->tbl_def, false);
+                        alarm->tbl_def, false, true);
     tuple_unpin(alarm_tuple, alarm->tbl_def->schema);
 
     alarm->deadline += alarm->period;
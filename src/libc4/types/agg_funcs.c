@@ -1,7 +1,10 @@
+#include <math.h>
+
 #include "c4-internal.h"
 #include "operator/agg.h"
 #include "types/agg_funcs.h"
 #include "util/rbtree.h"
+#include "util/strbuf.h"
 
 /* Average */
 typedef struct AvgStateVal
@@ -232,6 +235,578 @@ extrema_shutdown_f(AggStateVal state)
     apr_pool_destroy(ext_state->pool);
 }
 
+/*
+ * Min and Max over insert-only input. There is no need to remember every
+ * input value, just the extreme value seen so far.
+ */
+typedef struct RunningExtremaState
+{
+    Datum val;
+    DataType type;
+    datum_cmp_func cmp_func;
+} RunningExtremaState;
+
+static AggStateVal
+running_extrema_init_f(Datum v, AggOperator *agg_op, int aggno)
+{
+    AggStateVal state;
+    RunningExtremaState *ext_state;
+    AggExprInfo *agg_info;
+    DataType input_type;
+
+    agg_info = agg_op->agg_info[aggno];
+    input_type = schema_get_type(agg_op->op.proj_schema, agg_info->colno);
+
+    ext_state = ol_alloc(sizeof(*ext_state));
+    ext_state->type = input_type;
+    ext_state->cmp_func = type_get_cmp_func(input_type);
+    ext_state->val = datum_copy(v, input_type);
+
+    state.ptr = ext_state;
+    return state;
+}
+
+static void
+running_extrema_set_val(RunningExtremaState *ext_state, Datum v)
+{
+    datum_free(ext_state->val, ext_state->type);
+    ext_state->val = datum_copy(v, ext_state->type);
+}
+
+static AggStateVal
+running_max_fw_trans_f(AggStateVal state, Datum v)
+{
+    RunningExtremaState *ext_state = (RunningExtremaState *) state.ptr;
+
+    if (ext_state->cmp_func(v, ext_state->val) > 0)
+        running_extrema_set_val(ext_state, v);
+
+    return state;
+}
+
+static AggStateVal
+running_min_fw_trans_f(AggStateVal state, Datum v)
+{
+    RunningExtremaState *ext_state = (RunningExtremaState *) state.ptr;
+
+    if (ext_state->cmp_func(v, ext_state->val) < 0)
+        running_extrema_set_val(ext_state, v);
+
+    return state;
+}
+
+static Datum
+running_extrema_output_f(AggStateVal state)
+{
+    RunningExtremaState *ext_state = (RunningExtremaState *) state.ptr;
+
+    return ext_state->val;
+}
+
+static void
+running_extrema_shutdown_f(AggStateVal state)
+{
+    RunningExtremaState *ext_state = (RunningExtremaState *) state.ptr;
+
+    datum_free(ext_state->val, ext_state->type);
+    ol_free(ext_state);
+}
+
+/* The type of the input to an agg */
+static DataType
+agg_input_type(AggOperator *agg_op, int aggno)
+{
+    AggExprInfo *agg_info = agg_op->agg_info[aggno];
+
+    return schema_get_type(agg_op->op.proj_schema, agg_info->colno);
+}
+
+/* The value of the constant parameter of an agg, e.g. the k of topk<> */
+static const char *
+agg_param_value(AggOperator *agg_op, int aggno)
+{
+    AstAggExpr *ast_expr = agg_op->agg_info[aggno]->ast_expr;
+
+    ASSERT(ast_expr->param != NULL);
+    return ((AstConstExpr *) ast_expr->param)->value;
+}
+
+/*
+ * Count distinct: a HyperLogLog sketch (Flajolet et al., 2007). The hash of
+ * each input value selects one of HLL_NREGISTERS registers, which records
+ * the largest number of leading zeros (plus one) seen in the remaining bits
+ * of the hashes. The standard error of the estimate is about 1.04 /
+ * sqrt(HLL_NREGISTERS), i.e. 2.3%; small counts are estimated by "linear
+ * counting" of the empty registers, which is nearly exact. Since the hashes
+ * are only 32 bits, estimates above ~10^8 become less accurate. A sketch
+ * can't remove values, so it is rebuilt when an input is deleted.
+ */
+#define HLL_PRECISION   11
+#define HLL_NREGISTERS  (1 << HLL_PRECISION)
+
+typedef struct HllState
+{
+    datum_hash_func hash_func;
+    unsigned char registers[HLL_NREGISTERS];
+} HllState;
+
+/* The MurmurHash3 finalizer: make every bit of the hash depend on the input */
+static apr_uint32_t
+hll_mix(apr_uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static void
+hll_add_val(HllState *hll, Datum v)
+{
+    apr_uint32_t h;
+    apr_uint32_t rest;
+    int regno;
+    int rank;
+
+    h = hll_mix(hll->hash_func(v));
+    regno = (int) (h >> (32 - HLL_PRECISION));
+    rest = h << HLL_PRECISION;
+    if (rest == 0)
+        rank = 32 - HLL_PRECISION + 1;
+    else
+        rank = __builtin_clz(rest) + 1;
+
+    if (rank > hll->registers[regno])
+        hll->registers[regno] = (unsigned char) rank;
+}
+
+static AggStateVal
+count_distinct_init_f(Datum v, AggOperator *agg_op, int aggno)
+{
+    AggStateVal state;
+    HllState *hll;
+
+    hll = ol_alloc(sizeof(*hll));
+    hll->hash_func = type_get_hash_func(agg_input_type(agg_op, aggno));
+    memset(hll->registers, 0, sizeof(hll->registers));
+    hll_add_val(hll, v);
+
+    state.ptr = hll;
+    return state;
+}
+
+static AggStateVal
+count_distinct_fw_trans_f(AggStateVal state, Datum v)
+{
+    hll_add_val((HllState *) state.ptr, v);
+    return state;
+}
+
+static Datum
+count_distinct_output_f(AggStateVal state)
+{
+    HllState *hll = (HllState *) state.ptr;
+    double m = HLL_NREGISTERS;
+    double sum;
+    double estimate;
+    int nzero;
+    int i;
+    Datum result;
+
+    sum = 0.0;
+    nzero = 0;
+    for (i = 0; i < HLL_NREGISTERS; i++)
+    {
+        sum += ldexp(1.0, -hll->registers[i]);
+        if (hll->registers[i] == 0)
+            nzero++;
+    }
+
+    estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+    if (estimate <= 2.5 * m && nzero > 0)
+        estimate = m * log(m / nzero);
+
+    result.i8 = (apr_int64_t) (estimate + 0.5);
+    return result;
+}
+
+static void
+count_distinct_shutdown_f(AggStateVal state)
+{
+    ol_free(state.ptr);
+}
+
+/*
+ * Quantile: a stack of "compactors", as in the KLL sketch (Karnin, Lang and
+ * Liberty, 2016). Level h holds up to QUANTILE_LEVEL_SIZE values, each of
+ * which stands for 2^h input values. When a level is full, we sort it and
+ * promote every other value to the next level, alternating between the
+ * values at odd and even positions so that the rank errors tend to cancel.
+ * The rank error is O(log(n / QUANTILE_LEVEL_SIZE) / QUANTILE_LEVEL_SIZE)
+ * of the n inputs; a group with no more than QUANTILE_LEVEL_SIZE inputs is
+ * exact. The output is the smallest value whose rank is at least p * n (the
+ * "nearest rank" definition), so it is always one of the input values. We
+ * store the values as doubles, which is exact for ints up to 2^53. A sketch
+ * can't remove values, so it is rebuilt when an input is deleted.
+ */
+#define QUANTILE_LEVEL_SIZE     128
+#define QUANTILE_MAX_LEVELS     48
+
+typedef struct QuantileState
+{
+    double p;
+    bool is_int;
+    int nlevels;
+    int level_len[QUANTILE_MAX_LEVELS];
+    double *levels[QUANTILE_MAX_LEVELS];
+    /* Bit h says which half of level h to promote next */
+    apr_uint64_t parity;
+} QuantileState;
+
+typedef struct WeightedVal
+{
+    double val;
+    apr_uint64_t weight;
+} WeightedVal;
+
+static int
+double_val_cmp(const void *a, const void *b)
+{
+    double d1 = *(const double *) a;
+    double d2 = *(const double *) b;
+
+    return (d1 > d2) - (d1 < d2);
+}
+
+static int
+weighted_val_cmp(const void *a, const void *b)
+{
+    return double_val_cmp(&((const WeightedVal *) a)->val,
+                      &((const WeightedVal *) b)->val);
+}
+
+static void quantile_push(QuantileState *q, int level, double v);
+
+static void
+quantile_compact(QuantileState *q, int level)
+{
+    double *vals = q->levels[level];
+    int nvals = q->level_len[level];
+    int offset;
+    int i;
+
+    offset = (int) ((q->parity >> level) & 1);
+    q->parity ^= ((apr_uint64_t) 1 << level);
+
+    qsort(vals, nvals, sizeof(double), double_val_cmp);
+    q->level_len[level] = 0;
+    for (i = offset; i < nvals; i += 2)
+        quantile_push(q, level + 1, vals[i]);
+}
+
+static void
+quantile_push(QuantileState *q, int level, double v)
+{
+    if (level == q->nlevels)
+    {
+        if (level == QUANTILE_MAX_LEVELS)
+            ERROR("Too many input values for quantile aggregate");
+
+        q->levels[level] = ol_alloc(QUANTILE_LEVEL_SIZE * sizeof(double));
+        q->level_len[level] = 0;
+        q->nlevels++;
+    }
+
+    if (q->level_len[level] == QUANTILE_LEVEL_SIZE)
+        quantile_compact(q, level);
+
+    q->levels[level][q->level_len[level]++] = v;
+}
+
+static double
+quantile_input_val(QuantileState *q, Datum v)
+{
+    return q->is_int ? (double) v.i8 : v.d8;
+}
+
+static AggStateVal
+quantile_init_f(Datum v, AggOperator *agg_op, int aggno)
+{
+    AggStateVal state;
+    QuantileState *q;
+
+    q = ol_alloc(sizeof(*q));
+    q->p = strtod(agg_param_value(agg_op, aggno), NULL);
+    q->is_int = (agg_input_type(agg_op, aggno) == TYPE_INT);
+    q->nlevels = 0;
+    q->parity = 0;
+    quantile_push(q, 0, quantile_input_val(q, v));
+
+    state.ptr = q;
+    return state;
+}
+
+static AggStateVal
+quantile_fw_trans_f(AggStateVal state, Datum v)
+{
+    QuantileState *q = (QuantileState *) state.ptr;
+
+    quantile_push(q, 0, quantile_input_val(q, v));
+    return state;
+}
+
+static Datum
+quantile_output_f(AggStateVal state)
+{
+    QuantileState *q = (QuantileState *) state.ptr;
+    WeightedVal *vals;
+    apr_uint64_t total_weight;
+    apr_uint64_t target;
+    apr_uint64_t sum;
+    int nvals;
+    int level;
+    int i;
+    Datum result;
+
+    vals = ol_alloc(q->nlevels * QUANTILE_LEVEL_SIZE * sizeof(*vals));
+    nvals = 0;
+    total_weight = 0;
+    for (level = 0; level < q->nlevels; level++)
+    {
+        apr_uint64_t weight = (apr_uint64_t) 1 << level;
+
+        for (i = 0; i < q->level_len[level]; i++)
+        {
+            vals[nvals].val = q->levels[level][i];
+            vals[nvals].weight = weight;
+            nvals++;
+        }
+
+        total_weight += weight * q->level_len[level];
+    }
+
+    ASSERT(nvals > 0);
+    qsort(vals, nvals, sizeof(*vals), weighted_val_cmp);
+
+    target = (apr_uint64_t) ceil(q->p * (double) total_weight);
+    if (target == 0)
+        target = 1;
+
+    sum = 0;
+    for (i = 0; i < nvals - 1; i++)
+    {
+        sum += vals[i].weight;
+        if (sum >= target)
+            break;
+    }
+
+    if (q->is_int)
+        result.i8 = (apr_int64_t) vals[i].val;
+    else
+        result.d8 = vals[i].val;
+
+    ol_free(vals);
+    return result;
+}
+
+static void
+quantile_shutdown_f(AggStateVal state)
+{
+    QuantileState *q = (QuantileState *) state.ptr;
+    int level;
+
+    for (level = 0; level < q->nlevels; level++)
+        ol_free(q->levels[level]);
+    ol_free(q);
+}
+
+/*
+ * Topk: the k largest distinct input values, which we keep in a min-heap.
+ * The output is a string that lists them in descending order, separated by
+ * commas; string values are quoted as in string literals, since they can
+ * contain commas themselves. Removing a value from the heap would require
+ * the next largest value, which we don't keep, so the state is rebuilt when
+ * an input is deleted.
+ */
+typedef struct TopkState
+{
+    apr_pool_t *pool;
+    DataType type;
+    datum_cmp_func cmp_func;
+    int k;
+    int nvals;
+    Datum *heap;
+    /* Scratch space for topk_output_f() */
+    Datum *sorted;
+    StrBuf *buf;
+    /* The most recent output string, which we must unpin */
+    bool has_output;
+    Datum output;
+} TopkState;
+
+static void
+topk_sift_down(TopkState *topk, Datum *heap, int nvals, int i)
+{
+    while (true)
+    {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        Datum tmp;
+
+        if (left < nvals && topk->cmp_func(heap[left], heap[least]) < 0)
+            least = left;
+        if (right < nvals && topk->cmp_func(heap[right], heap[least]) < 0)
+            least = right;
+        if (least == i)
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+static void
+topk_add_val(TopkState *topk, Datum v)
+{
+    int i;
+
+    if (topk->nvals == topk->k && topk->cmp_func(v, topk->heap[0]) <= 0)
+        return;
+
+    for (i = 0; i < topk->nvals; i++)
+    {
+        if (topk->cmp_func(v, topk->heap[i]) == 0)
+            return;
+    }
+
+    if (topk->nvals < topk->k)
+    {
+        /* Sift the new value up from the end of the heap */
+        i = topk->nvals++;
+        while (i > 0 && topk->cmp_func(v, topk->heap[(i - 1) / 2]) < 0)
+        {
+            topk->heap[i] = topk->heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        topk->heap[i] = datum_copy(v, topk->type);
+    }
+    else
+    {
+        /* Replace the smallest value */
+        datum_free(topk->heap[0], topk->type);
+        topk->heap[0] = datum_copy(v, topk->type);
+        topk_sift_down(topk, topk->heap, topk->nvals, 0);
+    }
+}
+
+static AggStateVal
+topk_init_f(Datum v, AggOperator *agg_op, int aggno)
+{
+    AggStateVal state;
+    TopkState *topk;
+    apr_pool_t *pool;
+
+    pool = make_subpool(agg_op->op.pool);
+    topk = apr_palloc(pool, sizeof(*topk));
+    topk->pool = pool;
+    topk->type = agg_input_type(agg_op, aggno);
+    topk->cmp_func = type_get_cmp_func(topk->type);
+    topk->k = (int) apr_atoi64(agg_param_value(agg_op, aggno));
+    topk->nvals = 0;
+    topk->heap = apr_palloc(pool, topk->k * sizeof(Datum));
+    topk->sorted = apr_palloc(pool, topk->k * sizeof(Datum));
+    topk->buf = sbuf_make(pool);
+    topk->has_output = false;
+    topk_add_val(topk, v);
+
+    state.ptr = topk;
+    return state;
+}
+
+static AggStateVal
+topk_fw_trans_f(AggStateVal state, Datum v)
+{
+    topk_add_val((TopkState *) state.ptr, v);
+    return state;
+}
+
+/*
+ * Append a string value to the topk output in double quotes, with a
+ * backslash before each double quote or backslash in it.
+ */
+static void
+topk_append_string(StrBuf *buf, Datum d)
+{
+    const char *data = string_data(&d);
+    apr_size_t len = string_len(d);
+    apr_size_t i;
+
+    sbuf_append_char(buf, '"');
+    for (i = 0; i < len; i++)
+    {
+        if (data[i] == '"' || data[i] == '\\')
+            sbuf_append_char(buf, '\\');
+        sbuf_append_char(buf, data[i]);
+    }
+    sbuf_append_char(buf, '"');
+}
+
+static Datum
+topk_output_f(AggStateVal state)
+{
+    TopkState *topk = (TopkState *) state.ptr;
+    int nvals = topk->nvals;
+    int i;
+
+    /* Heapsort a copy of the heap into descending order */
+    memcpy(topk->sorted, topk->heap, nvals * sizeof(Datum));
+    for (i = nvals - 1; i > 0; i--)
+    {
+        Datum tmp = topk->sorted[0];
+
+        topk->sorted[0] = topk->sorted[i];
+        topk->sorted[i] = tmp;
+        topk_sift_down(topk, topk->sorted, i, 0);
+    }
+
+    sbuf_reset(topk->buf);
+    for (i = 0; i < nvals; i++)
+    {
+        if (i > 0)
+            sbuf_append_char(topk->buf, ',');
+        if (topk->type == TYPE_STRING)
+            topk_append_string(topk->buf, topk->sorted[i]);
+        else
+            datum_to_str(topk->sorted[i], topk->type, topk->buf);
+    }
+
+    if (topk->has_output)
+        datum_free(topk->output, TYPE_STRING);
+    topk->output = string_from_data(topk->buf->data, topk->buf->len);
+    topk->has_output = true;
+
+    return topk->output;
+}
+
+static void
+topk_shutdown_f(AggStateVal state)
+{
+    TopkState *topk = (TopkState *) state.ptr;
+    int i;
+
+    for (i = 0; i < topk->nvals; i++)
+        datum_free(topk->heap[i], topk->type);
+    if (topk->has_output)
+        datum_free(topk->output, TYPE_STRING);
+
+    apr_pool_destroy(topk->pool);
+}
+
 /* Sum */
 /* XXX: Currently assume that sum input and output is TYPE_INT */
 static AggStateVal
@@ -253,7 +828,8 @@ static AggFuncDesc agg_desc_avg = {
     avg_fw_trans_f,
     avg_bw_trans_f,
     avg_output_f,
-    avg_shutdown_f
+    avg_shutdown_f,
+    false
 };
 
 static AggFuncDesc agg_desc_count = {
@@ -261,7 +837,17 @@ static AggFuncDesc agg_desc_count = {
     count_fw_trans_f,
     count_bw_trans_f,
     NULL,
-    NULL
+    NULL,
+    false
+};
+
+static AggFuncDesc agg_desc_count_distinct = {
+    count_distinct_init_f,
+    count_distinct_fw_trans_f,
+    NULL,
+    count_distinct_output_f,
+    count_distinct_shutdown_f,
+    true
 };
 
 static AggFuncDesc agg_desc_max = {
@@ -269,7 +855,8 @@ static AggFuncDesc agg_desc_max = {
     extrema_fw_trans_f,
     extrema_bw_trans_f,
     max_output_f,
-    extrema_shutdown_f
+    extrema_shutdown_f,
+    true
 };
 
 static AggFuncDesc agg_desc_min = {
@@ -277,7 +864,35 @@ static AggFuncDesc agg_desc_min = {
     extrema_fw_trans_f,
     extrema_bw_trans_f,
     min_output_f,
-    extrema_shutdown_f
+    extrema_shutdown_f,
+    true
+};
+
+static AggFuncDesc agg_desc_quantile = {
+    quantile_init_f,
+    quantile_fw_trans_f,
+    NULL,
+    quantile_output_f,
+    quantile_shutdown_f,
+    false
+};
+
+static AggFuncDesc agg_desc_running_max = {
+    running_extrema_init_f,
+    running_max_fw_trans_f,
+    NULL,
+    running_extrema_output_f,
+    running_extrema_shutdown_f,
+    true
+};
+
+static AggFuncDesc agg_desc_running_min = {
+    running_extrema_init_f,
+    running_min_fw_trans_f,
+    NULL,
+    running_extrema_output_f,
+    running_extrema_shutdown_f,
+    true
 };
 
 static AggFuncDesc agg_desc_sum = {
@@ -285,11 +900,25 @@ static AggFuncDesc agg_desc_sum = {
     sum_fw_trans_f,
     sum_bw_trans_f,
     NULL,
-    NULL
+    NULL,
+    false
 };
 
+static AggFuncDesc agg_desc_topk = {
+    topk_init_f,
+    topk_fw_trans_f,
+    NULL,
+    topk_output_f,
+    topk_shutdown_f,
+    true
+};
+
+/*
+ * If "append_only" is true, the agg's input is insert-only, so we can use a
+ * cheaper implementation that doesn't support deletions, if there is one.
+ */
 AggFuncDesc *
-lookup_agg_desc(AstAggKind agg_kind)
+lookup_agg_desc(AstAggKind agg_kind, bool append_only)
 {
     switch (agg_kind)
     {
@@ -299,15 +928,28 @@ lookup_agg_desc(AstAggKind agg_kind)
         case AST_AGG_COUNT:
             return &agg_desc_count;
 
+        case AST_AGG_COUNT_DISTINCT:
+            return &agg_desc_count_distinct;
+
         case AST_AGG_MAX:
+            if (append_only)
+                return &agg_desc_running_max;
             return &agg_desc_max;
 
         case AST_AGG_MIN:
+            if (append_only)
+                return &agg_desc_running_min;
             return &agg_desc_min;
 
+        case AST_AGG_QUANTILE:
+            return &agg_desc_quantile;
+
         case AST_AGG_SUM:
             return &agg_desc_sum;
 
+        case AST_AGG_TOPK:
+            return &agg_desc_topk;
+
         default:
             ERROR("Unrecognized agg kind: %d", (int) agg_kind);
     }
@@ -1,6 +1,7 @@
 #include <apr_hash.h>
 
 #include "c4-internal.h"
+#include "operator/scancursor.h"
 #include "parser/ast.h"
 #include "router.h"
 #include "types/catalog.h"
@@ -55,9 +56,55 @@ find_loc_spec_colno(List *schema)
     return -1;
 }
 
+static int *
+make_key_cols(List *keys, apr_pool_t *pool)
+{
+    int *result;
+    int i;
+    ListCell *lc;
+
+    if (list_is_empty(keys))
+        return NULL;
+
+    result = apr_palloc(pool, list_length(keys) * sizeof(*result));
+    i = 0;
+    foreach (lc, keys)
+        result[i++] = lc_int(lc);
+
+    return result;
+}
+
+/*
+ * The sort order of an ordered table: the declared sort columns, followed
+ * by the remaining columns of the table in order.
+ */
+static int *
+make_order_cols(List *order_cols, int ncols, apr_pool_t *pool)
+{
+    int *result;
+    int i;
+    int j;
+    ListCell *lc;
+
+    result = apr_palloc(pool, ncols * sizeof(*result));
+    i = 0;
+    foreach (lc, order_cols)
+        result[i++] = lc_int(lc);
+
+    for (j = 0; j < ncols; j++)
+    {
+        if (!list_member_int(order_cols, j))
+            result[i++] = j;
+    }
+
+    ASSERT(i == ncols);
+    return result;
+}
+
 void
 cat_define_table(C4Catalog *cat, const char *name,
-                 AstStorageKind storage, List *schema)
+                 AstStorageKind storage, List *schema, List *keys,
+                 List *order_cols, int partition_col)
 {
     apr_pool_t *tbl_pool;
     TableDef *tbl_def;
@@ -72,7 +119,21 @@ cat_define_table(C4Catalog *cat, const char *name,
     tbl_def->storage = storage;
     tbl_def->schema = schema_make_from_ast(schema, cat->c4, tbl_pool);
     tbl_def->ls_colno = find_loc_spec_colno(schema);
+    tbl_def->nkeys = list_length(keys);
+    tbl_def->key_cols = make_key_cols(keys, tbl_pool);
+    if (storage == AST_STORAGE_ORDERED)
+        tbl_def->order_cols = make_order_cols(order_cols,
+                                              tbl_def->schema->len, tbl_pool);
+    else
+        tbl_def->order_cols = NULL;
+    tbl_def->partition_col = partition_col;
+    tbl_def->may_delete = (tbl_def->nkeys > 0);
+    tbl_def->derived_tbls = list_make(tbl_pool);
+    tbl_def->append_only_aggs = list_make(tbl_pool);
     tbl_def->cb = NULL;
+    tbl_def->stats.replan_above = TABLE_STATS_MIN_REPLAN;
+    tbl_def->stats.ndistinct = apr_pcalloc(tbl_pool, tbl_def->schema->len *
+                                           sizeof(*tbl_def->stats.ndistinct));
     tbl_def->table = table_make(tbl_def, cat->c4, tbl_pool);
     tbl_def->op_chain_list = router_get_opchain_list(cat->c4->router,
                                                      tbl_def->name);
@@ -119,6 +180,122 @@ cat_get_table_impl(C4Catalog *cat, const char *name)
     return (cat_get_table(cat, name))->table;
 }
 
+/*
+ * To estimate the number of distinct values in a column, we keep the
+ * KMV_SIZE smallest distinct hash values seen in the column: if the hash
+ * values are uniformly distributed, the k'th smallest of them is about
+ * k / ndistinct of the way through the hash space. Unlike the HyperLogLog
+ * sketch used by count_distinct (types/agg_funcs.c), this is exact for
+ * columns with fewer than KMV_SIZE distinct values, which is the common case
+ * for the small tables the planner sees.
+ */
+#define KMV_SIZE    64
+
+typedef struct KmvSketch
+{
+    int n;
+    apr_uint32_t vals[KMV_SIZE];    /* Sorted, without duplicates */
+} KmvSketch;
+
+static void
+kmv_add(KmvSketch *kmv, apr_uint32_t hash)
+{
+    int i;
+
+    if (kmv->n == KMV_SIZE && hash >= kmv->vals[KMV_SIZE - 1])
+        return;
+
+    for (i = kmv->n; i > 0 && kmv->vals[i - 1] > hash; i--)
+        ;
+    if (i > 0 && kmv->vals[i - 1] == hash)
+        return;
+
+    /* If the sketch is full, the largest value falls off the end */
+    if (kmv->n < KMV_SIZE)
+        kmv->n++;
+    memmove(&kmv->vals[i + 1], &kmv->vals[i],
+            (kmv->n - 1 - i) * sizeof(*kmv->vals));
+    kmv->vals[i] = hash;
+}
+
+static double
+kmv_estimate(KmvSketch *kmv)
+{
+    /* If there are fewer than KMV_SIZE distinct values, we saw them all */
+    if (kmv->n < KMV_SIZE)
+        return kmv->n;
+
+    return (KMV_SIZE - 1) * 4294967296.0 /
+        ((double) kmv->vals[KMV_SIZE - 1] + 1.0);
+}
+
+/*
+ * Scan the table to count its tuples and estimate the number of distinct
+ * values in each column.
+ */
+static void
+table_analyze(TableDef *tbl_def, apr_pool_t *pool)
+{
+    TableStats *stats = &tbl_def->stats;
+    Schema *schema = tbl_def->schema;
+    struct AbstractTable *tbl = tbl_def->table;
+    struct ScanCursor *cursor;
+    KmvSketch *sketches;
+    unsigned int ntuples;
+    Tuple *t;
+    int i;
+
+    sketches = apr_pcalloc(pool, schema->len * sizeof(*sketches));
+    ntuples = 0;
+    cursor = tbl->scan_make(tbl, pool);
+    tbl->scan_reset(tbl, cursor);
+    while ((t = tbl->scan_next(tbl, cursor)) != NULL)
+    {
+        for (i = 0; i < schema->len; i++)
+        {
+            datum_hash_func hash_func = schema->hash_funcs[i];
+
+            kmv_add(&sketches[i], hash_func(tuple_get_val(t, i, schema)));
+        }
+
+        ntuples++;
+    }
+
+    for (i = 0; i < schema->len; i++)
+        stats->ndistinct[i] = Min(kmv_estimate(&sketches[i]),
+                                  (double) ntuples);
+
+    stats->ntuples = ntuples;
+    stats->analyzed_ntuples = ntuples;
+    stats->analyzed = true;
+}
+
+/*
+ * Return the statistics for the named table, first recomputing the
+ * distinct-value estimates if they are missing or stale. Returns NULL if
+ * the table hasn't been defined yet (e.g. because it is defined by the
+ * program that is being planned).
+ */
+TableStats *
+cat_get_table_stats(C4Catalog *cat, const char *name, apr_pool_t *pool)
+{
+    TableDef *tbl_def;
+    TableStats *stats;
+
+    tbl_def = (TableDef *) apr_hash_get(cat->tbl_def_tbl, name,
+                                        APR_HASH_KEY_STRING);
+    if (tbl_def == NULL)
+        return NULL;
+
+    stats = &tbl_def->stats;
+    if (!stats->analyzed ||
+        stats->ntuples > stats->analyzed_ntuples * 2 ||
+        stats->ntuples < stats->analyzed_ntuples / 2)
+        table_analyze(tbl_def, pool);
+
+    return stats;
+}
+
 void
 cat_register_callback(C4Catalog *cat, const char *tbl_name,
                       C4TupleCallback callback, void *data)
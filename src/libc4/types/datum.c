@@ -1,3 +1,4 @@
+#include <apr_atomic.h>
 #include <apr_hash.h>
 
 #include "c4-internal.h"
@@ -31,9 +32,15 @@ int_equal(Datum d1, Datum d2)
 bool
 string_equal(Datum d1, Datum d2)
 {
-    C4String *s1 = d1.s;
-    C4String *s2 = d2.s;
+    C4String *s1;
+    C4String *s2;
 
+    /* Inline strings are never equal to out-of-line strings */
+    if (string_is_inline(d1) || string_is_inline(d2))
+        return d1.i8 == d2.i8;
+
+    s1 = d1.s;
+    s2 = d2.s;
     if (s1->len != s2->len)
         return false;
 
@@ -116,13 +123,13 @@ int_cmp(Datum d1, Datum d2)
 int
 string_cmp(Datum d1, Datum d2)
 {
-    C4String *s1 = d1.s;
-    C4String *s2 = d2.s;
+    apr_size_t len1 = string_len(d1);
+    apr_size_t len2 = string_len(d2);
     int result;
 
-    result = memcmp(s1->data, s2->data, Min(s1->len, s2->len));
-    if ((result == 0) && (s1->len != s2->len))
-        result = (s1->len < s2->len ? -1 : 1);
+    result = memcmp(string_data(&d1), string_data(&d2), Min(len1, len2));
+    if ((result == 0) && (len1 != len2))
+        result = (len1 < len2 ? -1 : 1);
 
     return result;
 }
@@ -159,18 +166,20 @@ datum_cmp(Datum d1, Datum d2, DataType type)
 apr_uint32_t
 bool_hash(Datum d)
 {
-    return hash_any((unsigned char *) &(d.b), sizeof(bool));
+    return hash_uint64(d.b);
 }
 
 apr_uint32_t
 char_hash(Datum d)
 {
-    return hash_any((unsigned char *) &(d.c), sizeof(unsigned char));
+    return hash_uint64(d.c);
 }
 
 apr_uint32_t
 double_hash(Datum d)
 {
+    apr_uint64_t bits;
+
     /*
      * Per IEEE754, minus zero and zero may have different bit patterns, but
      * they should compare as equal. Therefore, ensure they hash to the same
@@ -179,19 +188,274 @@ double_hash(Datum d)
     if (d.d8 == 0)
         return 0;
 
-    return hash_any((unsigned char *) &(d.d8), sizeof(double));
+    memcpy(&bits, &(d.d8), sizeof(bits));
+    return hash_uint64(bits);
 }
 
 apr_uint32_t
 int_hash(Datum d)
 {
-    return hash_any((unsigned char *) &(d.i8), sizeof(apr_int64_t));
+    return hash_uint64((apr_uint64_t) d.i8);
 }
 
 apr_uint32_t
 string_hash(Datum d)
 {
-    return hash_any((unsigned char *) d.s->data, d.s->len);
+    /* Inline strings are canonical, so we can just hash the Datum */
+    if (string_is_inline(d))
+        return hash_uint64((apr_uint64_t) d.i8);
+
+    return hash_bytes((unsigned char *) d.s->data, d.s->len);
+}
+
+/*
+ * Out-of-line strings up to STRING_SLAB_MAX bytes (including the C4String
+ * header) are allocated from a set of slabs, one per size class; larger
+ * strings use ol_alloc(). Each slab hands out elements from blocks of
+ * STRING_SLAB_BLOCK_SIZE bytes, and freed elements are kept on a freelist
+ * for reuse; as with TuplePools, memory is never returned to the OS.
+ *
+ * Strings are created without any runtime context (e.g. by text input
+ * functions), so each thread has its own set of slabs. A string is often
+ * freed by a different thread than the one that allocated it (e.g. a string
+ * computed by a worker thread and stored by the router, or a tuple sent to
+ * another shard), so it must be returned to the slab set that owns it:
+ * otherwise, the owner's freelist would never refill. Each block is aligned
+ * to its size and begins with a pointer to its owner, so freeing a string
+ * just masks its address. A string freed by another thread is pushed onto
+ * the owner's lock-free "remote_free" list for its size class, which the
+ * owner moves to its own freelist when that runs dry.
+ *
+ * When a thread exits, its slab set is adopted by the next thread that
+ * needs one; until then, strings freed by other threads accumulate on its
+ * remote_free lists.
+ */
+#define STRING_SLAB_QUANTUM     16
+#define STRING_SLAB_MAX         256
+#define STRING_SLAB_NCLASSES    (STRING_SLAB_MAX / STRING_SLAB_QUANTUM)
+#define STRING_SLAB_BLOCK_SIZE  8192
+/* Blocks are carved out of chunks of this many blocks */
+#define STRING_SLAB_CHUNK_NBLOCKS   16
+
+typedef struct SlabFreeElem
+{
+    struct SlabFreeElem *next_free;
+} SlabFreeElem;
+
+typedef struct StringSlab
+{
+    SlabFreeElem *free_head;
+    char *raw_alloc;
+    apr_size_t nalloc_unused;
+} StringSlab;
+
+typedef struct StringSlabSet
+{
+    StringSlab slabs[STRING_SLAB_NCLASSES];
+    /* Elements freed by other threads, most recent first */
+    SlabFreeElem *volatile remote_free[STRING_SLAB_NCLASSES];
+    /* Unused blocks of the current chunk */
+    char *chunk_next;
+    int chunk_nunused;
+    struct StringSlabSet *next_orphan;
+} StringSlabSet;
+
+/*
+ * The header of each block. It occupies the first STRING_SLAB_QUANTUM bytes
+ * of the block, so elements remain aligned.
+ */
+typedef struct SlabBlockHeader
+{
+    StringSlabSet *owner;
+} SlabBlockHeader;
+
+static __thread StringSlabSet *my_slab_set;
+/* The slab sets of threads that have exited */
+static StringSlabSet *volatile orphan_slab_sets;
+
+/*
+ * Push the list of elements from "head" to "tail" onto a lock-free stack. If
+ * the compare-and-swap fails, it returns the current head of the stack,
+ * which we try again with.
+ */
+static void
+slab_stack_push(void *volatile *stack, void *head, void **tail_next)
+{
+    void *old_head = NULL;
+
+    while (true)
+    {
+        void *cur_head;
+
+        *tail_next = old_head;
+        cur_head = apr_atomic_casptr((volatile void **) stack, head,
+                                     old_head);
+        if (cur_head == old_head)
+            break;
+
+        old_head = cur_head;
+    }
+}
+
+static StringSlabSet *
+string_slab_set_get(void)
+{
+    StringSlabSet *set;
+    StringSlabSet *rest;
+
+    if (my_slab_set != NULL)
+        return my_slab_set;
+
+    /*
+     * Adopt an orphaned slab set, if any. We take the whole list, so that
+     * no other thread can be reading the next pointer we're about to
+     * follow, and give back the rest.
+     */
+    set = apr_atomic_xchgptr((volatile void **) &orphan_slab_sets, NULL);
+    if (set != NULL)
+    {
+        rest = set->next_orphan;
+        if (rest != NULL)
+        {
+            StringSlabSet *tail = rest;
+
+            while (tail->next_orphan != NULL)
+                tail = tail->next_orphan;
+
+            slab_stack_push((void *volatile *) &orphan_slab_sets, rest,
+                            (void **) &tail->next_orphan);
+        }
+    }
+    else
+    {
+        set = ol_alloc0(sizeof(*set));
+    }
+
+    set->next_orphan = NULL;
+    my_slab_set = set;
+    return set;
+}
+
+/*
+ * Called by a thread that is about to exit, after it has freed any strings
+ * it is going to.
+ */
+void
+string_slab_thread_exit(void)
+{
+    StringSlabSet *set = my_slab_set;
+
+    if (set == NULL)
+        return;
+
+    my_slab_set = NULL;
+    slab_stack_push((void *volatile *) &orphan_slab_sets, set,
+                    (void **) &set->next_orphan);
+}
+
+/*
+ * Start a new block for "slab", which belongs to "set".
+ */
+static void
+string_slab_new_block(StringSlabSet *set, StringSlab *slab,
+                      apr_size_t elem_size)
+{
+    SlabBlockHeader *header;
+
+    if (set->chunk_nunused == 0)
+    {
+        char *chunk;
+
+        /* Leave room to align the first block */
+        chunk = ol_alloc((STRING_SLAB_CHUNK_NBLOCKS + 1) *
+                         STRING_SLAB_BLOCK_SIZE);
+        set->chunk_next = (char *) APR_ALIGN((apr_uintptr_t) chunk,
+                                             STRING_SLAB_BLOCK_SIZE);
+        set->chunk_nunused = STRING_SLAB_CHUNK_NBLOCKS;
+    }
+
+    header = (SlabBlockHeader *) set->chunk_next;
+    header->owner = set;
+    set->chunk_next += STRING_SLAB_BLOCK_SIZE;
+    set->chunk_nunused--;
+
+    slab->raw_alloc = ((char *) header) + STRING_SLAB_QUANTUM;
+    slab->nalloc_unused = (STRING_SLAB_BLOCK_SIZE - STRING_SLAB_QUANTUM) /
+                          elem_size;
+}
+
+static void *
+string_slab_alloc(apr_size_t sz)
+{
+    StringSlabSet *set;
+    StringSlab *slab;
+    apr_size_t elem_size;
+    int size_class;
+    void *result;
+
+    if (sz > STRING_SLAB_MAX)
+        return ol_alloc(sz);
+
+    set = string_slab_set_get();
+    size_class = (sz - 1) / STRING_SLAB_QUANTUM;
+    slab = &set->slabs[size_class];
+
+    /* Reclaim the elements that other threads have freed */
+    if (slab->free_head == NULL && set->remote_free[size_class] != NULL)
+        slab->free_head = apr_atomic_xchgptr(
+                            (volatile void **) &set->remote_free[size_class],
+                            NULL);
+
+    if (slab->free_head != NULL)
+    {
+        result = slab->free_head;
+        slab->free_head = slab->free_head->next_free;
+        return result;
+    }
+
+    elem_size = APR_ALIGN(sz, STRING_SLAB_QUANTUM);
+    if (slab->nalloc_unused == 0)
+        string_slab_new_block(set, slab, elem_size);
+
+    result = slab->raw_alloc;
+    slab->raw_alloc += elem_size;
+    slab->nalloc_unused--;
+
+    return result;
+}
+
+static void
+string_slab_free(void *ptr, apr_size_t sz)
+{
+    SlabBlockHeader *header;
+    StringSlabSet *owner;
+    SlabFreeElem *elem;
+    int size_class;
+
+    if (sz > STRING_SLAB_MAX)
+    {
+        ol_free(ptr);
+        return;
+    }
+
+    header = (SlabBlockHeader *) ((apr_uintptr_t) ptr &
+                                  ~((apr_uintptr_t) STRING_SLAB_BLOCK_SIZE - 1));
+    owner = header->owner;
+    size_class = (sz - 1) / STRING_SLAB_QUANTUM;
+    elem = (SlabFreeElem *) ptr;
+
+    if (owner == my_slab_set)
+    {
+        StringSlab *slab = &owner->slabs[size_class];
+
+        elem->next_free = slab->free_head;
+        slab->free_head = elem;
+    }
+    else
+    {
+        slab_stack_push((void *volatile *) &owner->remote_free[size_class],
+                        elem, (void **) &elem->next_free);
+    }
 }
 
 static void
@@ -206,14 +470,14 @@ string_unpin(C4String *s)
     ASSERT(s->refcount >= 1);
     s->refcount--;
     if (s->refcount == 0)
-        ol_free(s);
+        string_slab_free(s, offsetof(C4String, data) + s->len);
 }
 
 /* XXX: Consider inlining this function */
 Datum
 datum_copy(Datum in, DataType type)
 {
-    if (type == TYPE_STRING)
+    if (type == TYPE_STRING && !string_is_inline(in))
         string_pin(in.s);
 
     return in;
@@ -223,7 +487,7 @@ datum_copy(Datum in, DataType type)
 void
 datum_free(Datum in, DataType type)
 {
-    if (type == TYPE_STRING)
+    if (type == TYPE_STRING && !string_is_inline(in))
         string_unpin(in.s);
 }
 
@@ -246,7 +510,7 @@ void
 pool_track_datum(apr_pool_t *pool, Datum datum, DataType type)
 {
     /* Right now, strings are the only pass-by-ref datums */
-    if (type == TYPE_STRING)
+    if (type == TYPE_STRING && !string_is_inline(datum))
         apr_pool_cleanup_register(pool, datum.s, datum_cleanup,
                                   apr_pool_cleanup_null);
 }
@@ -320,30 +584,45 @@ int_from_str(const char *str)
     return result;
 }
 
-C4String *
-make_string(apr_size_t slen)
+/*
+ * Make a string of "slen" bytes, store it in "*result", and return a pointer
+ * to the string's (uninitialized) content. If the string is stored inline,
+ * the pointer refers to "*result" itself.
+ */
+char *
+make_string(apr_size_t slen, Datum *result)
 {
     C4String *s;
 
-    s = ol_alloc(offsetof(C4String, data) + (slen * sizeof(char)));
+    if (slen <= STRING_INLINE_MAX)
+    {
+        result->i8 = (apr_int64_t) ((slen << 1) | 1);
+        return (char *) result + STRING_INLINE_OFFSET;
+    }
+
+    s = string_slab_alloc(offsetof(C4String, data) + (slen * sizeof(char)));
     s->len = slen;
     s->refcount = 1;
-    return s;
+    result->s = s;
+    return s->data;
 }
 
-/* FIXME */
 Datum
-string_from_str(const char *str)
+string_from_data(const char *data, apr_size_t slen)
 {
-    apr_size_t slen;
     Datum result;
 
-    slen = strlen(str);
-    result.s = make_string(slen);
-    memcpy(result.s->data, str, slen);
+    memcpy(make_string(slen, &result), data, slen);
     return result;
 }
 
+/* FIXME */
+Datum
+string_from_str(const char *str)
+{
+    return string_from_data(str, strlen(str));
+}
+
 void
 bool_to_str(Datum d, StrBuf *buf)
 {
@@ -371,8 +650,7 @@ int_to_str(Datum d, StrBuf *buf)
 void
 string_to_str(Datum d, StrBuf *buf)
 {
-    C4String *s = d.s;
-    sbuf_append_data(buf, s->data, s->len);
+    sbuf_append_data(buf, string_data(&d), string_len(d));
 }
 
 /*
@@ -383,8 +661,7 @@ string_to_str(Datum d, StrBuf *buf)
 char *
 string_to_text(Datum d, apr_pool_t *pool)
 {
-    C4String *s = d.s;
-    return apr_pstrmemdup(pool, s->data, s->len);
+    return apr_pstrmemdup(pool, string_data(&d), string_len(d));
 }
 
 Datum
@@ -432,16 +709,32 @@ int_from_buf(StrBuf *buf)
     return result;
 }
 
-/* FIXME */
+/*
+ * In the binary format, a string's length is sent as a varint: 7 bits per
+ * byte, least-significant group first, with the high bit set on all but the
+ * last byte. Most strings are short, so this usually takes a single byte.
+ */
 Datum
 string_from_buf(StrBuf *buf)
 {
     Datum result;
     apr_uint32_t slen;
+    unsigned char c;
+    int shift;
+
+    slen = 0;
+    shift = 0;
+    do
+    {
+        if (shift > 28)
+            ERROR("Malformed string length in binary input");
 
-    slen = ntohl(sbuf_read_int32(buf));
-    result.s = make_string(slen);
-    sbuf_read_data(buf, result.s->data, slen);
+        c = sbuf_read_char(buf);
+        slen |= (apr_uint32_t) (c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    sbuf_read_data(buf, make_string(slen, &result), slen);
     return result;
 }
 
@@ -488,12 +781,15 @@ int_to_buf(Datum d, StrBuf *buf)
 void
 string_to_buf(Datum d, StrBuf *buf)
 {
-    C4String *s = d.s;
-    apr_uint32_t net_len;
+    apr_uint32_t slen = string_len(d);
 
-    net_len = htonl(s->len);
-    sbuf_append_data(buf, (char *) &net_len, sizeof(net_len));
-    sbuf_append_data(buf, s->data, s->len);
+    while (slen >= 0x80)
+    {
+        sbuf_append_char(buf, (char) ((slen & 0x7F) | 0x80));
+        slen >>= 7;
+    }
+    sbuf_append_char(buf, (char) slen);
+    sbuf_append_data(buf, string_data(&d), string_len(d));
 }
 
 void
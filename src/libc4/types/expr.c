@@ -1,353 +1,483 @@
 #include "c4-internal.h"
+#include "types/catalog.h"
 #include "types/expr.h"
 
-static Datum
-eval_op_uminus_i8(ExprState *state)
+/*
+ * Expressions that contain operators are compiled into a flat program for a
+ * simple register machine, which avoids walking the expression tree (and
+ * re-checking operand types) on every evaluation. Each instruction reads
+ * its operands from registers and writes its result to a register.
+ * Constants are placed in their registers when the program is compiled, and
+ * each column referenced by the expression is loaded once per evaluation.
+ * Integer operators have type-specialized opcodes; comparisons of other
+ * types call the type's comparison function, which is looked up when the
+ * program is compiled.
+ */
+typedef enum ExprOpcode
 {
-    Datum lhs;
-    Datum result;
-
-    ASSERT(state->lhs->expr->type == TYPE_INT);
-    ASSERT(state->expr->type == TYPE_INT);
-
-    lhs = eval_expr(state->lhs);
-    result.i8 = -(lhs.i8);
-    return result;
-}
+    EOP_LOAD_INNER,
+    EOP_LOAD_OUTER,
+    EOP_NEG_I8,
+    EOP_ADD_I8,
+    EOP_SUB_I8,
+    EOP_MUL_I8,
+    EOP_DIV_I8,
+    EOP_MOD_I8,
+    EOP_ADD_D8,
+    EOP_SUB_D8,
+    EOP_MUL_D8,
+    EOP_CONCAT_STR,
+    EOP_EQ_I8,
+    EOP_NEQ_I8,
+    EOP_LT_I8,
+    EOP_LTE_I8,
+    EOP_GT_I8,
+    EOP_GTE_I8,
+    EOP_EQ,
+    EOP_NEQ,
+    EOP_LT,
+    EOP_LTE,
+    EOP_GT,
+    EOP_GTE,
+    EOP_CHECK                   /* If lhs is false, the program returns false */
+} ExprOpcode;
+
+typedef struct ExprInstr
+{
+    ExprOpcode opcode;
+    int dst;
+    int lhs;                    /* Register number, or attno for loads */
+    int rhs;
+    datum_eq_func eq_func;      /* EOP_EQ and EOP_NEQ */
+    datum_cmp_func cmp_func;    /* EOP_LT, EOP_LTE, EOP_GT and EOP_GTE */
+} ExprInstr;
+
+struct ExprProgram
+{
+    int ninstrs;
+    ExprInstr *instrs;
+    Datum *regs;                /* Might be shared with other programs */
+    int result;                 /* Register that holds the program's result */
+};
+
+/*
+ * Compilation state. Several programs can be compiled into the same set of
+ * registers, in which case each program reuses the values computed by the
+ * programs compiled before it: they must then be evaluated in that order.
+ * Each value is computed once (value numbering): before emitting an
+ * instruction, we look for an earlier instruction with the same opcode and
+ * operands. Likewise, equal constants share a register.
+ */
+typedef struct ExprCompiler
+{
+    ExprProgram *prog;          /* The program we're emitting code into */
+    int nregs;
+    Datum *regs;
+    ExprConst **reg_consts;     /* The constant in each register, if any */
+    int nvalues;
+    ExprInstr **values;         /* The instructions that compute each value */
+} ExprCompiler;
 
 static Datum
-eval_op_plus_string(ExprState *state)
+concat_strings(Datum lhs, Datum rhs)
 {
-    Datum lhs;
-    Datum rhs;
     Datum result;
+    apr_size_t lhs_len;
+    apr_size_t rhs_len;
+    char *data;
 
-    ASSERT(state->lhs->expr->type == TYPE_STRING);
-    ASSERT(state->rhs->expr->type == TYPE_STRING);
-    ASSERT(state->expr->type == TYPE_STRING);
-
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
+    lhs_len = string_len(lhs);
+    rhs_len = string_len(rhs);
     /* XXX: FIXME */
-    result.s = make_string(lhs.s->len + rhs.s->len);
-    memcpy(result.s->data, lhs.s->data, lhs.s->len);
-    memcpy(result.s->data + lhs.s->len, rhs.s->data, rhs.s->len);
+    data = make_string(lhs_len + rhs_len, &result);
+    memcpy(data, string_data(&lhs), lhs_len);
+    memcpy(data + lhs_len, string_data(&rhs), rhs_len);
 
     return result;
 }
 
 static Datum
-eval_op_plus_i8(ExprState *state)
+eval_program(ExprState *state)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
+    ExprProgram *prog = state->prog;
+    ExprEvalContext *cxt = state->cxt;
+    Datum *regs = prog->regs;
+    ExprInstr *ip;
+    ExprInstr *end;
 
-    ASSERT(state->lhs->expr->type == TYPE_INT);
-    ASSERT(state->rhs->expr->type == TYPE_INT);
-    ASSERT(state->expr->type == TYPE_INT);
+    end = prog->instrs + prog->ninstrs;
+    for (ip = prog->instrs; ip < end; ip++)
+    {
+        Datum *dst = &regs[ip->dst];
+
+        switch (ip->opcode)
+        {
+            case EOP_LOAD_INNER:
+                if (cxt->inner_vals != NULL)
+                    *dst = cxt->inner_vals[ip->lhs];
+                else
+                    *dst = tuple_get_val(cxt->inner, ip->lhs,
+                                         cxt->inner_schema);
+                break;
+
+            case EOP_LOAD_OUTER:
+                ASSERT(cxt->outer != NULL);
+                *dst = tuple_get_val(cxt->outer, ip->lhs, cxt->outer_schema);
+                break;
+
+            case EOP_NEG_I8:
+                dst->i8 = -(regs[ip->lhs].i8);
+                break;
+
+            /* XXX: check for overflow? */
+            case EOP_ADD_I8:
+                dst->i8 = regs[ip->lhs].i8 + regs[ip->rhs].i8;
+                break;
+
+            case EOP_SUB_I8:
+                dst->i8 = regs[ip->lhs].i8 - regs[ip->rhs].i8;
+                break;
+
+            case EOP_MUL_I8:
+                dst->i8 = regs[ip->lhs].i8 * regs[ip->rhs].i8;
+                break;
+
+            /* XXX: error checking? e.g. divide by zero */
+            case EOP_DIV_I8:
+                dst->i8 = regs[ip->lhs].i8 / regs[ip->rhs].i8;
+                break;
+
+            case EOP_MOD_I8:
+                dst->i8 = regs[ip->lhs].i8 % regs[ip->rhs].i8;
+                break;
+
+            case EOP_ADD_D8:
+                dst->d8 = regs[ip->lhs].d8 + regs[ip->rhs].d8;
+                break;
+
+            case EOP_SUB_D8:
+                dst->d8 = regs[ip->lhs].d8 - regs[ip->rhs].d8;
+                break;
+
+            case EOP_MUL_D8:
+                dst->d8 = regs[ip->lhs].d8 * regs[ip->rhs].d8;
+                break;
+
+            case EOP_CONCAT_STR:
+                *dst = concat_strings(regs[ip->lhs], regs[ip->rhs]);
+                break;
+
+            case EOP_EQ_I8:
+                dst->b = (regs[ip->lhs].i8 == regs[ip->rhs].i8);
+                break;
+
+            case EOP_NEQ_I8:
+                dst->b = (regs[ip->lhs].i8 != regs[ip->rhs].i8);
+                break;
+
+            case EOP_LT_I8:
+                dst->b = (regs[ip->lhs].i8 < regs[ip->rhs].i8);
+                break;
+
+            case EOP_LTE_I8:
+                dst->b = (regs[ip->lhs].i8 <= regs[ip->rhs].i8);
+                break;
+
+            case EOP_GT_I8:
+                dst->b = (regs[ip->lhs].i8 > regs[ip->rhs].i8);
+                break;
+
+            case EOP_GTE_I8:
+                dst->b = (regs[ip->lhs].i8 >= regs[ip->rhs].i8);
+                break;
+
+            case EOP_EQ:
+                dst->b = ip->eq_func(regs[ip->lhs], regs[ip->rhs]);
+                break;
+
+            case EOP_NEQ:
+                dst->b = !ip->eq_func(regs[ip->lhs], regs[ip->rhs]);
+                break;
+
+            case EOP_LT:
+                dst->b = (ip->cmp_func(regs[ip->lhs], regs[ip->rhs]) < 0);
+                break;
+
+            case EOP_LTE:
+                dst->b = (ip->cmp_func(regs[ip->lhs], regs[ip->rhs]) <= 0);
+                break;
+
+            case EOP_GT:
+                dst->b = (ip->cmp_func(regs[ip->lhs], regs[ip->rhs]) > 0);
+                break;
+
+            case EOP_GTE:
+                dst->b = (ip->cmp_func(regs[ip->lhs], regs[ip->rhs]) >= 0);
+                break;
+
+            case EOP_CHECK:
+                if (regs[ip->lhs].b == false)
+                    return regs[ip->lhs];
+                break;
+        }
+    }
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    /* XXX: check for overflow? */
-    result.i8 = lhs.i8 + rhs.i8;
-    return result;
+    return regs[prog->result];
 }
 
 static Datum
-eval_op_minus_i8(ExprState *state)
+eval_var_expr(ExprState *state)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
-
-    ASSERT(state->lhs->expr->type == TYPE_INT);
-    ASSERT(state->rhs->expr->type == TYPE_INT);
-    ASSERT(state->expr->type == TYPE_INT);
+    ExprVar *var = (ExprVar *) state->expr;
+    ExprEvalContext *cxt = state->cxt;
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    /* XXX: check for underflow? */
-    result.i8 = lhs.i8 - rhs.i8;
-    return result;
+    /* XXX: bump refcount for pass-by-ref datums? */
+    if (var->is_outer)
+    {
+        ASSERT(cxt->outer != NULL);
+        return tuple_get_val(cxt->outer, var->attno, cxt->outer_schema);
+    }
+    else if (cxt->inner_vals != NULL)
+    {
+        return cxt->inner_vals[var->attno];
+    }
+    else
+    {
+        ASSERT(cxt->inner != NULL);
+        return tuple_get_val(cxt->inner, var->attno, cxt->inner_schema);
+    }
 }
 
 static Datum
-eval_op_times_i8(ExprState *state)
+eval_const_expr(ExprState *state)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
-
-    ASSERT(state->lhs->expr->type == TYPE_INT);
-    ASSERT(state->rhs->expr->type == TYPE_INT);
-    ASSERT(state->expr->type == TYPE_INT);
+    ExprConst *c_expr = (ExprConst *) state->expr;
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    /* XXX: check for overflow? */
-    result.i8 = lhs.i8 * rhs.i8;
-    return result;
+    /* XXX: bump refcount for pass-by-ref datums? */
+    return c_expr->value;
 }
 
-static Datum
-eval_op_divide_i8(ExprState *state)
+/*
+ * Return an upper bound on the number of instructions (and registers)
+ * needed to evaluate the expression.
+ */
+static int
+count_expr_nodes(ExprNode *expr)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
-
-    ASSERT(state->lhs->expr->type == TYPE_INT);
-    ASSERT(state->rhs->expr->type == TYPE_INT);
-    ASSERT(state->expr->type == TYPE_INT);
-
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    /* XXX: error checking? e.g. divide by zero */
-    /* XXX: should the return type be integer or float? */
-    result.i8 = lhs.i8 / rhs.i8;
-    return result;
-}
+    ExprOp *op_expr;
+    int result;
 
-static Datum
-eval_op_modulus_i8(ExprState *state)
-{
-    Datum lhs;
-    Datum rhs;
-    Datum result;
+    if (expr->node.kind != EXPR_OP)
+        return 1;
 
-    ASSERT(state->lhs->expr->type == TYPE_INT);
-    ASSERT(state->rhs->expr->type == TYPE_INT);
-    ASSERT(state->expr->type == TYPE_INT);
+    op_expr = (ExprOp *) expr;
+    result = 1 + count_expr_nodes(op_expr->lhs);
+    if (op_expr->rhs)
+        result += count_expr_nodes(op_expr->rhs);
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    /* XXX: error checking?  */
-    result.i8 = lhs.i8 % rhs.i8;
     return result;
 }
 
-static Datum
-eval_op_plus_d8(ExprState *state)
+static void
+compiler_init(ExprCompiler *comp, int max_regs, apr_pool_t *pool)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
-
-    ASSERT(state->lhs->expr->type == TYPE_DOUBLE);
-    ASSERT(state->rhs->expr->type == TYPE_DOUBLE);
-    ASSERT(state->expr->type == TYPE_DOUBLE);
-
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    result.d8 = lhs.d8 + rhs.d8;
-    return result;
+    comp->prog = NULL;
+    comp->nregs = 0;
+    comp->regs = apr_pcalloc(pool, max_regs * sizeof(*comp->regs));
+    comp->reg_consts = apr_pcalloc(pool, max_regs * sizeof(*comp->reg_consts));
+    comp->nvalues = 0;
+    comp->values = apr_palloc(pool, max_regs * sizeof(*comp->values));
 }
 
-static Datum
-eval_op_minus_d8(ExprState *state)
+static ExprProgram *
+compiler_begin_program(ExprCompiler *comp, int max_instrs, apr_pool_t *pool)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
+    ExprProgram *prog;
 
-    ASSERT(state->lhs->expr->type == TYPE_DOUBLE);
-    ASSERT(state->rhs->expr->type == TYPE_DOUBLE);
-    ASSERT(state->expr->type == TYPE_DOUBLE);
+    prog = apr_palloc(pool, sizeof(*prog));
+    prog->ninstrs = 0;
+    prog->instrs = apr_pcalloc(pool, max_instrs * sizeof(*prog->instrs));
+    prog->regs = comp->regs;
+    prog->result = -1;
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    result.d8 = lhs.d8 - rhs.d8;
-    return result;
+    comp->prog = prog;
+    return prog;
 }
 
-static Datum
-eval_op_times_d8(ExprState *state)
+static ExprInstr *
+append_instr(ExprCompiler *comp, ExprOpcode opcode, int dst, int lhs, int rhs)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
+    ExprProgram *prog = comp->prog;
+    ExprInstr *instr;
 
-    ASSERT(state->lhs->expr->type == TYPE_DOUBLE);
-    ASSERT(state->rhs->expr->type == TYPE_DOUBLE);
-    ASSERT(state->expr->type == TYPE_DOUBLE);
+    instr = &prog->instrs[prog->ninstrs++];
+    instr->opcode = opcode;
+    instr->dst = dst;
+    instr->lhs = lhs;
+    instr->rhs = rhs;
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    result.d8 = lhs.d8 * rhs.d8;
-    return result;
+    return instr;
 }
 
-static Datum
-eval_op_eq(ExprState *state)
+/*
+ * Return an instruction that computes "lhs opcode rhs" into a register,
+ * either by finding an existing one or by emitting a new one.
+ */
+static ExprInstr *
+emit_value(ExprCompiler *comp, ExprOpcode opcode, int lhs, int rhs)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
+    ExprInstr *instr;
+    int i;
 
-    ASSERT(state->lhs->expr->type == state->rhs->expr->type);
-    ASSERT(state->expr->type == TYPE_BOOL);
+    for (i = 0; i < comp->nvalues; i++)
+    {
+        instr = comp->values[i];
+        if (instr->opcode == opcode && instr->lhs == lhs && instr->rhs == rhs)
+            return instr;
+    }
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    result.b = datum_equal(lhs, rhs, state->lhs->expr->type);
-    return result;
+    instr = append_instr(comp, opcode, comp->nregs++, lhs, rhs);
+    comp->values[comp->nvalues++] = instr;
+    return instr;
 }
 
-static Datum
-eval_op_neq(ExprState *state)
+static int
+compile_const_expr(ExprCompiler *comp, ExprConst *c_expr)
 {
-    Datum lhs;
-    Datum rhs;
-    Datum result;
+    int reg;
 
-    ASSERT(state->lhs->expr->type == state->rhs->expr->type);
-    ASSERT(state->expr->type == TYPE_BOOL);
+    for (reg = 0; reg < comp->nregs; reg++)
+    {
+        ExprConst *other = comp->reg_consts[reg];
 
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-    result.b = datum_equal(lhs, rhs, state->lhs->expr->type) ? false : true;
-    return result;
+        if (other != NULL && other->expr.type == c_expr->expr.type &&
+            datum_equal(other->value, c_expr->value, other->expr.type))
+            return reg;
+    }
+
+    /* XXX: bump refcount for pass-by-ref datums? */
+    reg = comp->nregs++;
+    comp->regs[reg] = c_expr->value;
+    comp->reg_consts[reg] = c_expr;
+    return reg;
 }
 
-static Datum
-eval_op_logical(ExprState *state)
+static ExprOpcode
+cmp_opcode(AstOperKind op_kind, bool is_int)
 {
-    ExprOp *op = (ExprOp *) state->expr;
-    Datum lhs;
-    Datum rhs;
-    Datum result;
-    int cmp_result;
-
-    ASSERT(state->lhs->expr->type == state->rhs->expr->type);
-    ASSERT(state->expr->type == TYPE_BOOL);
-
-    lhs = eval_expr(state->lhs);
-    rhs = eval_expr(state->rhs);
-
-    cmp_result = datum_cmp(lhs, rhs, state->lhs->expr->type);
-    switch (op->op_kind)
+    switch (op_kind)
     {
         case AST_OP_LT:
-            result.b = (cmp_result < 0 ? true : false);
-            break;
+            return is_int ? EOP_LT_I8 : EOP_LT;
 
         case AST_OP_LTE:
-            result.b = (cmp_result <= 0 ? true : false);
-            break;
+            return is_int ? EOP_LTE_I8 : EOP_LTE;
 
         case AST_OP_GT:
-            result.b = (cmp_result > 0 ? true : false);
-            break;
+            return is_int ? EOP_GT_I8 : EOP_GT;
 
         case AST_OP_GTE:
-            result.b = (cmp_result >= 0 ? true : false);
-            break;
+            return is_int ? EOP_GTE_I8 : EOP_GTE;
 
-        default:
-            ERROR("Unexpected op kind: %d", (int) op->op_kind);
-    }
-
-    return result;
-}
+        case AST_OP_EQ:
+            return is_int ? EOP_EQ_I8 : EOP_EQ;
 
-static Datum
-eval_var_expr(ExprState *state)
-{
-    ExprVar *var = (ExprVar *) state->expr;
-    ExprEvalContext *cxt = state->cxt;
+        case AST_OP_NEQ:
+            return is_int ? EOP_NEQ_I8 : EOP_NEQ;
 
-    /* XXX: bump refcount for pass-by-ref datums? */
-    if (var->is_outer)
-    {
-        ASSERT(cxt->outer != NULL);
-        return tuple_get_val(cxt->outer, var->attno);
-    }
-    else
-    {
-        ASSERT(cxt->inner != NULL);
-        return tuple_get_val(cxt->inner, var->attno);
+        default:
+            ERROR("Unexpected op kind: %d", (int) op_kind);
     }
 }
 
-static Datum
-eval_const_expr(ExprState *state)
+static int compile_expr(ExprCompiler *comp, ExprNode *expr);
+
+static int
+compile_op_expr(ExprCompiler *comp, ExprOp *op_expr)
 {
-    ExprConst *c_expr = (ExprConst *) state->expr;
+    DataType type = op_expr->lhs->type;
+    bool is_double;
+    ExprInstr *instr;
+    int lhs;
+    int rhs;
 
-    /* XXX: bump refcount for pass-by-ref datums? */
-    return c_expr->value;
-}
+    lhs = compile_expr(comp, op_expr->lhs);
+    rhs = (op_expr->rhs != NULL) ? compile_expr(comp, op_expr->rhs) : -1;
+    is_double = (type == TYPE_DOUBLE &&
+                 op_expr->rhs != NULL && op_expr->rhs->type == TYPE_DOUBLE);
 
-static eval_expr_func
-lookup_op_expr_eval_func(ExprOp *op_expr)
-{
     switch (op_expr->op_kind)
     {
         case AST_OP_UMINUS:
-            return eval_op_uminus_i8;
+            ASSERT(type == TYPE_INT);
+            return emit_value(comp, EOP_NEG_I8, lhs, rhs)->dst;
 
         case AST_OP_PLUS:
-            if (op_expr->lhs->type == TYPE_STRING &&
-                op_expr->rhs->type == TYPE_STRING)
-                return eval_op_plus_string;
-            else if (op_expr->lhs->type == TYPE_DOUBLE &&
-                     op_expr->rhs->type == TYPE_DOUBLE)
-                return eval_op_plus_d8;
-            else
-                return eval_op_plus_i8;
+            if (type == TYPE_STRING && op_expr->rhs->type == TYPE_STRING)
+                return emit_value(comp, EOP_CONCAT_STR, lhs, rhs)->dst;
+            return emit_value(comp, is_double ? EOP_ADD_D8 : EOP_ADD_I8,
+                              lhs, rhs)->dst;
 
         case AST_OP_MINUS:
-            if (op_expr->lhs->type == TYPE_DOUBLE &&
-                op_expr->rhs->type == TYPE_DOUBLE)
-                return eval_op_minus_d8;
-            else
-                return eval_op_minus_i8;
+            return emit_value(comp, is_double ? EOP_SUB_D8 : EOP_SUB_I8,
+                              lhs, rhs)->dst;
 
         case AST_OP_TIMES:
-            if (op_expr->lhs->type == TYPE_DOUBLE &&
-                op_expr->rhs->type == TYPE_DOUBLE)
-                return eval_op_times_d8;
-            else
-                return eval_op_times_i8;
+            return emit_value(comp, is_double ? EOP_MUL_D8 : EOP_MUL_I8,
+                              lhs, rhs)->dst;
 
+        /* XXX: should the return type of division be integer or float? */
         case AST_OP_DIVIDE:
-            return eval_op_divide_i8;
+            return emit_value(comp, EOP_DIV_I8, lhs, rhs)->dst;
 
         case AST_OP_MODULUS:
-            return eval_op_modulus_i8;
+            return emit_value(comp, EOP_MOD_I8, lhs, rhs)->dst;
 
         case AST_OP_LT:
         case AST_OP_LTE:
         case AST_OP_GT:
         case AST_OP_GTE:
-            return eval_op_logical;
-
         case AST_OP_EQ:
-            return eval_op_eq;
-
         case AST_OP_NEQ:
-            return eval_op_neq;
+            ASSERT(type == op_expr->rhs->type);
+            ASSERT(op_expr->expr.type == TYPE_BOOL);
+            instr = emit_value(comp,
+                               cmp_opcode(op_expr->op_kind,
+                                          type == TYPE_INT),
+                               lhs, rhs);
+            if (instr->opcode == EOP_EQ || instr->opcode == EOP_NEQ)
+                instr->eq_func = type_get_eq_func(type);
+            else
+                instr->cmp_func = type_get_cmp_func(type);
+            return instr->dst;
 
-        /* AST_OP_UMINUS is handled above */
         default:
             ERROR("Unexpected op kind: %d", (int) op_expr->op_kind);
     }
 }
 
-static eval_expr_func
-lookup_expr_eval_func(ExprNode *expr)
+/*
+ * Emit the instructions to evaluate "expr", and return the register that
+ * will hold its value.
+ */
+static int
+compile_expr(ExprCompiler *comp, ExprNode *expr)
 {
+    ExprVar *var;
+
     switch (expr->node.kind)
     {
         case EXPR_OP:
-            return lookup_op_expr_eval_func((ExprOp *) expr);
+            return compile_op_expr(comp, (ExprOp *) expr);
 
         case EXPR_VAR:
-            return eval_var_expr;
+            var = (ExprVar *) expr;
+            return emit_value(comp,
+                              var->is_outer ? EOP_LOAD_OUTER : EOP_LOAD_INNER,
+                              var->attno, -1)->dst;
 
         case EXPR_CONST:
-            return eval_const_expr;
+            return compile_const_expr(comp, (ExprConst *) expr);
 
         default:
             ERROR("Unexpected node kind: %d", (int) expr->node.kind);
@@ -358,48 +488,117 @@ ExprState *
 make_expr_state(ExprNode *expr, ExprEvalContext *cxt, apr_pool_t *pool)
 {
     ExprState *expr_state;
+    ExprCompiler comp;
+    int max_instrs;
 
     expr_state = apr_pcalloc(pool, sizeof(*expr_state));
     expr_state->cxt = cxt;
     expr_state->expr = expr;
-    expr_state->expr_func = lookup_expr_eval_func(expr_state->expr);
 
-    /*
-     * XXX: Slightly ugly, but we need to down-cast to determine whether we
-     * need to initialize sub-ExprStates.
-     */
-    if (expr->node.kind == EXPR_OP)
+    /* Vars and consts are cheap enough to evaluate directly */
+    switch (expr->node.kind)
     {
-        ExprOp *op_expr = (ExprOp *) expr;
+        case EXPR_OP:
+            max_instrs = count_expr_nodes(expr);
+            compiler_init(&comp, max_instrs, pool);
+            expr_state->prog = compiler_begin_program(&comp, max_instrs, pool);
+            expr_state->prog->result = compile_expr(&comp, expr);
+            expr_state->expr_func = eval_program;
+            break;
+
+        case EXPR_VAR:
+            expr_state->expr_func = eval_var_expr;
+            break;
+
+        case EXPR_CONST:
+            expr_state->expr_func = eval_const_expr;
+            break;
 
-        expr_state->lhs = make_expr_state(op_expr->lhs, cxt, pool);
-        if (op_expr->rhs)
-            expr_state->rhs = make_expr_state(op_expr->rhs, cxt, pool);
+        default:
+            ERROR("Unexpected node kind: %d", (int) expr->node.kind);
     }
 
     return expr_state;
 }
 
-bool
-eval_qual_set(int nquals, ExprState **qual_ary)
+/*
+ * Compile a list of qualifiers into a single program, which returns true iff
+ * all the quals are satisfied. Quals are evaluated in order, and evaluation
+ * stops at the first qual that is not satisfied. If the list is empty, we
+ * return NULL (which eval_qual_set() treats as satisfied).
+ *
+ * If "nproj" > 0, the projection list in "proj_ary" is recompiled to reuse
+ * the values computed by the quals, such as columns and subexpressions that
+ * appear in both. The projection list must then only be evaluated when the
+ * quals have just been satisfied by the current input.
+ */
+ExprState *
+make_qual_set_state(List *qual_exprs, int nproj, ExprState **proj_ary,
+                    ExprEvalContext *cxt, apr_pool_t *pool)
 {
+    ExprState *expr_state;
+    ExprCompiler comp;
+    ExprProgram *prog;
+    ListCell *lc;
+    int max_regs;
+    int max_instrs;
     int i;
 
-    for (i = 0; i < nquals; i++)
+    if (list_is_empty(qual_exprs))
+        return NULL;
+
+    max_instrs = 0;
+    foreach (lc, qual_exprs)
     {
-        ExprState *qual_state = qual_ary[i];
-        Datum result;
+        ExprNode *expr = (ExprNode *) lc_ptr(lc);
 
         /*
          * Sanity check: we already require the return type of qual
          * expressions to be boolean in the analysis phase
          */
-        ASSERT(qual_state->expr->type == TYPE_BOOL);
+        ASSERT(expr->type == TYPE_BOOL);
+        max_instrs += count_expr_nodes(expr) + 1;
+    }
+
+    max_regs = max_instrs;
+    for (i = 0; i < nproj; i++)
+        max_regs += count_expr_nodes(proj_ary[i]->expr);
+
+    compiler_init(&comp, max_regs, pool);
+    prog = compiler_begin_program(&comp, max_instrs, pool);
+    foreach (lc, qual_exprs)
+    {
+        ExprNode *expr = (ExprNode *) lc_ptr(lc);
 
-        result = eval_expr(qual_state);
-        if (result.b == false)
-            return false;
+        prog->result = compile_expr(&comp, expr);
+
+        /* The last qual's value is the result of the program */
+        if (lc != list_tail(qual_exprs))
+            (void) append_instr(&comp, EOP_CHECK, prog->result,
+                                prog->result, -1);
+    }
+
+    expr_state = apr_pcalloc(pool, sizeof(*expr_state));
+    expr_state->cxt = cxt;
+    expr_state->expr = NULL;
+    expr_state->prog = prog;
+    expr_state->expr_func = eval_program;
+
+    for (i = 0; i < nproj; i++)
+    {
+        ExprState *proj_state = proj_ary[i];
+        ExprProgram *proj_prog;
+
+        if (proj_state->expr->node.kind != EXPR_OP)
+            continue;
+
+        ASSERT(proj_state->cxt == cxt);
+        proj_prog = compiler_begin_program(&comp,
+                                           count_expr_nodes(proj_state->expr),
+                                           pool);
+        proj_prog->result = compile_expr(&comp, proj_state->expr);
+        proj_state->prog = proj_prog;
     }
 
-    return true;
+    return expr_state;
 }
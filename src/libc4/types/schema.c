@@ -6,6 +6,7 @@
 #include "types/schema.h"
 
 static void lookup_type_funcs(Schema *schema, apr_pool_t *pool);
+static void compute_tuple_layout(Schema *schema, apr_pool_t *pool);
 static TuplePool *schema_new_tuple_pool(Schema *schema, C4Runtime *c4);
 
 Schema *
@@ -17,6 +18,7 @@ schema_make(int len, DataType *types, C4Runtime *c4, apr_pool_t *pool)
     schema->len = len;
     schema->types = apr_pmemdup(pool, types, len * sizeof(DataType));
     lookup_type_funcs(schema, pool);
+    compute_tuple_layout(schema, pool);
     schema->tuple_pool = schema_new_tuple_pool(schema, c4);
 
     return schema;
@@ -42,6 +44,7 @@ schema_make_from_ast(List *schema_ast, C4Runtime *c4, apr_pool_t *pool)
         i++;
     }
     lookup_type_funcs(schema, pool);
+    compute_tuple_layout(schema, pool);
     schema->tuple_pool = schema_new_tuple_pool(schema, c4);
 
     return schema;
@@ -62,6 +65,7 @@ schema_make_from_exprs(int len, ExprState **expr_ary, C4Runtime *c4, apr_pool_t
         schema->types[i] = expr_ary[i]->expr->type;
     }
     lookup_type_funcs(schema, pool);
+    compute_tuple_layout(schema, pool);
     schema->tuple_pool = schema_new_tuple_pool(schema, c4);
 
     return schema;
@@ -84,13 +88,86 @@ schema_equal(Schema *s1, Schema *s2)
     return true;
 }
 
+/*
+ * Returns the number of bytes used to store a value of the given type in a
+ * packed tuple. Pass-by-reference types are stored as a pointer.
+ */
+static int
+type_get_packed_width(DataType type)
+{
+    switch (type)
+    {
+        case TYPE_BOOL:
+        case TYPE_CHAR:
+            return 1;
+
+        case TYPE_DOUBLE:
+        case TYPE_INT:
+        case TYPE_STRING:
+            return sizeof(Datum);
+
+        default:
+            ERROR("Unexpected data type: %d", (int) type);
+            return 0;   /* Keep compiler quiet */
+    }
+}
+
+/*
+ * Assign each column an offset in the tuple's data area. We place the
+ * 8-byte columns first (in column order), followed by the 1-byte columns;
+ * since the data area is 8-byte aligned, this keeps every column aligned
+ * without any padding between columns.
+ */
+static void
+compute_tuple_layout(Schema *schema, apr_pool_t *pool)
+{
+    int offset;
+    int i;
+
+    schema->col_offsets = apr_palloc(pool, schema->len *
+                                     sizeof(*schema->col_offsets));
+    schema->col_widths = apr_palloc(pool, schema->len *
+                                    sizeof(*schema->col_widths));
+
+    schema->packed = false;
+    offset = 0;
+    for (i = 0; i < schema->len; i++)
+    {
+        schema->col_widths[i] = type_get_packed_width(schema->types[i]);
+        if (schema->col_widths[i] != sizeof(Datum))
+        {
+            schema->packed = true;
+            continue;
+        }
+
+        schema->col_offsets[i] = offset;
+        offset += sizeof(Datum);
+    }
+
+    for (i = 0; i < schema->len; i++)
+    {
+        if (schema->col_widths[i] == sizeof(Datum))
+            continue;
+
+        schema->col_offsets[i] = offset;
+        offset += schema->col_widths[i];
+    }
+}
+
 /*
  * Returns the size of a Tuple that has the given schema.
  */
 static apr_size_t
 schema_get_tuple_size(Schema *schema)
 {
-    return offsetof(Tuple, vals) + (schema->len * sizeof(Datum));
+    apr_size_t data_len = 0;
+    int i;
+
+    for (i = 0; i < schema->len; i++)
+        data_len += schema->col_widths[i];
+
+    /* Tuple pools hand out adjacent elements, so keep them aligned */
+    return APR_ALIGN_DEFAULT(offsetof(Tuple, data) + data_len);
 }
 
 static TuplePool *
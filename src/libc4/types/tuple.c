@@ -1,6 +1,7 @@
 #include "c4-internal.h"
 #include "types/catalog.h"
 #include "types/tuple.h"
+#include "util/hash_func.h"
 #include "util/socket.h"
 
 Tuple *
@@ -10,6 +11,7 @@ tuple_make_empty(Schema *s)
 
     t = tuple_pool_loan(s->tuple_pool);
     t->refcount = 1;
+    t->hash_valid = false;
     return t;
 }
 
@@ -17,10 +19,30 @@ Tuple *
 tuple_make(Schema *s, Datum *values)
 {
     Tuple *t;
+    int i;
 
     t = tuple_make_empty(s);
     /* XXX: pass-by-ref types? */
-    memcpy(t->vals, values, s->len * sizeof(Datum));
+    for (i = 0; i < s->len; i++)
+        tuple_set_val(t, i, values[i], s);
+
+    return t;
+}
+
+/*
+ * Like tuple_make(), but the new tuple takes its own reference to each
+ * pass-by-ref value.
+ */
+Tuple *
+tuple_make_copy(Schema *s, Datum *values)
+{
+    Tuple *t;
+    int i;
+
+    t = tuple_make_empty(s);
+    for (i = 0; i < s->len; i++)
+        tuple_set_val(t, i, datum_copy(values[i], schema_get_type(s, i)), s);
+
     return t;
 }
 
@@ -34,7 +56,7 @@ tuple_make_from_strings(Schema *s, char **values)
 
     for (i = 0; i < s->len; i++)
     {
-        tuple_get_val(t, i) = (s->text_in_funcs[i])(values[i]);
+        tuple_set_val(t, i, (s->text_in_funcs[i])(values[i]), s);
     }
 
     return t;
@@ -58,7 +80,7 @@ tuple_unpin(Tuple *tuple, Schema *s)
         int i;
 
         for (i = 0; i < s->len; i++)
-            datum_free(tuple_get_val(tuple, i),
+            datum_free(tuple_get_val(tuple, i, s),
                        schema_get_type(s, i));
 
         tuple_pool_return(s->tuple_pool, tuple);
@@ -72,8 +94,8 @@ tuple_equal(Tuple *t1, Tuple *t2, Schema *s)
 
     for (i = 0; i < s->len; i++)
     {
-        Datum val1 = tuple_get_val(t1, i);
-        Datum val2 = tuple_get_val(t2, i);
+        Datum val1 = tuple_get_val(t1, i, s);
+        Datum val2 = tuple_get_val(t2, i, s);
 
         if ((s->eq_funcs[i])(val1, val2) == false)
             return false;
@@ -88,16 +110,20 @@ tuple_hash(Tuple *tuple, Schema *s)
     apr_uint32_t result;
     int i;
 
+    if (tuple->hash_valid)
+        return tuple->hash;
+
     result = 37;
     for (i = 0; i < s->len; i++)
     {
-        Datum val = tuple_get_val(tuple, i);
+        Datum val = tuple_get_val(tuple, i, s);
         apr_uint32_t h = (s->hash_funcs[i])(val);
 
-        /* XXX: choose a better mixing function than XOR */
-        result ^= h;
+        result = hash_combine(result, h);
     }
 
+    tuple->hash = result;
+    tuple->hash_valid = true;
     return result;
 }
 
@@ -108,6 +134,10 @@ tuple_cmp_tbl(const void *k1, const void *k2, void *data)
     Tuple *t2 = (Tuple *) k2;
     Schema *s = (Schema *) data;
 
+    /* Tuples with different hash codes can't be equal */
+    if (t1->hash_valid && t2->hash_valid && t1->hash != t2->hash)
+        return false;
+
     return tuple_equal(t1, t2, s);
 }
 
@@ -146,7 +176,7 @@ tuple_to_str_buf(Tuple *tuple, Schema *s, StrBuf *buf)
         if (i != 0)
             sbuf_append_char(buf, ',');
 
-        (s->text_out_funcs[i])(tuple_get_val(tuple, i), buf);
+        (s->text_out_funcs[i])(tuple_get_val(tuple, i, s), buf);
     }
 
     /* Note that we don't NUL-terminate the buffer */
@@ -159,7 +189,7 @@ tuple_to_buf(Tuple *tuple, Schema *s, StrBuf *buf)
 
     for (i = 0; i < s->len; i++)
     {
-        (s->bin_out_funcs[i])(tuple_get_val(tuple, i), buf);
+        (s->bin_out_funcs[i])(tuple_get_val(tuple, i, s), buf);
     }
 }
 
@@ -173,7 +203,7 @@ tuple_from_buf(StrBuf *buf, Schema *s)
 
     for (i = 0; i < s->len; i++)
     {
-        tuple_get_val(result, i) = (s->bin_in_funcs[i])(buf);
+        tuple_set_val(result, i, (s->bin_in_funcs[i])(buf), s);
     }
 
     return result;
@@ -198,7 +228,7 @@ tuple_to_sql_insert_str(Tuple *tuple, Schema *s, apr_pool_t *pool)
         if (s->types[i] == TYPE_STRING)
             sbuf_append_char(buf, '\'');
 
-        (s->text_out_funcs[i])(tuple_get_val(tuple, i), buf);
+        (s->text_out_funcs[i])(tuple_get_val(tuple, i, s), buf);
 
         if (s->types[i] == TYPE_STRING)
             sbuf_append_char(buf, '\'');
@@ -216,6 +246,6 @@ tuple_is_remote(Tuple *tuple, TableDef *tbl_def, C4Runtime *c4)
     if (tbl_def->ls_colno == -1)
         return false;
 
-    tuple_addr = tuple_get_val(tuple, tbl_def->ls_colno);
+    tuple_addr = tuple_get_val(tuple, tbl_def->ls_colno, tbl_def->schema);
     return (string_equal(c4->local_addr, tuple_addr) == false);
 }
@@ -15,6 +15,12 @@
  * It also uses two separate mixing functions mix() and final(), instead
  * of a slower multi-purpose function.
  */
+#include <string.h>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
 #include "c4-internal.h"
 #include "util/hash_func.h"
 
@@ -312,3 +318,69 @@ hash_any(register const unsigned char *k, register int keylen)
 
     return c;
 }
+
+/*
+ * hash_uint64() -- hash a 64-bit integer into a 32-bit value
+ *
+ * This is the 64-bit finalizer from Austin Appleby's MurmurHash3: every bit
+ * of the input affects every bit of the output, which is all we need for a
+ * fixed-size key. It is much cheaper than running hash_any() over 8 bytes.
+ */
+apr_uint32_t
+hash_uint64(apr_uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return (apr_uint32_t) k;
+}
+
+#ifdef __SSE4_2__
+/*
+ * hash_bytes() using the SSE4.2 CRC32C instruction, which processes 8 bytes
+ * per instruction. CRC32C doesn't achieve avalanche by itself, so we finish
+ * with the 32-bit MurmurHash3 finalizer.
+ */
+apr_uint32_t
+hash_bytes(const unsigned char *k, int keylen)
+{
+    apr_uint64_t crc;
+    apr_uint32_t h;
+
+    crc = 0xFFFFFFFF ^ (apr_uint32_t) keylen;
+    while (keylen >= 8)
+    {
+        apr_uint64_t word;
+
+        memcpy(&word, k, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+        k += 8;
+        keylen -= 8;
+    }
+
+    h = (apr_uint32_t) crc;
+    while (keylen > 0)
+    {
+        h = _mm_crc32_u8(h, *k);
+        k++;
+        keylen--;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+#else
+apr_uint32_t
+hash_bytes(const unsigned char *k, int keylen)
+{
+    return hash_any(k, keylen);
+}
+#endif   /* __SSE4_2__ */
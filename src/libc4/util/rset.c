@@ -3,7 +3,9 @@
  * number of times it has been inserted. The count is decremented on removal;
  * when the count reaches zero, the element is deleted from the set.
  *
- * RSet is based on C4Hash, as of rev fad4ec5d1b9e (r635).
+ * RSet was originally based on C4Hash, as of rev fad4ec5d1b9e (r635). It is
+ * now an open-addressing hash table in the style of Google's "Swiss tables";
+ * the API is unchanged.
  */
 
 /* Licensed to the Apache Software Foundation (ASF) under one or more
@@ -23,67 +25,164 @@
  */
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "c4-internal.h"
 #include "util/rset.h"
 
 /*
  * The internal form of an rset.
  *
- * The table is an array indexed by the hash of the key; collisions are resolved
- * by hanging a linked list of rset entries off each element of the array.
- * Although this is a really simple design it isn't too bad given that pools
- * have a low allocation overhead.
+ * The table is an array of slots, divided into groups of GROUP_SIZE slots.
+ * Each slot has a one-byte control word: the control word of an occupied slot
+ * holds the low 7 bits of the element's hash value (the "tag"); otherwise, it
+ * marks the slot as empty or deleted. To look up an element, we visit the
+ * groups in the element's probe sequence; within a group, we compare the
+ * element's tag against all the control words at once, and only call the
+ * comparison function for slots whose tag matches. A lookup terminates at the
+ * first group that contains an empty slot.
+ *
+ * Each slot holds the element, its full hash value and its refcount, so we
+ * never need to chase a pointer to an entry or rehash elements when the
+ * table is resized.
  */
 
-typedef struct rset_entry_t rset_entry_t;
+typedef struct rset_slot_t rset_slot_t;
 
-struct rset_entry_t {
-    rset_entry_t *next;
+struct rset_slot_t {
     void         *key;
     unsigned int  hash;
     unsigned int  refcount;
 };
 
+#define GROUP_SIZE      16
+#define CTRL_EMPTY      ((unsigned char) 0x80)
+#define CTRL_DELETED    ((unsigned char) 0xFE)
+#define CTRL_IS_FULL(c) (((c) & 0x80) == 0)
+
+#define HASH_TAG(h)     ((unsigned char) ((h) & 0x7F))
+#define HASH_GROUP(h)   ((h) >> 7)
+
+/*
+ * The control and slot arrays are aligned to cache lines, so that loading a
+ * group's control words never touches two lines.
+ */
+#define RSET_CACHE_LINE 64
+
 /*
  * Data structure for iterating through an rset.
  *
- * We keep a pointer to the next rset entry here to allow the current entry to
- * be freed or otherwise mangled between calls to rset_iter_next().
+ * The current element may be removed between calls to rset_iter_next();
+ * adding elements to the rset invalidates any iterators.
  */
 struct rset_index_t {
     rset_t       *rs;
-    rset_entry_t *this;
-    rset_entry_t *next;
-    unsigned int  index;
+    unsigned int  this;
+    unsigned int  next;
     bool          at_end;
 };
 
 /*
- * The size of the array is always a power of two. We use the maximum index
- * rather than the size so that we can use bitwise-AND for modular
- * arithmetic. The count of rset entries may be greater depending on the chosen
- * collision rate.
+ * The number of slots is always a power of two, and at least GROUP_SIZE.  We
+ * never fill more than 7/8ths of the slots (counting deleted slots), so that
+ * every probe sequence is short and reaches an empty slot.
  *
- * We allocate the bucket array in a sub-pool, "array_pool". This allows us
- * to reclaim the old bucket array after an expansion.
+ * We allocate the control and slot arrays in a sub-pool, "array_pool". This
+ * allows us to reclaim the old arrays after a resize.
  */
 struct rset_t {
     apr_pool_t           *pool;
     apr_pool_t           *array_pool;
-    rset_entry_t        **array;
-    unsigned int          count, max;
+    unsigned char        *ctrl;
+    rset_slot_t          *slots;
+    unsigned int          nslots;
+    unsigned int          count;
+    unsigned int          growth_left; /* # of empty slots we can still fill */
     void                 *user_data;
     rset_hashfunc_t       hash_func;
     rset_keycomp_func_t   cmp_func;
-    rset_entry_t         *free; /* List of recycled entries */
 };
 
-#define INITIAL_MAX 15 /* tunable == 2^n - 1 */
+#define INITIAL_NSLOTS GROUP_SIZE /* tunable == 2^n, >= GROUP_SIZE */
+
+static unsigned int max_load(unsigned int nslots)
+{
+    return nslots - (nslots / 8);
+}
+
+/*
+ * Group matching primitives. Each returns a bitmask with bit i set iff the
+ * i'th control word of the group satisfies the predicate.
+ */
+#ifdef __SSE2__
+static inline unsigned int group_match(const unsigned char *group,
+                                       unsigned char tag)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+}
+
+static inline unsigned int group_match_empty(const unsigned char *group)
+{
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline unsigned int group_match_free(const unsigned char *group)
+{
+    /* Empty and deleted slots are exactly those with the high bit set */
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+#else
+static inline unsigned int group_match(const unsigned char *group,
+                                       unsigned char tag)
+{
+    unsigned int result = 0;
+    int i;
+
+    for (i = 0; i < GROUP_SIZE; i++) {
+        if (group[i] == tag)
+            result |= (1U << i);
+    }
+
+    return result;
+}
 
+static inline unsigned int group_match_empty(const unsigned char *group)
+{
+    return group_match(group, CTRL_EMPTY);
+}
 
-static rset_entry_t **alloc_array(rset_t *rs, unsigned int max)
+static inline unsigned int group_match_free(const unsigned char *group)
 {
-   return apr_pcalloc(rs->array_pool, sizeof(*rs->array) * (max + 1));
+    unsigned int result = 0;
+    int i;
+
+    for (i = 0; i < GROUP_SIZE; i++) {
+        if (!CTRL_IS_FULL(group[i]))
+            result |= (1U << i);
+    }
+
+    return result;
+}
+#endif
+
+static void *alloc_aligned(rset_t *rs, apr_size_t size)
+{
+    void *p = apr_palloc(rs->array_pool, size + RSET_CACHE_LINE);
+
+    return (void *) APR_ALIGN((apr_uintptr_t) p, RSET_CACHE_LINE);
+}
+
+static void alloc_arrays(rset_t *rs, unsigned int nslots)
+{
+    rs->nslots = nslots;
+    rs->ctrl = alloc_aligned(rs, nslots);
+    memset(rs->ctrl, CTRL_EMPTY, nslots);
+    rs->slots = alloc_aligned(rs, nslots * sizeof(*rs->slots));
+    rs->growth_left = max_load(nslots) - rs->count;
 }
 
 rset_t *rset_make(apr_pool_t *pool, void *cb_data,
@@ -98,10 +197,8 @@ rset_t *rset_make(apr_pool_t *pool, void *cb_data,
     rs = apr_palloc(pool, sizeof(rset_t));
     rs->pool = pool;
     rs->array_pool = array_pool;
-    rs->free = NULL;
     rs->count = 0;
-    rs->max = INITIAL_MAX;
-    rs->array = alloc_array(rs, rs->max);
+    alloc_arrays(rs, INITIAL_NSLOTS);
     rs->user_data = cb_data;
     rs->hash_func = hash_func;
     rs->cmp_func = cmp_func;
@@ -124,37 +221,29 @@ rset_index_t *rset_iter_make(apr_pool_t *p, rset_t *rs)
 
 void rset_iter_reset(rset_index_t *ri)
 {
-    ri->index = 0;
-    ri->this = NULL;
-    ri->next = NULL;
+    ri->this = 0;
+    ri->next = 0;
     ri->at_end = false;
 }
 
 bool rset_iter_next(rset_index_t *ri)
 {
+    rset_t *rs = ri->rs;
+
     if (ri->at_end)
         return false;
 
-    ri->this = ri->next;
-    while (!ri->this) {
-        if (ri->index > ri->rs->max) {
-            ri->at_end = true;
-            return false;
-        }
+    while (ri->next < rs->nslots) {
+        unsigned int i = ri->next++;
 
-        ri->this = ri->rs->array[ri->index++];
+        if (CTRL_IS_FULL(rs->ctrl[i])) {
+            ri->this = i;
+            return true;
+        }
     }
-    ri->next = ri->this->next;
-    /*
-     * GCC perf hack: We are very likely to read the next entry in the rset in
-     * the near future. Hence, prefetch to try to avoid a cache miss.  It seems
-     * to even be a win to do the conditional branch to prefetch the next bucket
-     * as well.
-     */
-    __builtin_prefetch(ri->next);
-    if (ri->index <= ri->rs->max)
-        __builtin_prefetch(ri->rs->array[ri->index]);
-    return true;
+
+    ri->at_end = true;
+    return false;
 }
 
 void *rset_this(rset_index_t *ri)
@@ -162,124 +251,233 @@ void *rset_this(rset_index_t *ri)
     if (ri->at_end)
         FAIL();
 
-    return ri->this->key;
+    return ri->rs->slots[ri->this].key;
+}
+
+/*
+ * Return the index of the first free (empty or deleted) slot in the probe
+ * sequence for "hash". There must be at least one free slot.
+ */
+static unsigned int find_free_slot(rset_t *rs, unsigned int hash)
+{
+    unsigned int group_mask = (rs->nslots / GROUP_SIZE) - 1;
+    unsigned int group = HASH_GROUP(hash) & group_mask;
+    unsigned int step = 0;
+
+    while (true) {
+        unsigned int base = group * GROUP_SIZE;
+        unsigned int mask = group_match_free(&rs->ctrl[base]);
+
+        if (mask != 0)
+            return base + __builtin_ctz(mask);
+
+        /* Triangular probing visits every group exactly once */
+        step++;
+        group = (group + step) & group_mask;
+    }
 }
 
-static void expand_array(rset_t *rs)
+/*
+ * Move all the elements into new arrays with "new_nslots" slots. This also
+ * discards deleted slots.
+ */
+static void resize(rset_t *rs, unsigned int new_nslots)
 {
     apr_pool_t *new_array_pool;
     apr_pool_t *old_array_pool;
-    rset_index_t *ri;
-    rset_entry_t **new_array;
-    unsigned int new_max;
+    unsigned char *old_ctrl;
+    rset_slot_t *old_slots;
+    unsigned int old_nslots;
+    unsigned int i;
 
     if (apr_pool_create(&new_array_pool, rs->pool) != APR_SUCCESS)
-        return; /* Give up and don't try to expand the array */
+        FAIL();
+
     old_array_pool = rs->array_pool;
+    old_ctrl = rs->ctrl;
+    old_slots = rs->slots;
+    old_nslots = rs->nslots;
+
     rs->array_pool = new_array_pool;
+    alloc_arrays(rs, new_nslots);
 
-    new_max = rs->max * 2 + 1;
-    new_array = alloc_array(rs, new_max);
+    for (i = 0; i < old_nslots; i++) {
+        unsigned int j;
 
-    ri = rset_iter_make(old_array_pool, rs);
-    while (rset_iter_next(ri)) {
-        unsigned int i = ri->this->hash & new_max;
-        ri->this->next = new_array[i];
-        new_array[i] = ri->this;
-    }
+        if (!CTRL_IS_FULL(old_ctrl[i]))
+            continue;
 
-    rs->array = new_array;
-    rs->max = new_max;
+        j = find_free_slot(rs, old_slots[i].hash);
+        rs->ctrl[j] = old_ctrl[i];
+        rs->slots[j] = old_slots[i];
+    }
 
     apr_pool_destroy(old_array_pool);
 }
 
 /*
- * This is where we keep the details of the hash function and control the
- * maximum collision rate.
+ * Make room for a new element. If most of the used slots are deleted rather
+ * than full, we just rehash in place; otherwise we double the table size.
+ */
+static void grow(rset_t *rs)
+{
+    if (rs->count < max_load(rs->nslots) / 2)
+        resize(rs, rs->nslots);
+    else
+        resize(rs, rs->nslots * 2);
+}
+
+/*
+ * Return the index of the slot containing "key", or -1 if "key" is not in
+ * the rset.
  *
- * If "make_new" is true, it creates and initializes a new rset entry if there
- * isn't already one there; it returns an updatable pointer so that entries can
- * be removed.
+ * Without help, a hit costs two dependent cache misses: one for the group's
+ * control words, and then one for the matching slot. Since new elements take
+ * the first free slot in their group, the first two cache lines of the
+ * group's slots hold most elements; prefetching them lets both misses
+ * overlap.
  */
-static rset_entry_t **find_entry(rset_t *rs, void *key, bool make_new)
+static int find_slot(rset_t *rs, void *key, unsigned int hash)
 {
-    rset_entry_t **rep, *re;
-    unsigned int hash;
+    unsigned int group_mask = (rs->nslots / GROUP_SIZE) - 1;
+    unsigned int group = HASH_GROUP(hash) & group_mask;
+    unsigned char tag = HASH_TAG(hash);
+    unsigned int step = 0;
 
-    hash = rs->hash_func(key, rs->user_data);
+    while (true) {
+        unsigned int base = group * GROUP_SIZE;
+        unsigned int mask;
 
-    /* scan linked list */
-    for (rep = &rs->array[hash & rs->max], re = *rep;
-         re; rep = &re->next, re = *rep)
-    {
-        if (re->hash == hash &&
-            rs->cmp_func(re->key, key, rs->user_data))
-            break;
-    }
-    if (re || !make_new)
-        return rep;
+        __builtin_prefetch(&rs->slots[base]);
+        __builtin_prefetch(&rs->slots[base + GROUP_SIZE / 4]);
+        mask = group_match(&rs->ctrl[base], tag);
 
-    /* add a new entry */
-    if ((re = rs->free) != NULL)
-        rs->free = re->next;
-    else
-        re = apr_palloc(rs->pool, sizeof(*re));
-    re->next = NULL;
-    re->hash = hash;
-    re->key  = key;
-    re->refcount = 0;
-    *rep = re;
-    rs->count++;
-    return rep;
+        while (mask != 0) {
+            unsigned int i = base + __builtin_ctz(mask);
+            rset_slot_t *slot = &rs->slots[i];
+
+            if (slot->hash == hash &&
+                rs->cmp_func(slot->key, key, rs->user_data))
+                return (int) i;
+
+            mask &= mask - 1;
+        }
+
+        if (group_match_empty(&rs->ctrl[base]) != 0)
+            return -1;
+
+        step++;
+        if (step > group_mask)
+            return -1;
+        group = (group + step) & group_mask;
+    }
 }
 
 unsigned int rset_get(rset_t *rs, void *elem)
 {
-    rset_entry_t *entry;
+    int i;
 
-    entry = *find_entry(rs, elem, false);
-    if (entry)
-        return entry->refcount;
+    i = find_slot(rs, elem, rs->hash_func(elem, rs->user_data));
+    if (i >= 0)
+        return rs->slots[i].refcount;
     else
         return 0;
 }
 
+void *rset_lookup(rset_t *rs, void *elem)
+{
+    int i;
+
+    i = find_slot(rs, elem, rs->hash_func(elem, rs->user_data));
+    if (i >= 0)
+        return rs->slots[i].key;
+    else
+        return NULL;
+}
+
 bool rset_add(rset_t *rs, void *elem)
 {
-    rset_entry_t *entry;
+    rset_slot_t *slot;
+    unsigned int hash;
+    unsigned int j;
+    int i;
 
-    entry = *find_entry(rs, elem, true);
-    entry->refcount++;
-    /* check that the collision rate isn't too high */
-    if (rs->count > rs->max)
-        expand_array(rs);
+    hash = rs->hash_func(elem, rs->user_data);
+    i = find_slot(rs, elem, hash);
+    if (i >= 0) {
+        rs->slots[i].refcount++;
+        return false;
+    }
 
-    return (entry->refcount == 1);
+    j = find_free_slot(rs, hash);
+    /* Reusing a deleted slot doesn't consume an empty one */
+    if (rs->ctrl[j] == CTRL_EMPTY) {
+        if (rs->growth_left == 0) {
+            grow(rs);
+            j = find_free_slot(rs, hash);
+        }
+        if (rs->ctrl[j] == CTRL_EMPTY)
+            rs->growth_left--;
+    }
+
+    rs->ctrl[j] = HASH_TAG(hash);
+    slot = &rs->slots[j];
+    slot->key = elem;
+    slot->hash = hash;
+    slot->refcount = 1;
+    rs->count++;
+
+    return true;
+}
+
+void *rset_replace(rset_t *rs, void *elem)
+{
+    rset_slot_t *slot;
+    void *old_elem;
+    int i;
+
+    i = find_slot(rs, elem, rs->hash_func(elem, rs->user_data));
+    if (i < 0)
+        return NULL;
+
+    slot = &rs->slots[i];
+    old_elem = slot->key;
+    slot->key = elem;
+    slot->refcount = 1;
+    return old_elem;
 }
 
 void *rset_remove(rset_t *rs, void *elem, unsigned int *new_refcount)
 {
-    rset_entry_t **rep;
-    rset_entry_t *entry;
+    rset_slot_t *slot;
+    int i;
 
-    rep = find_entry(rs, elem, false);
-    if (*rep == NULL)
+    i = find_slot(rs, elem, rs->hash_func(elem, rs->user_data));
+    if (i < 0)
         return NULL;
 
-    entry = *rep;
-    entry->refcount--;
-    *new_refcount = entry->refcount;
-    if (entry->refcount == 0)
-    {
-        /* Delete entry */
-        *rep = entry->next;
-        entry->next = rs->free;
-        rs->free = entry;
+    slot = &rs->slots[i];
+    slot->refcount--;
+    *new_refcount = slot->refcount;
+    if (slot->refcount == 0) {
+        unsigned int base = i & ~(GROUP_SIZE - 1);
+
+        /*
+         * If the slot's group has an empty slot, no lookup can have probed
+         * past this group, so we can mark the slot as empty; otherwise, we
+         * need to leave a "deleted" marker.
+         */
+        if (group_match_empty(&rs->ctrl[base]) != 0) {
+            rs->ctrl[i] = CTRL_EMPTY;
+            rs->growth_left++;
+        }
+        else
+            rs->ctrl[i] = CTRL_DELETED;
+
         rs->count--;
     }
 
-    return entry->key;
+    return slot->key;
 }
 
 unsigned int rset_count(rset_t *rs)
@@ -0,0 +1,213 @@
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+
+#include "c4-internal.h"
+#include "util/worker_pool.h"
+
+struct WorkerPool
+{
+    apr_pool_t *pool;
+    int nthreads;
+    apr_thread_t **threads;
+
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *start_cond;
+    apr_thread_cond_t *done_cond;
+
+    /*
+     * The current job. "generation" is incremented each time a job is
+     * started; "nrunning" is the number of worker threads that have not yet
+     * finished the current job. Protected by "lock".
+     */
+    worker_job_func job_func;
+    void *job_arg;
+    apr_uint32_t generation;
+    int nrunning;
+    bool shutdown;
+};
+
+typedef struct WorkerInitData
+{
+    WorkerPool *wp;
+    int worker_id;
+} WorkerInitData;
+
+static void
+wp_lock(WorkerPool *wp)
+{
+    apr_status_t s;
+
+    s = apr_thread_mutex_lock(wp->lock);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+}
+
+static void
+wp_unlock(WorkerPool *wp)
+{
+    apr_status_t s;
+
+    s = apr_thread_mutex_unlock(wp->lock);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+}
+
+static void
+wp_wait(WorkerPool *wp, apr_thread_cond_t *cond)
+{
+    apr_status_t s;
+
+    s = apr_thread_cond_wait(cond, wp->lock);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+}
+
+static void * APR_THREAD_FUNC
+worker_thread_main(apr_thread_t *thread, void *data)
+{
+    WorkerInitData *init_data = (WorkerInitData *) data;
+    WorkerPool *wp = init_data->wp;
+    apr_uint32_t seen_generation;
+
+    wp_lock(wp);
+    seen_generation = wp->generation;
+    while (true)
+    {
+        worker_job_func func;
+        void *arg;
+
+        while (!wp->shutdown && wp->generation == seen_generation)
+            wp_wait(wp, wp->start_cond);
+
+        if (wp->shutdown)
+            break;
+
+        seen_generation = wp->generation;
+        func = wp->job_func;
+        arg = wp->job_arg;
+        wp_unlock(wp);
+
+        func(arg, init_data->worker_id);
+
+        wp_lock(wp);
+        wp->nrunning--;
+        if (wp->nrunning == 0)
+            (void) apr_thread_cond_signal(wp->done_cond);
+    }
+    wp_unlock(wp);
+
+    string_slab_thread_exit();
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;        /* Return value ignored */
+}
+
+/*
+ * Wake up the worker threads and wait for them to exit. Since this cleanup
+ * is registered after the mutex and condition variables were created, it
+ * runs before they are destroyed.
+ */
+static apr_status_t
+worker_pool_cleanup(void *data)
+{
+    WorkerPool *wp = (WorkerPool *) data;
+    int i;
+
+    wp_lock(wp);
+    wp->shutdown = true;
+    (void) apr_thread_cond_broadcast(wp->start_cond);
+    wp_unlock(wp);
+
+    for (i = 0; i < wp->nthreads; i++)
+    {
+        apr_status_t thread_status;
+
+        (void) apr_thread_join(&thread_status, wp->threads[i]);
+    }
+
+    return APR_SUCCESS;
+}
+
+WorkerPool *
+worker_pool_make(int nthreads, apr_pool_t *pool)
+{
+    WorkerPool *wp;
+    apr_threadattr_t *thread_attr;
+    apr_status_t s;
+    int i;
+
+    ASSERT(nthreads > 0);
+
+    wp = apr_pcalloc(pool, sizeof(*wp));
+    wp->pool = pool;
+    wp->nthreads = nthreads;
+    wp->threads = apr_pcalloc(pool, nthreads * sizeof(*wp->threads));
+    wp->generation = 0;
+    wp->nrunning = 0;
+    wp->shutdown = false;
+
+    s = apr_thread_mutex_create(&wp->lock, APR_THREAD_MUTEX_DEFAULT, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    s = apr_thread_cond_create(&wp->start_cond, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    s = apr_thread_cond_create(&wp->done_cond, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    s = apr_threadattr_create(&thread_attr, pool);
+    if (s != APR_SUCCESS)
+        FAIL_APR(s);
+
+    for (i = 0; i < nthreads; i++)
+    {
+        WorkerInitData *init_data;
+
+        init_data = apr_palloc(pool, sizeof(*init_data));
+        init_data->wp = wp;
+        init_data->worker_id = i;
+
+        s = apr_thread_create(&wp->threads[i], thread_attr,
+                              worker_thread_main, init_data, pool);
+        if (s != APR_SUCCESS)
+            FAIL_APR(s);
+    }
+
+    apr_pool_cleanup_register(pool, wp, worker_pool_cleanup,
+                              apr_pool_cleanup_null);
+
+    return wp;
+}
+
+int
+worker_pool_size(WorkerPool *wp)
+{
+    return wp->nthreads;
+}
+
+/*
+ * Run "func" on every worker thread and on the calling thread, and return
+ * once all the invocations have returned. Only one job can run at a time.
+ */
+void
+worker_pool_run(WorkerPool *wp, worker_job_func func, void *arg)
+{
+    wp_lock(wp);
+    ASSERT(wp->nrunning == 0);
+    wp->job_func = func;
+    wp->job_arg = arg;
+    wp->nrunning = wp->nthreads;
+    wp->generation++;
+    (void) apr_thread_cond_broadcast(wp->start_cond);
+    wp_unlock(wp);
+
+    func(arg, wp->nthreads);
+
+    wp_lock(wp);
+    while (wp->nrunning > 0)
+        wp_wait(wp, wp->done_cond);
+    wp_unlock(wp);
+}
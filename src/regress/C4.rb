@@ -11,6 +11,9 @@ class C4
     ffi_lib 'c4'
     attach_function 'c4_initialize', [], :void
     attach_function 'c4_make', [:pointer, :int], :pointer
+    attach_function 'c4_make_sharded', [:pointer, :int, :int], :pointer
+    attach_function 'c4_set_fixpoint_mode', [:pointer, :int], :int
+    attach_function 'c4_set_worker_threads', [:pointer, :int], :int
     attach_function 'c4_install_file', [:pointer, :string], :int
     attach_function 'c4_install_str', [:pointer, :string], :int
     attach_function 'c4_dump_table', [:pointer, :string], :string
@@ -18,9 +21,21 @@ class C4
     attach_function 'c4_terminate', [], :void
   end
 
-  def initialize(port=0)
+  def initialize(port=0, nshards=1)
     C4Lib.c4_initialize
-    @c4 = C4Lib.c4_make(nil, port)
+    @c4 = C4Lib.c4_make_sharded(nil, port, nshards)
+  end
+
+  FIXPOINT_MODES = { :tuple => 0, :set => 1 }
+
+  # TODO: check status
+  def set_fixpoint_mode(mode)
+    s = C4Lib.c4_set_fixpoint_mode(@c4, FIXPOINT_MODES.fetch(mode))
+  end
+
+  # TODO: check status
+  def set_worker_threads(nthreads)
+    s = C4Lib.c4_set_worker_threads(@c4, nthreads)
   end
 
   # TODO: check status
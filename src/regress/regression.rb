@@ -12,18 +12,55 @@ def make_output_dir
   Dir.mkdir(OUTPUT_DIR)
 end
 
-def run_tests(c4, test_name)
+# The settings of the C4 instance that runs the tests. A test can override
+# them with directives at the start of its input file (e.g. "\workers 2"),
+# in which case it runs in a C4 instance of its own.
+def default_settings
+  {
+    "shards" => ENV['C4_SHARDS'] || "1",
+    "fixpoint" => ENV['C4_FIXPOINT_MODE'],
+    "workers" => ENV['C4_WORKER_THREADS']
+  }
+end
+
+def make_c4(settings)
+  c = C4.new(0, settings["shards"].to_i)
+  c.set_fixpoint_mode(settings["fixpoint"].to_sym) if settings["fixpoint"]
+  c.set_worker_threads(settings["workers"].to_i) if settings["workers"]
+  c
+end
+
+def read_directives(test)
+  directives = {}
+  File.open("#{INPUT_DIR}/#{test}").each_line do |line|
+    break unless line =~ /^\\(shards|fixpoint|workers) (\S+)/
+    directives[$1] = $2
+  end
+  directives
+end
+
+def run_tests(test_name)
   puts "===="
   tests = Dir.entries(INPUT_DIR).reject { |i| i.match(/^\./) }
   ran_tests = []
+  shared_c4 = nil
   tests.each do |test|
     next unless (test_name.nil? or test == test_name)
     ran_tests << test
     print "Running test \"#{test}\"..."
+    directives = read_directives(test)
+    if directives.empty?
+      shared_c4 ||= make_c4(default_settings)
+      c4 = shared_c4
+    else
+      c4 = make_c4(default_settings.merge(directives))
+    end
     input = ""
     output = ""
     File.open("#{INPUT_DIR}/#{test}").each_line do |line|
-      if line =~ /^\\dump (.+)/
+      if line =~ /^\\(shards|fixpoint|workers) /
+        next
+      elsif line =~ /^\\dump (.+)/
         c4.install_str(input) unless input == ""
         output << "**** \\dump \"#{$1}\" ****\n"
         output << c4.dump_table($1).split("\n").sort.join("\n")
@@ -33,6 +70,7 @@ def run_tests(c4, test_name)
         input << line
       end
     end
+    c4.destroy unless c4 == shared_c4
     puts " done"
 
     File.open("#{OUTPUT_DIR}/#{test}", 'w') do |f|
@@ -40,6 +78,8 @@ def run_tests(c4, test_name)
     end
   end
 
+  shared_c4.destroy if shared_c4
+
   puts "===="
   num_fails = 0
   ran_tests.each do |test|
@@ -59,6 +99,4 @@ end
 
 make_output_dir
 File.delete(DIFF_FILE) if File.exists?(DIFF_FILE)
-c = C4.new
-run_tests(c, ARGV[0])
-c.destroy
+run_tests(ARGV[0])